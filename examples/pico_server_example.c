@@ -32,6 +32,8 @@
  *  8       RTC, hour
  *  9       RTC, min
  *  10      RTC, second
+ *  100...131   network statistics, updated every second
+ *              (see MODBUS_NET_STATS_* in modbus-pico-tcp.h)
  *
  * Holding register (libmodbus mapping: mb_mapping->tab_registers)
  *  0       Intitial value of RTC, year
@@ -74,7 +76,8 @@ modbus_t *ctx;
 modbus_mapping_t *mb_mapping;
 
 
-#define NB_INPUT_REGISTERS      11
+#define NET_STATS_ADDRESS       100
+#define NB_INPUT_REGISTERS      (NET_STATS_ADDRESS + MODBUS_NET_STATS_REGISTERS)
 #define NB_HOLDING_REGISTERS    7
 #define NB_DISCRETE_INPUTS      2
 #define NB_COILS                3
@@ -333,6 +336,11 @@ int main()
         }
         cnt++;
 
+        // snapshot of the network statistics (Input register 131:100)
+        if(cnt % 10 == 0){
+            modbus_tcp_net_stats(ctx, mb_mapping, NET_STATS_ADDRESS);
+        }
+
         // get and store CPU-temerature (Input register 3:0)
         read_onboard_temperature();
 
@@ -0,0 +1,545 @@
+/*
+ * Copyright © Gerhard Schiller 2024, <gerhard.schiller@pm.me>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+/* Scheduler of the reads of many slaves on a multi-drop RTU line, one
+ * modbus_new_rtu() context for the line. Each slave has its list of reads,
+ * released every period. The released read of the earliest release goes
+ * next, whatever its slave, as soon as the silent interval (t3.5) after the
+ * previous response has elapsed: a slave could miss a request sent earlier,
+ * while a loop of modbus_set_slave() and reads doesn't wait.
+ *
+ * The response timeout of each slave is learned from its turnaround, the
+ * time to respond without the characters on the line: the smoothed turnaround
+ * plus four times its mean deviation, as TCP does for its retransmission
+ * timeout (RFC 6298), on top of the characters of the read. It's doubled on
+ * each timeout up to the response timeout of the context, used until the
+ * first response.
+ *
+ * A slave timing out nb_timeouts times in a row is quarantined: none of its
+ * reads is released, a single read probes it after a back-off doubled on each
+ * probe left unanswered. A response, even an exception, puts it back in
+ * service. */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "modbus-private.h"
+#include "modbus-bus.h"
+#include "modbus-rtu-private.h"
+
+/* Slaves up to 255 with MODBUS_QUIRK_MAX_SLAVE */
+#define _BUS_NB_SLAVES 256
+
+#define _BUS_QUARANTINE_TIMEOUTS 3
+#define _BUS_BACKOFF_MIN         1000000
+#define _BUS_BACKOFF_MAX         30000000
+
+typedef struct _modbus_bus_read {
+    modbus_prepared_t *prepared;
+    struct _modbus_bus_slave *slave;
+    uint32_t period;
+    /* Absolute time of the pending release */
+    uint64_t release;
+    /* Characters of the request and of its response */
+    int wire_length;
+    modbus_bus_fn fn;
+    void *user_data;
+} modbus_bus_read_t;
+
+typedef struct _modbus_bus_slave {
+    int id;
+    /* Read probing the slave in quarantine */
+    modbus_bus_read_t *probe;
+    /* Smoothed turnaround and mean deviation, none until the first response */
+    uint32_t srtt;
+    uint32_t rttvar;
+    int has_rtt;
+    /* Timeouts in a row */
+    int timeouts;
+    uint32_t backoff;
+    uint64_t retry;
+    uint64_t turnaround_sum;
+    modbus_bus_slave_stats_t stats;
+} modbus_bus_slave_t;
+
+struct _modbus_bus {
+    modbus_t *ctx;
+    /* Restored by modbus_bus_free() */
+    int slave;
+    uint32_t response_timeout;
+    /* Time of a character on the line and silent interval */
+    uint32_t char_time;
+    uint32_t silent_interval;
+    int quarantine_timeouts;
+    uint32_t backoff_min;
+    uint32_t backoff_max;
+    /* End of the last response, the next request waits for the silent
+       interval */
+    uint64_t last;
+    int nb_reads;
+    int max_reads;
+    modbus_bus_read_t **reads;
+    modbus_bus_slave_t *slaves[_BUS_NB_SLAVES];
+    uint64_t stats_start;
+    modbus_bus_stats_t stats;
+};
+
+/* Sets back the slave of the context, none on a new context */
+static int restore_slave(modbus_bus_t *bus)
+{
+    if (bus->slave < 0)
+        return 0;
+
+    return modbus_set_slave(bus->ctx, bus->slave);
+}
+
+/* Time of the read when the slave doesn't delay it, its earliest probe if the
+   slave is in quarantine or UINT64_MAX */
+static uint64_t read_time(const modbus_bus_read_t *read)
+{
+    const modbus_bus_slave_t *slave = read->slave;
+
+    if (slave->stats.quarantined)
+        return slave->probe == read ? slave->retry : UINT64_MAX;
+
+    return read->release;
+}
+
+/* Returns the released read with the earliest release or NULL */
+static modbus_bus_read_t *next_read(modbus_bus_t *bus, uint64_t now)
+{
+    modbus_bus_read_t *best = NULL;
+    uint64_t best_time = UINT64_MAX;
+    int i;
+
+    for (i = 0; i < bus->nb_reads; i++) {
+        uint64_t time = read_time(bus->reads[i]);
+
+        if (time <= now && time < best_time) {
+            best = bus->reads[i];
+            best_time = time;
+        }
+    }
+
+    return best;
+}
+
+static uint32_t
+slave_timeout(modbus_bus_t *bus, const modbus_bus_slave_t *slave, int wire_length)
+{
+    uint64_t timeout;
+    int i;
+
+    if (!slave->has_rtt)
+        return bus->response_timeout;
+
+    timeout = (uint64_t) wire_length * bus->char_time + slave->srtt + 4 * slave->rttvar +
+              2 * bus->silent_interval;
+    for (i = 0; i < slave->timeouts && timeout < bus->response_timeout; i++) {
+        timeout *= 2;
+    }
+
+    return timeout < bus->response_timeout ? timeout : bus->response_timeout;
+}
+
+/* RFC 6298 with a gain of 1/8 for the mean and 1/4 for the deviation */
+static void slave_sample(modbus_bus_slave_t *slave, uint32_t turnaround)
+{
+    if (!slave->has_rtt) {
+        slave->srtt = turnaround;
+        slave->rttvar = turnaround / 2;
+        slave->has_rtt = TRUE;
+    } else {
+        uint32_t delta = turnaround > slave->srtt ? turnaround - slave->srtt
+                                                  : slave->srtt - turnaround;
+
+        slave->rttvar = (3 * slave->rttvar + delta) / 4;
+        slave->srtt = (7 * slave->srtt + turnaround) / 8;
+    }
+
+    slave->turnaround_sum += turnaround;
+    if (turnaround > slave->stats.turnaround_max)
+        slave->stats.turnaround_max = turnaround;
+}
+
+static void slave_timed_out(modbus_bus_t *bus, modbus_bus_slave_t *slave, uint64_t now)
+{
+    slave->timeouts++;
+    slave->stats.timeouts++;
+
+    if (slave->stats.quarantined) {
+        slave->backoff = slave->backoff < bus->backoff_max / 2 ? 2 * slave->backoff
+                                                              : bus->backoff_max;
+    } else if (slave->timeouts >= bus->quarantine_timeouts) {
+        slave->stats.quarantined = TRUE;
+        slave->stats.quarantines++;
+        slave->backoff = bus->backoff_min;
+    } else {
+        return;
+    }
+    slave->retry = now + slave->backoff;
+}
+
+modbus_bus_t *modbus_bus_new(modbus_t *ctx)
+{
+    modbus_rtu_t *ctx_rtu;
+    modbus_bus_t *bus;
+    uint32_t to_sec;
+    uint32_t to_usec;
+    int nb_bits;
+
+    if (ctx == NULL || ctx->backend->backend_type != _MODBUS_BACKEND_TYPE_RTU) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    bus = (modbus_bus_t *) malloc(sizeof(modbus_bus_t));
+    if (bus == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    memset(bus, 0, sizeof(modbus_bus_t));
+
+    ctx_rtu = ctx->backend_data;
+    nb_bits =
+        1 + ctx_rtu->data_bit + (ctx_rtu->parity == 'N' ? 0 : 1) + ctx_rtu->stop_bit;
+    modbus_get_response_timeout(ctx, &to_sec, &to_usec);
+
+    bus->ctx = ctx;
+    bus->slave = modbus_get_slave(ctx);
+    bus->response_timeout = to_sec * 1000000 + to_usec;
+    bus->char_time = 1000000 * nb_bits / ctx_rtu->baud;
+    bus->silent_interval = ctx_rtu->silent_interval;
+    bus->quarantine_timeouts = _BUS_QUARANTINE_TIMEOUTS;
+    bus->backoff_min = _BUS_BACKOFF_MIN;
+    bus->backoff_max = _BUS_BACKOFF_MAX;
+    bus->stats_start = _modbus_time_us();
+
+    return bus;
+}
+
+/* Adds a read of nb values at addr of the slave every period_us (0 to read
+   again as soon as possible), fn is called with the result of each read. The
+   read is released at once. Returns the index of the read. */
+int modbus_bus_add_read(modbus_bus_t *bus,
+                        int slave,
+                        int function,
+                        int addr,
+                        int nb,
+                        void *dest,
+                        uint32_t period_us,
+                        modbus_bus_fn fn,
+                        void *user_data)
+{
+    modbus_bus_slave_t *bus_slave;
+    modbus_bus_read_t *read;
+    int rsp_length;
+
+    /* No response to a broadcast */
+    if (bus == NULL || slave <= 0 || slave >= _BUS_NB_SLAVES) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (bus->nb_reads == bus->max_reads) {
+        int max_reads = bus->max_reads ? 2 * bus->max_reads : 16;
+        modbus_bus_read_t **reads =
+            realloc(bus->reads, max_reads * sizeof(modbus_bus_read_t *));
+
+        if (reads == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        bus->reads = reads;
+        bus->max_reads = max_reads;
+    }
+
+    bus_slave = bus->slaves[slave];
+    if (bus_slave == NULL) {
+        bus_slave = (modbus_bus_slave_t *) malloc(sizeof(modbus_bus_slave_t));
+        if (bus_slave == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        memset(bus_slave, 0, sizeof(modbus_bus_slave_t));
+        bus_slave->id = slave;
+        bus->slaves[slave] = bus_slave;
+    }
+
+    read = (modbus_bus_read_t *) malloc(sizeof(modbus_bus_read_t));
+    if (read == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    /* The request is bound to the slave set */
+    if (modbus_set_slave(bus->ctx, slave) == -1) {
+        free(read);
+        return -1;
+    }
+    read->prepared = modbus_prepare_read(bus->ctx, function, addr, nb, dest);
+    if (read->prepared == NULL) {
+        int saved_errno = errno;
+
+        restore_slave(bus);
+        free(read);
+        errno = saved_errno;
+        return -1;
+    }
+    if (restore_slave(bus) == -1) {
+        modbus_prepared_free(read->prepared);
+        free(read);
+        return -1;
+    }
+
+    /* Slave, function, byte count, data and CRC */
+    if (function == MODBUS_FC_READ_COILS || function == MODBUS_FC_READ_DISCRETE_INPUTS)
+        rsp_length = 5 + (nb + 7) / 8;
+    else
+        rsp_length = 5 + 2 * nb;
+
+    read->slave = bus_slave;
+    read->period = period_us;
+    read->release = _modbus_time_us();
+    read->wire_length = _MODBUS_RTU_PRESET_REQ_LENGTH + _MODBUS_RTU_CHECKSUM_LENGTH +
+                        rsp_length;
+    read->fn = fn;
+    read->user_data = user_data;
+    if (bus_slave->probe == NULL)
+        bus_slave->probe = read;
+
+    bus->reads[bus->nb_reads] = read;
+    return bus->nb_reads++;
+}
+
+/* A slave is quarantined after nb_timeouts timeouts in a row, then probed
+   after backoff_min_us, doubled up to backoff_max_us. */
+int modbus_bus_set_quarantine(modbus_bus_t *bus,
+                              int nb_timeouts,
+                              uint32_t backoff_min_us,
+                              uint32_t backoff_max_us)
+{
+    if (bus == NULL || nb_timeouts < 1 || backoff_min_us == 0 ||
+        backoff_max_us < backoff_min_us) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    bus->quarantine_timeouts = nb_timeouts;
+    bus->backoff_min = backoff_min_us;
+    bus->backoff_max = backoff_max_us;
+
+    return 0;
+}
+
+/* Runs the released read with the earliest release, after the silent
+   interval. Returns 1 if a read has been run, 0 if none is released. */
+int modbus_bus_run_once(modbus_bus_t *bus)
+{
+    modbus_bus_read_t *read;
+    modbus_bus_slave_t *slave;
+    uint64_t now;
+    uint64_t start;
+    uint64_t end;
+    uint32_t timeout;
+    int saved_errno;
+    int rc;
+
+    if (bus == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    now = _modbus_time_us();
+    read = next_read(bus, now);
+    if (read == NULL)
+        return 0;
+    slave = read->slave;
+
+    if (now < bus->last + bus->silent_interval)
+        _modbus_sleep_us(bus->last + bus->silent_interval - now);
+
+    timeout = slave_timeout(bus, slave, read->wire_length);
+    if (modbus_set_slave(bus->ctx, slave->id) == -1)
+        return -1;
+    modbus_set_response_timeout(bus->ctx, timeout / 1000000, timeout % 1000000);
+
+    start = _modbus_time_us();
+    rc = modbus_prepared_execute(read->prepared);
+    saved_errno = errno;
+    end = _modbus_time_us();
+    bus->last = end;
+
+    bus->stats.transactions++;
+    bus->stats.busy_us += end - start;
+    slave->stats.transactions++;
+    if (rc == -1) {
+        bus->stats.errors++;
+        slave->stats.errors++;
+    }
+
+    if (rc == -1 && saved_errno == ETIMEDOUT) {
+        bus->stats.timeouts++;
+        bus->stats.timeout_us += end - start;
+        bus->stats.wire_us +=
+            (uint64_t) (_MODBUS_RTU_PRESET_REQ_LENGTH + _MODBUS_RTU_CHECKSUM_LENGTH) *
+            bus->char_time;
+        slave_timed_out(bus, slave, end);
+        /* A late response mustn't be read as the next one */
+        modbus_flush(bus->ctx);
+    } else {
+        uint32_t wire = read->wire_length * bus->char_time;
+
+        /* The slave is there, even if it responds with an exception */
+        bus->stats.wire_us += wire;
+        slave->timeouts = 0;
+        slave->stats.quarantined = FALSE;
+        if (rc != -1)
+            slave_sample(slave, end - start > wire ? end - start - wire : 0);
+    }
+
+    read->release =
+        _modbus_next_release(read->release, read->period, end, &bus->stats.overruns);
+
+    if (read->fn != NULL) {
+        errno = saved_errno;
+        read->fn(bus->ctx, rc, read->user_data);
+    }
+
+    return 1;
+}
+
+/* Runs the reads for duration_us (forever if 0) and sleeps while none is
+   released. Returns the number of reads run. */
+int modbus_bus_run(modbus_bus_t *bus, uint32_t duration_us)
+{
+    uint64_t stop;
+    int nb_runs = 0;
+    int rc;
+
+    if (bus == NULL || bus->nb_reads == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    stop = _modbus_time_us() + duration_us;
+    for (;;) {
+        uint64_t now;
+        uint64_t wakeup;
+        int i;
+
+        rc = modbus_bus_run_once(bus);
+        if (rc == -1)
+            return -1;
+        nb_runs += rc;
+
+        now = _modbus_time_us();
+        if (duration_us != 0 && now >= stop)
+            break;
+
+        wakeup = UINT64_MAX;
+        for (i = 0; i < bus->nb_reads; i++) {
+            uint64_t time = read_time(bus->reads[i]);
+
+            if (time < wakeup)
+                wakeup = time;
+        }
+        if (duration_us != 0 && wakeup > stop)
+            wakeup = stop;
+        if (wakeup > now)
+            _modbus_sleep_us(wakeup - now);
+    }
+
+    return nb_runs;
+}
+
+int modbus_bus_get_stats(modbus_bus_t *bus, modbus_bus_stats_t *stats)
+{
+    int i;
+
+    if (bus == NULL || stats == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    *stats = bus->stats;
+    stats->elapsed_us = _modbus_time_us() - bus->stats_start;
+    stats->nb_quarantined = 0;
+    for (i = 0; i < _BUS_NB_SLAVES; i++) {
+        if (bus->slaves[i] != NULL && bus->slaves[i]->stats.quarantined)
+            stats->nb_quarantined++;
+    }
+
+    return 0;
+}
+
+int modbus_bus_get_slave_stats(modbus_bus_t *bus,
+                               int slave,
+                               modbus_bus_slave_stats_t *stats)
+{
+    const modbus_bus_slave_t *bus_slave;
+    uint32_t nb_samples;
+
+    if (bus == NULL || stats == NULL || slave < 0 || slave >= _BUS_NB_SLAVES ||
+        bus->slaves[slave] == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    bus_slave = bus->slaves[slave];
+    *stats = bus_slave->stats;
+    nb_samples = stats->transactions - stats->errors;
+    stats->turnaround_avg = nb_samples > 0 ? bus_slave->turnaround_sum / nb_samples : 0;
+    stats->timeout = slave_timeout(bus, bus_slave, 0);
+
+    return 0;
+}
+
+/* The learned timeouts and the quarantines are kept */
+void modbus_bus_reset_stats(modbus_bus_t *bus)
+{
+    int i;
+
+    if (bus == NULL)
+        return;
+
+    memset(&bus->stats, 0, sizeof(modbus_bus_stats_t));
+    bus->stats_start = _modbus_time_us();
+    for (i = 0; i < _BUS_NB_SLAVES; i++) {
+        modbus_bus_slave_t *slave = bus->slaves[i];
+
+        if (slave != NULL) {
+            int quarantined = slave->stats.quarantined;
+
+            memset(&slave->stats, 0, sizeof(modbus_bus_slave_stats_t));
+            slave->stats.quarantined = quarantined;
+            slave->turnaround_sum = 0;
+        }
+    }
+}
+
+/* The slave and the response timeout of the context are restored */
+void modbus_bus_free(modbus_bus_t *bus)
+{
+    int i;
+
+    if (bus == NULL)
+        return;
+
+    for (i = 0; i < bus->nb_reads; i++) {
+        modbus_prepared_free(bus->reads[i]->prepared);
+        free(bus->reads[i]);
+    }
+    for (i = 0; i < _BUS_NB_SLAVES; i++) {
+        free(bus->slaves[i]);
+    }
+    restore_slave(bus);
+    modbus_set_response_timeout(
+        bus->ctx, bus->response_timeout / 1000000, bus->response_timeout % 1000000);
+    free(bus->reads);
+    free(bus);
+}
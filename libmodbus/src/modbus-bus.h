@@ -0,0 +1,76 @@
+/*
+ * Copyright © Gerhard Schiller 2024, <gerhard.schiller@pm.me>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#ifndef MODBUS_BUS_H
+#define MODBUS_BUS_H
+
+#include "modbus.h"
+
+MODBUS_BEGIN_DECLS
+
+/* Completion of a read, the slave of ctx is the slave read. rc is the number
+ * of values read into its destination or -1 with errno set. */
+typedef void (*modbus_bus_fn)(modbus_t *ctx, int rc, void *user_data);
+
+/* Counters of the bus since its creation or the last reset, times in
+ * microseconds. The bus is busy from a request sent to its response received
+ * or timed out: the utilisation is busy_us / elapsed_us and the scan rate
+ * transactions / elapsed_us. */
+typedef struct _modbus_bus_stats {
+    uint64_t elapsed_us;
+    uint64_t busy_us;
+    /* Characters of the requests and of the responses on the line */
+    uint64_t wire_us;
+    /* Waited for the slaves which didn't respond */
+    uint64_t timeout_us;
+    uint32_t transactions;
+    uint32_t errors;
+    uint32_t timeouts;
+    /* Releases skipped, the bus being late */
+    uint32_t overruns;
+    int nb_quarantined;
+} modbus_bus_stats_t;
+
+typedef struct _modbus_bus_slave_stats {
+    uint32_t transactions;
+    uint32_t errors;
+    uint32_t timeouts;
+    uint32_t quarantines;
+    /* Time taken by the slave to respond, without the characters on the line */
+    uint32_t turnaround_avg;
+    uint32_t turnaround_max;
+    /* Response timeout learned, without the characters of the read */
+    uint32_t timeout;
+    int quarantined;
+} modbus_bus_slave_stats_t;
+
+typedef struct _modbus_bus modbus_bus_t;
+
+MODBUS_API modbus_bus_t *modbus_bus_new(modbus_t *ctx);
+MODBUS_API int modbus_bus_add_read(modbus_bus_t *bus,
+                                   int slave,
+                                   int function,
+                                   int addr,
+                                   int nb,
+                                   void *dest,
+                                   uint32_t period_us,
+                                   modbus_bus_fn fn,
+                                   void *user_data);
+MODBUS_API int modbus_bus_set_quarantine(modbus_bus_t *bus,
+                                         int nb_timeouts,
+                                         uint32_t backoff_min_us,
+                                         uint32_t backoff_max_us);
+MODBUS_API int modbus_bus_run_once(modbus_bus_t *bus);
+MODBUS_API int modbus_bus_run(modbus_bus_t *bus, uint32_t duration_us);
+MODBUS_API int modbus_bus_get_stats(modbus_bus_t *bus, modbus_bus_stats_t *stats);
+MODBUS_API int
+modbus_bus_get_slave_stats(modbus_bus_t *bus, int slave, modbus_bus_slave_stats_t *stats);
+MODBUS_API void modbus_bus_reset_stats(modbus_bus_t *bus);
+MODBUS_API void modbus_bus_free(modbus_bus_t *bus);
+
+MODBUS_END_DECLS
+
+#endif /* MODBUS_BUS_H */
@@ -0,0 +1,95 @@
+/*
+ * Copyright © Gerhard Schiller 2024, <gerhard.schiller@pm.me>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#ifndef MODBUS_CONFIG_H
+#define MODBUS_CONFIG_H
+
+/* Compile-time selection of the features of libmodbus. The defaults build
+ * everything, a firmware overrides them with compiler definitions, e.g. in
+ * CMake:
+ *
+ *   target_compile_definitions(app PRIVATE
+ *       MODBUS_CONFIG_LOG_LEVEL=MODBUS_LOG_ERROR
+ *       MODBUS_CONFIG_FC_READ_DISCRETE_INPUTS=0)
+ *
+ * The disabled paths are not compiled at all. */
+
+/* Output printed when modbus_set_debug() is enabled:
+ * - MODBUS_LOG_NONE, nothing, the messages are not even stored in flash;
+ * - MODBUS_LOG_ERROR, the error messages only;
+ * - MODBUS_LOG_DEBUG, the errors and the trace of the frames. */
+#define MODBUS_LOG_NONE  0
+#define MODBUS_LOG_ERROR 1
+#define MODBUS_LOG_DEBUG 2
+
+#ifndef MODBUS_CONFIG_LOG_LEVEL
+#define MODBUS_CONFIG_LOG_LEVEL MODBUS_LOG_DEBUG
+#endif
+
+/* Function codes answered by modbus_reply(). A disabled one gets an illegal
+ * function exception, as an unknown function code. */
+#ifndef MODBUS_CONFIG_FC_READ_COILS
+#define MODBUS_CONFIG_FC_READ_COILS 1
+#endif
+#ifndef MODBUS_CONFIG_FC_READ_DISCRETE_INPUTS
+#define MODBUS_CONFIG_FC_READ_DISCRETE_INPUTS 1
+#endif
+#ifndef MODBUS_CONFIG_FC_READ_HOLDING_REGISTERS
+#define MODBUS_CONFIG_FC_READ_HOLDING_REGISTERS 1
+#endif
+#ifndef MODBUS_CONFIG_FC_READ_INPUT_REGISTERS
+#define MODBUS_CONFIG_FC_READ_INPUT_REGISTERS 1
+#endif
+#ifndef MODBUS_CONFIG_FC_WRITE_SINGLE_COIL
+#define MODBUS_CONFIG_FC_WRITE_SINGLE_COIL 1
+#endif
+#ifndef MODBUS_CONFIG_FC_WRITE_SINGLE_REGISTER
+#define MODBUS_CONFIG_FC_WRITE_SINGLE_REGISTER 1
+#endif
+#ifndef MODBUS_CONFIG_FC_WRITE_MULTIPLE_COILS
+#define MODBUS_CONFIG_FC_WRITE_MULTIPLE_COILS 1
+#endif
+#ifndef MODBUS_CONFIG_FC_WRITE_MULTIPLE_REGISTERS
+#define MODBUS_CONFIG_FC_WRITE_MULTIPLE_REGISTERS 1
+#endif
+#ifndef MODBUS_CONFIG_FC_REPORT_SLAVE_ID
+#define MODBUS_CONFIG_FC_REPORT_SLAVE_ID 1
+#endif
+#ifndef MODBUS_CONFIG_FC_DIAGNOSTICS
+#define MODBUS_CONFIG_FC_DIAGNOSTICS 1
+#endif
+#ifndef MODBUS_CONFIG_FC_GET_COMM_EVENT_COUNTER
+#define MODBUS_CONFIG_FC_GET_COMM_EVENT_COUNTER 1
+#endif
+#ifndef MODBUS_CONFIG_FC_GET_COMM_EVENT_LOG
+#define MODBUS_CONFIG_FC_GET_COMM_EVENT_LOG 1
+#endif
+#ifndef MODBUS_CONFIG_FC_READ_FILE_RECORD
+#define MODBUS_CONFIG_FC_READ_FILE_RECORD 1
+#endif
+#ifndef MODBUS_CONFIG_FC_WRITE_FILE_RECORD
+#define MODBUS_CONFIG_FC_WRITE_FILE_RECORD 1
+#endif
+#ifndef MODBUS_CONFIG_FC_MASK_WRITE_REGISTER
+#define MODBUS_CONFIG_FC_MASK_WRITE_REGISTER 1
+#endif
+#ifndef MODBUS_CONFIG_FC_WRITE_AND_READ_REGISTERS
+#define MODBUS_CONFIG_FC_WRITE_AND_READ_REGISTERS 1
+#endif
+
+/* Records of the messages sent and received in the ring set by
+ * modbus_set_trace(). Without it, the hooks are not compiled. */
+#ifndef MODBUS_CONFIG_TRACE
+#define MODBUS_CONFIG_TRACE 1
+#endif
+
+/* Counters and latency histograms of the requests in the statistics set by
+ * modbus_set_stats(). Without it, the hooks are not compiled. */
+#ifndef MODBUS_CONFIG_STATS
+#define MODBUS_CONFIG_STATS 1
+#endif
+
+#endif /* MODBUS_CONFIG_H */
@@ -15,6 +15,7 @@
  * SPDX-License-Identifier: LGPL-2.1-or-later
  */
 
+#include <errno.h>
 #include <stdlib.h>
 
 // clang-format off
@@ -43,6 +44,11 @@
 #  include <byteswap.h>
 #endif
 
+#if defined(__SSE2__)
+#  include <emmintrin.h>
+#  define MODBUS_DATA_SSE2
+#endif
+
 #if defined(__APPLE__)
 #  include <libkern/OSByteOrder.h>
 #  define bswap_16 OSSwapInt16
@@ -83,6 +89,7 @@ static inline uint32_t bswap_32(uint32_t x)
     return (bswap_16(x & 0xffff) << 16) | (bswap_16(x >> 16));
 }
 #endif
+
 // clang-format on
 
 /* Sets many bits from a single byte value (all 8 bits of the byte value are
@@ -303,3 +310,311 @@ void modbus_set_float(float f, uint16_t *dest)
     dest[0] = (uint16_t) i;
     dest[1] = (uint16_t) (i >> 16);
 }
+
+/* Bulk conversions between registers (as read by modbus_read_registers) and
+ * 32/64 bit values. A value is converted by reversing the order of its
+ * registers in memory and/or by swapping the bytes of each register. Both
+ * operations are their own inverse, so the same code serves the get and set
+ * directions. */
+
+static int order_reverses_registers(modbus_order_t order)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return order == MODBUS_ORDER_DCBA || order == MODBUS_ORDER_CDAB;
+#else
+    return order == MODBUS_ORDER_ABCD || order == MODBUS_ORDER_BADC;
+#endif
+}
+
+static int order_swaps_bytes(modbus_order_t order)
+{
+    return order == MODBUS_ORDER_DCBA || order == MODBUS_ORDER_BADC;
+}
+
+/* Converts nb values of nb_registers (2 or 4) registers, src and dest may be
+   the same array */
+static void convert_values(
+    const void *src, void *dest, int nb, int nb_registers, modbus_order_t order)
+{
+    const uint8_t *in = src;
+    uint8_t *out = dest;
+    const int reverse = order_reverses_registers(order);
+    const int swap = order_swaps_bytes(order);
+    const int size = 2 * nb_registers;
+    int i = 0;
+
+    if (!reverse && !swap) {
+        memmove(dest, src, nb * size);
+        return;
+    }
+
+#if defined(MODBUS_DATA_SSE2)
+    for (; i + 16 / size <= nb; i += 16 / size, in += 16, out += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) in);
+
+        if (reverse && nb_registers == 2) {
+            v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+            v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+        } else if (reverse) {
+            v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+            v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+        }
+        if (swap) {
+            v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        }
+        _mm_storeu_si128((__m128i *) out, v);
+    }
+#endif
+
+    /* Remaining values (or all of them without vector unit), a pair of
+       registers per word: REV, ROR and REV16 on ARM */
+    for (; i < nb; i++, in += size, out += size) {
+        uint32_t w[2];
+        int k;
+
+        memcpy(w, in, size);
+        if (reverse && nb_registers == 4) {
+            uint32_t tmp = w[0];
+
+            w[0] = w[1];
+            w[1] = tmp;
+        }
+        for (k = 0; k < nb_registers / 2; k++) {
+            if (reverse && swap)
+                w[k] = bswap_32(w[k]);
+            else if (reverse)
+                w[k] = (w[k] >> 16) | (w[k] << 16);
+            else
+                w[k] = ((w[k] & 0x00FF00FF) << 8) | ((w[k] >> 8) & 0x00FF00FF);
+        }
+        memcpy(out, w, size);
+    }
+}
+
+/* The view holds the registers as received, big endian. On a little endian
+   host, they are registers of the host with their bytes swapped. */
+static modbus_order_t view_order(modbus_order_t order)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return order;
+#else
+    switch (order) {
+    case MODBUS_ORDER_ABCD:
+        return MODBUS_ORDER_BADC;
+    case MODBUS_ORDER_BADC:
+        return MODBUS_ORDER_ABCD;
+    case MODBUS_ORDER_DCBA:
+        return MODBUS_ORDER_CDAB;
+    default:
+        return MODBUS_ORDER_DCBA;
+    }
+#endif
+}
+
+static int view_check(const modbus_view_t *view,
+                      int index,
+                      int nb,
+                      int nb_registers,
+                      modbus_order_t order,
+                      const void *dest)
+{
+    if (view == NULL || view->data == NULL || dest == NULL || index < 0 || nb < 0 ||
+        nb > view->nb || index + nb * nb_registers > view->nb ||
+        (int) order < MODBUS_ORDER_ABCD || order > MODBUS_ORDER_CDAB) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Copies the nb registers from index of the view. Returns nb. */
+int modbus_view_get_uint16(const modbus_view_t *view, int index, int nb, uint16_t *dest)
+{
+    const uint8_t *src;
+    int i;
+
+    if (view_check(view, index, nb, 1, MODBUS_ORDER_ABCD, dest) == -1)
+        return -1;
+
+    src = view->data + 2 * index;
+    for (i = 0; i < nb; i++) {
+        dest[i] = (src[2 * i] << 8) | src[2 * i + 1];
+    }
+
+    return nb;
+}
+
+/* The typed getters decode nb values from the register index of the view in
+   a single pass. They return nb. */
+int modbus_view_get_uint32(
+    const modbus_view_t *view, int index, int nb, modbus_order_t order, uint32_t *dest)
+{
+    if (view_check(view, index, nb, 2, order, dest) == -1)
+        return -1;
+
+    convert_values(view->data + 2 * index, dest, nb, 2, view_order(order));
+    return nb;
+}
+
+int modbus_view_get_int32(
+    const modbus_view_t *view, int index, int nb, modbus_order_t order, int32_t *dest)
+{
+    if (view_check(view, index, nb, 2, order, dest) == -1)
+        return -1;
+
+    convert_values(view->data + 2 * index, dest, nb, 2, view_order(order));
+    return nb;
+}
+
+int modbus_view_get_float(
+    const modbus_view_t *view, int index, int nb, modbus_order_t order, float *dest)
+{
+    if (view_check(view, index, nb, 2, order, dest) == -1)
+        return -1;
+
+    convert_values(view->data + 2 * index, dest, nb, 2, view_order(order));
+    return nb;
+}
+
+int modbus_view_get_int64(
+    const modbus_view_t *view, int index, int nb, modbus_order_t order, int64_t *dest)
+{
+    if (view_check(view, index, nb, 4, order, dest) == -1)
+        return -1;
+
+    convert_values(view->data + 2 * index, dest, nb, 4, view_order(order));
+    return nb;
+}
+
+int modbus_view_get_double(
+    const modbus_view_t *view, int index, int nb, modbus_order_t order, double *dest)
+{
+    if (view_check(view, index, nb, 4, order, dest) == -1)
+        return -1;
+
+    convert_values(view->data + 2 * index, dest, nb, 4, view_order(order));
+    return nb;
+}
+
+static int convert_check(const void *src, int nb, modbus_order_t order, const void *dest)
+{
+    if (src == NULL || dest == NULL || nb < 0 || (int) order < MODBUS_ORDER_ABCD ||
+        order > MODBUS_ORDER_CDAB) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* The get functions decode nb values from the registers of src (2 or 4 per
+   value), the set functions encode them back. Registers and values may share
+   the same memory. They return nb. */
+int modbus_get_floats(const uint16_t *src, int nb, modbus_order_t order, float *dest)
+{
+    if (convert_check(src, nb, order, dest) == -1)
+        return -1;
+
+    convert_values(src, dest, nb, 2, order);
+    return nb;
+}
+
+int modbus_set_floats(const float *src, int nb, modbus_order_t order, uint16_t *dest)
+{
+    if (convert_check(src, nb, order, dest) == -1)
+        return -1;
+
+    convert_values(src, dest, nb, 2, order);
+    return nb;
+}
+
+int modbus_get_doubles(const uint16_t *src, int nb, modbus_order_t order, double *dest)
+{
+    if (convert_check(src, nb, order, dest) == -1)
+        return -1;
+
+    convert_values(src, dest, nb, 4, order);
+    return nb;
+}
+
+int modbus_set_doubles(const double *src, int nb, modbus_order_t order, uint16_t *dest)
+{
+    if (convert_check(src, nb, order, dest) == -1)
+        return -1;
+
+    convert_values(src, dest, nb, 4, order);
+    return nb;
+}
+
+int modbus_get_int32s(const uint16_t *src, int nb, modbus_order_t order, int32_t *dest)
+{
+    if (convert_check(src, nb, order, dest) == -1)
+        return -1;
+
+    convert_values(src, dest, nb, 2, order);
+    return nb;
+}
+
+int modbus_set_int32s(const int32_t *src, int nb, modbus_order_t order, uint16_t *dest)
+{
+    if (convert_check(src, nb, order, dest) == -1)
+        return -1;
+
+    convert_values(src, dest, nb, 2, order);
+    return nb;
+}
+
+int modbus_get_uint32s(const uint16_t *src, int nb, modbus_order_t order, uint32_t *dest)
+{
+    if (convert_check(src, nb, order, dest) == -1)
+        return -1;
+
+    convert_values(src, dest, nb, 2, order);
+    return nb;
+}
+
+int modbus_set_uint32s(const uint32_t *src, int nb, modbus_order_t order, uint16_t *dest)
+{
+    if (convert_check(src, nb, order, dest) == -1)
+        return -1;
+
+    convert_values(src, dest, nb, 2, order);
+    return nb;
+}
+
+int modbus_get_int64s(const uint16_t *src, int nb, modbus_order_t order, int64_t *dest)
+{
+    if (convert_check(src, nb, order, dest) == -1)
+        return -1;
+
+    convert_values(src, dest, nb, 4, order);
+    return nb;
+}
+
+int modbus_set_int64s(const int64_t *src, int nb, modbus_order_t order, uint16_t *dest)
+{
+    if (convert_check(src, nb, order, dest) == -1)
+        return -1;
+
+    convert_values(src, dest, nb, 4, order);
+    return nb;
+}
+
+int modbus_get_uint64s(const uint16_t *src, int nb, modbus_order_t order, uint64_t *dest)
+{
+    if (convert_check(src, nb, order, dest) == -1)
+        return -1;
+
+    convert_values(src, dest, nb, 4, order);
+    return nb;
+}
+
+int modbus_set_uint64s(const uint64_t *src, int nb, modbus_order_t order, uint16_t *dest)
+{
+    if (convert_check(src, nb, order, dest) == -1)
+        return -1;
+
+    convert_values(src, dest, nb, 4, order);
+    return nb;
+}
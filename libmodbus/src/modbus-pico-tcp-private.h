@@ -97,6 +97,7 @@ static int          _modbus_tcp_flush(modbus_t *ctx);
 static int _modbus_set_slave(modbus_t *ctx, int slave);
 static int _modbus_tcp_build_request_basis(
     modbus_t *ctx, int function, int addr, int nb, uint8_t *req);
+static int _modbus_tcp_next_tid(modbus_t *ctx);
 static int _modbus_tcp_build_response_basis(sft_t *sft, uint8_t *rsp);
 static int _modbus_tcp_prepare_response_tid(
     const uint8_t *req, int *req_length);
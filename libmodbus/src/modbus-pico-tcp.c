@@ -26,6 +26,7 @@
 
 #include "lwipopts.h"
 #include "lwip/pbuf.h"
+#include "lwip/stats.h"
 #include "lwip/tcp.h"
 
 #include "modbus-private.h"
@@ -49,13 +50,13 @@ static err_t tcp_server_accepted(void *arg, struct tcp_pcb *client_pcb, err_t er
     modbus_tcp_t *ctx_tcp  = (modbus_tcp_t *) ctx->backend_data;;
 
     if (err != ERR_OK) {
-        if (ctx->debug)
+        if (_MODBUS_ERROR(ctx))
             printf("\tFailure in accept: %s\n", lwip_err_str(err));
         tcp_connection_exit(arg);
         return ERR_VAL;
     }
     if (client_pcb == NULL) {
-        if (ctx->debug)
+        if (_MODBUS_ERROR(ctx))
             printf("\tFailure in accept: client_pcb == NULL\n");
         tcp_connection_exit(arg);
         return ERR_VAL;
@@ -115,7 +116,7 @@ static void tcp_connection_err(void *arg, err_t err) {
         ctx_tcp->connected = false;
     }
     else{
-        if (ctx->debug)
+        if (_MODBUS_ERROR(ctx))
             printf("tcp_connection_err(): %s (%d)\n", lwip_err_str(err), err);
 //         if (err != ERR_ABRT) {
 //             TODO How to handle this?
@@ -159,7 +160,7 @@ err_t tcp_connection_recved(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err
 
 //     TODO handle this gracefully...
     if (err != ERR_OK) {
-        if (ctx->debug)
+        if (_MODBUS_ERROR(ctx))
             printf("\tERROR: %s (%d)\n", lwip_err_str(err), err);
         return tcp_connection_exit(arg);
     }
@@ -209,7 +210,7 @@ static err_t tcp_connection_close(void *arg)
         tcp_err(ctx_tcp->client_pcb, NULL);
         err = tcp_close(ctx_tcp->client_pcb);
         if (err != ERR_OK) {
-            if (ctx->debug)
+            if (_MODBUS_ERROR(ctx))
                 printf("\tclose failed %d, calling abort\n", err);
             tcp_abort(ctx_tcp->client_pcb);
             err = ERR_ABRT;
@@ -220,7 +221,7 @@ static err_t tcp_connection_close(void *arg)
         tcp_arg(ctx_tcp->server_pcb, NULL);
         err = tcp_close(ctx_tcp->server_pcb);
         if (err != ERR_OK) {
-            if (ctx->debug)
+            if (_MODBUS_ERROR(ctx))
                 printf("\tclose failed %d, calling abort\n", err);
             tcp_abort(ctx_tcp->client_pcb);
             err = ERR_ABRT;
@@ -269,6 +270,7 @@ const modbus_backend_t _modbus_tcp_backend = {
     MODBUS_TCP_MAX_ADU_LENGTH,
     _modbus_set_slave,
     _modbus_tcp_build_request_basis,
+    _modbus_tcp_next_tid,
     _modbus_tcp_build_response_basis,
     _modbus_tcp_prepare_response_tid,
     _modbus_tcp_send_msg_pre,
@@ -320,7 +322,7 @@ modbus_t *modbus_new_tcp(const char *ip, int port)
         dest_size = sizeof(char) * 16;
         ret_size = strlcpy(ctx_tcp->ip, ip, dest_size);
         if (ret_size == 0) {
-            if (ctx->debug)
+            if (_MODBUS_ERROR(ctx))
                 printf("\tThe IP string is empty\n");
             modbus_free(ctx);
             errno = EINVAL;
@@ -328,7 +330,7 @@ modbus_t *modbus_new_tcp(const char *ip, int port)
         }
 
         if (ret_size >= dest_size) {
-            if (ctx->debug)
+            if (_MODBUS_ERROR(ctx))
                 printf("\tThe IP string has been truncated\n");
             modbus_free(ctx);
             errno = EINVAL;
@@ -354,28 +356,28 @@ int modbus_tcp_listen(modbus_t *ctx, int nb_connection)
     modbus_tcp_t *ctx_tcp;
     ctx_tcp = (modbus_tcp_t *) ctx->backend_data;
 
-    if (ctx->debug)
+    if (_MODBUS_DEBUG(ctx))
         printf("\tStarting server at %s on port %u\n",
                  ip4addr_ntoa(netif_ip4_addr(netif_list)),
                  ctx_tcp->port);
 
     struct tcp_pcb *pcb = tcp_new_ip_type(IPADDR_TYPE_ANY);
     if (!pcb) {
-        if (ctx->debug)
+        if (_MODBUS_ERROR(ctx))
             printf("\tfailed to create pcb\n");
         return -1;
     }
 
     err_t err = tcp_bind(pcb, NULL, ctx_tcp->port);
     if (err) {
-        if (ctx->debug)
+        if (_MODBUS_ERROR(ctx))
             printf("\tfailed to bind to port %d\n", ctx_tcp->port);
         return false;
     }
 
     ctx_tcp->server_pcb = tcp_listen_with_backlog(pcb, nb_connection);
     if (!ctx_tcp->server_pcb) {
-        if (ctx->debug)
+        if (_MODBUS_ERROR(ctx))
             printf("\tfailed to listen\n");
         if (pcb) {
             tcp_close(pcb);
@@ -441,7 +443,7 @@ static int _modbus_tcp_connect(modbus_t *ctx)
     ctx_tcp->waitConnect = true;
     err_t err = tcp_connect(
         ctx_tcp->client_pcb, &remote_addr, ctx_tcp->port, tcp_client_connected);
-    if (ctx->debug)
+    if (_MODBUS_DEBUG(ctx))
         printf("\tResult from tcp_connect(): %s (%d)\n", lwip_err_str(err), err);
 
     cyw43_arch_lwip_end();
@@ -450,12 +452,12 @@ static int _modbus_tcp_connect(modbus_t *ctx)
         sleep_ms(_WAIT_LOOP_INTERVAL_MS);
     }
     if(ctx_tcp->connected){
-        if (ctx->debug)
+        if (_MODBUS_DEBUG(ctx))
             printf("\tConnect: OK\n");
         return 0;
     }
     else{
-        if (ctx->debug)
+        if (_MODBUS_ERROR(ctx))
             printf("\tConnect: FAILED\n");
         return -1;
     }
@@ -516,7 +518,7 @@ static ssize_t _modbus_tcp_recv(modbus_t *ctx, uint8_t *rsp, int rsp_length)
         if(ctx_tcp->connected){
             printf("\tthis should never happen...\n");
         }
-        if (ctx->debug)
+        if (_MODBUS_DEBUG(ctx))
             printf("\tremote closed connection\n");
         return -1;
     }
@@ -526,7 +528,7 @@ static ssize_t _modbus_tcp_recv(modbus_t *ctx, uint8_t *rsp, int rsp_length)
     memmove(ctx_tcp->buffer_recv, ctx_tcp->buffer_recv + numBytes, ctx_tcp->recv_len - numBytes);
 
     ctx_tcp->recv_len -= numBytes;
-    if (ctx->debug)
+    if (_MODBUS_DEBUG(ctx))
         printf("\t<Received %d byte(s) from remote>\n", numBytes);
 
     return numBytes;
@@ -540,7 +542,7 @@ static ssize_t _modbus_tcp_send(modbus_t *ctx, const uint8_t *req, int req_lengt
     ctx_tcp = (modbus_tcp_t *) ctx->backend_data;
 
     if(!ctx_tcp->connected){
-        if (ctx->debug)
+        if (_MODBUS_ERROR(ctx))
             printf("\tNot sending %d byte(s), connection is down\n", req_length);
         errno = ECONNRESET;
         return(-1);
@@ -549,14 +551,14 @@ static ssize_t _modbus_tcp_send(modbus_t *ctx, const uint8_t *req, int req_lengt
     ctx_tcp->sent_len = 0;
     errno = 0;
 
-    if (ctx->debug)
+    if (_MODBUS_DEBUG(ctx))
         printf("\t[Writing %d byte(s) to remote]\n", req_length);
 
     cyw43_arch_lwip_begin();
     struct tcp_pcb *tpcb = ctx_tcp->client_pcb;
     err_t err = tcp_write(tpcb, req, req_length, TCP_WRITE_FLAG_COPY);
     if (err != ERR_OK) {
-        if (ctx->debug)
+        if (_MODBUS_ERROR(ctx))
             printf("\tFailed to write data: %s (%d)\n", lwip_strerr(err), err);
         errno = EPIPE;
         ctx_tcp->connected = false;
@@ -567,7 +569,7 @@ static ssize_t _modbus_tcp_send(modbus_t *ctx, const uint8_t *req, int req_lengt
     // wait for sent-callback and return the actual count!!!!
     while(ctx_tcp->sent_len == 0){
         if(!ctx_tcp->connected){
-            if (ctx->debug)
+            if (_MODBUS_ERROR(ctx))
                 printf("\tFailed to write data: connection is down\n");
             errno = EPIPE;
             return -1;
@@ -634,19 +636,26 @@ static int _modbus_set_slave(modbus_t *ctx, int slave)
     return 0;
 }
 
-/* Builds a TCP request header */
-static int _modbus_tcp_build_request_basis(
-    modbus_t *ctx, int function, int addr, int nb, uint8_t *req)
+static int _modbus_tcp_next_tid(modbus_t *ctx)
 {
     modbus_tcp_t *ctx_tcp = ctx->backend_data;
 
-    /* Increase transaction ID */
     if (ctx_tcp->t_id < UINT16_MAX)
         ctx_tcp->t_id++;
     else
         ctx_tcp->t_id = 0;
-    req[0] = ctx_tcp->t_id >> 8;
-    req[1] = ctx_tcp->t_id & 0x00ff;
+
+    return ctx_tcp->t_id;
+}
+
+/* Builds a TCP request header */
+static int _modbus_tcp_build_request_basis(
+    modbus_t *ctx, int function, int addr, int nb, uint8_t *req)
+{
+    int t_id = _modbus_tcp_next_tid(ctx);
+
+    req[0] = t_id >> 8;
+    req[1] = t_id & 0x00ff;
 
     /* Protocol Modbus */
     req[2] = 0;
@@ -722,7 +731,7 @@ static int _modbus_tcp_pre_check_confirmation(modbus_t *ctx,
     unsigned int protocol_id;
     /* Check transaction ID */
     if (req[0] != rsp[0] || req[1] != rsp[1]) {
-        if (ctx->debug) {
+        if (_MODBUS_ERROR(ctx)) {
             fprintf(stderr,
                     "Invalid transaction ID received 0x%X (not 0x%X)\n",
                     (rsp[0] << 8) + rsp[1],
@@ -735,7 +744,7 @@ static int _modbus_tcp_pre_check_confirmation(modbus_t *ctx,
     /* Check protocol ID */
     protocol_id = (rsp[2] << 8) + rsp[3];
     if (protocol_id != 0x0) {
-        if (ctx->debug) {
+        if (_MODBUS_ERROR(ctx)) {
             fprintf(stderr, "Invalid protocol ID received 0x%X (not 0x0)\n", protocol_id);
         }
         errno = EMBBADDATA;
@@ -809,6 +818,85 @@ void modbus_tcp_mapping_unlock(modbus_t *ctx)
     critical_section_exit(&(ctx_tcp->cs));
 }
 
+#if LWIP_STATS && (MEM_STATS || MEMP_STATS)
+static void net_stats_mem(uint16_t *dest, const struct stats_mem *mem)
+{
+    dest[0] = mem->avail;
+    dest[1] = mem->used;
+    dest[2] = mem->max;
+    dest[3] = mem->err;
+}
+#endif
+
+/* Copies a snapshot of the lwIP statistics and of the WiFi link to the
+ * MODBUS_NET_STATS_REGISTERS input registers starting at address. To be called
+ * periodically (e.g. every second) by the application, a client reads them as
+ * any other input registers. */
+int modbus_tcp_net_stats(modbus_t *ctx, modbus_mapping_t *mb_mapping, int address)
+{
+    uint16_t tab[MODBUS_NET_STATS_REGISTERS];
+    uint32_t uptime;
+    int32_t rssi;
+    int offset;
+
+    if (ctx == NULL || mb_mapping == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    offset = address - mb_mapping->start_input_registers;
+    if (offset < 0 ||
+        offset + MODBUS_NET_STATS_REGISTERS > mb_mapping->nb_input_registers) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(tab, 0, sizeof(tab));
+    uptime = (uint32_t) (time_us_64() / 1000000);
+    tab[MODBUS_NET_STATS_UPTIME] = uptime >> 16;
+    tab[MODBUS_NET_STATS_UPTIME + 1] = uptime & 0xFFFF;
+
+    /* The driver and the counters are owned by the lwIP context */
+    cyw43_arch_lwip_begin();
+    if (cyw43_wifi_get_rssi(&cyw43_state, &rssi) == 0)
+        tab[MODBUS_NET_STATS_RSSI] = (uint16_t) (int16_t) rssi;
+    tab[MODBUS_NET_STATS_LINK_STATUS] =
+        (uint16_t) cyw43_wifi_link_status(&cyw43_state, CYW43_ITF_STA);
+#if LWIP_STATS && LINK_STATS
+    tab[MODBUS_NET_STATS_LINK] = lwip_stats.link.xmit;
+    tab[MODBUS_NET_STATS_LINK + 1] = lwip_stats.link.recv;
+    tab[MODBUS_NET_STATS_LINK + 2] = lwip_stats.link.drop;
+    tab[MODBUS_NET_STATS_LINK + 3] = lwip_stats.link.err;
+#endif
+#if LWIP_STATS && TCP_STATS
+    tab[MODBUS_NET_STATS_TCP] = lwip_stats.tcp.xmit;
+    tab[MODBUS_NET_STATS_TCP + 1] = lwip_stats.tcp.recv;
+    tab[MODBUS_NET_STATS_TCP + 2] = lwip_stats.tcp.drop;
+    tab[MODBUS_NET_STATS_TCP + 3] = lwip_stats.tcp.chkerr;
+    tab[MODBUS_NET_STATS_TCP + 4] = lwip_stats.tcp.memerr;
+    tab[MODBUS_NET_STATS_TCP + 5] = lwip_stats.tcp.err;
+#endif
+#if LWIP_STATS && MIB2_STATS
+    tab[MODBUS_NET_STATS_TCP_RETRANS] = lwip_stats.mib2.tcpretranssegs >> 16;
+    tab[MODBUS_NET_STATS_TCP_RETRANS + 1] = lwip_stats.mib2.tcpretranssegs & 0xFFFF;
+#endif
+#if LWIP_STATS && MEM_STATS
+    net_stats_mem(tab + MODBUS_NET_STATS_MEM, &lwip_stats.mem);
+#endif
+#if LWIP_STATS && MEMP_STATS
+    net_stats_mem(tab + MODBUS_NET_STATS_PBUF_POOL, lwip_stats.memp[MEMP_PBUF_POOL]);
+    net_stats_mem(tab + MODBUS_NET_STATS_TCP_SEG, lwip_stats.memp[MEMP_TCP_SEG]);
+    net_stats_mem(tab + MODBUS_NET_STATS_TCP_PCB, lwip_stats.memp[MEMP_TCP_PCB]);
+#endif
+    cyw43_arch_lwip_end();
+
+    modbus_tcp_mapping_lock(ctx);
+    memcpy(mb_mapping->tab_input_registers + offset, tab, sizeof(tab));
+    modbus_tcp_mapping_unlock(ctx);
+
+    return MODBUS_NET_STATS_REGISTERS;
+}
+
 int modbus_tcp_get_error(void)
 {
     return errno;
@@ -29,6 +29,20 @@
 #define MODBUS_TCP_MAX_ADU_LENGTH 260
 
 
+/* Input registers written by modbus_tcp_net_stats(). The lwIP values are the
+ * low 16 bits of the counters, 0 when not enabled in lwipopts.h */
+#define MODBUS_NET_STATS_UPTIME      0  /* Seconds, 2 registers high word first */
+#define MODBUS_NET_STATS_RSSI        2  /* WiFi RSSI in dBm, signed */
+#define MODBUS_NET_STATS_LINK_STATUS 3  /* cyw43_wifi_link_status() */
+#define MODBUS_NET_STATS_LINK        4  /* Frames xmit, recv, drop, err */
+#define MODBUS_NET_STATS_TCP         8  /* Segments xmit, recv, drop, chkerr, memerr, err */
+#define MODBUS_NET_STATS_TCP_RETRANS 14 /* Segments retransmitted, 2 registers */
+#define MODBUS_NET_STATS_MEM         16 /* Heap avail, used, max, err */
+#define MODBUS_NET_STATS_PBUF_POOL   20 /* Pool avail, used, max, err */
+#define MODBUS_NET_STATS_TCP_SEG     24 /* Pool avail, used, max, err */
+#define MODBUS_NET_STATS_TCP_PCB     28 /* Pool avail, used, max, err */
+#define MODBUS_NET_STATS_REGISTERS   32
+
 typedef struct _modbus_message_t {
     uint8_t     code;
     uint16_t    addr;
@@ -43,6 +57,7 @@ bool modbus_tcp_message(modbus_t *ctx, const uint8_t *req, modbus_message_t *msg
 void modbus_tcp_mapping_lock(modbus_t *ctx);
 void modbus_tcp_mapping_unlock(modbus_t *ctx);
 int modbus_tcp_get_error(void);
+int modbus_tcp_net_stats(modbus_t *ctx, modbus_mapping_t *mb_mapping, int address);
 bool modbus_get_debug(modbus_t *ctx);
 
 #endif /* MODBUS_PICO_TCP_H */
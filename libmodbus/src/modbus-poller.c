@@ -0,0 +1,1152 @@
+/*
+ * Copyright © Gerhard Schiller 2024, <gerhard.schiller@pm.me>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+/* Asynchronous poller of many TCP devices from one thread, for Linux. Each
+ * device is a modbus_new_tcp() context, connected without waiting and watched
+ * by epoll in edge-triggered mode. Its reads are released every period into
+ * its queue and sent one at a time, the completion callback is called with
+ * the result once the response is decoded or has timed out. A device down,
+ * slow or unreachable only delays its own reads.
+ *
+ * The releases and the timeouts are timers of a hashed wheel of 1 ms ticks:
+ * starting and stopping a timer is O(1) whatever the number of devices, only
+ * the slots of the ticks elapsed are visited.
+ *
+ * A response timeout fails the read in flight, a response arriving later is
+ * dropped on its transaction ID. A connection failure fails all the reads of
+ * the device, it's connected again on the next release.
+ *
+ * With modbus_poller_set_engine(), io_uring is used instead of epoll: a
+ * multishot receive per device into buffers provided to the kernel, sends and
+ * polls of the connections on fixed files, all submitted by one system call
+ * per run. */
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "modbus-private.h"
+#include "modbus-poller.h"
+
+#ifdef HAVE_SYS_EPOLL_H
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "modbus-tcp.h"
+#include "modbus-tcp-private.h"
+#include "modbus-uring-private.h"
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <poll.h>
+#include <sys/resource.h>
+#endif
+
+/* A turn of the wheel is about one second, the timers further away stay in
+   their slot for the next turns */
+#define _POLLER_TICK_US 1000
+#define _POLLER_NB_SLOTS 1024
+#define _POLLER_NB_EVENTS 256
+/* Fixed files of io_uring, each device needs a descriptor up to the limit of
+   the process */
+#define _POLLER_MAX_FILES 65536
+
+/* Operation completed, in the low bits of the address of its device */
+#define _URING_OP_CONNECT 0
+#define _URING_OP_RECV    1
+#define _URING_OP_SEND    2
+#define _URING_OP_CANCEL  3
+#define _URING_OP_MASK    7
+
+typedef struct _modbus_poller_timer {
+    struct _modbus_poller_timer *prev;
+    struct _modbus_poller_timer *next;
+    uint64_t expiry;
+    /* Timeout of a device or release of a read */
+    int is_device;
+} modbus_poller_timer_t;
+
+typedef enum {
+    _DEVICE_CLOSED,
+    _DEVICE_CONNECTING,
+    _DEVICE_CONNECTED
+} modbus_poller_state_t;
+
+typedef struct _modbus_poller_read {
+    /* First, the read is found from its timer */
+    modbus_poller_timer_t timer;
+    struct _modbus_poller_device *device;
+    modbus_prepared_t *prepared;
+    uint32_t period;
+    modbus_poller_fn fn;
+    void *user_data;
+    /* Queued or in flight, a new release is skipped */
+    int pending;
+    struct _modbus_poller_read *next;
+} modbus_poller_read_t;
+
+typedef struct _modbus_poller_device {
+    /* First, the device is found from its timer (connection or response) */
+    modbus_poller_timer_t timer;
+    modbus_t *ctx;
+    modbus_poller_state_t state;
+    modbus_poller_read_t *queue_head;
+    modbus_poller_read_t *queue_tail;
+    modbus_poller_read_t *in_flight;
+    const uint8_t *tx;
+    int tx_offset;
+    int tx_length;
+    int rx_length;
+    /* io_uring: index in the fixed files, send in flight, operations to
+       complete before the socket is closed */
+    int file;
+    int recv_armed;
+    int sending;
+    int nb_pending;
+    int closing;
+    uint8_t rx[2 * MODBUS_TCP_MAX_ADU_LENGTH];
+} modbus_poller_device_t;
+
+struct _modbus_poller {
+    int epfd;
+#ifdef HAVE_LINUX_IO_URING_H
+    /* NULL with epoll */
+    modbus_uring_t *uring;
+#endif
+    int nb_devices;
+    int max_devices;
+    modbus_poller_device_t **devices;
+    int nb_reads;
+    int max_reads;
+    modbus_poller_read_t **reads;
+    /* Completions of the current run */
+    int nb_completions;
+    /* Next tick to expire */
+    uint64_t tick;
+    modbus_poller_timer_t slots[_POLLER_NB_SLOTS];
+    struct epoll_event events[_POLLER_NB_EVENTS];
+};
+
+static void send_next(modbus_poller_t *poller, modbus_poller_device_t *device);
+static void connect_device(modbus_poller_t *poller, modbus_poller_device_t *device);
+
+static void timer_init(modbus_poller_timer_t *timer)
+{
+    timer->prev = timer;
+    timer->next = timer;
+}
+
+static void timer_stop(modbus_poller_timer_t *timer)
+{
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer_init(timer);
+}
+
+static void
+timer_start(modbus_poller_t *poller, modbus_poller_timer_t *timer, uint64_t expiry)
+{
+    modbus_poller_timer_t *slot;
+    uint64_t tick = expiry / _POLLER_TICK_US;
+
+    timer_stop(timer);
+    /* Not in a slot already passed */
+    if (tick < poller->tick)
+        tick = poller->tick;
+    slot = &poller->slots[tick % _POLLER_NB_SLOTS];
+
+    timer->expiry = expiry;
+    timer->prev = slot->prev;
+    timer->next = slot;
+    slot->prev->next = timer;
+    slot->prev = timer;
+}
+
+static uint64_t response_timeout_us(modbus_t *ctx)
+{
+    return (uint64_t) ctx->response_timeout.tv_sec * 1000000 +
+           ctx->response_timeout.tv_usec;
+}
+
+/* Calls the callback of the read in flight and sends the next one */
+static void complete(modbus_poller_t *poller, modbus_poller_device_t *device, int rc)
+{
+    modbus_poller_read_t *read = device->in_flight;
+    int saved_errno = errno;
+
+    device->in_flight = NULL;
+    timer_stop(&device->timer);
+    read->pending = FALSE;
+    poller->nb_completions++;
+    if (read->fn != NULL) {
+        errno = saved_errno;
+        read->fn(device->ctx, rc, read->user_data);
+    }
+
+    if (device->state == _DEVICE_CONNECTED)
+        send_next(poller, device);
+}
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+static int uring_recv(modbus_poller_t *poller, modbus_poller_device_t *device)
+{
+    if (_modbus_uring_recv(
+            poller->uring, device->file, (uintptr_t) device | _URING_OP_RECV) == -1)
+        return -1;
+    device->recv_armed = TRUE;
+    device->nb_pending++;
+
+    return 0;
+}
+
+/* Waits for the connection in progress */
+static int uring_poll_connect(modbus_poller_t *poller, modbus_poller_device_t *device)
+{
+    struct io_uring_sqe *sqe =
+        _modbus_uring_get_sqe(poller->uring, (uintptr_t) device | _URING_OP_CONNECT);
+
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = device->file;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->poll32_events = POLLOUT;
+    device->nb_pending++;
+
+    return 0;
+}
+
+/* Sends the rest of the request, one send at a time */
+static int uring_send(modbus_poller_t *poller, modbus_poller_device_t *device)
+{
+    struct io_uring_sqe *sqe;
+
+    if (device->sending || device->tx_offset == device->tx_length)
+        return 0;
+
+    sqe = _modbus_uring_get_sqe(poller->uring, (uintptr_t) device | _URING_OP_SEND);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = device->file;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->addr = (uintptr_t) (device->tx + device->tx_offset);
+    sqe->len = device->tx_length - device->tx_offset;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    device->sending = TRUE;
+    device->nb_pending++;
+
+    return 0;
+}
+
+/* The socket is shut down to end the operations pending, it's closed at the
+   last completion and the device connected again if reads are queued */
+static void uring_close_device(modbus_poller_t *poller, modbus_poller_device_t *device)
+{
+    modbus_t *ctx = device->ctx;
+
+    if (device->nb_pending > 0) {
+        if (!device->closing) {
+            struct io_uring_sqe *sqe = NULL;
+
+            device->closing = TRUE;
+            shutdown(ctx->s, SHUT_RDWR);
+            /* Not ended by a shut down before the connection */
+            if (device->state == _DEVICE_CONNECTING)
+                sqe = _modbus_uring_get_sqe(poller->uring,
+                                            (uintptr_t) device | _URING_OP_CANCEL);
+            if (sqe != NULL) {
+                sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                sqe->addr = (uintptr_t) device | _URING_OP_CONNECT;
+                device->nb_pending++;
+            }
+        }
+        return;
+    }
+
+    if (device->file != -1) {
+        _modbus_uring_remove_file(poller->uring, device->file);
+        device->file = -1;
+    }
+    modbus_close(ctx);
+    device->closing = FALSE;
+    device->recv_armed = FALSE;
+    device->sending = FALSE;
+}
+
+#endif /* HAVE_LINUX_IO_URING_H */
+
+/* Closes the connection and fails all the reads of the device with the error */
+static void close_device(modbus_poller_t *poller, modbus_poller_device_t *device, int err)
+{
+    modbus_t *ctx = device->ctx;
+
+    if (ctx->debug) {
+        fprintf(stderr,
+                "Connection on socket %d closed: %s\n",
+                ctx->s,
+                modbus_strerror(err));
+    }
+
+#ifdef HAVE_LINUX_IO_URING_H
+    if (poller->uring != NULL) {
+        uring_close_device(poller, device);
+    } else
+#endif
+    {
+        if (ctx->s >= 0)
+            epoll_ctl(poller->epfd, EPOLL_CTL_DEL, ctx->s, NULL);
+        modbus_close(ctx);
+    }
+    device->state = _DEVICE_CLOSED;
+    device->rx_length = 0;
+    device->tx_offset = 0;
+    device->tx_length = 0;
+    timer_stop(&device->timer);
+
+    while (device->in_flight != NULL || device->queue_head != NULL) {
+        if (device->in_flight == NULL) {
+            device->in_flight = device->queue_head;
+            device->queue_head = device->in_flight->next;
+        }
+        errno = err;
+        complete(poller, device, -1);
+    }
+    device->queue_tail = NULL;
+}
+
+static int watch_device(modbus_poller_t *poller, modbus_poller_device_t *device)
+{
+    struct epoll_event event;
+
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = device;
+
+    return epoll_ctl(poller->epfd, EPOLL_CTL_ADD, device->ctx->s, &event);
+}
+
+static void connect_device(modbus_poller_t *poller, modbus_poller_device_t *device)
+{
+    int rc;
+
+#ifdef HAVE_LINUX_IO_URING_H
+    /* Connected again once the previous socket is closed */
+    if (device->closing)
+        return;
+#endif
+
+    if (_modbus_tcp_connect_nowait(device->ctx) == -1) {
+        close_device(poller, device, errno);
+        return;
+    }
+
+#ifdef HAVE_LINUX_IO_URING_H
+    if (poller->uring != NULL) {
+        device->file = _modbus_uring_add_file(poller->uring, device->ctx->s);
+        rc = device->file == -1 ? -1 : uring_poll_connect(poller, device);
+    } else
+#endif
+        rc = watch_device(poller, device);
+    if (rc == -1) {
+        close_device(poller, device, errno);
+        return;
+    }
+
+    device->state = _DEVICE_CONNECTING;
+    timer_start(
+        poller, &device->timer, _modbus_time_us() + response_timeout_us(device->ctx));
+}
+
+/* The socket is writable, the connection is established or has failed */
+static void connected(modbus_poller_t *poller, modbus_poller_device_t *device)
+{
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    if (getsockopt(device->ctx->s, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+        err = errno;
+    if (err != 0) {
+        close_device(poller, device, err);
+        return;
+    }
+
+    device->state = _DEVICE_CONNECTED;
+    timer_stop(&device->timer);
+#ifdef HAVE_LINUX_IO_URING_H
+    if (poller->uring != NULL && uring_recv(poller, device) == -1) {
+        close_device(poller, device, errno);
+        return;
+    }
+#endif
+    send_next(poller, device);
+}
+
+static void flush_tx(modbus_poller_t *poller, modbus_poller_device_t *device)
+{
+#ifdef HAVE_LINUX_IO_URING_H
+    if (poller->uring != NULL) {
+        if (uring_send(poller, device) == -1)
+            close_device(poller, device, errno);
+        return;
+    }
+#endif
+
+    while (device->tx_offset < device->tx_length) {
+        ssize_t rc = send(device->ctx->s,
+                          device->tx + device->tx_offset,
+                          device->tx_length - device->tx_offset,
+                          MSG_NOSIGNAL);
+
+        if (rc == -1) {
+            if (errno == EINTR)
+                continue;
+            /* Sent on the next EPOLLOUT */
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                close_device(poller, device, errno);
+            return;
+        }
+        device->tx_offset += rc;
+    }
+}
+
+static void send_next(modbus_poller_t *poller, modbus_poller_device_t *device)
+{
+    modbus_poller_read_t *read = device->queue_head;
+
+    if (read == NULL || device->in_flight != NULL)
+        return;
+
+    device->queue_head = read->next;
+    if (device->queue_head == NULL)
+        device->queue_tail = NULL;
+    read->next = NULL;
+
+    device->in_flight = read;
+    device->tx_length = _modbus_prepared_next(read->prepared, &device->tx);
+    device->tx_offset = 0;
+    if (device->ctx->debug) {
+        int i;
+
+        for (i = 0; i < device->tx_length; i++)
+            printf("[%.2X]", device->tx[i]);
+        printf("\n");
+    }
+    timer_start(
+        poller, &device->timer, _modbus_time_us() + response_timeout_us(device->ctx));
+    flush_tx(poller, device);
+}
+
+/* Decodes a response, one to a read timed out is dropped */
+static void received(modbus_poller_t *poller,
+                     modbus_poller_device_t *device,
+                     uint8_t *rsp,
+                     int rsp_length)
+{
+    modbus_t *ctx = device->ctx;
+    modbus_poller_read_t *read = device->in_flight;
+    modbus_error_recovery_mode error_recovery;
+    int rc;
+
+    if (read == NULL || rsp[0] != device->tx[0] || rsp[1] != device->tx[1])
+        return;
+
+    _modbus_received_msg(ctx, rsp, MSG_CONFIRMATION, rsp_length);
+    /* No flush nor sleep of the recovery, the other devices are waiting */
+    error_recovery = ctx->error_recovery;
+    ctx->error_recovery = MODBUS_ERROR_RECOVERY_NONE;
+    rc = _modbus_prepared_decode(read->prepared, rsp, rsp_length);
+    ctx->error_recovery = error_recovery;
+
+    complete(poller, device, rc);
+}
+
+/* Cuts the bytes received into responses. Returns -1 if the device is
+   closed meanwhile. */
+static int cut_responses(modbus_poller_t *poller, modbus_poller_device_t *device)
+{
+    int offset = 0;
+
+    while (device->rx_length - offset >= _MODBUS_TCP_PRESET_RSP_LENGTH) {
+        uint8_t *rsp = device->rx + offset;
+        /* Unit identifier and PDU */
+        int length = (rsp[4] << 8) + rsp[5];
+
+        if (length < 2 ||
+            _MODBUS_TCP_HEADER_LENGTH - 1 + length > MODBUS_TCP_MAX_ADU_LENGTH) {
+            close_device(poller, device, EMBBADDATA);
+            return -1;
+        }
+        length += _MODBUS_TCP_HEADER_LENGTH - 1;
+        if (device->rx_length - offset < length)
+            break;
+        offset += length;
+        received(poller, device, rsp, length);
+        /* Closed by the callback or by a failure */
+        if (device->state != _DEVICE_CONNECTED)
+            return -1;
+    }
+    device->rx_length -= offset;
+    memmove(device->rx, device->rx + offset, device->rx_length);
+
+    return 0;
+}
+
+/* Reads all the bytes available and cuts them into responses */
+static void receive_responses(modbus_poller_t *poller, modbus_poller_device_t *device)
+{
+    for (;;) {
+        ssize_t rc = recv(device->ctx->s,
+                          device->rx + device->rx_length,
+                          sizeof(device->rx) - device->rx_length,
+                          0);
+
+        if (rc == 0) {
+            close_device(poller, device, ECONNRESET);
+            return;
+        }
+        if (rc == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                close_device(poller, device, errno);
+            return;
+        }
+        device->rx_length += rc;
+
+        if (cut_responses(poller, device) == -1)
+            return;
+    }
+}
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+/* Copies the bytes received, they are cut into responses once the request is
+   sent */
+static void uring_received(modbus_poller_t *poller,
+                           modbus_poller_device_t *device,
+                           const struct io_uring_cqe *cqe)
+{
+    int err = 0;
+
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        device->recv_armed = FALSE;
+        device->nb_pending--;
+    }
+
+    if (cqe->res > 0) {
+        int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        const uint8_t *buf = poller->uring->bufs + bid * _MODBUS_URING_BUF_SIZE;
+        int offset = 0;
+
+        while (!device->closing && device->state == _DEVICE_CONNECTED &&
+               offset < cqe->res) {
+            int length = sizeof(device->rx) - device->rx_length;
+
+            if (length == 0) {
+                err = EMBBADDATA;
+                break;
+            }
+            if (length > cqe->res - offset)
+                length = cqe->res - offset;
+            memcpy(device->rx + device->rx_length, buf + offset, length);
+            device->rx_length += length;
+            offset += length;
+            if (!device->sending && cut_responses(poller, device) == -1)
+                break;
+        }
+        _modbus_uring_recycle(poller->uring, bid);
+    } else if (cqe->res == 0) {
+        err = ECONNRESET;
+    } else if (cqe->res != -ENOBUFS) {
+        err = -cqe->res;
+    }
+
+    if (device->closing) {
+        uring_close_device(poller, device);
+    } else if (device->state == _DEVICE_CONNECTED) {
+        if (err != 0)
+            close_device(poller, device, err);
+        else if (!device->recv_armed && uring_recv(poller, device) == -1)
+            close_device(poller, device, errno);
+    }
+}
+
+static void
+uring_sent(modbus_poller_t *poller, modbus_poller_device_t *device, int res)
+{
+    device->nb_pending--;
+    device->sending = FALSE;
+    if (device->closing) {
+        uring_close_device(poller, device);
+        return;
+    }
+    if (res < 0) {
+        close_device(poller, device, -res);
+        return;
+    }
+
+    device->tx_offset += res;
+    if (device->tx_offset < device->tx_length) {
+        flush_tx(poller, device);
+        return;
+    }
+
+    /* A response received meanwhile */
+    cut_responses(poller, device);
+}
+
+static void uring_complete(modbus_poller_t *poller, const struct io_uring_cqe *cqe)
+{
+    modbus_poller_device_t *device = (modbus_poller_device_t *) (uintptr_t) (
+        cqe->user_data & ~(uint64_t) _URING_OP_MASK);
+
+    switch (cqe->user_data & _URING_OP_MASK) {
+    case _URING_OP_RECV:
+        uring_received(poller, device, cqe);
+        break;
+    case _URING_OP_SEND:
+        uring_sent(poller, device, cqe->res);
+        break;
+    default:
+        device->nb_pending--;
+        if (device->closing)
+            uring_close_device(poller, device);
+        else if ((cqe->user_data & _URING_OP_MASK) == _URING_OP_CONNECT &&
+                 device->state == _DEVICE_CONNECTING)
+            connected(poller, device);
+        break;
+    }
+
+    /* Closed, the reads queued meanwhile connect it again */
+    if (device->state == _DEVICE_CLOSED && !device->closing && device->queue_head != NULL)
+        connect_device(poller, device);
+}
+
+#endif /* HAVE_LINUX_IO_URING_H */
+
+static void release(modbus_poller_t *poller, modbus_poller_read_t *read, uint64_t now)
+{
+    modbus_poller_device_t *device = read->device;
+
+    if (read->period != 0) {
+        timer_start(poller,
+                    &read->timer,
+                    _modbus_next_release(read->timer.expiry, read->period, now, NULL));
+    }
+
+    /* The previous one is not finished */
+    if (read->pending)
+        return;
+
+    read->pending = TRUE;
+    read->next = NULL;
+    if (device->queue_tail == NULL)
+        device->queue_head = read;
+    else
+        device->queue_tail->next = read;
+    device->queue_tail = read;
+
+    if (device->state == _DEVICE_CLOSED)
+        connect_device(poller, device);
+    else if (device->state == _DEVICE_CONNECTED)
+        send_next(poller, device);
+}
+
+static void timed_out(modbus_poller_t *poller, modbus_poller_device_t *device)
+{
+    /* A request partly sent can't be followed by the next one */
+    if (device->state == _DEVICE_CONNECTING || device->tx_offset < device->tx_length) {
+        close_device(poller, device, ETIMEDOUT);
+    } else if (device->in_flight != NULL) {
+        /* The connection is kept */
+        errno = ETIMEDOUT;
+        complete(poller, device, -1);
+    }
+}
+
+/* Expires the timers of the ticks elapsed, up to one tick late */
+static void expire_timers(modbus_poller_t *poller, uint64_t now)
+{
+    uint64_t tick = now / _POLLER_TICK_US;
+    int nb_slots = 0;
+
+    while (poller->tick < tick && nb_slots < _POLLER_NB_SLOTS) {
+        modbus_poller_timer_t *slot = &poller->slots[poller->tick % _POLLER_NB_SLOTS];
+        modbus_poller_timer_t expired;
+
+        /* Moved aside, the timers started by the handlers don't come back */
+        timer_init(&expired);
+        if (slot->next != slot) {
+            expired.next = slot->next;
+            expired.prev = slot->prev;
+            expired.next->prev = &expired;
+            expired.prev->next = &expired;
+            timer_init(slot);
+        }
+
+        /* A handler may stop any other timer of the list */
+        while (expired.next != &expired) {
+            modbus_poller_timer_t *timer = expired.next;
+
+            timer_stop(timer);
+            if (timer->expiry / _POLLER_TICK_US > poller->tick) {
+                /* A next turn */
+                timer_start(poller, timer, timer->expiry);
+            } else if (timer->is_device) {
+                timed_out(poller, (modbus_poller_device_t *) timer);
+            } else {
+                release(poller, (modbus_poller_read_t *) timer, now);
+            }
+        }
+
+        poller->tick++;
+        nb_slots++;
+    }
+
+    /* All the slots visited, nothing left behind */
+    if (poller->tick < tick)
+        poller->tick = tick;
+}
+
+/* Milliseconds to the first slot with a timer or -1 */
+static int next_timeout(modbus_poller_t *poller, uint64_t now)
+{
+    int i;
+
+    for (i = 0; i < _POLLER_NB_SLOTS; i++) {
+        uint64_t tick = poller->tick + i;
+        const modbus_poller_timer_t *slot = &poller->slots[tick % _POLLER_NB_SLOTS];
+
+        if (slot->next != slot) {
+            uint64_t expiry = (tick + 1) * _POLLER_TICK_US;
+
+            if (expiry <= now)
+                return 0;
+            return (expiry - now + 999) / 1000;
+        }
+    }
+
+    return -1;
+}
+
+modbus_poller_t *modbus_poller_new(void)
+{
+    modbus_poller_t *poller;
+    int i;
+
+    poller = (modbus_poller_t *) malloc(sizeof(modbus_poller_t));
+    if (poller == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    memset(poller, 0, sizeof(modbus_poller_t));
+
+    poller->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (poller->epfd == -1) {
+        free(poller);
+        return NULL;
+    }
+
+    for (i = 0; i < _POLLER_NB_SLOTS; i++)
+        timer_init(&poller->slots[i]);
+    poller->tick = _modbus_time_us() / _POLLER_TICK_US;
+
+    return poller;
+}
+
+/* Selects the I/O engine, before the devices are added. The io_uring one needs
+   Linux 6.0, the engine is left unchanged and errno set to ENOTSUP if it isn't
+   available. */
+int modbus_poller_set_engine(modbus_poller_t *poller, modbus_poller_engine_t engine)
+{
+#ifdef HAVE_LINUX_IO_URING_H
+    struct rlimit limit;
+    int nb_files = _POLLER_MAX_FILES;
+#endif
+
+    if (poller == NULL ||
+        (engine != MODBUS_POLLER_ENGINE_EPOLL && engine != MODBUS_POLLER_ENGINE_IO_URING)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (poller->nb_devices > 0) {
+        errno = EBUSY;
+        return -1;
+    }
+
+#ifdef HAVE_LINUX_IO_URING_H
+    if (engine == MODBUS_POLLER_ENGINE_EPOLL) {
+        _modbus_uring_free(poller->uring);
+        poller->uring = NULL;
+        return 0;
+    }
+    if (poller->uring != NULL)
+        return 0;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < (rlim_t) nb_files)
+        nb_files = limit.rlim_cur;
+    poller->uring = _modbus_uring_new(nb_files);
+
+    return poller->uring == NULL ? -1 : 0;
+#else
+    if (engine == MODBUS_POLLER_ENGINE_EPOLL)
+        return 0;
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
+/* Adds a modbus_new_tcp() context, returns the index of the device. A context
+   connected is polled on its connection, an other one is connected on the
+   first release of its reads. */
+int modbus_poller_add_device(modbus_poller_t *poller, modbus_t *ctx)
+{
+    modbus_poller_device_t *device;
+    int rc;
+
+    if (poller == NULL || ctx == NULL ||
+        ctx->backend->backend_type != _MODBUS_BACKEND_TYPE_TCP) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (poller->nb_devices == poller->max_devices) {
+        int max_devices = poller->max_devices ? 2 * poller->max_devices : 16;
+        modbus_poller_device_t **devices =
+            realloc(poller->devices, max_devices * sizeof(modbus_poller_device_t *));
+
+        if (devices == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        poller->devices = devices;
+        poller->max_devices = max_devices;
+    }
+
+    device = (modbus_poller_device_t *) malloc(sizeof(modbus_poller_device_t));
+    if (device == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memset(device, 0, sizeof(modbus_poller_device_t));
+    timer_init(&device->timer);
+    device->timer.is_device = TRUE;
+    device->ctx = ctx;
+    device->state = _DEVICE_CLOSED;
+    device->file = -1;
+
+    if (ctx->s >= 0) {
+        /* The socket of libmodbus is non-blocking */
+        _modbus_read_ahead_drop(ctx);
+#ifdef HAVE_LINUX_IO_URING_H
+        if (poller->uring != NULL) {
+            device->file = _modbus_uring_add_file(poller->uring, ctx->s);
+            rc = device->file == -1 ? -1 : uring_recv(poller, device);
+            if (rc == -1 && device->file != -1)
+                _modbus_uring_remove_file(poller->uring, device->file);
+        } else
+#endif
+            rc = watch_device(poller, device);
+        if (rc == -1) {
+            free(device);
+            return -1;
+        }
+        device->state = _DEVICE_CONNECTED;
+    }
+
+    poller->devices[poller->nb_devices] = device;
+    return poller->nb_devices++;
+}
+
+/* Adds a read of the device released every period (once if 0), the first
+   release is at the next run. The destination is written before the
+   callback is called, the values are those of modbus_read_registers() and
+   the like. */
+int modbus_poller_add_read(modbus_poller_t *poller,
+                           int device,
+                           int function,
+                           int addr,
+                           int nb,
+                           void *dest,
+                           uint32_t period_us,
+                           modbus_poller_fn fn,
+                           void *user_data)
+{
+    modbus_poller_read_t *read;
+
+    if (poller == NULL || device < 0 || device >= poller->nb_devices) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (poller->nb_reads == poller->max_reads) {
+        int max_reads = poller->max_reads ? 2 * poller->max_reads : 16;
+        modbus_poller_read_t **reads =
+            realloc(poller->reads, max_reads * sizeof(modbus_poller_read_t *));
+
+        if (reads == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        poller->reads = reads;
+        poller->max_reads = max_reads;
+    }
+
+    read = (modbus_poller_read_t *) malloc(sizeof(modbus_poller_read_t));
+    if (read == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memset(read, 0, sizeof(modbus_poller_read_t));
+
+    read->prepared =
+        modbus_prepare_read(poller->devices[device]->ctx, function, addr, nb, dest);
+    if (read->prepared == NULL) {
+        free(read);
+        return -1;
+    }
+    read->device = poller->devices[device];
+    read->period = period_us;
+    read->fn = fn;
+    read->user_data = user_data;
+    timer_init(&read->timer);
+    timer_start(poller, &read->timer, _modbus_time_us());
+
+    poller->reads[poller->nb_reads] = read;
+    return poller->nb_reads++;
+}
+
+#ifdef HAVE_LINUX_IO_URING_H
+/* Waits for the completions up to timeout_ms and processes them */
+static int run_uring_once(modbus_poller_t *poller, int timeout_ms)
+{
+    struct io_uring_cqe cqe;
+
+    if (_modbus_uring_enter(poller->uring, 1, timeout_ms) == -1)
+        return -1;
+
+    while (_modbus_uring_get_cqe(poller->uring, &cqe))
+        uring_complete(poller, &cqe);
+
+    return 0;
+}
+#endif
+
+/* Waits for the events and the timers of the devices up to timeout_ms. The
+   entries of io_uring queued are submitted on return if submit is set, by the
+   next wait otherwise. */
+static int run_once(modbus_poller_t *poller, int timeout_ms, int submit)
+{
+    int timeout;
+    int nb_events;
+    int i;
+
+    timeout = next_timeout(poller, _modbus_time_us());
+    if (timeout == -1 || (timeout_ms >= 0 && timeout_ms < timeout))
+        timeout = timeout_ms;
+
+    poller->nb_completions = 0;
+#ifdef HAVE_LINUX_IO_URING_H
+    if (poller->uring != NULL) {
+        if (run_uring_once(poller, timeout) == -1)
+            return -1;
+        expire_timers(poller, _modbus_time_us());
+        if (submit && _modbus_uring_enter(poller->uring, 0, -1) == -1)
+            return -1;
+        return poller->nb_completions;
+    }
+#endif
+
+    nb_events = epoll_wait(poller->epfd, poller->events, _POLLER_NB_EVENTS, timeout);
+    if (nb_events == -1) {
+        if (errno != EINTR)
+            return -1;
+        nb_events = 0;
+    }
+
+    for (i = 0; i < nb_events; i++) {
+        modbus_poller_device_t *device = poller->events[i].data.ptr;
+        uint32_t events = poller->events[i].events;
+
+        if (device->state == _DEVICE_CONNECTING &&
+            (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+            connected(poller, device);
+        }
+        if (device->state == _DEVICE_CONNECTED &&
+            (events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP))) {
+            receive_responses(poller, device);
+        }
+        if (device->state == _DEVICE_CONNECTED && (events & EPOLLOUT))
+            flush_tx(poller, device);
+    }
+
+    expire_timers(poller, _modbus_time_us());
+
+    return poller->nb_completions;
+}
+
+/* Waits for the events and the timers of the devices up to timeout_ms (-1 for
+   the next timer). Returns the number of reads completed. */
+int modbus_poller_run_once(modbus_poller_t *poller, int timeout_ms)
+{
+    if (poller == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return run_once(poller, timeout_ms, TRUE);
+}
+
+/* Runs the poller for the duration (0 for ever). Returns the number of reads
+   completed. */
+int modbus_poller_run(modbus_poller_t *poller, uint32_t duration_us)
+{
+    uint64_t stop;
+    int nb_completions = 0;
+
+    if (poller == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    stop = _modbus_time_us() + duration_us;
+    for (;;) {
+        uint64_t now = _modbus_time_us();
+        int timeout = -1;
+        int rc;
+
+        if (duration_us != 0) {
+            if (now >= stop)
+                break;
+            timeout = (stop - now + 999) / 1000;
+        }
+
+        /* The requests are submitted with the next wait */
+        rc = run_once(poller, timeout, FALSE);
+        if (rc == -1)
+            return -1;
+        nb_completions += rc;
+    }
+
+#ifdef HAVE_LINUX_IO_URING_H
+    if (poller->uring != NULL && _modbus_uring_enter(poller->uring, 0, -1) == -1)
+        return -1;
+#endif
+
+    return nb_completions;
+}
+
+int modbus_poller_get_nb_connected(modbus_poller_t *poller)
+{
+    int nb_connected = 0;
+    int i;
+
+    if (poller == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (i = 0; i < poller->nb_devices; i++) {
+        if (poller->devices[i]->state == _DEVICE_CONNECTED)
+            nb_connected++;
+    }
+
+    return nb_connected;
+}
+
+/* The contexts are left to the caller, those connected stay connected (a
+   response in flight may come later) */
+void modbus_poller_free(modbus_poller_t *poller)
+{
+    int i;
+
+    if (poller == NULL)
+        return;
+
+#ifdef HAVE_LINUX_IO_URING_H
+    /* Closing the ring ends the operations on the sockets */
+    _modbus_uring_free(poller->uring);
+#endif
+    for (i = 0; i < poller->nb_devices; i++) {
+        modbus_poller_device_t *device = poller->devices[i];
+
+        if (device->state == _DEVICE_CONNECTING || device->closing)
+            modbus_close(device->ctx);
+        free(device);
+    }
+    for (i = 0; i < poller->nb_reads; i++) {
+        modbus_prepared_free(poller->reads[i]->prepared);
+        free(poller->reads[i]);
+    }
+
+    close(poller->epfd);
+    free(poller->devices);
+    free(poller->reads);
+    free(poller);
+}
+
+#else /* HAVE_SYS_EPOLL_H */
+
+modbus_poller_t *modbus_poller_new(void)
+{
+    errno = ENOTSUP;
+    return NULL;
+}
+
+int modbus_poller_set_engine(modbus_poller_t *poller, modbus_poller_engine_t engine)
+{
+    errno = EINVAL;
+    return -1;
+}
+
+int modbus_poller_add_device(modbus_poller_t *poller, modbus_t *ctx)
+{
+    errno = EINVAL;
+    return -1;
+}
+
+int modbus_poller_add_read(modbus_poller_t *poller,
+                           int device,
+                           int function,
+                           int addr,
+                           int nb,
+                           void *dest,
+                           uint32_t period_us,
+                           modbus_poller_fn fn,
+                           void *user_data)
+{
+    errno = EINVAL;
+    return -1;
+}
+
+int modbus_poller_run_once(modbus_poller_t *poller, int timeout_ms)
+{
+    errno = EINVAL;
+    return -1;
+}
+
+int modbus_poller_run(modbus_poller_t *poller, uint32_t duration_us)
+{
+    errno = EINVAL;
+    return -1;
+}
+
+int modbus_poller_get_nb_connected(modbus_poller_t *poller)
+{
+    errno = EINVAL;
+    return -1;
+}
+
+void modbus_poller_free(modbus_poller_t *poller)
+{
+}
+
+#endif /* HAVE_SYS_EPOLL_H */
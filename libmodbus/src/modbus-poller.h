@@ -0,0 +1,45 @@
+/*
+ * Copyright © Gerhard Schiller 2024, <gerhard.schiller@pm.me>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#ifndef MODBUS_POLLER_H
+#define MODBUS_POLLER_H
+
+#include "modbus.h"
+
+MODBUS_BEGIN_DECLS
+
+/* Completion of a read, rc is the number of values read into its destination
+ * or -1 with errno set (ETIMEDOUT, ECONNREFUSED, an exception, ...) */
+typedef void (*modbus_poller_fn)(modbus_t *ctx, int rc, void *user_data);
+
+typedef struct _modbus_poller modbus_poller_t;
+
+typedef enum {
+    MODBUS_POLLER_ENGINE_EPOLL,
+    MODBUS_POLLER_ENGINE_IO_URING
+} modbus_poller_engine_t;
+
+MODBUS_API modbus_poller_t *modbus_poller_new(void);
+MODBUS_API int modbus_poller_set_engine(modbus_poller_t *poller,
+                                        modbus_poller_engine_t engine);
+MODBUS_API int modbus_poller_add_device(modbus_poller_t *poller, modbus_t *ctx);
+MODBUS_API int modbus_poller_add_read(modbus_poller_t *poller,
+                                      int device,
+                                      int function,
+                                      int addr,
+                                      int nb,
+                                      void *dest,
+                                      uint32_t period_us,
+                                      modbus_poller_fn fn,
+                                      void *user_data);
+MODBUS_API int modbus_poller_run_once(modbus_poller_t *poller, int timeout_ms);
+MODBUS_API int modbus_poller_run(modbus_poller_t *poller, uint32_t duration_us);
+MODBUS_API int modbus_poller_get_nb_connected(modbus_poller_t *poller);
+MODBUS_API void modbus_poller_free(modbus_poller_t *poller);
+
+MODBUS_END_DECLS
+
+#endif /* MODBUS_POLLER_H */
@@ -0,0 +1,475 @@
+/*
+ * Copyright © Gerhard Schiller 2024, <gerhard.schiller@pm.me>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+/* Pool of client connections keyed by endpoint (IP and port), shared by
+ * threads. A checkout hands out the connection idle for the shortest time,
+ * checked alive without blocking, or connects a new one within the limit of
+ * the endpoint: a server accepting one client at a time (the Pico) has a
+ * limit of 1, the next checkout waits for the checkin.
+ *
+ * A connect failure marks the endpoint down, the checkouts fail at once with
+ * the same error until the retry time, doubled on each failure. The idle
+ * connections are closed after the idle timeout, on the next checkout or
+ * checkin of their endpoint or by modbus_pool_evict(). */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "modbus-private.h"
+#include "modbus-pool.h"
+
+#if defined(HAVE_PTHREAD_H) && !defined(_WIN32)
+
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "modbus-tcp.h"
+#include "modbus-tcp-private.h"
+
+#define _POOL_RETRY_MIN_US 250000
+#define _POOL_RETRY_MAX_US 8000000
+
+typedef struct _modbus_pool_conn {
+    modbus_t *ctx;
+    uint64_t idle_since;
+    struct _modbus_pool_conn *next;
+} modbus_pool_conn_t;
+
+typedef struct _modbus_pool_endpoint {
+    char ip[16];
+    int port;
+    /* Most recently checked in first */
+    modbus_pool_conn_t *idle;
+    uint64_t retry_at;
+    int last_error;
+    modbus_pool_stats_t stats;
+    struct _modbus_pool_endpoint *next;
+} modbus_pool_endpoint_t;
+
+struct _modbus_pool {
+    int max_per_endpoint;
+    uint32_t idle_timeout;
+    modbus_pool_endpoint_t *endpoints;
+    pthread_mutex_t lock;
+    /* Signaled on each checkin */
+    pthread_cond_t released;
+};
+
+static modbus_pool_endpoint_t *
+find_endpoint(modbus_pool_t *pool, const char *ip, int port)
+{
+    modbus_pool_endpoint_t *endpoint;
+
+    for (endpoint = pool->endpoints; endpoint != NULL; endpoint = endpoint->next) {
+        if (endpoint->port == port && strcmp(endpoint->ip, ip) == 0)
+            return endpoint;
+    }
+
+    return NULL;
+}
+
+/* Closes the idle connections of the endpoint beyond the idle timeout, the
+   oldest are at the end of the list. Returns the number closed. */
+static int evict_idle(modbus_pool_t *pool, modbus_pool_endpoint_t *endpoint, uint64_t now)
+{
+    modbus_pool_conn_t **link = &endpoint->idle;
+    int nb_evicted = 0;
+
+    if (pool->idle_timeout == 0)
+        return 0;
+
+    while (*link != NULL && now - (*link)->idle_since < pool->idle_timeout)
+        link = &(*link)->next;
+
+    while (*link != NULL) {
+        modbus_pool_conn_t *conn = *link;
+
+        *link = conn->next;
+        modbus_close(conn->ctx);
+        modbus_free(conn->ctx);
+        free(conn);
+        endpoint->stats.nb_idle--;
+        endpoint->stats.evictions++;
+        nb_evicted++;
+    }
+
+    return nb_evicted;
+}
+
+/* An idle connection has nothing to read: the server closed it or a late
+   response is left on it, on the socket or in the read-ahead */
+static int is_alive(modbus_t *ctx)
+{
+    uint8_t byte;
+    ssize_t rc;
+
+    if (modbus_get_read_ahead_length(ctx) > 0)
+        return FALSE;
+
+    rc = recv(ctx->s, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+
+    return rc == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/* The errors which leave the connection in step with the server */
+static int is_kept(int error)
+{
+    return error == 0 || (error >= EMBXILFUN && error <= EMBXGTAR) ||
+           error == EMBMDATA || error == EINVAL;
+}
+
+/* Connects a new context for the endpoint, the lock not held */
+static modbus_t *connect_endpoint(modbus_pool_endpoint_t *endpoint)
+{
+    modbus_t *ctx = modbus_new_tcp(endpoint->ip, endpoint->port);
+
+    if (ctx == NULL)
+        return NULL;
+
+    if (modbus_connect(ctx) == -1) {
+        int saved_errno = errno;
+
+        modbus_free(ctx);
+        errno = saved_errno;
+        return NULL;
+    }
+
+    return ctx;
+}
+
+modbus_pool_t *modbus_pool_new(int max_per_endpoint, uint32_t idle_timeout_us)
+{
+    modbus_pool_t *pool;
+
+    if (max_per_endpoint <= 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    pool = (modbus_pool_t *) malloc(sizeof(modbus_pool_t));
+    if (pool == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    memset(pool, 0, sizeof(modbus_pool_t));
+    pool->max_per_endpoint = max_per_endpoint;
+    pool->idle_timeout = idle_timeout_us;
+    pthread_mutex_init(&pool->lock, NULL);
+#ifdef HAVE_PTHREAD_CONDATTR_SETCLOCK
+    {
+        pthread_condattr_t attr;
+
+        /* The waits are not cut or stretched by a change of the time of day */
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&pool->released, &attr);
+        pthread_condattr_destroy(&attr);
+    }
+#else
+    pthread_cond_init(&pool->released, NULL);
+#endif
+
+    return pool;
+}
+
+/* Checks out a connection to the endpoint, waiting up to wait_us for one to be
+   checked in when the limit is reached (EBUSY then). The context is the
+   caller's until modbus_pool_put(), its settings (slave, timeouts) are kept
+   from a checkout to the next one. */
+modbus_t *modbus_pool_get(modbus_pool_t *pool, const char *ip, int port, uint32_t wait_us)
+{
+    modbus_pool_endpoint_t *endpoint;
+    modbus_t *ctx = NULL;
+    struct timespec deadline;
+    int waited = FALSE;
+    int rc;
+
+    if (pool == NULL || ip == NULL || strlen(ip) >= sizeof(endpoint->ip)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    endpoint = find_endpoint(pool, ip, port);
+    if (endpoint == NULL) {
+        endpoint = (modbus_pool_endpoint_t *) malloc(sizeof(modbus_pool_endpoint_t));
+        if (endpoint == NULL) {
+            pthread_mutex_unlock(&pool->lock);
+            errno = ENOMEM;
+            return NULL;
+        }
+        memset(endpoint, 0, sizeof(modbus_pool_endpoint_t));
+        strcpy(endpoint->ip, ip);
+        endpoint->port = port;
+        endpoint->next = pool->endpoints;
+        pool->endpoints = endpoint;
+    }
+    endpoint->stats.checkouts++;
+
+    for (;;) {
+        uint64_t now = _modbus_time_us();
+
+        evict_idle(pool, endpoint, now);
+        while (endpoint->idle != NULL) {
+            modbus_pool_conn_t *conn = endpoint->idle;
+
+            endpoint->idle = conn->next;
+            endpoint->stats.nb_idle--;
+            if (is_alive(conn->ctx)) {
+                ctx = conn->ctx;
+                free(conn);
+                endpoint->stats.nb_in_use++;
+                endpoint->stats.reuses++;
+                pthread_mutex_unlock(&pool->lock);
+                return ctx;
+            }
+            endpoint->stats.dead++;
+            modbus_close(conn->ctx);
+            modbus_free(conn->ctx);
+            free(conn);
+        }
+
+        /* Down, no connect nor wait before the retry time */
+        if (endpoint->stats.consecutive_failures > 0 && now < endpoint->retry_at) {
+            endpoint->stats.fast_failures++;
+            rc = endpoint->last_error;
+            pthread_mutex_unlock(&pool->lock);
+            errno = rc;
+            return NULL;
+        }
+
+        if (endpoint->stats.nb_in_use < pool->max_per_endpoint)
+            break;
+
+        if (!waited) {
+#ifdef HAVE_PTHREAD_CONDATTR_SETCLOCK
+            struct timespec ts;
+#else
+            struct timeval tv;
+#endif
+            uint64_t usec;
+
+            endpoint->stats.waits++;
+            waited = TRUE;
+#ifdef HAVE_PTHREAD_CONDATTR_SETCLOCK
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            usec = (uint64_t) ts.tv_nsec / 1000 + wait_us;
+            deadline.tv_sec = ts.tv_sec + usec / 1000000;
+#else
+            /* The condition uses the real time clock */
+            gettimeofday(&tv, NULL);
+            usec = (uint64_t) tv.tv_usec + wait_us;
+            deadline.tv_sec = tv.tv_sec + usec / 1000000;
+#endif
+            deadline.tv_nsec = (usec % 1000000) * 1000;
+        }
+        rc = pthread_cond_timedwait(&pool->released, &pool->lock, &deadline);
+        if (rc == ETIMEDOUT) {
+            pthread_mutex_unlock(&pool->lock);
+            errno = EBUSY;
+            return NULL;
+        }
+    }
+
+    /* The slot is taken while connecting, the other endpoints go on */
+    endpoint->stats.nb_in_use++;
+    endpoint->stats.connects++;
+    pthread_mutex_unlock(&pool->lock);
+
+    ctx = connect_endpoint(endpoint);
+    rc = errno;
+
+    pthread_mutex_lock(&pool->lock);
+    if (ctx == NULL) {
+        uint32_t retry = _POOL_RETRY_MIN_US;
+        int i;
+
+        for (i = 0; i < endpoint->stats.consecutive_failures; i++) {
+            retry *= 2;
+            if (retry >= _POOL_RETRY_MAX_US) {
+                retry = _POOL_RETRY_MAX_US;
+                break;
+            }
+        }
+
+        endpoint->stats.nb_in_use--;
+        endpoint->stats.connect_failures++;
+        endpoint->stats.consecutive_failures++;
+        endpoint->retry_at = _modbus_time_us() + retry;
+        endpoint->last_error = rc;
+        pthread_cond_broadcast(&pool->released);
+    } else {
+        endpoint->stats.consecutive_failures = 0;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    errno = rc;
+    return ctx;
+}
+
+/* Checks in a connection of modbus_pool_get(). error is 0 or the errno of
+   the last call on the context: after an exception the connection is kept,
+   after an error of the link (a timeout, a reset...) it's closed. */
+int modbus_pool_put(modbus_pool_t *pool, modbus_t *ctx, int error)
+{
+    modbus_pool_endpoint_t *endpoint;
+    modbus_tcp_t *ctx_tcp;
+    modbus_pool_conn_t *conn = NULL;
+
+    if (pool == NULL || ctx == NULL ||
+        ctx->backend->backend_type != _MODBUS_BACKEND_TYPE_TCP) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ctx_tcp = ctx->backend_data;
+    pthread_mutex_lock(&pool->lock);
+    endpoint = find_endpoint(pool, ctx_tcp->ip, ctx_tcp->port);
+    if (endpoint == NULL || endpoint->stats.nb_in_use == 0) {
+        pthread_mutex_unlock(&pool->lock);
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (is_kept(error) && ctx->s >= 0)
+        conn = (modbus_pool_conn_t *) malloc(sizeof(modbus_pool_conn_t));
+    if (conn != NULL) {
+        conn->ctx = ctx;
+        conn->idle_since = _modbus_time_us();
+        conn->next = endpoint->idle;
+        endpoint->idle = conn;
+        endpoint->stats.nb_idle++;
+    }
+    endpoint->stats.nb_in_use--;
+    evict_idle(pool, endpoint, _modbus_time_us());
+    pthread_cond_broadcast(&pool->released);
+    pthread_mutex_unlock(&pool->lock);
+
+    if (conn == NULL) {
+        modbus_close(ctx);
+        modbus_free(ctx);
+    }
+
+    return 0;
+}
+
+/* Closes the idle connections of all the endpoints beyond the idle timeout.
+   Returns the number closed. */
+int modbus_pool_evict(modbus_pool_t *pool)
+{
+    modbus_pool_endpoint_t *endpoint;
+    uint64_t now;
+    int nb_evicted = 0;
+
+    if (pool == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    now = _modbus_time_us();
+    for (endpoint = pool->endpoints; endpoint != NULL; endpoint = endpoint->next)
+        nb_evicted += evict_idle(pool, endpoint, now);
+    pthread_mutex_unlock(&pool->lock);
+
+    return nb_evicted;
+}
+
+int modbus_pool_get_stats(modbus_pool_t *pool,
+                          const char *ip,
+                          int port,
+                          modbus_pool_stats_t *stats)
+{
+    modbus_pool_endpoint_t *endpoint;
+
+    if (pool == NULL || ip == NULL || stats == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    endpoint = find_endpoint(pool, ip, port);
+    if (endpoint != NULL)
+        *stats = endpoint->stats;
+    pthread_mutex_unlock(&pool->lock);
+
+    if (endpoint == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Closes the idle connections, those checked out must have been put back */
+void modbus_pool_free(modbus_pool_t *pool)
+{
+    if (pool == NULL)
+        return;
+
+    while (pool->endpoints != NULL) {
+        modbus_pool_endpoint_t *endpoint = pool->endpoints;
+
+        while (endpoint->idle != NULL) {
+            modbus_pool_conn_t *conn = endpoint->idle;
+
+            endpoint->idle = conn->next;
+            modbus_close(conn->ctx);
+            modbus_free(conn->ctx);
+            free(conn);
+        }
+        pool->endpoints = endpoint->next;
+        free(endpoint);
+    }
+
+    pthread_cond_destroy(&pool->released);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+#else /* HAVE_PTHREAD_H */
+
+modbus_pool_t *modbus_pool_new(int max_per_endpoint, uint32_t idle_timeout_us)
+{
+    errno = ENOTSUP;
+    return NULL;
+}
+
+modbus_t *modbus_pool_get(modbus_pool_t *pool, const char *ip, int port, uint32_t wait_us)
+{
+    errno = EINVAL;
+    return NULL;
+}
+
+int modbus_pool_put(modbus_pool_t *pool, modbus_t *ctx, int error)
+{
+    errno = EINVAL;
+    return -1;
+}
+
+int modbus_pool_evict(modbus_pool_t *pool)
+{
+    errno = EINVAL;
+    return -1;
+}
+
+int modbus_pool_get_stats(modbus_pool_t *pool,
+                          const char *ip,
+                          int port,
+                          modbus_pool_stats_t *stats)
+{
+    errno = EINVAL;
+    return -1;
+}
+
+void modbus_pool_free(modbus_pool_t *pool)
+{
+}
+
+#endif /* HAVE_PTHREAD_H */
@@ -0,0 +1,50 @@
+/*
+ * Copyright © Gerhard Schiller 2024, <gerhard.schiller@pm.me>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#ifndef MODBUS_POOL_H
+#define MODBUS_POOL_H
+
+#include "modbus.h"
+
+MODBUS_BEGIN_DECLS
+
+/* Counters of an endpoint since the creation of the pool */
+typedef struct _modbus_pool_stats {
+    uint32_t checkouts;
+    /* Checkouts served by an idle connection */
+    uint32_t reuses;
+    uint32_t connects;
+    uint32_t connect_failures;
+    /* Checkouts failed at once, the endpoint being down */
+    uint32_t fast_failures;
+    /* Checkouts which waited for the limit of the endpoint */
+    uint32_t waits;
+    /* Idle connections closed after the idle timeout */
+    uint32_t evictions;
+    /* Idle connections found closed by the server or with stale data */
+    uint32_t dead;
+    /* Current state */
+    int nb_idle;
+    int nb_in_use;
+    int consecutive_failures;
+} modbus_pool_stats_t;
+
+typedef struct _modbus_pool modbus_pool_t;
+
+MODBUS_API modbus_pool_t *modbus_pool_new(int max_per_endpoint, uint32_t idle_timeout_us);
+MODBUS_API modbus_t *
+modbus_pool_get(modbus_pool_t *pool, const char *ip, int port, uint32_t wait_us);
+MODBUS_API int modbus_pool_put(modbus_pool_t *pool, modbus_t *ctx, int error);
+MODBUS_API int modbus_pool_evict(modbus_pool_t *pool);
+MODBUS_API int modbus_pool_get_stats(modbus_pool_t *pool,
+                                     const char *ip,
+                                     int port,
+                                     modbus_pool_stats_t *stats);
+MODBUS_API void modbus_pool_free(modbus_pool_t *pool);
+
+MODBUS_END_DECLS
+
+#endif /* MODBUS_POOL_H */
@@ -36,9 +36,15 @@ typedef int ssize_t;
 #endif // PICO_W
 
 #include "modbus.h"
+#include "modbus-config.h"
 
 MODBUS_BEGIN_DECLS
 
+/* Test of the debug flag for the error messages and for the trace, constant
+   false when the output is compiled out (see modbus-config.h) */
+#define _MODBUS_ERROR(ctx) (MODBUS_CONFIG_LOG_LEVEL >= MODBUS_LOG_ERROR && (ctx)->debug)
+#define _MODBUS_DEBUG(ctx) (MODBUS_CONFIG_LOG_LEVEL >= MODBUS_LOG_DEBUG && (ctx)->debug)
+
 /* It's not really the minimal length (the real one is report slave ID
  * in RTU (4 bytes)) but it's a convenient size to use in RTU or TCP
  * communications to read many values or write a single one.
@@ -89,6 +95,9 @@ typedef struct _modbus_backend {
     int (*set_slave)(modbus_t *ctx, int slave);
     int (*build_request_basis)(
         modbus_t *ctx, int function, int addr, int nb, uint8_t *req);
+    /* Increases and returns the transaction ID of the next request, NULL
+       without one (RTU) */
+    int (*next_tid)(modbus_t *ctx);
     int (*build_response_basis)(sft_t *sft, uint8_t *rsp);
     int (*prepare_response_tid)(const uint8_t *req, int *req_length);
     int (*send_msg_pre)(uint8_t *req, int req_length);
@@ -109,9 +118,60 @@ typedef struct _modbus_backend {
 #ifdef PICO_W
     void (*mapping_lock)(modbus_t *ctx);
     void (*mapping_unlock)(modbus_t *ctx);
+#else
+    /* NULL unless the mapping is shared by the workers of a server (see
+       modbus-server.c). A read returns the sequence that mapping_end() checks,
+       it returns 1 if the mapping was written meanwhile and the read must run
+       again. */
+    uint32_t (*mapping_begin)(modbus_t *ctx, int write);
+    int (*mapping_end)(modbus_t *ctx, int write, uint32_t seq);
+    /* NULL unless the diagnostics are shared by the workers of a server */
+    void (*diag_lock)(modbus_t *ctx);
+    void (*diag_unlock)(modbus_t *ctx);
 #endif
+    /* NULL for the generic receive of modbus.c, reading a message in the steps
+       of its header */
+    int (*receive_msg)(modbus_t *ctx, uint8_t *msg, msg_type_t msg_type);
 } modbus_backend_t;
 
+/* The diagnostics are only maintained for the function codes reporting them */
+#define _MODBUS_DIAG                                                                     \
+    (MODBUS_CONFIG_FC_DIAGNOSTICS || MODBUS_CONFIG_FC_GET_COMM_EVENT_COUNTER ||          \
+     MODBUS_CONFIG_FC_GET_COMM_EVENT_LOG)
+
+/* Bytes read past the message received, kept for the next ones. Filled by a
+   single read of the backend, for the socket s only. */
+#define _MODBUS_READ_AHEAD_SIZE 1024
+
+typedef struct _modbus_read_ahead {
+    int s;
+    int offset;
+    int length;
+    uint8_t buf[_MODBUS_READ_AHEAD_SIZE];
+} modbus_read_ahead_t;
+
+/* Messages sent while the context is corked, written by a single send at
+   modbus_uncork() or when the buffer is full, to the socket s */
+#define _MODBUS_CORK_SIZE 4096
+
+typedef struct _modbus_cork {
+    int corked;
+    int s;
+    int length;
+    uint8_t buf[_MODBUS_CORK_SIZE];
+} modbus_cork_t;
+
+/* Diagnostics of a server, updated by the thread using the context or under
+   the diag_lock of the backend */
+typedef struct _modbus_diag {
+    modbus_diag_counters_t counters;
+    /* Ring of the communication events, the most recent at head - 1 */
+    uint8_t events[MODBUS_MAX_COMM_EVENTS];
+    uint8_t head;
+    uint8_t nb_events;
+    uint8_t listen_only;
+} modbus_diag_t;
+
 struct _modbus {
     /* Slave address */
     int slave;
@@ -125,11 +185,74 @@ struct _modbus {
     struct timeval indication_timeout;
     const modbus_backend_t *backend;
     void *backend_data;
+    const modbus_file_storage_t *file_storage;
+    modbus_trace_t *trace;
+    modbus_stats_t *stats;
+    /* NULL unless enabled by modbus_set_read_ahead() */
+    modbus_read_ahead_t *read_ahead;
+    /* Allocated by the first modbus_cork() */
+    modbus_cork_t *cork;
+    /* diag_data, or the one of the server for the copies of its workers */
+    modbus_diag_t *diag;
+    modbus_diag_t diag_data;
+};
+
+/* Ring of trace records with a single writer, modbus_trace_add() */
+struct _modbus_trace {
+    /* Number of records minus one, the number is a power of 2 */
+    uint32_t mask;
+    /* Sequence number of the next record, incremented once it's written */
+    volatile uint32_t head;
+    modbus_trace_record_t *records;
 };
 
+/* Function codes 1 to 0x18 have their own latency histogram, the others
+   share the one of index 0 */
+#define _MODBUS_STATS_NB_FUNCTIONS 0x19
+
+/* Statistics written by the thread using the context */
+struct _modbus_stats {
+    /* Times of the request in progress */
+    uint64_t t_start;
+    uint64_t t_adu;
+    uint64_t t_reply;
+    uint64_t t_sent;
+    int connected;
+    modbus_stats_counters_t counters;
+    /* Indexed by MODBUS_STATS_*, the TOTAL one of all the function codes */
+    uint32_t stages[MODBUS_STATS_SEND + 1][MODBUS_STATS_NB_BUCKETS];
+    uint32_t latency[_MODBUS_STATS_NB_FUNCTIONS][MODBUS_STATS_NB_BUCKETS];
+};
+
+/* Orders the writes of a record before the publication of the new head (and
+   the reads of the head before the reads of the records) for a reader running
+   on another core */
+#if defined(__GNUC__)
+#define _MODBUS_FENCE_RELEASE() __atomic_thread_fence(__ATOMIC_RELEASE)
+#define _MODBUS_FENCE_ACQUIRE() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#else
+#define _MODBUS_FENCE_RELEASE() ((void) 0)
+#define _MODBUS_FENCE_ACQUIRE() ((void) 0)
+#endif
+
 void _modbus_init_common(modbus_t *ctx);
 void _error_print(modbus_t *ctx, const char *context);
 int _modbus_receive_msg(modbus_t *ctx, uint8_t *msg, msg_type_t msg_type);
+uint8_t _modbus_meta_length_after_function(int function, msg_type_t msg_type);
+int _modbus_data_length_after_meta(modbus_t *ctx, uint8_t *msg, msg_type_t msg_type);
+void _modbus_sleep_response_timeout(modbus_t *ctx);
+void _modbus_received_msg(modbus_t *ctx, const uint8_t *msg, msg_type_t msg_type, int rc);
+ssize_t _modbus_read_ahead(modbus_t *ctx,
+                           uint8_t *dest,
+                           int length,
+                           ssize_t (*read_fn)(modbus_t *ctx, uint8_t *buf, int size));
+int _modbus_read_ahead_drop(modbus_t *ctx);
+int _modbus_prepared_next(modbus_prepared_t *prepared, const uint8_t **req);
+int _modbus_prepared_decode(modbus_prepared_t *prepared, uint8_t *rsp, int rsp_length);
+uint64_t _modbus_time_us(void);
+void _modbus_sleep_us(uint32_t us);
+uint64_t
+_modbus_next_release(uint64_t release, uint32_t period, uint64_t end, uint32_t *overruns);
 
 #ifndef HAVE_STRLCPY
 size_t strlcpy(char *dest, const char *src, size_t dest_size);
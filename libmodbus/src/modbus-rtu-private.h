@@ -72,6 +72,12 @@ typedef struct _modbus_rtu {
 #endif
     /* To handle many slaves on the same link */
     int confirmation_to_ignore;
+    /* CRC of the bytes received from crc_start up to crc_end */
+    uint16_t crc;
+    const uint8_t *crc_start;
+    const uint8_t *crc_end;
+    /* Silence ending a message (t3.5) in microseconds */
+    int silent_interval;
 } modbus_rtu_t;
 
 #endif /* MODBUS_RTU_PRIVATE_H */
@@ -38,6 +38,11 @@ MODBUS_API int modbus_rtu_set_custom_rts(modbus_t *ctx,
 MODBUS_API int modbus_rtu_set_rts_delay(modbus_t *ctx, int us);
 MODBUS_API int modbus_rtu_get_rts_delay(modbus_t *ctx);
 
+MODBUS_API int modbus_rtu_set_silent_interval(modbus_t *ctx, int us);
+MODBUS_API int modbus_rtu_get_silent_interval(modbus_t *ctx);
+
+MODBUS_API uint16_t modbus_rtu_crc16(uint16_t crc, const uint8_t *buffer, int length);
+
 MODBUS_END_DECLS
 
 #endif /* MODBUS_RTU_H */
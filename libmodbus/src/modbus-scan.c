@@ -0,0 +1,403 @@
+/*
+ * Copyright © Gerhard Schiller 2024, <gerhard.schiller@pm.me>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+/* Client scan list: the tags of a device are coalesced into the fewest read
+ * requests allowed by the protocol limits, the values read are scattered
+ * back to the tags. The requests are prepared once for the context and the
+ * slave they are run on. */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "modbus.h"
+
+typedef struct _modbus_scan_tag {
+    int table;
+    int addr;
+    /* Number of values and number of bits or registers used by them */
+    int nb;
+    int span;
+    int type;
+    void *dest;
+    int status;
+} modbus_scan_tag_t;
+
+typedef struct _modbus_scan_request {
+    int table;
+    int addr;
+    int nb;
+    /* Tags served by the request (index of the first one in order) */
+    int first;
+    int count;
+    modbus_prepared_t *prepared;
+} modbus_scan_request_t;
+
+struct _modbus_scan {
+    int max_gap;
+    int nb_tags;
+    int max_tags;
+    modbus_scan_tag_t *tags;
+    /* Tags sorted by table and address */
+    modbus_scan_tag_t **order;
+    int nb_requests;
+    modbus_scan_request_t *requests;
+    /* Context and slave of the prepared requests */
+    modbus_t *ctx;
+    int slave;
+    /* The requests are computed again when a tag has been added */
+    int dirty;
+    uint8_t tab_bits[MODBUS_MAX_READ_BITS];
+    uint16_t tab_registers[MODBUS_MAX_READ_REGISTERS];
+};
+
+static int is_bit_table(int table)
+{
+    return table == MODBUS_TABLE_COILS || table == MODBUS_TABLE_DISCRETE_INPUTS;
+}
+
+static int compare_tags(const void *a, const void *b)
+{
+    const modbus_scan_tag_t *tag_a = *(modbus_scan_tag_t *const *) a;
+    const modbus_scan_tag_t *tag_b = *(modbus_scan_tag_t *const *) b;
+
+    if (tag_a->table != tag_b->table)
+        return tag_a->table - tag_b->table;
+    if (tag_a->addr != tag_b->addr)
+        return tag_a->addr - tag_b->addr;
+    /* Keep the order of insertion for a stable result */
+    return (tag_a < tag_b) ? -1 : (tag_a > tag_b);
+}
+
+static void scan_unprepare(modbus_scan_t *scan)
+{
+    int i;
+
+    for (i = 0; i < scan->nb_requests; i++) {
+        modbus_prepared_free(scan->requests[i].prepared);
+        scan->requests[i].prepared = NULL;
+    }
+    scan->ctx = NULL;
+}
+
+static int scan_prepare(modbus_scan_t *scan, modbus_t *ctx)
+{
+    static const int functions[] = { MODBUS_FC_READ_COILS,
+                                     MODBUS_FC_READ_DISCRETE_INPUTS,
+                                     MODBUS_FC_READ_HOLDING_REGISTERS,
+                                     MODBUS_FC_READ_INPUT_REGISTERS };
+    int i;
+
+    scan_unprepare(scan);
+    for (i = 0; i < scan->nb_requests; i++) {
+        modbus_scan_request_t *req = &scan->requests[i];
+        void *dest =
+            is_bit_table(req->table) ? (void *) scan->tab_bits : scan->tab_registers;
+
+        req->prepared =
+            modbus_prepare_read(ctx, functions[req->table], req->addr, req->nb, dest);
+        if (req->prepared == NULL) {
+            scan_unprepare(scan);
+            return -1;
+        }
+    }
+    scan->ctx = ctx;
+    scan->slave = modbus_get_slave(ctx);
+
+    return 0;
+}
+
+/* Merges the sorted tags into requests. A tag joins the current request when
+   it's in the same table, the hole before it is not larger than max_gap and
+   the request stays within the limit of its function code. */
+static int scan_plan(modbus_scan_t *scan)
+{
+    modbus_scan_request_t *req = NULL;
+    int i;
+
+    scan_unprepare(scan);
+    free(scan->order);
+    free(scan->requests);
+    scan->order = NULL;
+    scan->requests = NULL;
+    scan->nb_requests = 0;
+    if (scan->nb_tags == 0) {
+        scan->dirty = FALSE;
+        return 0;
+    }
+
+    scan->order = malloc(scan->nb_tags * sizeof(modbus_scan_tag_t *));
+    scan->requests = malloc(scan->nb_tags * sizeof(modbus_scan_request_t));
+    if (scan->order == NULL || scan->requests == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for (i = 0; i < scan->nb_tags; i++) {
+        scan->order[i] = &scan->tags[i];
+    }
+    qsort(scan->order, scan->nb_tags, sizeof(modbus_scan_tag_t *), compare_tags);
+
+    for (i = 0; i < scan->nb_tags; i++) {
+        const modbus_scan_tag_t *tag = scan->order[i];
+        int limit = is_bit_table(tag->table) ? MODBUS_MAX_READ_BITS
+                                             : MODBUS_MAX_READ_REGISTERS;
+
+        if (req != NULL && req->table == tag->table &&
+            tag->addr - (req->addr + req->nb) <= scan->max_gap) {
+            int end = tag->addr + tag->span;
+
+            if (end < req->addr + req->nb) {
+                /* Included in the request */
+                end = req->addr + req->nb;
+            }
+            if (end - req->addr <= limit) {
+                req->nb = end - req->addr;
+                req->count++;
+                continue;
+            }
+        }
+
+        req = &scan->requests[scan->nb_requests++];
+        req->table = tag->table;
+        req->addr = tag->addr;
+        req->nb = tag->span;
+        req->first = i;
+        req->count = 1;
+        req->prepared = NULL;
+    }
+    scan->dirty = FALSE;
+
+    return 0;
+}
+
+static void scan_scatter(modbus_scan_t *scan,
+                         const modbus_scan_request_t *req,
+                         modbus_scan_tag_t *tag)
+{
+    const int offset = tag->addr - req->addr;
+    const uint16_t *src = scan->tab_registers + offset;
+    int i;
+
+    switch (tag->type) {
+    case MODBUS_SCAN_BIT:
+        memcpy(tag->dest, scan->tab_bits + offset, tag->nb);
+        break;
+    case MODBUS_SCAN_UINT16:
+        memcpy(tag->dest, src, tag->nb * sizeof(uint16_t));
+        break;
+    case MODBUS_SCAN_INT16:
+        for (i = 0; i < tag->nb; i++) {
+            ((int16_t *) tag->dest)[i] = (int16_t) src[i];
+        }
+        break;
+    case MODBUS_SCAN_UINT32:
+        for (i = 0; i < tag->nb; i++) {
+            ((uint32_t *) tag->dest)[i] =
+                ((uint32_t) src[2 * i] << 16) | src[2 * i + 1];
+        }
+        break;
+    case MODBUS_SCAN_INT32:
+        for (i = 0; i < tag->nb; i++) {
+            ((int32_t *) tag->dest)[i] = MODBUS_GET_INT32_FROM_INT16(src, 2 * i);
+        }
+        break;
+    case MODBUS_SCAN_FLOAT:
+        for (i = 0; i < tag->nb; i++) {
+            ((float *) tag->dest)[i] = modbus_get_float_abcd(src + 2 * i);
+        }
+        break;
+    }
+}
+
+/* Allocates a scan list. Holes of up to max_gap bits or registers between
+   two tags are read to merge them in a single request. */
+modbus_scan_t *modbus_scan_new(int max_gap)
+{
+    modbus_scan_t *scan;
+
+    if (max_gap < 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    scan = (modbus_scan_t *) malloc(sizeof(modbus_scan_t));
+    if (scan == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    scan->max_gap = max_gap;
+    scan->nb_tags = 0;
+    scan->max_tags = 0;
+    scan->tags = NULL;
+    scan->order = NULL;
+    scan->nb_requests = 0;
+    scan->requests = NULL;
+    scan->ctx = NULL;
+    scan->dirty = FALSE;
+
+    return scan;
+}
+
+/* Adds a tag of nb values of type read from addr in table to dest. Returns
+   the index of the tag. */
+int modbus_scan_add(modbus_scan_t *scan,
+                    modbus_table_t table,
+                    int addr,
+                    int nb,
+                    modbus_scan_type_t type,
+                    void *dest)
+{
+    modbus_scan_tag_t *tag;
+    int span;
+
+    if (scan == NULL || dest == NULL || nb < 1 || addr < 0 ||
+        (int) table < MODBUS_TABLE_COILS || table > MODBUS_TABLE_INPUT_REGISTERS ||
+        (int) type < MODBUS_SCAN_BIT || type > MODBUS_SCAN_FLOAT ||
+        is_bit_table(table) != (type == MODBUS_SCAN_BIT)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    span = (type == MODBUS_SCAN_UINT32 || type == MODBUS_SCAN_INT32 ||
+            type == MODBUS_SCAN_FLOAT)
+               ? 2 * nb
+               : nb;
+    if (span > (is_bit_table(table) ? MODBUS_MAX_READ_BITS : MODBUS_MAX_READ_REGISTERS)) {
+        errno = EMBMDATA;
+        return -1;
+    }
+    if (addr + span > 0x10000) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (scan->nb_tags == scan->max_tags) {
+        int max_tags = scan->max_tags ? 2 * scan->max_tags : 8;
+        modbus_scan_tag_t *tags =
+            realloc(scan->tags, max_tags * sizeof(modbus_scan_tag_t));
+
+        if (tags == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        scan->tags = tags;
+        scan->max_tags = max_tags;
+    }
+
+    tag = &scan->tags[scan->nb_tags];
+    tag->table = table;
+    tag->addr = addr;
+    tag->nb = nb;
+    tag->span = span;
+    tag->type = type;
+    tag->dest = dest;
+    /* Not read yet */
+    tag->status = EAGAIN;
+    scan->dirty = TRUE;
+
+    return scan->nb_tags++;
+}
+
+/* Returns the number of requests sent by modbus_scan_run() */
+int modbus_scan_get_nb_requests(modbus_scan_t *scan)
+{
+    if (scan == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (scan->dirty && scan_plan(scan) == -1)
+        return -1;
+
+    return scan->nb_requests;
+}
+
+/* Reads all the tags. A request answered by an exception only fails its own
+   tags, any other error aborts the scan. Returns the number of requests or -1
+   if one of them failed (the status of each tag tells which ones). */
+int modbus_scan_run(modbus_scan_t *scan, modbus_t *ctx)
+{
+    int saved_errno = 0;
+    int i;
+
+    if (scan == NULL || ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (scan->dirty && scan_plan(scan) == -1)
+        return -1;
+    /* A prepared request keeps the slave of its preparation */
+    if ((scan->ctx != ctx || scan->slave != modbus_get_slave(ctx)) &&
+        scan_prepare(scan, ctx) == -1)
+        return -1;
+
+    for (i = 0; i < scan->nb_requests; i++) {
+        const modbus_scan_request_t *req = &scan->requests[i];
+        int rc;
+        int j;
+
+        rc = modbus_prepared_execute(req->prepared);
+        if (rc == -1) {
+            int error = errno;
+            int last = i;
+
+            if (saved_errno == 0)
+                saved_errno = error;
+            if (error < EMBXILFUN || error > EMBXGTAR) {
+                /* The link is broken, don't insist */
+                last = scan->nb_requests - 1;
+            }
+            for (; i <= last; i++) {
+                for (j = 0; j < scan->requests[i].count; j++) {
+                    scan->order[scan->requests[i].first + j]->status = error;
+                }
+            }
+            i = last;
+            continue;
+        }
+
+        for (j = 0; j < req->count; j++) {
+            modbus_scan_tag_t *tag = scan->order[req->first + j];
+
+            scan_scatter(scan, req, tag);
+            tag->status = 0;
+        }
+    }
+
+    if (saved_errno != 0) {
+        errno = saved_errno;
+        return -1;
+    }
+
+    return scan->nb_requests;
+}
+
+/* Returns 0 if the tag has been updated by the last scan, otherwise the errno
+   value of the request that failed (EAGAIN if never read). */
+int modbus_scan_get_status(modbus_scan_t *scan, int tag)
+{
+    if (scan == NULL || tag < 0 || tag >= scan->nb_tags) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return scan->tags[tag].status;
+}
+
+void modbus_scan_free(modbus_scan_t *scan)
+{
+    if (scan == NULL)
+        return;
+
+    scan_unprepare(scan);
+    free(scan->tags);
+    free(scan->order);
+    free(scan->requests);
+    free(scan);
+}
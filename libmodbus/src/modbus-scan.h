@@ -0,0 +1,49 @@
+/*
+ * Copyright © Gerhard Schiller 2024, <gerhard.schiller@pm.me>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#ifndef MODBUS_SCAN_H
+#define MODBUS_SCAN_H
+
+#include "modbus.h"
+
+MODBUS_BEGIN_DECLS
+
+/* Tables of the Modbus data model, one read function code each */
+typedef enum {
+    MODBUS_TABLE_COILS = 0,
+    MODBUS_TABLE_DISCRETE_INPUTS,
+    MODBUS_TABLE_HOLDING_REGISTERS,
+    MODBUS_TABLE_INPUT_REGISTERS
+} modbus_table_t;
+
+/* Type of the values of a tag. The 32 bit types use two registers, the high
+ * word first (as MODBUS_GET_INT32_FROM_INT16 and modbus_get_float_abcd). */
+typedef enum {
+    MODBUS_SCAN_BIT = 0, /* uint8_t, coils and discrete inputs only */
+    MODBUS_SCAN_UINT16,
+    MODBUS_SCAN_INT16,
+    MODBUS_SCAN_UINT32,
+    MODBUS_SCAN_INT32,
+    MODBUS_SCAN_FLOAT
+} modbus_scan_type_t;
+
+typedef struct _modbus_scan modbus_scan_t;
+
+MODBUS_API modbus_scan_t *modbus_scan_new(int max_gap);
+MODBUS_API int modbus_scan_add(modbus_scan_t *scan,
+                               modbus_table_t table,
+                               int addr,
+                               int nb,
+                               modbus_scan_type_t type,
+                               void *dest);
+MODBUS_API int modbus_scan_get_nb_requests(modbus_scan_t *scan);
+MODBUS_API int modbus_scan_run(modbus_scan_t *scan, modbus_t *ctx);
+MODBUS_API int modbus_scan_get_status(modbus_scan_t *scan, int tag);
+MODBUS_API void modbus_scan_free(modbus_scan_t *scan);
+
+MODBUS_END_DECLS
+
+#endif /* MODBUS_SCAN_H */
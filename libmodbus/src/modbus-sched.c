@@ -0,0 +1,252 @@
+/*
+ * Copyright © Gerhard Schiller 2024, <gerhard.schiller@pm.me>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+/* Cyclic poll scheduler for clients. Each job is released every period and
+ * must be finished within its deadline. Among the released jobs, the one with
+ * the earliest absolute deadline runs first (EDF), the priority breaks ties.
+ * A long bulk read can't hold back a fast loop with a shorter deadline for
+ * more than one run. */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef PICO_W
+#include "pico/stdlib.h"
+#endif
+
+#include "modbus-private.h"
+#include "modbus-sched.h"
+
+typedef struct _modbus_sched_job {
+    modbus_t *ctx;
+    modbus_sched_fn fn;
+    void *user_data;
+    uint32_t period;
+    uint32_t deadline;
+    int priority;
+    /* Absolute time of the pending release */
+    uint64_t release;
+    uint64_t jitter_sum;
+    modbus_sched_stats_t stats;
+} modbus_sched_job_t;
+
+struct _modbus_sched {
+    int nb_jobs;
+    int max_jobs;
+    modbus_sched_job_t *jobs;
+};
+
+static void reset_job_stats(modbus_sched_job_t *job)
+{
+    memset(&job->stats, 0, sizeof(modbus_sched_stats_t));
+    job->stats.jitter_min = UINT32_MAX;
+    job->jitter_sum = 0;
+}
+
+/* Returns the released job with the earliest deadline or NULL */
+static modbus_sched_job_t *next_job(modbus_sched_t *sched, uint64_t now)
+{
+    modbus_sched_job_t *best = NULL;
+    int i;
+
+    for (i = 0; i < sched->nb_jobs; i++) {
+        modbus_sched_job_t *job = &sched->jobs[i];
+
+        if (job->release > now)
+            continue;
+
+        if (best == NULL ||
+            job->release + job->deadline < best->release + best->deadline ||
+            (job->release + job->deadline == best->release + best->deadline &&
+             job->priority > best->priority)) {
+            best = job;
+        }
+    }
+
+    return best;
+}
+
+modbus_sched_t *modbus_sched_new(void)
+{
+    modbus_sched_t *sched;
+
+    sched = (modbus_sched_t *) malloc(sizeof(modbus_sched_t));
+    if (sched == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    sched->nb_jobs = 0;
+    sched->max_jobs = 0;
+    sched->jobs = NULL;
+
+    return sched;
+}
+
+/* Adds a job calling fn on ctx every period_us. A deadline_us of 0 means the
+   job must be finished before its next release. The job is released at once.
+   Returns the index of the job. */
+int modbus_sched_add(modbus_sched_t *sched,
+                     modbus_t *ctx,
+                     uint32_t period_us,
+                     uint32_t deadline_us,
+                     int priority,
+                     modbus_sched_fn fn,
+                     void *user_data)
+{
+    modbus_sched_job_t *job;
+
+    if (sched == NULL || ctx == NULL || fn == NULL || period_us == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (sched->nb_jobs == sched->max_jobs) {
+        int max_jobs = sched->max_jobs ? 2 * sched->max_jobs : 4;
+        modbus_sched_job_t *jobs =
+            realloc(sched->jobs, max_jobs * sizeof(modbus_sched_job_t));
+
+        if (jobs == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        sched->jobs = jobs;
+        sched->max_jobs = max_jobs;
+    }
+
+    job = &sched->jobs[sched->nb_jobs];
+    job->ctx = ctx;
+    job->fn = fn;
+    job->user_data = user_data;
+    job->period = period_us;
+    job->deadline = deadline_us ? deadline_us : period_us;
+    job->priority = priority;
+    job->release = _modbus_time_us();
+    reset_job_stats(job);
+
+    return sched->nb_jobs++;
+}
+
+/* Runs the released job with the earliest deadline. Returns 1 if a job has
+   been run, 0 if none is released. */
+int modbus_sched_run_once(modbus_sched_t *sched)
+{
+    modbus_sched_job_t *job;
+    uint64_t start;
+    uint64_t end;
+    uint32_t jitter;
+
+    if (sched == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    start = _modbus_time_us();
+    job = next_job(sched, start);
+    if (job == NULL)
+        return 0;
+
+    if (job->fn(job->ctx, job->user_data) == -1)
+        job->stats.errors++;
+    end = _modbus_time_us();
+
+    job->stats.runs++;
+    jitter = start - job->release;
+    if (jitter < job->stats.jitter_min)
+        job->stats.jitter_min = jitter;
+    if (jitter > job->stats.jitter_max)
+        job->stats.jitter_max = jitter;
+    job->jitter_sum += jitter;
+    if (end - start > job->stats.duration_max)
+        job->stats.duration_max = end - start;
+    if (end > job->release + job->deadline)
+        job->stats.missed_deadlines++;
+
+    job->release =
+        _modbus_next_release(job->release, job->period, end, &job->stats.overruns);
+
+    return 1;
+}
+
+/* Runs the jobs for duration_us (forever if 0) and sleeps while no job is
+   released. Returns the number of runs. */
+int modbus_sched_run(modbus_sched_t *sched, uint32_t duration_us)
+{
+    uint64_t stop;
+    int nb_runs = 0;
+
+    if (sched == NULL || sched->nb_jobs == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    stop = _modbus_time_us() + duration_us;
+    for (;;) {
+        uint64_t now;
+        uint64_t wakeup;
+        int i;
+
+        nb_runs += modbus_sched_run_once(sched);
+
+        now = _modbus_time_us();
+        if (duration_us != 0 && now >= stop)
+            break;
+
+        wakeup = sched->jobs[0].release;
+        for (i = 1; i < sched->nb_jobs; i++) {
+            if (sched->jobs[i].release < wakeup)
+                wakeup = sched->jobs[i].release;
+        }
+        if (duration_us != 0 && wakeup > stop)
+            wakeup = stop;
+        if (wakeup > now)
+            _modbus_sleep_us(wakeup - now);
+    }
+
+    return nb_runs;
+}
+
+int modbus_sched_get_stats(modbus_sched_t *sched, int job, modbus_sched_stats_t *stats)
+{
+    const modbus_sched_job_t *sched_job;
+
+    if (sched == NULL || stats == NULL || job < 0 || job >= sched->nb_jobs) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    sched_job = &sched->jobs[job];
+    *stats = sched_job->stats;
+    if (stats->runs == 0) {
+        stats->jitter_min = 0;
+    } else {
+        stats->jitter_avg = sched_job->jitter_sum / stats->runs;
+    }
+
+    return 0;
+}
+
+void modbus_sched_reset_stats(modbus_sched_t *sched)
+{
+    int i;
+
+    if (sched == NULL)
+        return;
+
+    for (i = 0; i < sched->nb_jobs; i++) {
+        reset_job_stats(&sched->jobs[i]);
+    }
+}
+
+void modbus_sched_free(modbus_sched_t *sched)
+{
+    if (sched == NULL)
+        return;
+
+    free(sched->jobs);
+    free(sched);
+}
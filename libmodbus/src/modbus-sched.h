@@ -0,0 +1,51 @@
+/*
+ * Copyright © Gerhard Schiller 2024, <gerhard.schiller@pm.me>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#ifndef MODBUS_SCHED_H
+#define MODBUS_SCHED_H
+
+#include "modbus.h"
+
+MODBUS_BEGIN_DECLS
+
+/* A poll job returns -1 on error (errno set by libmodbus) */
+typedef int (*modbus_sched_fn)(modbus_t *ctx, void *user_data);
+
+/* Statistics of a job, all times in microseconds. The jitter is the delay
+ * between the release of the job and the start of its run. */
+typedef struct _modbus_sched_stats {
+    uint32_t runs;
+    uint32_t errors;
+    /* Releases skipped because the previous run was not finished */
+    uint32_t overruns;
+    /* Runs finished after their deadline */
+    uint32_t missed_deadlines;
+    uint32_t jitter_min;
+    uint32_t jitter_max;
+    uint32_t jitter_avg;
+    uint32_t duration_max;
+} modbus_sched_stats_t;
+
+typedef struct _modbus_sched modbus_sched_t;
+
+MODBUS_API modbus_sched_t *modbus_sched_new(void);
+MODBUS_API int modbus_sched_add(modbus_sched_t *sched,
+                                modbus_t *ctx,
+                                uint32_t period_us,
+                                uint32_t deadline_us,
+                                int priority,
+                                modbus_sched_fn fn,
+                                void *user_data);
+MODBUS_API int modbus_sched_run_once(modbus_sched_t *sched);
+MODBUS_API int modbus_sched_run(modbus_sched_t *sched, uint32_t duration_us);
+MODBUS_API int
+modbus_sched_get_stats(modbus_sched_t *sched, int job, modbus_sched_stats_t *stats);
+MODBUS_API void modbus_sched_reset_stats(modbus_sched_t *sched);
+MODBUS_API void modbus_sched_free(modbus_sched_t *sched);
+
+MODBUS_END_DECLS
+
+#endif /* MODBUS_SCHED_H */
@@ -0,0 +1,1254 @@
+/*
+ * Copyright © Gerhard Schiller 2024, <gerhard.schiller@pm.me>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+/* Multi-connection TCP server engine for Linux. The connections are
+ * non-blocking sockets watched by epoll in edge-triggered mode, each one with
+ * its own receive and send buffers: a connection sending its requests byte by
+ * byte holds no other one. The requests read are served one after the other,
+ * by modbus_reply() or a callback, and their responses are sent at once.
+ *
+ * The context given serves all the connections, its socket is the one of the
+ * connection served while a request is processed. Its backend is replaced by
+ * a copy queuing the responses until modbus_server_free().
+ *
+ * With modbus_server_new_workers(), each thread runs its own loop on its own
+ * listening socket, the kernel spreads the connections over them
+ * (SO_REUSEPORT). They serve the same mapping under a seqlock: the reads never
+ * wait for each other, a read overlapping a write runs again.
+ *
+ * With modbus_server_set_engine(), the workers use io_uring instead of epoll:
+ * a multishot accept, a multishot receive per connection into buffers provided
+ * to the kernel, sends on fixed files, all submitted by one system call per
+ * loop. */
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "modbus-private.h"
+#include "modbus-server.h"
+
+#ifdef HAVE_SYS_EPOLL_H
+
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "modbus-tcp.h"
+#include "modbus-tcp-private.h"
+#include "modbus-uring-private.h"
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <poll.h>
+#endif
+
+/* Several requests read at once */
+#define _SERVER_RX_SIZE (4 * MODBUS_TCP_MAX_ADU_LENGTH)
+/* Responses queued before the requests of the connection are left unread */
+#define _SERVER_TX_MAX 65536
+#define _SERVER_NB_EVENTS 256
+
+typedef struct _modbus_server_conn {
+    int s;
+    /* Set by an event, cleared when recv() has nothing more */
+    int readable;
+    int rx_length;
+    int rx_size;
+    int tx_offset;
+    int tx_length;
+    int tx_size;
+    uint8_t *rx;
+    uint8_t *tx;
+    /* io_uring: the responses being sent, the queued ones are swapped in
+       when they are */
+    uint8_t *out;
+    int out_size;
+    int out_offset;
+    int out_length;
+    /* io_uring: index in the fixed files, state of the multishot receive
+       and operations to complete before the connection is freed */
+    int file;
+    int recv_armed;
+    int recv_cancelled;
+    int nb_pending;
+    int closing;
+    struct _modbus_server_conn *prev;
+    struct _modbus_server_conn *next;
+} modbus_server_conn_t;
+
+/* An event loop, the only one of a server or one per thread */
+typedef struct _modbus_server_worker {
+    /* First, the worker is found from the backend of its context */
+    modbus_backend_t backend;
+    modbus_server_t *server;
+    /* The context of the server or a copy of it for a thread */
+    modbus_t *ctx;
+    modbus_t ctx_copy;
+    int ctx_s;
+    int s;
+    /* The socket is closed with the worker */
+    int own_s;
+    int epfd;
+    int wakeup;
+#ifdef HAVE_LINUX_IO_URING_H
+    /* NULL with epoll */
+    modbus_uring_t *uring;
+#endif
+    pthread_t thread;
+    int max_connections;
+    int nb_connections;
+    modbus_server_conn_t *conns;
+    /* Connection of the request served */
+    modbus_server_conn_t *conn;
+    struct epoll_event events[_SERVER_NB_EVENTS];
+} modbus_server_worker_t;
+
+struct _modbus_server {
+    modbus_t *ctx;
+    const modbus_backend_t *ctx_backend;
+    volatile int stop;
+    modbus_mapping_t *mb_mapping;
+    modbus_server_fn fn;
+    void *user_data;
+    modbus_server_engine_t engine;
+    int nb_workers;
+    modbus_server_worker_t *workers;
+    /* Seqlock of the mapping shared by the workers: odd while it's written,
+       the writers are serialized by the mutex */
+    uint32_t seq;
+    pthread_mutex_t write_lock;
+    /* Diagnostics of the context, shared by the copies of the workers */
+    pthread_mutex_t diag_lock;
+};
+
+static modbus_server_worker_t *worker_of(modbus_t *ctx)
+{
+    return (modbus_server_worker_t *) ((char *) ctx->backend -
+                                       offsetof(modbus_server_worker_t, backend));
+}
+
+/* Send of the backend, queues the response on the connection served */
+static ssize_t server_send(modbus_t *ctx, const uint8_t *rsp, int rsp_length)
+{
+    modbus_server_conn_t *conn = worker_of(ctx)->conn;
+
+    if (conn->tx_length + rsp_length > conn->tx_size) {
+        int tx_size = conn->tx_size ? conn->tx_size : MODBUS_TCP_MAX_ADU_LENGTH;
+        uint8_t *tx;
+
+        while (tx_size < conn->tx_length + rsp_length)
+            tx_size *= 2;
+        tx = realloc(conn->tx, tx_size);
+        if (tx == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        conn->tx = tx;
+        conn->tx_size = tx_size;
+    }
+
+    memcpy(conn->tx + conn->tx_length, rsp, rsp_length);
+    conn->tx_length += rsp_length;
+
+    return rsp_length;
+}
+
+/* Flush of the backend, the requests are cut from the buffer of the
+   connection by their length, there is nothing to drop */
+static int server_flush(modbus_t *ctx)
+{
+    return 0;
+}
+
+static uint32_t mapping_begin(modbus_t *ctx, int write)
+{
+    modbus_server_t *server = worker_of(ctx)->server;
+    uint32_t seq;
+
+    if (write) {
+        pthread_mutex_lock(&server->write_lock);
+        __atomic_store_n(&server->seq, server->seq + 1, __ATOMIC_RELAXED);
+        /* The sequence is odd before the mapping changes */
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        return 0;
+    }
+
+    while ((seq = __atomic_load_n(&server->seq, __ATOMIC_ACQUIRE)) & 1)
+        sched_yield();
+
+    return seq;
+}
+
+static int mapping_end(modbus_t *ctx, int write, uint32_t seq)
+{
+    modbus_server_t *server = worker_of(ctx)->server;
+
+    if (write) {
+        __atomic_store_n(&server->seq, server->seq + 1, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&server->write_lock);
+        return 0;
+    }
+
+    /* The mapping is read before the sequence is checked again */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&server->seq, __ATOMIC_RELAXED) != seq;
+}
+
+static void diag_lock(modbus_t *ctx)
+{
+    pthread_mutex_lock(&worker_of(ctx)->server->diag_lock);
+}
+
+static void diag_unlock(modbus_t *ctx)
+{
+    pthread_mutex_unlock(&worker_of(ctx)->server->diag_lock);
+}
+
+static int default_reply(modbus_t *ctx, const uint8_t *req, int req_length, void *user_data)
+{
+    return modbus_reply(ctx, req, req_length, (modbus_mapping_t *) user_data);
+}
+
+static modbus_server_conn_t *new_conn(modbus_server_worker_t *worker, int s)
+{
+    modbus_server_conn_t *conn;
+    int option = 1;
+
+    conn = (modbus_server_conn_t *) calloc(1, sizeof(modbus_server_conn_t));
+    if (conn == NULL)
+        return NULL;
+    conn->rx = malloc(_SERVER_RX_SIZE);
+    if (conn->rx == NULL) {
+        free(conn);
+        return NULL;
+    }
+    conn->s = s;
+    conn->readable = 1;
+    conn->rx_size = _SERVER_RX_SIZE;
+    conn->file = -1;
+
+    /* Each response is written at once */
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &option, sizeof(option));
+
+    return conn;
+}
+
+static void add_conn(modbus_server_worker_t *worker, modbus_server_conn_t *conn)
+{
+    conn->prev = NULL;
+    conn->next = worker->conns;
+    if (worker->conns != NULL)
+        worker->conns->prev = conn;
+    worker->conns = conn;
+    worker->nb_connections++;
+
+    if (worker->ctx->debug)
+        printf("New connection on socket %d\n", conn->s);
+}
+
+static void close_conn(modbus_server_worker_t *worker, modbus_server_conn_t *conn)
+{
+    if (worker->ctx->debug)
+        printf("Connection closed on socket %d\n", conn->s);
+
+    close(conn->s);
+    if (conn->prev != NULL)
+        conn->prev->next = conn->next;
+    else
+        worker->conns = conn->next;
+    if (conn->next != NULL)
+        conn->next->prev = conn->prev;
+    worker->nb_connections--;
+    free(conn->rx);
+    free(conn->tx);
+    free(conn->out);
+    free(conn);
+}
+
+static void accept_conns(modbus_server_worker_t *worker)
+{
+    modbus_server_conn_t *conn;
+    struct epoll_event event;
+    int s;
+
+    for (;;) {
+        s = accept4(worker->s, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (s == -1) {
+            if (errno != EAGAIN && errno != EINTR && worker->ctx->debug)
+                fprintf(stderr, "ERROR accept %s\n", strerror(errno));
+            if (errno != EINTR)
+                return;
+            continue;
+        }
+
+        if (worker->nb_connections >= worker->max_connections) {
+            close(s);
+            continue;
+        }
+
+        conn = new_conn(worker, s);
+        if (conn == NULL) {
+            close(s);
+            continue;
+        }
+
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.ptr = conn;
+        if (epoll_ctl(worker->epfd, EPOLL_CTL_ADD, s, &event) == -1) {
+            close(s);
+            free(conn->rx);
+            free(conn);
+            continue;
+        }
+        add_conn(worker, conn);
+    }
+}
+
+/* Serves the complete requests received, until too many responses are queued.
+   Returns the number of requests served or -1 to close the connection. */
+static int serve_requests(modbus_server_worker_t *worker, modbus_server_conn_t *conn)
+{
+    modbus_server_t *server = worker->server;
+    modbus_t *ctx = worker->ctx;
+    struct timeval response_timeout = ctx->response_timeout;
+    modbus_cork_t *cork = ctx->cork;
+    int offset = 0;
+    int nb_served = 0;
+
+    worker->conn = conn;
+    ctx->s = conn->s;
+    /* No wait before the flush of an exception, the other connections would
+       wait too */
+    ctx->response_timeout.tv_sec = 0;
+    ctx->response_timeout.tv_usec = 0;
+    /* The responses are batched by the engine already */
+    ctx->cork = NULL;
+
+    while (conn->rx_length - offset >= _MODBUS_TCP_HEADER_LENGTH &&
+           conn->tx_length - conn->tx_offset < _SERVER_TX_MAX) {
+        const uint8_t *req = conn->rx + offset;
+        /* The MBAP header holds the length of the unit ID and of the PDU */
+        int length = (req[4] << 8) + req[5];
+        int req_length = 6 + length;
+
+        if (req[2] != 0 || req[3] != 0 || length < 2 ||
+            req_length > MODBUS_TCP_MAX_ADU_LENGTH) {
+            errno = EMBBADDATA;
+            _modbus_received_msg(ctx, req, MSG_INDICATION, -1);
+            nb_served = -1;
+            break;
+        }
+        if (conn->rx_length - offset < req_length)
+            break;
+
+#if MODBUS_CONFIG_STATS
+        if (ctx->stats != NULL)
+            ctx->stats->t_start = _modbus_time_us();
+#endif
+        _modbus_received_msg(ctx, req, MSG_INDICATION, req_length);
+        if (server->fn(ctx, req, req_length, server->user_data) == -1) {
+            nb_served = -1;
+            break;
+        }
+        offset += req_length;
+        nb_served++;
+    }
+
+    ctx->response_timeout = response_timeout;
+    ctx->cork = cork;
+    ctx->s = worker->ctx_s;
+
+    if (offset > 0) {
+        conn->rx_length -= offset;
+        memmove(conn->rx, conn->rx + offset, conn->rx_length);
+    }
+
+    return nb_served;
+}
+
+/* Returns -1 if the connection is lost */
+static int send_responses(modbus_server_conn_t *conn)
+{
+    ssize_t rc;
+
+    while (conn->tx_offset < conn->tx_length) {
+        rc = send(conn->s,
+                  conn->tx + conn->tx_offset,
+                  conn->tx_length - conn->tx_offset,
+                  MSG_NOSIGNAL);
+        if (rc == -1) {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN ? 0 : -1;
+        }
+        conn->tx_offset += rc;
+    }
+    conn->tx_offset = 0;
+    conn->tx_length = 0;
+
+    return 0;
+}
+
+/* Reads and serves the requests of a connection until recv() has nothing more
+   or the peer doesn't read its responses. Returns the number of requests
+   served or -1 to close the connection. */
+static int process_conn(modbus_server_worker_t *worker, modbus_server_conn_t *conn)
+{
+    int nb_served = 0;
+    ssize_t rc;
+
+    for (;;) {
+        rc = serve_requests(worker, conn);
+        if (rc == -1 || send_responses(conn) == -1)
+            return -1;
+        nb_served += rc;
+
+        /* Waits for EPOLLOUT, the requests left are served then */
+        if (conn->tx_length > 0)
+            return nb_served;
+        /* Requests may be left behind the responses just sent */
+        if (rc > 0)
+            continue;
+        if (!conn->readable)
+            return nb_served;
+
+        rc = recv(conn->s, conn->rx + conn->rx_length, conn->rx_size - conn->rx_length, 0);
+        if (rc > 0) {
+            conn->rx_length += rc;
+        } else if (rc == 0) {
+            return -1;
+        } else if (errno == EAGAIN) {
+            conn->readable = 0;
+        } else if (errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+/* Operation completed, in the low bits of the address of its connection */
+#define _URING_OP_ACCEPT 0
+#define _URING_OP_RECV   1
+#define _URING_OP_SEND   2
+#define _URING_OP_CANCEL 3
+#define _URING_OP_WAKEUP 4
+#define _URING_OP_MASK   7
+
+static int uring_accept(modbus_server_worker_t *worker)
+{
+    struct io_uring_sqe *sqe = _modbus_uring_get_sqe(worker->uring, _URING_OP_ACCEPT);
+
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = worker->s;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+
+    return 0;
+}
+
+static int uring_wait_wakeup(modbus_server_worker_t *worker)
+{
+    struct io_uring_sqe *sqe = _modbus_uring_get_sqe(worker->uring, _URING_OP_WAKEUP);
+
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = worker->wakeup;
+    sqe->poll32_events = POLLIN;
+
+    return 0;
+}
+
+static int uring_recv(modbus_uring_t *uring, modbus_server_conn_t *conn)
+{
+    if (_modbus_uring_recv(uring, conn->file, (uintptr_t) conn | _URING_OP_RECV) == -1)
+        return -1;
+    conn->recv_armed = 1;
+    conn->recv_cancelled = 0;
+    conn->nb_pending++;
+
+    return 0;
+}
+
+/* The peer doesn't read its responses, its requests are left unread */
+static int uring_cancel_recv(modbus_uring_t *uring, modbus_server_conn_t *conn)
+{
+    struct io_uring_sqe *sqe =
+        _modbus_uring_get_sqe(uring, (uintptr_t) conn | _URING_OP_CANCEL);
+
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uintptr_t) conn | _URING_OP_RECV;
+    conn->recv_cancelled = 1;
+    conn->nb_pending++;
+
+    return 0;
+}
+
+/* Sends the rest of the responses being sent or, when they are, the ones
+   queued since. One send at a time keeps them in order. */
+static int uring_send(modbus_uring_t *uring, modbus_server_conn_t *conn)
+{
+    struct io_uring_sqe *sqe;
+
+    if (conn->out_length == 0) {
+        uint8_t *out = conn->out;
+        int out_size = conn->out_size;
+
+        if (conn->tx_length == 0)
+            return 0;
+        conn->out = conn->tx;
+        conn->out_size = conn->tx_size;
+        conn->out_offset = 0;
+        conn->out_length = conn->tx_length;
+        conn->tx = out;
+        conn->tx_size = out_size;
+        conn->tx_length = 0;
+    }
+
+    sqe = _modbus_uring_get_sqe(uring, (uintptr_t) conn | _URING_OP_SEND);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->file;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->addr = (uintptr_t) (conn->out + conn->out_offset);
+    sqe->len = conn->out_length - conn->out_offset;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    conn->nb_pending++;
+
+    return 0;
+}
+
+/* The socket is shut down to end the operations pending, the connection is
+   freed at the last completion */
+static void uring_close_conn(modbus_server_worker_t *worker, modbus_server_conn_t *conn)
+{
+    if (!conn->closing) {
+        conn->closing = 1;
+        shutdown(conn->s, SHUT_RDWR);
+    }
+    if (conn->nb_pending > 0)
+        return;
+
+    _modbus_uring_remove_file(worker->uring, conn->file);
+    close_conn(worker, conn);
+}
+
+static void uring_accept_conn(modbus_server_worker_t *worker, int s)
+{
+    modbus_server_conn_t *conn;
+
+    if (worker->nb_connections >= worker->max_connections) {
+        close(s);
+        return;
+    }
+
+    conn = new_conn(worker, s);
+    if (conn == NULL) {
+        close(s);
+        return;
+    }
+
+    conn->file = _modbus_uring_add_file(worker->uring, s);
+    if (conn->file == -1) {
+        close(s);
+        free(conn->rx);
+        free(conn);
+        return;
+    }
+
+    add_conn(worker, conn);
+    if (uring_recv(worker->uring, conn) == -1)
+        uring_close_conn(worker, conn);
+}
+
+/* Serves the requests received, sends their responses and receives more
+   unless the peer doesn't read them. Returns the number of requests served. */
+static int uring_serve(modbus_server_worker_t *worker, modbus_server_conn_t *conn)
+{
+    modbus_uring_t *uring = worker->uring;
+    int rc;
+
+    rc = serve_requests(worker, conn);
+    if (rc == -1 || (conn->out_length == 0 && uring_send(uring, conn) == -1)) {
+        uring_close_conn(worker, conn);
+        return 0;
+    }
+
+    if (conn->tx_length >= _SERVER_TX_MAX) {
+        if (conn->recv_armed && !conn->recv_cancelled &&
+            uring_cancel_recv(uring, conn) == -1)
+            uring_close_conn(worker, conn);
+    } else if (!conn->recv_armed && uring_recv(uring, conn) == -1) {
+        uring_close_conn(worker, conn);
+    }
+
+    return rc;
+}
+
+static int uring_received(modbus_server_worker_t *worker,
+                          modbus_server_conn_t *conn,
+                          const struct io_uring_cqe *cqe)
+{
+    modbus_uring_t *uring = worker->uring;
+    int lost = 0;
+
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        conn->recv_armed = 0;
+        conn->nb_pending--;
+    }
+
+    if (cqe->res > 0) {
+        int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+        if (!conn->closing && conn->rx_length + cqe->res > conn->rx_size) {
+            int rx_size = conn->rx_size;
+            uint8_t *rx;
+
+            while (rx_size < conn->rx_length + cqe->res)
+                rx_size *= 2;
+            rx = realloc(conn->rx, rx_size);
+            if (rx != NULL) {
+                conn->rx = rx;
+                conn->rx_size = rx_size;
+            } else {
+                lost = 1;
+            }
+        }
+        if (!conn->closing && !lost) {
+            memcpy(conn->rx + conn->rx_length,
+                   uring->bufs + bid * _MODBUS_URING_BUF_SIZE,
+                   cqe->res);
+            conn->rx_length += cqe->res;
+        }
+        _modbus_uring_recycle(uring, bid);
+    } else if (cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+        /* End of the stream or error */
+        lost = 1;
+    }
+
+    if (lost || conn->closing) {
+        uring_close_conn(worker, conn);
+        return 0;
+    }
+
+    return uring_serve(worker, conn);
+}
+
+static int uring_sent(modbus_server_worker_t *worker, modbus_server_conn_t *conn, int res)
+{
+    conn->nb_pending--;
+    if (res < 0 || conn->closing) {
+        uring_close_conn(worker, conn);
+        return 0;
+    }
+
+    conn->out_offset += res;
+    if (conn->out_offset < conn->out_length) {
+        if (uring_send(worker->uring, conn) == -1)
+            uring_close_conn(worker, conn);
+        return 0;
+    }
+    conn->out_length = 0;
+
+    /* Serves the requests left behind the responses */
+    return uring_serve(worker, conn);
+}
+
+/* Returns the number of requests served by the completion or -1 if the
+   worker can't go on */
+static int uring_complete(modbus_server_worker_t *worker, const struct io_uring_cqe *cqe)
+{
+    modbus_server_conn_t *conn =
+        (modbus_server_conn_t *) (uintptr_t) (cqe->user_data & ~(uint64_t) _URING_OP_MASK);
+
+    switch (cqe->user_data & _URING_OP_MASK) {
+    case _URING_OP_ACCEPT:
+        if (cqe->res >= 0)
+            uring_accept_conn(worker, cqe->res);
+        else if (worker->ctx->debug)
+            fprintf(stderr, "ERROR accept %s\n", strerror(-cqe->res));
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+            return uring_accept(worker);
+        return 0;
+    case _URING_OP_WAKEUP: {
+        uint64_t value;
+
+        if (read(worker->wakeup, &value, sizeof(value)) == -1) {
+            /* Already cleared */
+        }
+        return uring_wait_wakeup(worker);
+    }
+    case _URING_OP_RECV:
+        return uring_received(worker, conn, cqe);
+    case _URING_OP_SEND:
+        return uring_sent(worker, conn, cqe->res);
+    default:
+        conn->nb_pending--;
+        if (conn->closing)
+            uring_close_conn(worker, conn);
+        return 0;
+    }
+}
+
+/* Waits for the completions up to timeout_ms and processes them. The entries
+   they queue are submitted on return if submit is set, by the next wait
+   otherwise. */
+static int run_uring_once(modbus_server_worker_t *worker, int timeout_ms, int submit)
+{
+    modbus_uring_t *uring = worker->uring;
+    struct io_uring_cqe cqe;
+    int nb_served = 0;
+    int rc;
+
+    if (_modbus_uring_enter(uring, 1, timeout_ms) == -1)
+        return -1;
+
+    while (_modbus_uring_get_cqe(uring, &cqe)) {
+        rc = uring_complete(worker, &cqe);
+        if (rc == -1)
+            return -1;
+        nb_served += rc;
+    }
+
+    if (submit && _modbus_uring_enter(uring, 0, -1) == -1)
+        return -1;
+
+    return nb_served;
+}
+
+/* Opens the rings of a worker and submits its accept */
+static modbus_uring_t *uring_new(modbus_server_worker_t *worker)
+{
+    modbus_uring_t *uring;
+
+    /* A fixed file per connection */
+    uring = _modbus_uring_new(worker->max_connections);
+    if (uring == NULL)
+        return NULL;
+
+    worker->uring = uring;
+    if (uring_accept(worker) == -1 || uring_wait_wakeup(worker) == -1) {
+        worker->uring = NULL;
+        _modbus_uring_free(uring);
+        return NULL;
+    }
+
+    return uring;
+}
+
+#endif /* HAVE_LINUX_IO_URING_H */
+
+/* Waits for the events of a worker up to timeout_ms and processes them.
+   Returns the number of requests served. */
+static int run_worker_once(modbus_server_worker_t *worker, int timeout_ms)
+{
+    int nb_served = 0;
+    int nb_events;
+    int i;
+
+#ifdef HAVE_LINUX_IO_URING_H
+    if (worker->uring != NULL)
+        return run_uring_once(worker, timeout_ms, TRUE);
+#endif
+
+    nb_events = epoll_wait(worker->epfd, worker->events, _SERVER_NB_EVENTS, timeout_ms);
+    if (nb_events == -1)
+        return errno == EINTR ? 0 : -1;
+
+    for (i = 0; i < nb_events; i++) {
+        struct epoll_event *event = &worker->events[i];
+        modbus_server_conn_t *conn = event->data.ptr;
+        int rc;
+
+        if (conn == NULL) {
+            accept_conns(worker);
+        } else if (event->data.ptr == &worker->wakeup) {
+            uint64_t value;
+
+            if (read(worker->wakeup, &value, sizeof(value)) == -1) {
+                /* Already cleared */
+            }
+        } else {
+            if (event->events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                conn->readable = 1;
+            rc = process_conn(worker, conn);
+            if (rc == -1)
+                close_conn(worker, conn);
+            else
+                nb_served += rc;
+        }
+    }
+
+    return nb_served;
+}
+
+static void *run_worker(void *arg)
+{
+    modbus_server_worker_t *worker = arg;
+
+    int rc;
+
+    while (!worker->server->stop) {
+#ifdef HAVE_LINUX_IO_URING_H
+        /* The responses are submitted with the next wait */
+        if (worker->uring != NULL)
+            rc = run_uring_once(worker, -1, FALSE);
+        else
+#endif
+            rc = run_worker_once(worker, -1);
+        if (rc == -1)
+            return (void *) -1;
+    }
+
+    return NULL;
+}
+
+static void close_worker(modbus_server_worker_t *worker)
+{
+#ifdef HAVE_LINUX_IO_URING_H
+    /* Closing the ring ends the operations on the connections */
+    if (worker->uring != NULL)
+        _modbus_uring_free(worker->uring);
+#endif
+    while (worker->conns != NULL)
+        close_conn(worker, worker->conns);
+    if (worker->epfd != -1)
+        close(worker->epfd);
+    if (worker->wakeup != -1)
+        close(worker->wakeup);
+    if (worker->own_s && worker->s != -1)
+        close(worker->s);
+}
+
+/* Opens the event loop of a worker serving ctx on the socket s */
+static int init_worker(modbus_server_worker_t *worker,
+                       modbus_server_t *server,
+                       modbus_t *ctx,
+                       int s,
+                       int max_connections)
+{
+    struct epoll_event event;
+
+    worker->backend = *server->ctx_backend;
+    worker->backend.send = server_send;
+    worker->backend.flush = server_flush;
+    worker->server = server;
+    worker->ctx = ctx;
+    worker->ctx_s = ctx->s;
+    worker->s = s;
+    worker->max_connections = max_connections;
+    worker->nb_connections = 0;
+    worker->conns = NULL;
+    worker->conn = NULL;
+
+    worker->epfd = epoll_create1(EPOLL_CLOEXEC);
+    worker->wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (worker->epfd == -1 || worker->wakeup == -1)
+        return -1;
+
+    /* The connections pending are all accepted on an event */
+    fcntl(s, F_SETFL, fcntl(s, F_GETFL, 0) | O_NONBLOCK);
+    event.events = EPOLLIN | EPOLLET;
+    event.data.ptr = NULL;
+    if (epoll_ctl(worker->epfd, EPOLL_CTL_ADD, s, &event) == -1)
+        return -1;
+    event.events = EPOLLIN;
+    event.data.ptr = &worker->wakeup;
+    if (epoll_ctl(worker->epfd, EPOLL_CTL_ADD, worker->wakeup, &event) == -1)
+        return -1;
+
+    ctx->backend = &worker->backend;
+
+    return 0;
+}
+
+static modbus_server_t *
+new_server(modbus_t *ctx, modbus_mapping_t *mb_mapping, int nb_workers)
+{
+    modbus_server_t *server;
+    int i;
+
+    server = (modbus_server_t *) malloc(sizeof(modbus_server_t));
+    if (server != NULL) {
+        server->workers = calloc(nb_workers, sizeof(modbus_server_worker_t));
+        if (server->workers == NULL) {
+            free(server);
+            server = NULL;
+        }
+    }
+    if (server == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    server->ctx = ctx;
+    server->ctx_backend = ctx->backend;
+    server->stop = 0;
+    server->mb_mapping = mb_mapping;
+    server->fn = default_reply;
+    server->user_data = mb_mapping;
+    server->engine = MODBUS_SERVER_ENGINE_EPOLL;
+    server->nb_workers = nb_workers;
+    server->seq = 0;
+    pthread_mutex_init(&server->write_lock, NULL);
+    pthread_mutex_init(&server->diag_lock, NULL);
+    for (i = 0; i < nb_workers; i++) {
+        server->workers[i].s = -1;
+        server->workers[i].epfd = -1;
+        server->workers[i].wakeup = -1;
+    }
+
+    return server;
+}
+
+modbus_server_t *modbus_server_new(modbus_t *ctx,
+                                   int server_socket,
+                                   modbus_mapping_t *mb_mapping,
+                                   int max_connections)
+{
+    modbus_server_t *server;
+
+    if (ctx == NULL || ctx->backend->backend_type != _MODBUS_BACKEND_TYPE_TCP ||
+        server_socket < 0 || max_connections < 1) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    server = new_server(ctx, mb_mapping, 1);
+    if (server == NULL)
+        return NULL;
+
+    if (init_worker(&server->workers[0], server, ctx, server_socket, max_connections) ==
+        -1) {
+        modbus_server_free(server);
+        return NULL;
+    }
+
+    return server;
+}
+
+/* Serves the address of ctx with nb_workers threads, each one with its own
+   socket listening with SO_REUSEPORT so the kernel balances the connections
+   between them. The workers share the mapping, the reads run concurrently and
+   only the writes are serialized. The workers use copies of ctx, without its
+   trace and its statistics. They share its diagnostics: a listen only mode
+   forced on a connection holds for all of them. */
+modbus_server_t *modbus_server_new_workers(modbus_t *ctx,
+                                           modbus_mapping_t *mb_mapping,
+                                           int nb_workers,
+                                           int max_connections)
+{
+    modbus_server_t *server;
+    int i;
+
+    if (ctx == NULL || ctx->backend->backend_type != _MODBUS_BACKEND_TYPE_TCP ||
+        nb_workers < 1 || max_connections < nb_workers) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    server = new_server(ctx, mb_mapping, nb_workers);
+    if (server == NULL)
+        return NULL;
+
+    for (i = 0; i < nb_workers; i++) {
+        modbus_server_worker_t *worker = &server->workers[i];
+        int max_worker = max_connections / nb_workers;
+        int s;
+
+        /* The first ones take the remainder */
+        if (i < max_connections % nb_workers)
+            max_worker++;
+
+        worker->ctx_copy = *ctx;
+        worker->ctx_copy.trace = NULL;
+        worker->ctx_copy.stats = NULL;
+        worker->ctx_copy.read_ahead = NULL;
+        worker->ctx_copy.cork = NULL;
+        s = _modbus_tcp_listen_reuseport(ctx, max_worker);
+        worker->own_s = 1;
+        if (s == -1 || init_worker(worker, server, &worker->ctx_copy, s, max_worker) == -1) {
+            modbus_server_free(server);
+            return NULL;
+        }
+        worker->backend.mapping_begin = mapping_begin;
+        worker->backend.mapping_end = mapping_end;
+        worker->backend.diag_lock = diag_lock;
+        worker->backend.diag_unlock = diag_unlock;
+    }
+
+    return server;
+}
+
+/* Replaces modbus_reply() with the mapping of modbus_server_new(), fn is
+   called by all the workers */
+int modbus_server_set_request_callback(modbus_server_t *server,
+                                       modbus_server_fn fn,
+                                       void *user_data)
+{
+    if (server == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (fn != NULL) {
+        server->fn = fn;
+        server->user_data = user_data;
+    } else {
+        server->fn = default_reply;
+        server->user_data = server->mb_mapping;
+    }
+
+    return 0;
+}
+
+/* Selects the I/O engine of the workers, before they have connections. The
+   io_uring one needs Linux 6.0, the engine is left unchanged and errno set
+   to ENOTSUP if it isn't available. */
+int modbus_server_set_engine(modbus_server_t *server, modbus_server_engine_t engine)
+{
+#ifdef HAVE_LINUX_IO_URING_H
+    int i;
+#endif
+
+    if (server == NULL ||
+        (engine != MODBUS_SERVER_ENGINE_EPOLL && engine != MODBUS_SERVER_ENGINE_IO_URING)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (engine == server->engine)
+        return 0;
+    if (modbus_server_get_nb_connections(server) > 0) {
+        errno = EBUSY;
+        return -1;
+    }
+
+#ifdef HAVE_LINUX_IO_URING_H
+    /* All the rings first, the workers stay on epoll if one fails */
+    for (i = 0; engine == MODBUS_SERVER_ENGINE_IO_URING && i < server->nb_workers; i++) {
+        if (uring_new(&server->workers[i]) == NULL) {
+            int saved_errno = errno;
+
+            while (--i >= 0) {
+                _modbus_uring_free(server->workers[i].uring);
+                server->workers[i].uring = NULL;
+            }
+            errno = saved_errno;
+            return -1;
+        }
+    }
+
+    for (i = 0; i < server->nb_workers; i++) {
+        modbus_server_worker_t *worker = &server->workers[i];
+        int flags = fcntl(worker->s, F_GETFL, 0);
+
+        if (engine == MODBUS_SERVER_ENGINE_IO_URING) {
+            /* io_uring waits for the connections itself */
+            fcntl(worker->s, F_SETFL, flags & ~O_NONBLOCK);
+        } else {
+            _modbus_uring_free(worker->uring);
+            worker->uring = NULL;
+            /* accept_conns() stops on EAGAIN */
+            fcntl(worker->s, F_SETFL, flags | O_NONBLOCK);
+        }
+    }
+    server->engine = engine;
+
+    return 0;
+#else
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
+/* Waits for the events up to timeout_ms (-1 for ever) and processes them.
+   Returns the number of requests served. Not for the servers with workers,
+   their threads are run by modbus_server_run(). */
+int modbus_server_run_once(modbus_server_t *server, int timeout_ms)
+{
+    if (server == NULL || server->nb_workers > 1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return run_worker_once(&server->workers[0], timeout_ms);
+}
+
+/* Serves the connections until modbus_server_stop(), the first worker runs
+   in the calling thread */
+int modbus_server_run(modbus_server_t *server)
+{
+    int nb_threads = 0;
+    int rc = 0;
+    int i;
+
+    if (server == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (i = 1; i < server->nb_workers; i++) {
+        if (pthread_create(&server->workers[i].thread, NULL, run_worker,
+                           &server->workers[i]) != 0) {
+            modbus_server_stop(server);
+            rc = -1;
+            break;
+        }
+        nb_threads++;
+    }
+
+    if (rc == 0 && run_worker(&server->workers[0]) != NULL) {
+        modbus_server_stop(server);
+        rc = -1;
+    }
+
+    for (i = 1; i <= nb_threads; i++) {
+        void *thread_rc;
+
+        pthread_join(server->workers[i].thread, &thread_rc);
+        if (thread_rc != NULL)
+            rc = -1;
+    }
+    server->stop = 0;
+
+    return rc;
+}
+
+/* Stops modbus_server_run(), from another thread or a signal handler */
+int modbus_server_stop(modbus_server_t *server)
+{
+    uint64_t value = 1;
+    int rc = 0;
+    int i;
+
+    if (server == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    server->stop = 1;
+    for (i = 0; i < server->nb_workers; i++) {
+        if (write(server->workers[i].wakeup, &value, sizeof(value)) == -1)
+            rc = -1;
+    }
+
+    return rc;
+}
+
+/* Connections of all the workers, only a snapshot while they run */
+int modbus_server_get_nb_connections(modbus_server_t *server)
+{
+    int nb_connections = 0;
+    int i;
+
+    if (server == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (i = 0; i < server->nb_workers; i++)
+        nb_connections += __atomic_load_n(&server->workers[i].nb_connections,
+                                          __ATOMIC_RELAXED);
+
+    return nb_connections;
+}
+
+/* Closes the connections and gives its backend back to the context. The server
+   socket of modbus_server_new() is left open. */
+void modbus_server_free(modbus_server_t *server)
+{
+    int i;
+
+    if (server == NULL)
+        return;
+
+    for (i = 0; i < server->nb_workers; i++)
+        close_worker(&server->workers[i]);
+    server->ctx->backend = server->ctx_backend;
+    pthread_mutex_destroy(&server->write_lock);
+    pthread_mutex_destroy(&server->diag_lock);
+    free(server->workers);
+    free(server);
+}
+
+#else /* HAVE_SYS_EPOLL_H */
+
+modbus_server_t *modbus_server_new(modbus_t *ctx,
+                                   int server_socket,
+                                   modbus_mapping_t *mb_mapping,
+                                   int max_connections)
+{
+    errno = ENOTSUP;
+    return NULL;
+}
+
+modbus_server_t *modbus_server_new_workers(modbus_t *ctx,
+                                           modbus_mapping_t *mb_mapping,
+                                           int nb_workers,
+                                           int max_connections)
+{
+    errno = ENOTSUP;
+    return NULL;
+}
+
+int modbus_server_set_request_callback(modbus_server_t *server,
+                                       modbus_server_fn fn,
+                                       void *user_data)
+{
+    errno = EINVAL;
+    return -1;
+}
+
+int modbus_server_set_engine(modbus_server_t *server, modbus_server_engine_t engine)
+{
+    errno = ENOTSUP;
+    return -1;
+}
+
+int modbus_server_run_once(modbus_server_t *server, int timeout_ms)
+{
+    errno = EINVAL;
+    return -1;
+}
+
+int modbus_server_run(modbus_server_t *server)
+{
+    errno = EINVAL;
+    return -1;
+}
+
+int modbus_server_stop(modbus_server_t *server)
+{
+    errno = EINVAL;
+    return -1;
+}
+
+int modbus_server_get_nb_connections(modbus_server_t *server)
+{
+    errno = EINVAL;
+    return -1;
+}
+
+void modbus_server_free(modbus_server_t *server)
+{
+}
+
+#endif /* HAVE_SYS_EPOLL_H */
@@ -0,0 +1,50 @@
+/*
+ * Copyright © Gerhard Schiller 2024, <gerhard.schiller@pm.me>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#ifndef MODBUS_SERVER_H
+#define MODBUS_SERVER_H
+
+#include "modbus.h"
+
+MODBUS_BEGIN_DECLS
+
+/* Serves a request of a connection, e.g. with modbus_reply(). The responses
+ * are queued on the connection and sent once the requests read are served.
+ * Returns -1 to close the connection. */
+typedef int (*modbus_server_fn)(modbus_t *ctx,
+                                const uint8_t *req,
+                                int req_length,
+                                void *user_data);
+
+typedef struct _modbus_server modbus_server_t;
+
+typedef enum {
+    MODBUS_SERVER_ENGINE_EPOLL,
+    MODBUS_SERVER_ENGINE_IO_URING
+} modbus_server_engine_t;
+
+MODBUS_API modbus_server_t *modbus_server_new(modbus_t *ctx,
+                                              int server_socket,
+                                              modbus_mapping_t *mb_mapping,
+                                              int max_connections);
+MODBUS_API modbus_server_t *modbus_server_new_workers(modbus_t *ctx,
+                                                      modbus_mapping_t *mb_mapping,
+                                                      int nb_workers,
+                                                      int max_connections);
+MODBUS_API int modbus_server_set_request_callback(modbus_server_t *server,
+                                                  modbus_server_fn fn,
+                                                  void *user_data);
+MODBUS_API int modbus_server_set_engine(modbus_server_t *server,
+                                        modbus_server_engine_t engine);
+MODBUS_API int modbus_server_run_once(modbus_server_t *server, int timeout_ms);
+MODBUS_API int modbus_server_run(modbus_server_t *server);
+MODBUS_API int modbus_server_stop(modbus_server_t *server);
+MODBUS_API int modbus_server_get_nb_connections(modbus_server_t *server);
+MODBUS_API void modbus_server_free(modbus_server_t *server);
+
+MODBUS_END_DECLS
+
+#endif /* MODBUS_SERVER_H */
@@ -0,0 +1,161 @@
+/*
+ * Copyright © Gerhard Schiller 2024, <gerhard.schiller@pm.me>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+/* Statistics of the requests. The hooks of modbus.c take a timestamp when the
+ * first byte of a message is received, when the ADU is complete, when the
+ * reply is built and when it's sent, and increment a counter and a bucket of
+ * the latency histograms. The functions below only read them. */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef PICO_W
+#include "pico/stdlib.h"
+#endif
+
+#include "modbus-private.h"
+#include "modbus-stats.h"
+
+modbus_stats_t *modbus_stats_new(void)
+{
+    modbus_stats_t *stats;
+
+    stats = (modbus_stats_t *) calloc(1, sizeof(modbus_stats_t));
+    if (stats == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    return stats;
+}
+
+int modbus_stats_get_counters(modbus_stats_t *stats, modbus_stats_counters_t *dest)
+{
+    if (stats == NULL || dest == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    *dest = stats->counters;
+    return 0;
+}
+
+/* Copies the MODBUS_STATS_NB_BUCKETS buckets of the histogram of stage. The
+   MODBUS_STATS_TOTAL one is kept per function code, 0 for all of them. */
+int modbus_stats_get_histogram(modbus_stats_t *stats, int stage, int function, uint32_t *dest)
+{
+    const uint32_t *histogram;
+
+    if (stats == NULL || dest == NULL || stage < MODBUS_STATS_TOTAL ||
+        stage > MODBUS_STATS_SEND || function < 0 || function > 0x7F ||
+        (function != 0 && stage != MODBUS_STATS_TOTAL)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (function == 0) {
+        histogram = stats->stages[stage];
+    } else if (function < _MODBUS_STATS_NB_FUNCTIONS) {
+        histogram = stats->latency[function];
+    } else {
+        /* Shared by the other function codes */
+        histogram = stats->latency[0];
+    }
+
+    memcpy(dest, histogram, MODBUS_STATS_NB_BUCKETS * sizeof(uint32_t));
+    return 0;
+}
+
+/* Returns the upper bound in microseconds of the bucket holding the given
+   percentile (in thousandths, 990 for p99) of the histogram. The last bucket
+   has no bound, its lower one is returned. */
+int modbus_stats_percentile(const uint32_t *histogram, int permille)
+{
+    uint64_t total = 0;
+    uint64_t rank;
+    uint64_t sum = 0;
+    int i;
+
+    if (histogram == NULL || permille < 0 || permille > 1000) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (i = 0; i < MODBUS_STATS_NB_BUCKETS; i++) {
+        total += histogram[i];
+    }
+    if (total == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Rank of the value, rounded up */
+    rank = (total * permille + 999) / 1000;
+    if (rank == 0)
+        rank = 1;
+
+    for (i = 0; i < MODBUS_STATS_NB_BUCKETS - 1; i++) {
+        sum += histogram[i];
+        if (sum >= rank)
+            break;
+    }
+
+    if (i == MODBUS_STATS_NB_BUCKETS - 1)
+        return 1 << (i - 1);
+
+    return (1 << i) - 1;
+}
+
+/* Fills the MODBUS_STATS_REGISTERS registers of a read-only block, see
+   modbus-stats.h for the layout. Returns the number of registers written. */
+int modbus_stats_to_registers(modbus_stats_t *stats, uint16_t *dest)
+{
+    uint32_t counters[5];
+    int nb = 0;
+    int i;
+    int j;
+
+    if (stats == NULL || dest == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    counters[0] = stats->counters.requests;
+    counters[1] = stats->counters.exceptions;
+    counters[2] = stats->counters.timeouts;
+    counters[3] = stats->counters.flushes;
+    counters[4] = stats->counters.reconnects;
+    for (i = 0; i < 5; i++) {
+        dest[nb++] = counters[i] >> 16;
+        dest[nb++] = counters[i] & 0xFFFF;
+    }
+
+    for (i = MODBUS_STATS_TOTAL; i <= MODBUS_STATS_SEND; i++) {
+        for (j = 0; j < MODBUS_STATS_NB_BUCKETS; j++) {
+            dest[nb++] = stats->stages[i][j] >> 16;
+            dest[nb++] = stats->stages[i][j] & 0xFFFF;
+        }
+    }
+
+    return nb;
+}
+
+/* Clears the counters and the histograms, the request in progress is kept */
+void modbus_stats_reset(modbus_stats_t *stats)
+{
+    if (stats == NULL)
+        return;
+
+    memset(&stats->counters, 0, sizeof(stats->counters));
+    memset(stats->stages, 0, sizeof(stats->stages));
+    memset(stats->latency, 0, sizeof(stats->latency));
+}
+
+void modbus_stats_free(modbus_stats_t *stats)
+{
+    free(stats);
+}
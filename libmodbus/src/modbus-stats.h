@@ -0,0 +1,66 @@
+/*
+ * Copyright © Gerhard Schiller 2024, <gerhard.schiller@pm.me>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#ifndef MODBUS_STATS_H
+#define MODBUS_STATS_H
+
+#include "modbus.h"
+
+MODBUS_BEGIN_DECLS
+
+/* Latency histograms, the bucket i counts the latencies from 2^(i-1) to
+ * 2^i - 1 microseconds (bucket 0 for 0 µs), the last bucket counts all the
+ * latencies above 2^(MODBUS_STATS_NB_BUCKETS - 2) µs (0.26 s) */
+#define MODBUS_STATS_NB_BUCKETS 20
+
+/* Histograms of modbus_stats_get_histogram():
+ * - MODBUS_STATS_TOTAL, from the first byte of the request received to the
+ *   reply sent (server), or from the request sent to the response received
+ *   (client), kept per function code;
+ * - MODBUS_STATS_RECEIVE, from the first byte to the complete ADU;
+ * - MODBUS_STATS_PROCESS, from the complete ADU to the reply built (server);
+ * - MODBUS_STATS_SEND, from the reply built to the reply sent (server). */
+#define MODBUS_STATS_TOTAL   0
+#define MODBUS_STATS_RECEIVE 1
+#define MODBUS_STATS_PROCESS 2
+#define MODBUS_STATS_SEND    3
+
+/* Number of registers filled by modbus_stats_to_registers(), all values on
+ * 32 bits (high word first):
+ * - 0 to 9, the counters in the order of modbus_stats_counters_t;
+ * - 10 to 169, the buckets of the histograms TOTAL, RECEIVE, PROCESS and
+ *   SEND.
+ * More than a read of registers, read it in two parts. */
+#define MODBUS_STATS_REGISTERS (10 + 4 * 2 * MODBUS_STATS_NB_BUCKETS)
+
+typedef struct _modbus_stats_counters {
+    /* Indications received (server) or responses received (client) */
+    uint32_t requests;
+    /* Exception responses sent (server) or received (client) */
+    uint32_t exceptions;
+    uint32_t timeouts;
+    /* Successful modbus_flush() calls */
+    uint32_t flushes;
+    /* Connections established again by modbus_connect() */
+    uint32_t reconnects;
+} modbus_stats_counters_t;
+
+typedef struct _modbus_stats modbus_stats_t;
+
+MODBUS_API modbus_stats_t *modbus_stats_new(void);
+MODBUS_API int modbus_set_stats(modbus_t *ctx, modbus_stats_t *stats);
+MODBUS_API int modbus_stats_get_counters(modbus_stats_t *stats,
+                                         modbus_stats_counters_t *dest);
+MODBUS_API int
+modbus_stats_get_histogram(modbus_stats_t *stats, int stage, int function, uint32_t *dest);
+MODBUS_API int modbus_stats_percentile(const uint32_t *histogram, int permille);
+MODBUS_API int modbus_stats_to_registers(modbus_stats_t *stats, uint16_t *dest);
+MODBUS_API void modbus_stats_reset(modbus_stats_t *stats);
+MODBUS_API void modbus_stats_free(modbus_stats_t *stats);
+
+MODBUS_END_DECLS
+
+#endif /* MODBUS_STATS_H */
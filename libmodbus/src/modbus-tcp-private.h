@@ -38,4 +38,7 @@ typedef struct _modbus_tcp_pi {
     char *service;
 } modbus_tcp_pi_t;
 
+int _modbus_tcp_listen_reuseport(modbus_t *ctx, int nb_connection);
+int _modbus_tcp_connect_nowait(modbus_t *ctx);
+
 #endif /* MODBUS_TCP_PRIVATE_H */
@@ -97,19 +97,26 @@ static int _modbus_set_slave(modbus_t *ctx, int slave)
     return 0;
 }
 
-/* Builds a TCP request header */
-static int _modbus_tcp_build_request_basis(
-    modbus_t *ctx, int function, int addr, int nb, uint8_t *req)
+static int _modbus_tcp_next_tid(modbus_t *ctx)
 {
     modbus_tcp_t *ctx_tcp = ctx->backend_data;
 
-    /* Increase transaction ID */
     if (ctx_tcp->t_id < UINT16_MAX)
         ctx_tcp->t_id++;
     else
         ctx_tcp->t_id = 0;
-    req[0] = ctx_tcp->t_id >> 8;
-    req[1] = ctx_tcp->t_id & 0x00ff;
+
+    return ctx_tcp->t_id;
+}
+
+/* Builds a TCP request header */
+static int _modbus_tcp_build_request_basis(
+    modbus_t *ctx, int function, int addr, int nb, uint8_t *req)
+{
+    int t_id = _modbus_tcp_next_tid(ctx);
+
+    req[0] = t_id >> 8;
+    req[1] = t_id & 0x00ff;
 
     /* Protocol Modbus */
     req[2] = 0;
@@ -181,8 +188,16 @@ static int _modbus_tcp_receive(modbus_t *ctx, uint8_t *req)
     return _modbus_receive_msg(ctx, req, MSG_INDICATION);
 }
 
+static ssize_t tcp_read(modbus_t *ctx, uint8_t *buf, int size)
+{
+    return recv(ctx->s, (char *) buf, size, 0);
+}
+
 static ssize_t _modbus_tcp_recv(modbus_t *ctx, uint8_t *rsp, int rsp_length)
 {
+    if (ctx->read_ahead != NULL)
+        return _modbus_read_ahead(ctx, rsp, rsp_length, tcp_read);
+
     return recv(ctx->s, (char *) rsp, rsp_length, 0);
 }
 
@@ -310,8 +325,9 @@ static int _connect(int sockfd,
     return rc;
 }
 
-/* Establishes a modbus TCP connection with a Modbus server. */
-static int _modbus_tcp_connect(modbus_t *ctx)
+/* Establishes a modbus TCP connection with a Modbus server. With nowait, the
+   connection may still be in progress on return. */
+static int tcp_connect(modbus_t *ctx, int nowait)
 {
     int rc;
     /* Specialized version of sockaddr for Internet socket address (same size) */
@@ -361,8 +377,14 @@ static int _modbus_tcp_connect(modbus_t *ctx)
         return -1;
     }
 
-    rc =
-        _connect(ctx->s, (struct sockaddr *) &addr, sizeof(addr), &ctx->response_timeout);
+    if (nowait) {
+        rc = connect(ctx->s, (struct sockaddr *) &addr, sizeof(addr));
+        if (rc == -1 && errno == EINPROGRESS)
+            rc = 0;
+    } else {
+        rc = _connect(
+            ctx->s, (struct sockaddr *) &addr, sizeof(addr), &ctx->response_timeout);
+    }
     if (rc == -1) {
         close(ctx->s);
         ctx->s = -1;
@@ -372,6 +394,11 @@ static int _modbus_tcp_connect(modbus_t *ctx)
     return 0;
 }
 
+static int _modbus_tcp_connect(modbus_t *ctx)
+{
+    return tcp_connect(ctx, FALSE);
+}
+
 /* Establishes a modbus TCP PI connection with a Modbus server. */
 static int _modbus_tcp_pi_connect(modbus_t *ctx)
 {
@@ -467,7 +494,7 @@ static void _modbus_tcp_close(modbus_t *ctx)
 static int _modbus_tcp_flush(modbus_t *ctx)
 {
     int rc;
-    int rc_sum = 0;
+    int rc_sum = _modbus_read_ahead_drop(ctx);
 
     do {
         /* Extract the garbage from the socket */
@@ -502,7 +529,8 @@ static int _modbus_tcp_flush(modbus_t *ctx)
 }
 
 /* Listens for any request from one or many modbus masters in TCP */
-int modbus_tcp_listen(modbus_t *ctx, int nb_connection)
+/* With reuse_port, other sockets can listen on the same port */
+static int tcp_listen(modbus_t *ctx, int nb_connection, int reuse_port)
 {
     int new_s;
     int enable;
@@ -541,6 +569,14 @@ int modbus_tcp_listen(modbus_t *ctx, int nb_connection)
         close(new_s);
         return -1;
     }
+#ifdef SO_REUSEPORT
+    if (reuse_port &&
+        setsockopt(new_s, SOL_SOCKET, SO_REUSEPORT, (char *) &enable, sizeof(enable)) ==
+            -1) {
+        close(new_s);
+        return -1;
+    }
+#endif
 
     memset(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET;
@@ -574,7 +610,12 @@ int modbus_tcp_listen(modbus_t *ctx, int nb_connection)
     return new_s;
 }
 
-int modbus_tcp_pi_listen(modbus_t *ctx, int nb_connection)
+int modbus_tcp_listen(modbus_t *ctx, int nb_connection)
+{
+    return tcp_listen(ctx, nb_connection, FALSE);
+}
+
+static int tcp_pi_listen(modbus_t *ctx, int nb_connection, int reuse_port)
 {
     int rc;
     struct addrinfo *ai_list;
@@ -651,6 +692,11 @@ int modbus_tcp_pi_listen(modbus_t *ctx, int nb_connection)
             int enable = 1;
             rc =
                 setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (void *) &enable, sizeof(enable));
+#ifdef SO_REUSEPORT
+            if (rc == 0 && reuse_port)
+                rc = setsockopt(
+                    s, SOL_SOCKET, SO_REUSEPORT, (void *) &enable, sizeof(enable));
+#endif
             if (rc != 0) {
                 close(s);
                 if (ctx->debug) {
@@ -690,6 +736,41 @@ int modbus_tcp_pi_listen(modbus_t *ctx, int nb_connection)
     return new_s;
 }
 
+int modbus_tcp_pi_listen(modbus_t *ctx, int nb_connection)
+{
+    return tcp_pi_listen(ctx, nb_connection, FALSE);
+}
+
+static void _modbus_tcp_pi_free(modbus_t *ctx);
+
+/* Listens on the address of the context with SO_REUSEPORT, each worker of a
+   server has its own socket on the same port (see modbus-server.c) */
+int _modbus_tcp_listen_reuseport(modbus_t *ctx, int nb_connection)
+{
+#ifdef SO_REUSEPORT
+    if (ctx->backend->free == _modbus_tcp_pi_free)
+        return tcp_pi_listen(ctx, nb_connection, TRUE);
+
+    return tcp_listen(ctx, nb_connection, TRUE);
+#else
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
+/* Starts the connection of a modbus_new_tcp() context without waiting for
+   it, the socket becomes writable once it's established or has failed (see
+   modbus-poller.c) */
+int _modbus_tcp_connect_nowait(modbus_t *ctx)
+{
+    if (ctx->backend->free == _modbus_tcp_pi_free) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    return tcp_connect(ctx, TRUE);
+}
+
 int modbus_tcp_accept(modbus_t *ctx, int *s)
 {
     struct sockaddr_in addr;
@@ -811,6 +892,7 @@ const modbus_backend_t _modbus_tcp_backend = {
     MODBUS_TCP_MAX_ADU_LENGTH,
     _modbus_set_slave,
     _modbus_tcp_build_request_basis,
+    _modbus_tcp_next_tid,
     _modbus_tcp_build_response_basis,
     _modbus_tcp_prepare_response_tid,
     _modbus_tcp_send_msg_pre,
@@ -824,7 +906,12 @@ const modbus_backend_t _modbus_tcp_backend = {
     _modbus_tcp_close,
     _modbus_tcp_flush,
     _modbus_tcp_select,
-    _modbus_tcp_free
+    _modbus_tcp_free,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL
 };
 
 const modbus_backend_t _modbus_tcp_pi_backend = {
@@ -834,6 +921,7 @@ const modbus_backend_t _modbus_tcp_pi_backend = {
     MODBUS_TCP_MAX_ADU_LENGTH,
     _modbus_set_slave,
     _modbus_tcp_build_request_basis,
+    _modbus_tcp_next_tid,
     _modbus_tcp_build_response_basis,
     _modbus_tcp_prepare_response_tid,
     _modbus_tcp_send_msg_pre,
@@ -847,7 +935,12 @@ const modbus_backend_t _modbus_tcp_pi_backend = {
     _modbus_tcp_close,
     _modbus_tcp_flush,
     _modbus_tcp_select,
-    _modbus_tcp_pi_free
+    _modbus_tcp_pi_free,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL
 };
 
 // clang-format on
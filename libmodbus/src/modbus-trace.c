@@ -0,0 +1,195 @@
+/*
+ * Copyright © Gerhard Schiller 2024, <gerhard.schiller@pm.me>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+/* Binary trace of the messages. The hot path only stores a 16 byte record in
+ * a ring (modbus_trace_add() in modbus.c), the records are printed or copied
+ * to registers later, from any thread or core. A reader never blocks the
+ * writer: the records overwritten while they were copied are dropped. */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef PICO_W
+#include "pico/stdlib.h"
+#endif
+
+#include "modbus-private.h"
+#include "modbus-trace.h"
+
+/* Allocates a ring of nb_records, rounded up to a power of 2 */
+modbus_trace_t *modbus_trace_new(int nb_records)
+{
+    modbus_trace_t *trace;
+    uint32_t size = 2;
+
+    if (nb_records < 2 || nb_records > 0x10000) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    while (size < (uint32_t) nb_records) {
+        size <<= 1;
+    }
+
+    trace = (modbus_trace_t *) malloc(sizeof(modbus_trace_t));
+    if (trace == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    trace->records = calloc(size, sizeof(modbus_trace_record_t));
+    if (trace->records == NULL) {
+        free(trace);
+        errno = ENOMEM;
+        return NULL;
+    }
+    trace->mask = size - 1;
+    trace->head = 0;
+
+    return trace;
+}
+
+/* Copies up to max_records records from the sequence number *seq (0 for the
+   oldest one) and advances *seq past them. The records lost because the
+   reader is too late are skipped, *seq jumps over them. Returns the number of
+   records copied. */
+int modbus_trace_read(modbus_trace_t *trace,
+                      uint32_t *seq,
+                      modbus_trace_record_t *dest,
+                      int max_records)
+{
+    uint32_t capacity;
+    uint32_t head;
+    uint32_t first;
+    uint32_t nb;
+    uint32_t lost;
+    uint32_t i;
+
+    if (trace == NULL || seq == NULL || dest == NULL || max_records < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* The slot of the head may be under write */
+    capacity = trace->mask;
+    head = trace->head;
+    _MODBUS_FENCE_ACQUIRE();
+
+    first = *seq;
+    if (head - first > capacity)
+        first = head - capacity;
+    nb = head - first;
+    if (nb > (uint32_t) max_records)
+        nb = max_records;
+
+    for (i = 0; i < nb; i++) {
+        dest[i] = trace->records[(first + i) & trace->mask];
+    }
+
+    /* Drops the records overwritten during the copy */
+    _MODBUS_FENCE_ACQUIRE();
+    head = trace->head;
+    if (head - first > capacity) {
+        lost = head - capacity - first;
+        if (lost > nb)
+            lost = nb;
+        memmove(dest, dest + lost, (nb - lost) * sizeof(modbus_trace_record_t));
+        first += lost;
+        nb -= lost;
+    }
+
+    *seq = first + nb;
+
+    return nb;
+}
+
+/* Prints the records from *seq, one per line, and advances *seq. Returns the
+   number of records printed. */
+int modbus_trace_print(modbus_trace_t *trace, uint32_t *seq, FILE *stream)
+{
+    modbus_trace_record_t records[16];
+    int nb_printed = 0;
+    int rc;
+
+    if (seq == NULL || stream == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    do {
+        uint32_t expected = *seq;
+        int i;
+
+        rc = modbus_trace_read(trace, seq, records, 16);
+        if (rc == -1)
+            return -1;
+
+        if (*seq - rc != expected)
+            fprintf(stream, "... %u records lost\n", (unsigned) (*seq - rc - expected));
+
+        for (i = 0; i < rc; i++) {
+            const modbus_trace_record_t *record = &records[i];
+            const char *event = record->event == MODBUS_TRACE_SEND      ? "TX"
+                                : record->event == MODBUS_TRACE_RECEIVE ? "RX"
+                                                                        : "USR";
+
+            fprintf(stream,
+                    "%10u %-3s %3u slave %3u tid %5u fc 0x%02X len %3u rc %ld\n",
+                    (unsigned) record->time,
+                    event,
+                    record->connection,
+                    record->slave,
+                    record->t_id,
+                    record->function,
+                    record->length,
+                    (long) record->result);
+        }
+        nb_printed += rc;
+    } while (rc == 16);
+
+    return nb_printed;
+}
+
+/* Packs the records in MODBUS_TRACE_RECORD_REGISTERS registers each, to be
+   served from a reserved area of the mapping. Returns the number of registers
+   written. */
+int modbus_trace_to_registers(const modbus_trace_record_t *records,
+                              int nb_records,
+                              uint16_t *dest)
+{
+    int i;
+
+    if (records == NULL || dest == NULL || nb_records < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (i = 0; i < nb_records; i++) {
+        const modbus_trace_record_t *record = &records[i];
+        uint16_t *reg = dest + i * MODBUS_TRACE_RECORD_REGISTERS;
+
+        reg[0] = record->time >> 16;
+        reg[1] = record->time & 0xFFFF;
+        reg[2] = (uint32_t) record->result >> 16;
+        reg[3] = (uint32_t) record->result & 0xFFFF;
+        reg[4] = record->t_id;
+        reg[5] = record->length;
+        reg[6] = (record->event << 8) | record->function;
+        reg[7] = (record->slave << 8) | record->connection;
+    }
+
+    return nb_records * MODBUS_TRACE_RECORD_REGISTERS;
+}
+
+void modbus_trace_free(modbus_trace_t *trace)
+{
+    if (trace == NULL)
+        return;
+
+    free(trace->records);
+    free(trace);
+}
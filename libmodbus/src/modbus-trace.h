@@ -0,0 +1,65 @@
+/*
+ * Copyright © Gerhard Schiller 2024, <gerhard.schiller@pm.me>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#ifndef MODBUS_TRACE_H
+#define MODBUS_TRACE_H
+
+#include <stdio.h>
+
+#include "modbus.h"
+
+MODBUS_BEGIN_DECLS
+
+/* Events of the trace records */
+#define MODBUS_TRACE_SEND    1
+#define MODBUS_TRACE_RECEIVE 2
+/* First event free for the application (modbus_trace_add) */
+#define MODBUS_TRACE_USER 0x80
+
+/* Number of registers filled by modbus_trace_to_registers() per record */
+#define MODBUS_TRACE_RECORD_REGISTERS 8
+
+/* A traced message, 16 bytes */
+typedef struct _modbus_trace_record {
+    /* Microseconds, wraps after 71 minutes */
+    uint32_t time;
+    /* Bytes sent or received, or -errno on failure */
+    int32_t result;
+    /* Transaction ID of TCP, 0 for RTU */
+    uint16_t t_id;
+    uint16_t length;
+    uint8_t event;
+    uint8_t function;
+    uint8_t slave;
+    /* Low byte of the socket or file descriptor */
+    uint8_t connection;
+} modbus_trace_record_t;
+
+typedef struct _modbus_trace modbus_trace_t;
+
+MODBUS_API modbus_trace_t *modbus_trace_new(int nb_records);
+MODBUS_API int modbus_set_trace(modbus_t *ctx, modbus_trace_t *trace);
+MODBUS_API void modbus_trace_add(modbus_trace_t *trace,
+                                 int event,
+                                 int connection,
+                                 int t_id,
+                                 int slave,
+                                 int function,
+                                 int length,
+                                 int result);
+MODBUS_API int modbus_trace_read(modbus_trace_t *trace,
+                                 uint32_t *seq,
+                                 modbus_trace_record_t *dest,
+                                 int max_records);
+MODBUS_API int modbus_trace_print(modbus_trace_t *trace, uint32_t *seq, FILE *stream);
+MODBUS_API int modbus_trace_to_registers(const modbus_trace_record_t *records,
+                                         int nb_records,
+                                         uint16_t *dest);
+MODBUS_API void modbus_trace_free(modbus_trace_t *trace);
+
+MODBUS_END_DECLS
+
+#endif /* MODBUS_TRACE_H */
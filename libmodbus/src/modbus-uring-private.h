@@ -0,0 +1,68 @@
+/*
+ * Copyright © Gerhard Schiller 2024, <gerhard.schiller@pm.me>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#ifndef MODBUS_URING_PRIVATE_H
+#define MODBUS_URING_PRIVATE_H
+
+/* Rings of io_uring set up with raw system calls, shared by the server and
+ * the poller engines. A ring is used by a single thread. */
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#ifndef IORING_RECV_MULTISHOT
+/* Headers older than the multishot receive, epoll only */
+#undef HAVE_LINUX_IO_URING_H
+#endif
+#endif
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Buffers provided to the multishot receives, a power of 2 */
+#define _MODBUS_URING_NB_BUFS  1024
+#define _MODBUS_URING_BUF_SIZE 1024
+
+/* Submission and completion rings mapped from the kernel, the ring of the
+   buffers provided to the receives and the fixed files */
+typedef struct _modbus_uring {
+    int fd;
+    unsigned sq_entries;
+    unsigned sq_mask;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned cq_mask;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    struct io_uring_cqe *cqes;
+    void *rings;
+    size_t rings_size;
+    size_t sqes_size;
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_size;
+    uint16_t buf_tail;
+    uint8_t *bufs;
+    /* Free indexes of the fixed files */
+    int *free_files;
+    int nb_free_files;
+} modbus_uring_t;
+
+modbus_uring_t *_modbus_uring_new(int nb_files);
+void _modbus_uring_free(modbus_uring_t *uring);
+int _modbus_uring_enter(modbus_uring_t *uring, unsigned min_complete, int timeout_ms);
+struct io_uring_sqe *_modbus_uring_get_sqe(modbus_uring_t *uring, uint64_t user_data);
+int _modbus_uring_get_cqe(modbus_uring_t *uring, struct io_uring_cqe *cqe);
+int _modbus_uring_recv(modbus_uring_t *uring, int file, uint64_t user_data);
+void _modbus_uring_recycle(modbus_uring_t *uring, int bid);
+int _modbus_uring_add_file(modbus_uring_t *uring, int s);
+void _modbus_uring_remove_file(modbus_uring_t *uring, int file);
+
+#endif /* HAVE_LINUX_IO_URING_H */
+
+#endif /* MODBUS_URING_PRIVATE_H */
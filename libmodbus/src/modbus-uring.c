@@ -0,0 +1,313 @@
+/*
+ * Copyright © Gerhard Schiller 2024, <gerhard.schiller@pm.me>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "modbus-private.h"
+#include "modbus-uring-private.h"
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define _URING_SQ_ENTRIES 256
+/* Room for the completions of many multishot receives */
+#define _URING_CQ_ENTRIES 4096
+#define _URING_BGID 0
+
+static int uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void *uring_mmap(size_t size, int fd, off_t offset)
+{
+    void *addr;
+
+    if (fd == -1)
+        addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    else
+        addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+
+    return addr == MAP_FAILED ? NULL : addr;
+}
+
+/* Opens the rings with nb_files fixed files, all free. Sets errno to ENOTSUP
+   if the kernel lacks the multishot receive of Linux 6.0. */
+modbus_uring_t *_modbus_uring_new(int nb_files)
+{
+    modbus_uring_t *uring;
+    struct io_uring_params params;
+    struct io_uring_buf_reg reg;
+    size_t cq_size;
+    char *rings;
+    int *files;
+    int fd;
+    int rc;
+    int i;
+
+    /* SINGLE_ISSUER came in the same release, io_uring may be disabled too */
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_SINGLE_ISSUER;
+    fd = (int) syscall(__NR_io_uring_setup, 1, &params);
+    if (fd == -1) {
+        errno = ENOTSUP;
+        return NULL;
+    }
+    close(fd);
+
+    uring = (modbus_uring_t *) calloc(1, sizeof(modbus_uring_t));
+    if (uring == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = _URING_CQ_ENTRIES;
+    uring->fd = (int) syscall(__NR_io_uring_setup, _URING_SQ_ENTRIES, &params);
+    if (uring->fd == -1) {
+        _modbus_uring_free(uring);
+        return NULL;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+        !(params.features & IORING_FEAT_EXT_ARG)) {
+        _modbus_uring_free(uring);
+        errno = ENOTSUP;
+        return NULL;
+    }
+
+    /* Both rings in one mapping */
+    uring->rings_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (cq_size > uring->rings_size)
+        uring->rings_size = cq_size;
+    uring->rings = uring_mmap(uring->rings_size, uring->fd, IORING_OFF_SQ_RING);
+    uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    uring->sqes = uring_mmap(uring->sqes_size, uring->fd, IORING_OFF_SQES);
+    if (uring->rings == NULL || uring->sqes == NULL) {
+        _modbus_uring_free(uring);
+        return NULL;
+    }
+    rings = uring->rings;
+    uring->sq_entries = params.sq_entries;
+    uring->sq_mask = *(unsigned *) (rings + params.sq_off.ring_mask);
+    uring->sq_head = (unsigned *) (rings + params.sq_off.head);
+    uring->sq_tail = (unsigned *) (rings + params.sq_off.tail);
+    uring->sq_array = (unsigned *) (rings + params.sq_off.array);
+    uring->cq_mask = *(unsigned *) (rings + params.cq_off.ring_mask);
+    uring->cq_head = (unsigned *) (rings + params.cq_off.head);
+    uring->cq_tail = (unsigned *) (rings + params.cq_off.tail);
+    uring->cqes = (struct io_uring_cqe *) (rings + params.cq_off.cqes);
+
+    files = malloc(nb_files * sizeof(int));
+    uring->free_files = malloc(nb_files * sizeof(int));
+    if (files == NULL || uring->free_files == NULL) {
+        free(files);
+        _modbus_uring_free(uring);
+        errno = ENOMEM;
+        return NULL;
+    }
+    for (i = 0; i < nb_files; i++) {
+        files[i] = -1;
+        uring->free_files[i] = nb_files - 1 - i;
+    }
+    uring->nb_free_files = nb_files;
+    rc = uring_register(uring->fd, IORING_REGISTER_FILES, files, nb_files);
+    free(files);
+    if (rc == -1) {
+        _modbus_uring_free(uring);
+        return NULL;
+    }
+
+    uring->buf_ring_size = _MODBUS_URING_NB_BUFS * sizeof(struct io_uring_buf);
+    uring->buf_ring = uring_mmap(uring->buf_ring_size, -1, 0);
+    uring->bufs = malloc(_MODBUS_URING_NB_BUFS * _MODBUS_URING_BUF_SIZE);
+    if (uring->buf_ring == NULL || uring->bufs == NULL) {
+        _modbus_uring_free(uring);
+        errno = ENOMEM;
+        return NULL;
+    }
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t) (uintptr_t) uring->buf_ring;
+    reg.ring_entries = _MODBUS_URING_NB_BUFS;
+    reg.bgid = _URING_BGID;
+    if (uring_register(uring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        _modbus_uring_free(uring);
+        return NULL;
+    }
+    for (i = 0; i < _MODBUS_URING_NB_BUFS; i++)
+        _modbus_uring_recycle(uring, i);
+
+    return uring;
+}
+
+/* Closing the ring ends the operations in flight */
+void _modbus_uring_free(modbus_uring_t *uring)
+{
+    int saved_errno = errno;
+
+    if (uring == NULL)
+        return;
+
+    if (uring->fd != -1)
+        close(uring->fd);
+    if (uring->rings != NULL)
+        munmap(uring->rings, uring->rings_size);
+    if (uring->sqes != NULL)
+        munmap(uring->sqes, uring->sqes_size);
+    if (uring->buf_ring != NULL)
+        munmap(uring->buf_ring, uring->buf_ring_size);
+    free(uring->bufs);
+    free(uring->free_files);
+    free(uring);
+    errno = saved_errno;
+}
+
+/* Submits the entries queued and waits for min_complete completions up to
+   timeout_ms (-1 for ever) */
+int _modbus_uring_enter(modbus_uring_t *uring, unsigned min_complete, int timeout_ms)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned to_submit;
+    int rc;
+
+    to_submit = *uring->sq_tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+    if (to_submit == 0 && min_complete == 0)
+        return 0;
+
+    memset(&arg, 0, sizeof(arg));
+    if (timeout_ms >= 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000;
+        arg.ts = (uint64_t) (uintptr_t) &ts;
+    }
+    rc = (int) syscall(__NR_io_uring_enter,
+                       uring->fd,
+                       to_submit,
+                       min_complete,
+                       IORING_ENTER_EXT_ARG | (min_complete ? IORING_ENTER_GETEVENTS : 0),
+                       &arg,
+                       sizeof(arg));
+    if (rc == -1 && (errno == ETIME || errno == EINTR))
+        return 0;
+
+    return rc;
+}
+
+/* Returns a cleared entry, submitted by the next _modbus_uring_enter() */
+struct io_uring_sqe *_modbus_uring_get_sqe(modbus_uring_t *uring, uint64_t user_data)
+{
+    unsigned tail = *uring->sq_tail;
+    struct io_uring_sqe *sqe;
+
+    /* Full, the entries queued are submitted first */
+    if (tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) == uring->sq_entries) {
+        if (_modbus_uring_enter(uring, 0, -1) == -1)
+            return NULL;
+        if (tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) == uring->sq_entries) {
+            errno = EBUSY;
+            return NULL;
+        }
+    }
+
+    sqe = &uring->sqes[tail & uring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = user_data;
+    uring->sq_array[tail & uring->sq_mask] = tail & uring->sq_mask;
+    /* Without SQPOLL, the kernel reads the entry at io_uring_enter() only */
+    __atomic_store_n(uring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    return sqe;
+}
+
+/* Takes the next completion, returns 0 if there is none */
+int _modbus_uring_get_cqe(modbus_uring_t *uring, struct io_uring_cqe *cqe)
+{
+    unsigned head = *uring->cq_head;
+
+    if (head == __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE))
+        return 0;
+
+    *cqe = uring->cqes[head & uring->cq_mask];
+    /* The entry is given back before its processing submits others */
+    __atomic_store_n(uring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+    return 1;
+}
+
+/* Multishot receive on the fixed file into the buffers provided, the buffer of
+   a completion is given back by _modbus_uring_recycle() */
+int _modbus_uring_recv(modbus_uring_t *uring, int file, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe = _modbus_uring_get_sqe(uring, user_data);
+
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = file;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->buf_group = _URING_BGID;
+
+    return 0;
+}
+
+/* Gives a buffer back to the kernel */
+void _modbus_uring_recycle(modbus_uring_t *uring, int bid)
+{
+    struct io_uring_buf *buf =
+        &uring->buf_ring->bufs[uring->buf_tail & (_MODBUS_URING_NB_BUFS - 1)];
+
+    buf->addr = (uint64_t) (uintptr_t) (uring->bufs + bid * _MODBUS_URING_BUF_SIZE);
+    buf->len = _MODBUS_URING_BUF_SIZE;
+    buf->bid = bid;
+    uring->buf_tail++;
+    __atomic_store_n(&uring->buf_ring->tail, uring->buf_tail, __ATOMIC_RELEASE);
+}
+
+/* Returns the index of the fixed file of the socket or -1 */
+int _modbus_uring_add_file(modbus_uring_t *uring, int s)
+{
+    struct io_uring_files_update update;
+    int file;
+
+    if (uring->nb_free_files == 0) {
+        errno = EMFILE;
+        return -1;
+    }
+
+    file = uring->free_files[--uring->nb_free_files];
+    memset(&update, 0, sizeof(update));
+    update.offset = file;
+    update.fds = (uint64_t) (uintptr_t) &s;
+    if (uring_register(uring->fd, IORING_REGISTER_FILES_UPDATE, &update, 1) != 1) {
+        uring->free_files[uring->nb_free_files++] = file;
+        return -1;
+    }
+
+    return file;
+}
+
+/* The operations in flight on the file keep their reference */
+void _modbus_uring_remove_file(modbus_uring_t *uring, int file)
+{
+    struct io_uring_files_update update;
+    int fd = -1;
+
+    memset(&update, 0, sizeof(update));
+    update.offset = file;
+    update.fds = (uint64_t) (uintptr_t) &fd;
+    uring_register(uring->fd, IORING_REGISTER_FILES_UPDATE, &update, 1);
+    uring->free_files[uring->nb_free_files++] = file;
+}
+
+#endif /* HAVE_LINUX_IO_URING_H */
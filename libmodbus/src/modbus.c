@@ -104,7 +104,7 @@ const char *modbus_strerror(int errnum)
 
 void _error_print(modbus_t *ctx, const char *context)
 {
-    if (ctx->debug) {
+    if (_MODBUS_ERROR(ctx)) {
         fprintf(stderr, "ERROR %s", modbus_strerror(errno));
         if (context != NULL) {
             fprintf(stderr, ": %s\n", context);
@@ -114,7 +114,7 @@ void _error_print(modbus_t *ctx, const char *context)
     }
 }
 
-static void _sleep_response_timeout(modbus_t *ctx)
+void _modbus_sleep_response_timeout(modbus_t *ctx)
 {
     /* Response timeout is always positive */
 #ifdef _WIN32
@@ -137,6 +137,65 @@ static void _sleep_response_timeout(modbus_t *ctx)
 #endif
 }
 
+/* Monotonic time in microseconds */
+uint64_t _modbus_time_us(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (uint64_t) (counter.QuadPart / frequency.QuadPart) * 1000000 +
+           (uint64_t) (counter.QuadPart % frequency.QuadPart) * 1000000 /
+               frequency.QuadPart;
+#elif !defined PICO_W
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+#else // PICO_W
+    return time_us_64();
+#endif
+}
+
+void _modbus_sleep_us(uint32_t us)
+{
+#ifdef _WIN32
+    Sleep(us / 1000);
+#elif !defined PICO_W
+    struct timespec request, remaining;
+    request.tv_sec = us / 1000000;
+    request.tv_nsec = ((long int) (us % 1000000)) * 1000;
+    while (nanosleep(&request, &remaining) == -1 && errno == EINTR) {
+        request = remaining;
+    }
+#else // PICO_W
+    sleep_us(us);
+#endif
+}
+
+/* Release after the one of a periodic run ended at end. The releases already
+   gone are skipped, not queued, and added to overruns if not NULL. A period
+   of 0 releases again at end. */
+uint64_t
+_modbus_next_release(uint64_t release, uint32_t period, uint64_t end, uint32_t *overruns)
+{
+    uint64_t next = release + period;
+    uint64_t skipped;
+
+    if (next > end)
+        return next;
+    if (period == 0)
+        return end;
+
+    skipped = (end - next) / period + 1;
+    if (overruns != NULL)
+        *overruns += skipped;
+
+    return next + skipped * period;
+}
+
 int modbus_flush(modbus_t *ctx)
 {
     int rc;
@@ -147,7 +206,11 @@ int modbus_flush(modbus_t *ctx)
     }
 
     rc = ctx->backend->flush(ctx);
-    if (rc != -1 && ctx->debug) {
+#if MODBUS_CONFIG_STATS
+    if (rc != -1 && ctx->stats != NULL)
+        ctx->stats->counters.flushes++;
+#endif
+    if (rc != -1 && _MODBUS_DEBUG(ctx)) {
         /* Not all backends are able to return the number of bytes flushed */
         printf("Bytes flushed (%d)\n", rc);
     }
@@ -177,12 +240,29 @@ static unsigned int compute_response_length_from_request(modbus_t *ctx, uint8_t
         length = 3;
         break;
     case MODBUS_FC_REPORT_SLAVE_ID:
+    case MODBUS_FC_GET_COMM_EVENT_LOG:
         /* The response is device specific (the header provides the
            length) */
         return MSG_LENGTH_UNDEFINED;
     case MODBUS_FC_MASK_WRITE_REGISTER:
         length = 7;
         break;
+    case MODBUS_FC_READ_FILE_RECORD: {
+        /* Header + for each sub-request the file response length, the
+           reference type and 2 * nb values */
+        int nb_records = req[offset + 1] / 7;
+        int i;
+
+        length = 2;
+        for (i = 0; i < nb_records; i++) {
+            int pos = offset + 2 + 7 * i;
+            length += 2 + 2 * ((req[pos + 5] << 8) | req[pos + 6]);
+        }
+    } break;
+    case MODBUS_FC_WRITE_FILE_RECORD:
+        /* The response is an echo of the request */
+        length = 2 + req[offset + 1];
+        break;
     default:
         length = 5;
     }
@@ -190,15 +270,253 @@ static unsigned int compute_response_length_from_request(modbus_t *ctx, uint8_t
     return offset + length + ctx->backend->checksum_length;
 }
 
-/* Sends a request/response */
-static int send_msg(modbus_t *ctx, uint8_t *msg, int msg_length)
+#if MODBUS_CONFIG_TRACE
+/* Records a message sent or received, msg is only read when rc > 0 */
+static void trace_msg(modbus_t *ctx, int event, const uint8_t *msg, int msg_length, int rc)
+{
+    const int offset = ctx->backend->header_length;
+    int t_id = 0;
+    int slave = 0;
+    int function = 0;
+
+    if (rc > offset) {
+        if (ctx->backend->backend_type == _MODBUS_BACKEND_TYPE_TCP)
+            t_id = (msg[0] << 8) | msg[1];
+        slave = msg[offset - 1];
+        function = msg[offset];
+    }
+
+    modbus_trace_add(ctx->trace,
+                     event,
+                     ctx->s,
+                     t_id,
+                     slave,
+                     function,
+                     msg_length,
+                     rc == -1 ? -errno : rc);
+}
+#endif
+
+#if MODBUS_CONFIG_STATS
+/* Index of the bucket of a latency in microseconds */
+static int stats_bucket(uint32_t us)
+{
+    int bucket;
+
+#if defined(__GNUC__)
+    bucket = us ? 32 - __builtin_clz(us) : 0;
+#else
+    for (bucket = 0; us != 0; bucket++)
+        us >>= 1;
+#endif
+
+    return bucket < MODBUS_STATS_NB_BUCKETS ? bucket : MODBUS_STATS_NB_BUCKETS - 1;
+}
+
+static void
+stats_latency(modbus_stats_t *stats, int function, uint64_t start, uint64_t end)
+{
+    const int bucket = stats_bucket((uint32_t) (end - start));
+
+    stats->stages[MODBUS_STATS_TOTAL][bucket]++;
+    stats->latency[function < _MODBUS_STATS_NB_FUNCTIONS ? function : 0][bucket]++;
+}
+
+/* Records a message received, a response also ends the request of a client */
+static void stats_receive(modbus_t *ctx, const uint8_t *msg, msg_type_t msg_type, int rc)
+{
+    modbus_stats_t *stats = ctx->stats;
+    int function;
+
+    if (rc == -1) {
+        if (errno == ETIMEDOUT)
+            stats->counters.timeouts++;
+        return;
+    }
+
+    stats->t_adu = _modbus_time_us();
+    stats->counters.requests++;
+    stats->stages[MODBUS_STATS_RECEIVE]
+                 [stats_bucket((uint32_t) (stats->t_adu - stats->t_start))]++;
+
+    if (msg_type == MSG_CONFIRMATION) {
+        function = msg[ctx->backend->header_length];
+        if (function & 0x80)
+            stats->counters.exceptions++;
+        stats_latency(stats, function & 0x7F, stats->t_sent, stats->t_adu);
+    }
+}
+
+/* Records a reply of a server, send_msg_ready() has stored the time it was
+   sent */
+static void stats_reply(modbus_t *ctx, const uint8_t *rsp, int rc)
+{
+    modbus_stats_t *stats = ctx->stats;
+    const int function = rsp[ctx->backend->header_length];
+
+    if (function & 0x80)
+        stats->counters.exceptions++;
+    if (rc == -1)
+        return;
+
+    stats->stages[MODBUS_STATS_PROCESS]
+                 [stats_bucket((uint32_t) (stats->t_reply - stats->t_adu))]++;
+    stats->stages[MODBUS_STATS_SEND]
+                 [stats_bucket((uint32_t) (stats->t_sent - stats->t_reply))]++;
+    stats_latency(stats, function & 0x7F, stats->t_start, stats->t_sent);
+}
+#endif
+
+#if _MODBUS_DIAG
+/* The workers of a server share their diagnostics (see modbus-server.c) */
+static void diag_lock(modbus_t *ctx)
+{
+#ifndef PICO_W
+    if (ctx->backend->diag_lock != NULL)
+        ctx->backend->diag_lock(ctx);
+#endif
+}
+
+static void diag_unlock(modbus_t *ctx)
+{
+#ifndef PICO_W
+    if (ctx->backend->diag_unlock != NULL)
+        ctx->backend->diag_unlock(ctx);
+#endif
+}
+
+/* Adds an event to the log of MODBUS_FC_GET_COMM_EVENT_LOG */
+static void diag_event(modbus_t *ctx, uint8_t event)
+{
+    modbus_diag_t *diag = ctx->diag;
+
+    diag->events[diag->head] = event;
+    diag->head = (diag->head + 1) % MODBUS_MAX_COMM_EVENTS;
+    if (diag->nb_events < MODBUS_MAX_COMM_EVENTS)
+        diag->nb_events++;
+}
+
+/* Counts an indication received by a server, rc is the result of receive_msg */
+static void diag_receive(modbus_t *ctx, const uint8_t *msg, int rc)
+{
+    modbus_diag_t *diag = ctx->diag;
+    uint8_t event = MODBUS_EVENT_RECEIVE;
+
+    if (rc == -1) {
+        if (errno == EMBBADCRC) {
+            diag->counters.bus_comm_errors++;
+            event |= MODBUS_EVENT_RECEIVE_COMM_ERROR;
+        } else if (errno == EMBBADDATA) {
+            diag->counters.bus_overruns++;
+            event |= MODBUS_EVENT_RECEIVE_OVERRUN;
+        } else {
+            return;
+        }
+    } else {
+        diag->counters.bus_messages++;
+        if (rc == 0) {
+            /* Addressed to another slave */
+            return;
+        }
+        diag->counters.server_messages++;
+        if (ctx->backend->backend_type == _MODBUS_BACKEND_TYPE_RTU &&
+            msg[ctx->backend->header_length - 1] == MODBUS_BROADCAST_ADDRESS) {
+            event |= MODBUS_EVENT_RECEIVE_BROADCAST;
+        }
+    }
+
+    if (diag->listen_only)
+        event |= MODBUS_EVENT_RECEIVE_LISTEN_ONLY;
+    diag_event(ctx, event);
+}
+
+/* Counts a reply sent by a server */
+static void diag_reply(modbus_t *ctx, const uint8_t *rsp, int rc)
+{
+    modbus_diag_t *diag = ctx->diag;
+    const int offset = ctx->backend->header_length;
+    const int function = rsp[offset];
+    uint8_t event = MODBUS_EVENT_SEND;
+
+    if (function & 0x80) {
+        const int exception_code = rsp[offset + 1];
+
+        diag->counters.bus_exceptions++;
+        if (exception_code <= MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE) {
+            event |= MODBUS_EVENT_SEND_READ_EXCEPTION;
+        } else if (exception_code == MODBUS_EXCEPTION_SLAVE_OR_SERVER_FAILURE) {
+            event |= MODBUS_EVENT_SEND_ABORT;
+        } else if (exception_code == MODBUS_EXCEPTION_ACKNOWLEDGE ||
+                   exception_code == MODBUS_EXCEPTION_SLAVE_OR_SERVER_BUSY) {
+            event |= MODBUS_EVENT_SEND_BUSY;
+        } else if (exception_code == MODBUS_EXCEPTION_NEGATIVE_ACKNOWLEDGE) {
+            event |= MODBUS_EVENT_SEND_NAK;
+        }
+        if (exception_code == MODBUS_EXCEPTION_SLAVE_OR_SERVER_BUSY)
+            diag->counters.server_busy++;
+        else if (exception_code == MODBUS_EXCEPTION_NEGATIVE_ACKNOWLEDGE)
+            diag->counters.server_naks++;
+    } else if (rc != -1 && function != MODBUS_FC_GET_COMM_EVENT_COUNTER &&
+               function != MODBUS_FC_GET_COMM_EVENT_LOG) {
+        diag->counters.comm_events++;
+    }
+
+    diag_event(ctx, event);
+}
+#endif
+
+/* Writes the messages of the cork buffer to the socket they were sent on */
+static int flush_cork(modbus_t *ctx)
+{
+    modbus_cork_t *cork = ctx->cork;
+    int s = ctx->s;
+    int offset = 0;
+    ssize_t rc = 0;
+
+    ctx->s = cork->s;
+    while (offset < cork->length) {
+        rc = ctx->backend->send(ctx, cork->buf + offset, cork->length - offset);
+        if (rc == -1) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        offset += rc;
+    }
+    ctx->s = s;
+    cork->length = 0;
+
+    return rc == -1 ? -1 : 0;
+}
+
+/* Send of the backend or, while the context is corked, append to the cork
+   buffer */
+static ssize_t backend_send(modbus_t *ctx, const uint8_t *msg, int msg_length)
+{
+    modbus_cork_t *cork = ctx->cork;
+
+    if (cork == NULL || !cork->corked)
+        return ctx->backend->send(ctx, msg, msg_length);
+
+    if (cork->length > 0 &&
+        (cork->s != ctx->s || cork->length + msg_length > _MODBUS_CORK_SIZE) &&
+        flush_cork(ctx) == -1)
+        return -1;
+
+    cork->s = ctx->s;
+    memcpy(cork->buf + cork->length, msg, msg_length);
+    cork->length += msg_length;
+
+    return msg_length;
+}
+
+/* Sends a request/response already completed by send_msg_pre */
+static int send_msg_ready(modbus_t *ctx, uint8_t *msg, int msg_length)
 {
     int rc;
     int i;
 
-    msg_length = ctx->backend->send_msg_pre(msg, msg_length);
-
-    if (ctx->debug) {
+    if (_MODBUS_DEBUG(ctx)) {
         for (i = 0; i < msg_length; i++)
             printf("[%.2X]", msg[i]);
         printf("\n");
@@ -207,7 +525,7 @@ static int send_msg(modbus_t *ctx, uint8_t *msg, int msg_length)
     /* In recovery mode, the write command will be issued until to be
        successful! Disabled by default. */
     do {
-        rc = ctx->backend->send(ctx, msg, msg_length);
+        rc = backend_send(ctx, msg, msg_length);
         if (rc == -1) {
             _error_print(ctx, NULL);
             if (ctx->error_recovery & MODBUS_ERROR_RECOVERY_LINK) {
@@ -218,10 +536,10 @@ static int send_msg(modbus_t *ctx, uint8_t *msg, int msg_length)
                     wsa_err == WSAEHOSTUNREACH || wsa_err == WSAECONNABORTED ||
                     wsa_err == WSAECONNRESET || wsa_err == WSAETIMEDOUT) {
                     modbus_close(ctx);
-                    _sleep_response_timeout(ctx);
+                    _modbus_sleep_response_timeout(ctx);
                     modbus_connect(ctx);
                 } else {
-                    _sleep_response_timeout(ctx);
+                    _modbus_sleep_response_timeout(ctx);
                     modbus_flush(ctx);
                 }
 #else
@@ -230,11 +548,11 @@ static int send_msg(modbus_t *ctx, uint8_t *msg, int msg_length)
                 if ((errno == EBADF || errno == ECONNRESET || errno == EPIPE)) {
 //                     printf("TEST send_msg connect\n");
                     modbus_close(ctx);
-                    _sleep_response_timeout(ctx);
+                    _modbus_sleep_response_timeout(ctx);
                     modbus_connect(ctx);
                 } else {
 //                     printf("TEST send_msg flush\n");
-                    _sleep_response_timeout(ctx);
+                    _modbus_sleep_response_timeout(ctx);
                     modbus_flush(ctx);
                 }
                 errno = saved_errno;
@@ -245,9 +563,51 @@ static int send_msg(modbus_t *ctx, uint8_t *msg, int msg_length)
 
     if (rc > 0 && rc != msg_length) {
         errno = EMBBADDATA;
-        return -1;
+        rc = -1;
     }
 
+#if MODBUS_CONFIG_TRACE
+    if (ctx->trace != NULL)
+        trace_msg(ctx, MODBUS_TRACE_SEND, msg, msg_length, rc);
+#endif
+#if MODBUS_CONFIG_STATS
+    if (ctx->stats != NULL && rc != -1)
+        ctx->stats->t_sent = _modbus_time_us();
+#endif
+
+    return rc;
+}
+
+/* Sends a request/response */
+static int send_msg(modbus_t *ctx, uint8_t *msg, int msg_length)
+{
+    msg_length = ctx->backend->send_msg_pre(msg, msg_length);
+
+    return send_msg_ready(ctx, msg, msg_length);
+}
+
+/* Sends the reply of a server */
+static int send_reply(modbus_t *ctx, uint8_t *rsp, int rsp_length)
+{
+    int rc;
+
+#if MODBUS_CONFIG_STATS
+    if (ctx->stats != NULL)
+        ctx->stats->t_reply = _modbus_time_us();
+#endif
+
+    rc = send_msg(ctx, rsp, rsp_length);
+
+#if MODBUS_CONFIG_STATS
+    if (ctx->stats != NULL)
+        stats_reply(ctx, rsp, rc);
+#endif
+#if _MODBUS_DIAG
+    diag_lock(ctx);
+    diag_reply(ctx, rsp, rc);
+    diag_unlock(ctx);
+#endif
+
     return rc;
 }
 
@@ -293,7 +653,7 @@ int modbus_send_raw_request(modbus_t *ctx, const uint8_t *raw_req, int raw_req_l
  */
 
 /* Computes the length to read after the function received */
-static uint8_t compute_meta_length_after_function(int function, msg_type_t msg_type)
+uint8_t _modbus_meta_length_after_function(int function, msg_type_t msg_type)
 {
     int length;
 
@@ -303,12 +663,20 @@ static uint8_t compute_meta_length_after_function(int function, msg_type_t msg_t
         } else if (function == MODBUS_FC_WRITE_MULTIPLE_COILS ||
                    function == MODBUS_FC_WRITE_MULTIPLE_REGISTERS) {
             length = 5;
+        } else if (function == MODBUS_FC_DIAGNOSTICS) {
+            /* Sub-function and data */
+            length = 4;
         } else if (function == MODBUS_FC_MASK_WRITE_REGISTER) {
             length = 6;
         } else if (function == MODBUS_FC_WRITE_AND_READ_REGISTERS) {
             length = 9;
+        } else if (function == MODBUS_FC_READ_FILE_RECORD ||
+                   function == MODBUS_FC_WRITE_FILE_RECORD) {
+            /* Byte count */
+            length = 1;
         } else {
-            /* MODBUS_FC_READ_EXCEPTION_STATUS, MODBUS_FC_REPORT_SLAVE_ID */
+            /* MODBUS_FC_READ_EXCEPTION_STATUS, MODBUS_FC_REPORT_SLAVE_ID,
+               MODBUS_FC_GET_COMM_EVENT_COUNTER, MODBUS_FC_GET_COMM_EVENT_LOG */
             length = 0;
         }
     } else {
@@ -318,6 +686,8 @@ static uint8_t compute_meta_length_after_function(int function, msg_type_t msg_t
         case MODBUS_FC_WRITE_SINGLE_REGISTER:
         case MODBUS_FC_WRITE_MULTIPLE_COILS:
         case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+        case MODBUS_FC_DIAGNOSTICS:
+        case MODBUS_FC_GET_COMM_EVENT_COUNTER:
             length = 4;
             break;
         case MODBUS_FC_MASK_WRITE_REGISTER:
@@ -332,8 +702,7 @@ static uint8_t compute_meta_length_after_function(int function, msg_type_t msg_t
 }
 
 /* Computes the length to read after the meta information (address, count, etc) */
-static int
-compute_data_length_after_meta(modbus_t *ctx, uint8_t *msg, msg_type_t msg_type)
+int _modbus_data_length_after_meta(modbus_t *ctx, uint8_t *msg, msg_type_t msg_type)
 {
     int function = msg[ctx->backend->header_length];
     int length;
@@ -347,6 +716,10 @@ compute_data_length_after_meta(modbus_t *ctx, uint8_t *msg, msg_type_t msg_type)
         case MODBUS_FC_WRITE_AND_READ_REGISTERS:
             length = msg[ctx->backend->header_length + 9];
             break;
+        case MODBUS_FC_READ_FILE_RECORD:
+        case MODBUS_FC_WRITE_FILE_RECORD:
+            length = msg[ctx->backend->header_length + 1];
+            break;
         default:
             length = 0;
         }
@@ -354,7 +727,10 @@ compute_data_length_after_meta(modbus_t *ctx, uint8_t *msg, msg_type_t msg_type)
         /* MSG_CONFIRMATION */
         if (function <= MODBUS_FC_READ_INPUT_REGISTERS ||
             function == MODBUS_FC_REPORT_SLAVE_ID ||
-            function == MODBUS_FC_WRITE_AND_READ_REGISTERS) {
+            function == MODBUS_FC_GET_COMM_EVENT_LOG ||
+            function == MODBUS_FC_WRITE_AND_READ_REGISTERS ||
+            function == MODBUS_FC_READ_FILE_RECORD ||
+            function == MODBUS_FC_WRITE_FILE_RECORD) {
             length = msg[ctx->backend->header_length + 1];
         } else {
             length = 0;
@@ -377,8 +753,7 @@ compute_data_length_after_meta(modbus_t *ctx, uint8_t *msg, msg_type_t msg_type)
    - ETIMEDOUT
    - read() or recv() error codes
 */
-
-int _modbus_receive_msg(modbus_t *ctx, uint8_t *msg, msg_type_t msg_type)
+static int receive_msg(modbus_t *ctx, uint8_t *msg, msg_type_t msg_type)
 {
     int rc;
     fd_set rset;
@@ -391,7 +766,7 @@ int _modbus_receive_msg(modbus_t *ctx, uint8_t *msg, msg_type_t msg_type)
     int wsa_err;
 #endif
 
-    if (ctx->debug) {
+    if (_MODBUS_DEBUG(ctx)) {
         if (msg_type == MSG_INDICATION) {
             printf("Waiting for an indication...\n");
         } else {
@@ -400,7 +775,7 @@ int _modbus_receive_msg(modbus_t *ctx, uint8_t *msg, msg_type_t msg_type)
     }
 
     if (!ctx->backend->is_connected(ctx)) {
-        if (ctx->debug) {
+        if (_MODBUS_ERROR(ctx)) {
             fprintf(stderr, "ERROR The connection is not established.\n");
         }
         return -1;
@@ -436,7 +811,7 @@ int _modbus_receive_msg(modbus_t *ctx, uint8_t *msg, msg_type_t msg_type)
     }
 
     while (length_to_read != 0) {
-        if (ctx->debug) {
+        if (_MODBUS_DEBUG(ctx)) {
 #ifndef PICO_W
             printf("_modbus_receive_msg(modbus,c): l:%u, sec:%ld usec:%ld\n",
                length_to_read, tv.tv_sec, tv.tv_usec);
@@ -445,7 +820,11 @@ int _modbus_receive_msg(modbus_t *ctx, uint8_t *msg, msg_type_t msg_type)
                    length_to_read, tv.tv_sec, tv.tv_usec);
 #endif
         }
-        rc = ctx->backend->select(ctx, &rset, p_tv, length_to_read);
+        /* The bytes read ahead are there already */
+        if (modbus_get_read_ahead_length(ctx) > 0)
+            rc = 1;
+        else
+            rc = ctx->backend->select(ctx, &rset, p_tv, length_to_read);
         if (rc == -1) {
             _error_print(ctx, "select");
             if (ctx->error_recovery & MODBUS_ERROR_RECOVERY_LINK) {
@@ -462,7 +841,7 @@ int _modbus_receive_msg(modbus_t *ctx, uint8_t *msg, msg_type_t msg_type)
 
                 if (errno == ETIMEDOUT) {
 //                     printf("TEST _modbus_receive_msg flush\n");
-                    _sleep_response_timeout(ctx);
+                    _modbus_sleep_response_timeout(ctx);
                     modbus_flush(ctx);
                 } else if (errno == EBADF) {
 //                     printf("TEST _modbus_receive_msg connect\n");
@@ -512,12 +891,17 @@ int _modbus_receive_msg(modbus_t *ctx, uint8_t *msg, msg_type_t msg_type)
         }
 
         /* Display the hex code of each character received */
-        if (ctx->debug) {
+        if (_MODBUS_DEBUG(ctx)) {
             int i;
             for (i = 0; i < rc; i++)
                 printf("<%.2X>", msg[msg_length + i]);
         }
 
+#if MODBUS_CONFIG_STATS
+        if (msg_length == 0 && ctx->stats != NULL)
+            ctx->stats->t_start = _modbus_time_us();
+#endif
+
         /* Sums bytes received */
         msg_length += rc;
         /* Computes remaining bytes */
@@ -527,14 +911,14 @@ int _modbus_receive_msg(modbus_t *ctx, uint8_t *msg, msg_type_t msg_type)
             switch (step) {
             case _STEP_FUNCTION:
                 /* Function code position */
-                length_to_read = compute_meta_length_after_function(
+                length_to_read = _modbus_meta_length_after_function(
                     msg[ctx->backend->header_length], msg_type);
                 if (length_to_read != 0) {
                     step = _STEP_META;
                     break;
                 } /* else switches straight to the next step */
             case _STEP_META:
-                length_to_read = compute_data_length_after_meta(ctx, msg, msg_type);
+                length_to_read = _modbus_data_length_after_meta(ctx, msg, msg_type);
                 if ((msg_length + length_to_read) > ctx->backend->max_adu_length) {
                     errno = EMBBADDATA;
                     _error_print(ctx, "too many data");
@@ -561,12 +945,44 @@ int _modbus_receive_msg(modbus_t *ctx, uint8_t *msg, msg_type_t msg_type)
            expiration of response timeout (for CONFIRMATION only) */
     }
 
-    if (ctx->debug)
+    if (_MODBUS_DEBUG(ctx))
         printf("\n");
 
     return ctx->backend->check_integrity(ctx, msg, msg_length);
 }
 
+int _modbus_receive_msg(modbus_t *ctx, uint8_t *msg, msg_type_t msg_type)
+{
+    int rc = ctx->backend->receive_msg != NULL
+                 ? ctx->backend->receive_msg(ctx, msg, msg_type)
+                 : receive_msg(ctx, msg, msg_type);
+
+    _modbus_received_msg(ctx, msg, msg_type, rc);
+
+    return rc;
+}
+
+/* Records a message received, by receive_msg() or by the server engine which
+   reads its requests itself (see modbus-server.c), rc is the length or -1 */
+void _modbus_received_msg(modbus_t *ctx, const uint8_t *msg, msg_type_t msg_type, int rc)
+{
+#if MODBUS_CONFIG_TRACE
+    if (ctx->trace != NULL)
+        trace_msg(ctx, MODBUS_TRACE_RECEIVE, msg, rc > 0 ? rc : 0, rc);
+#endif
+#if MODBUS_CONFIG_STATS
+    if (ctx->stats != NULL)
+        stats_receive(ctx, msg, msg_type, rc);
+#endif
+#if _MODBUS_DIAG
+    if (msg_type == MSG_INDICATION) {
+        diag_lock(ctx);
+        diag_receive(ctx, msg, rc);
+        diag_unlock(ctx);
+    }
+#endif
+}
+
 /* Receive the request from a modbus master */
 int modbus_receive(modbus_t *ctx, uint8_t *req)
 {
@@ -607,7 +1023,7 @@ static int check_confirmation(modbus_t *ctx, uint8_t *req, uint8_t *rsp, int rsp
         rc = ctx->backend->pre_check_confirmation(ctx, req, rsp, rsp_length);
         if (rc == -1) {
             if (ctx->error_recovery & MODBUS_ERROR_RECOVERY_PROTOCOL) {
-                _sleep_response_timeout(ctx);
+                _modbus_sleep_response_timeout(ctx);
                 modbus_flush(ctx);
             }
             return -1;
@@ -648,7 +1064,7 @@ static int check_confirmation(modbus_t *ctx, uint8_t *req, uint8_t *rsp, int rsp
 
         /* Check function code */
         if (function != req[offset]) {
-            if (ctx->debug) {
+            if (_MODBUS_ERROR(ctx)) {
                 fprintf(
                     stderr,
                     "Received function not corresponding to the request (0x%X != 0x%X)\n",
@@ -656,7 +1072,7 @@ static int check_confirmation(modbus_t *ctx, uint8_t *req, uint8_t *rsp, int rsp
                     req[offset]);
             }
             if (ctx->error_recovery & MODBUS_ERROR_RECOVERY_PROTOCOL) {
-                _sleep_response_timeout(ctx);
+                _modbus_sleep_response_timeout(ctx);
                 modbus_flush(ctx);
             }
             errno = EMBBADDATA;
@@ -696,6 +1112,42 @@ static int check_confirmation(modbus_t *ctx, uint8_t *req, uint8_t *rsp, int rsp
             /* Report slave ID (bytes received) */
             req_nb_value = rsp_nb_value = rsp[offset + 1];
             break;
+        case MODBUS_FC_DIAGNOSTICS:
+            /* Echo of the sub-function, and of the data of the query */
+            if ((req[offset + 1] != rsp[offset + 1]) ||
+                (req[offset + 2] != rsp[offset + 2])) {
+                resp_addr_ok = FALSE;
+            }
+            if (((req[offset + 1] << 8) | req[offset + 2]) ==
+                    MODBUS_DIAG_RETURN_QUERY_DATA &&
+                ((req[offset + 3] != rsp[offset + 3]) ||
+                 (req[offset + 4] != rsp[offset + 4]))) {
+                resp_data_ok = FALSE;
+            }
+            req_nb_value = rsp_nb_value = 1;
+            break;
+        case MODBUS_FC_GET_COMM_EVENT_LOG:
+            /* Status, event count, message count and the events (bytes) */
+            req_nb_value = rsp_nb_value = rsp[offset + 1];
+            if (rsp_nb_value < 6 || rsp_nb_value > 6 + MODBUS_MAX_COMM_EVENTS) {
+                resp_data_ok = FALSE;
+            }
+            break;
+        case MODBUS_FC_READ_FILE_RECORD:
+            /* Response data length (bytes) */
+            req_nb_value =
+                rsp_length_computed - offset - 2 - ctx->backend->checksum_length;
+            rsp_nb_value = rsp[offset + 1];
+            break;
+        case MODBUS_FC_WRITE_FILE_RECORD:
+            /* The response is an echo of the request */
+            req_nb_value = req[offset + 1];
+            rsp_nb_value = rsp[offset + 1];
+            if (req_nb_value == rsp_nb_value &&
+                memcmp(req + offset + 2, rsp + offset + 2, req_nb_value) != 0) {
+                resp_data_ok = FALSE;
+            }
+            break;
         case MODBUS_FC_WRITE_SINGLE_COIL:
         case MODBUS_FC_WRITE_SINGLE_REGISTER:
             /* address in request and response must be equal */
@@ -721,7 +1173,7 @@ static int check_confirmation(modbus_t *ctx, uint8_t *req, uint8_t *rsp, int rsp
             (resp_data_ok == TRUE)) {
             rc = rsp_nb_value;
         } else {
-            if (ctx->debug) {
+            if (_MODBUS_ERROR(ctx)) {
                 fprintf(stderr,
                         "Received data not corresponding to the request (%d != %d)\n",
                         rsp_nb_value,
@@ -729,7 +1181,7 @@ static int check_confirmation(modbus_t *ctx, uint8_t *req, uint8_t *rsp, int rsp
             }
 
             if (ctx->error_recovery & MODBUS_ERROR_RECOVERY_PROTOCOL) {
-                _sleep_response_timeout(ctx);
+                _modbus_sleep_response_timeout(ctx);
                 modbus_flush(ctx);
             }
 
@@ -737,7 +1189,7 @@ static int check_confirmation(modbus_t *ctx, uint8_t *req, uint8_t *rsp, int rsp
             rc = -1;
         }
     } else {
-        if (ctx->debug) {
+        if (_MODBUS_ERROR(ctx)) {
             fprintf(
                 stderr,
                 "Message length not corresponding to the computed length (%d != %d)\n",
@@ -745,7 +1197,7 @@ static int check_confirmation(modbus_t *ctx, uint8_t *req, uint8_t *rsp, int rsp
                 rsp_length_computed);
         }
         if (ctx->error_recovery & MODBUS_ERROR_RECOVERY_PROTOCOL) {
-            _sleep_response_timeout(ctx);
+            _modbus_sleep_response_timeout(ctx);
             modbus_flush(ctx);
         }
         errno = EMBBADDATA;
@@ -755,6 +1207,7 @@ static int check_confirmation(modbus_t *ctx, uint8_t *req, uint8_t *rsp, int rsp
     return rc;
 }
 
+#if MODBUS_CONFIG_FC_READ_COILS || MODBUS_CONFIG_FC_READ_DISCRETE_INPUTS
 static int
 response_io_status(uint8_t *tab_io_status, int address, int nb, uint8_t *rsp, int offset)
 {
@@ -779,8 +1232,32 @@ response_io_status(uint8_t *tab_io_status, int address, int nb, uint8_t *rsp, in
 
     return offset;
 }
+#endif
 
 /* Build the exception response */
+static int build_exception(modbus_t *ctx,
+                           sft_t *sft,
+                           int exception_code,
+                           uint8_t *rsp,
+                           unsigned int to_flush)
+{
+    int rsp_length;
+
+    /* Flush if required */
+    if (to_flush) {
+        _modbus_sleep_response_timeout(ctx);
+        modbus_flush(ctx);
+    }
+
+    /* Build exception response */
+    sft->function = sft->function + 0x80;
+    rsp_length = ctx->backend->build_response_basis(sft, rsp);
+    rsp[rsp_length++] = exception_code;
+
+    return rsp_length;
+}
+
+#if MODBUS_CONFIG_LOG_LEVEL >= MODBUS_LOG_DEBUG
 static int response_exception(modbus_t *ctx,
                               sft_t *sft,
                               int exception_code,
@@ -789,8 +1266,6 @@ static int response_exception(modbus_t *ctx,
                               const char *template,
                               ...)
 {
-    int rsp_length;
-
      /* Print debug message */
     if (ctx->debug && FALSE) {
         va_list ap;
@@ -800,39 +1275,390 @@ static int response_exception(modbus_t *ctx,
         va_end(ap);
     }
 
-    /* Flush if required */
-    if (to_flush) {
-        _sleep_response_timeout(ctx);
-        modbus_flush(ctx);
+    return build_exception(ctx, sft, exception_code, rsp, to_flush);
+}
+#else
+/* The messages and their arguments are not compiled */
+#define response_exception(ctx, sft, exception_code, rsp, to_flush, ...)              \
+    build_exception(ctx, sft, exception_code, rsp, to_flush)
+#endif
+
+#if MODBUS_CONFIG_FC_DIAGNOSTICS
+/* Build the response to a diagnostics request, 0 when there is no response
+   (listen only mode) */
+static int
+response_diagnostics(modbus_t *ctx, sft_t *sft, const uint8_t *req, uint8_t *rsp)
+{
+    const int offset = ctx->backend->header_length;
+    const int sub_function = (req[offset + 1] << 8) | req[offset + 2];
+    const uint16_t data = (req[offset + 3] << 8) | req[offset + 4];
+    modbus_diag_t *diag = ctx->diag;
+    uint16_t value = data;
+    int rsp_length;
+
+    switch (sub_function) {
+    case MODBUS_DIAG_RETURN_QUERY_DATA:
+        break;
+    case MODBUS_DIAG_RESTART_COMMUNICATIONS: {
+        const int listen_only = diag->listen_only;
+
+        if (data != 0x0000 && data != 0xFF00) {
+            return response_exception(ctx,
+                                      sft,
+                                      MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE,
+                                      rsp,
+                                      FALSE,
+                                      "Illegal data of restart communications 0x%0X\n",
+                                      data);
+        }
+        memset(&diag->counters, 0, sizeof(diag->counters));
+        diag->listen_only = FALSE;
+        if (data == 0xFF00) {
+            /* Clears the log too */
+            diag->head = 0;
+            diag->nb_events = 0;
+        }
+        diag_event(ctx, MODBUS_EVENT_COMM_RESTART);
+        if (listen_only)
+            return 0;
+    } break;
+    case MODBUS_DIAG_RETURN_DIAGNOSTIC_REGISTER:
+        /* No diagnostic bit is defined */
+        value = 0;
+        break;
+    case MODBUS_DIAG_FORCE_LISTEN_ONLY:
+        diag->listen_only = TRUE;
+        diag_event(ctx, MODBUS_EVENT_LISTEN_ONLY);
+        return 0;
+    case MODBUS_DIAG_CLEAR_COUNTERS:
+        memset(&diag->counters, 0, sizeof(diag->counters));
+        break;
+    case MODBUS_DIAG_BUS_MESSAGE_COUNT:
+        value = diag->counters.bus_messages;
+        break;
+    case MODBUS_DIAG_BUS_COMM_ERROR_COUNT:
+        value = diag->counters.bus_comm_errors;
+        break;
+    case MODBUS_DIAG_BUS_EXCEPTION_COUNT:
+        value = diag->counters.bus_exceptions;
+        break;
+    case MODBUS_DIAG_SERVER_MESSAGE_COUNT:
+        value = diag->counters.server_messages;
+        break;
+    case MODBUS_DIAG_SERVER_NO_RESPONSE_COUNT:
+        value = diag->counters.server_no_responses;
+        break;
+    case MODBUS_DIAG_SERVER_NAK_COUNT:
+        value = diag->counters.server_naks;
+        break;
+    case MODBUS_DIAG_SERVER_BUSY_COUNT:
+        value = diag->counters.server_busy;
+        break;
+    case MODBUS_DIAG_BUS_OVERRUN_COUNT:
+        value = diag->counters.bus_overruns;
+        break;
+    case MODBUS_DIAG_CLEAR_OVERRUN:
+        diag->counters.bus_overruns = 0;
+        break;
+    default:
+        return response_exception(ctx,
+                                  sft,
+                                  MODBUS_EXCEPTION_ILLEGAL_FUNCTION,
+                                  rsp,
+                                  FALSE,
+                                  "Unknown diagnostics sub-function 0x%0X\n",
+                                  sub_function);
     }
 
-    /* Build exception response */
-    sft->function = sft->function + 0x80;
     rsp_length = ctx->backend->build_response_basis(sft, rsp);
-    rsp[rsp_length++] = exception_code;
+    rsp[rsp_length++] = sub_function >> 8;
+    rsp[rsp_length++] = sub_function & 0xFF;
+    rsp[rsp_length++] = value >> 8;
+    rsp[rsp_length++] = value & 0xFF;
 
     return rsp_length;
 }
+#endif
 
-/* Send a response to the received request.
-   Analyses the request and constructs a response.
-
-   If an error occurs, this function construct the response
-   accordingly.
-*/
-int modbus_reply(modbus_t *ctx,
-                 const uint8_t *req,
-                 int req_length,
-                 modbus_mapping_t *mb_mapping)
+#if MODBUS_CONFIG_FC_GET_COMM_EVENT_LOG
+/* Build the response to a get comm event log request, the most recent event
+   first */
+static int response_comm_event_log(modbus_t *ctx, sft_t *sft, uint8_t *rsp)
 {
-    unsigned int offset;
-    int slave;
-    int function;
-    uint16_t address;
-    uint8_t rsp[MAX_MESSAGE_LENGTH];
-    int rsp_length = 0;
-    sft_t sft;
-
+    const modbus_diag_t *diag = ctx->diag;
+    int rsp_length;
+    int i;
+
+    rsp_length = ctx->backend->build_response_basis(sft, rsp);
+    rsp[rsp_length++] = 6 + diag->nb_events;
+    /* Not busy */
+    rsp[rsp_length++] = 0;
+    rsp[rsp_length++] = 0;
+    rsp[rsp_length++] = diag->counters.comm_events >> 8;
+    rsp[rsp_length++] = diag->counters.comm_events & 0xFF;
+    rsp[rsp_length++] = diag->counters.bus_messages >> 8;
+    rsp[rsp_length++] = diag->counters.bus_messages & 0xFF;
+    for (i = 1; i <= diag->nb_events; i++) {
+        rsp[rsp_length++] =
+            diag->events[(diag->head + MODBUS_MAX_COMM_EVENTS - i) % MODBUS_MAX_COMM_EVENTS];
+    }
+
+    return rsp_length;
+}
+#endif
+
+#if MODBUS_CONFIG_FC_READ_FILE_RECORD || MODBUS_CONFIG_FC_WRITE_FILE_RECORD
+/* Exception code to send back when a file storage callback fails */
+static int file_storage_exception(int rc)
+{
+    if (rc <= 0 || rc >= MODBUS_EXCEPTION_MAX)
+        return MODBUS_EXCEPTION_SLAVE_OR_SERVER_FAILURE;
+    return rc;
+}
+#endif
+
+#if MODBUS_CONFIG_FC_READ_FILE_RECORD
+/* Build the response to a read file record request */
+static int response_read_file_record(
+    modbus_t *ctx, sft_t *sft, const uint8_t *req, int req_length, uint8_t *rsp)
+{
+    const int offset = ctx->backend->header_length;
+    const modbus_file_storage_t *storage = ctx->file_storage;
+    int byte_count = req[offset + 1];
+    int nb_records = byte_count / 7;
+    /* Function code + response data length */
+    int rsp_pdu_length = 2;
+    int rsp_length;
+    int byte_count_pos;
+    int i;
+
+    if (storage == NULL || storage->read == NULL) {
+        return response_exception(ctx,
+                                  sft,
+                                  MODBUS_EXCEPTION_ILLEGAL_FUNCTION,
+                                  rsp,
+                                  TRUE,
+                                  "No file storage for read_file_record\n");
+    }
+
+    if (byte_count < 7 || byte_count > MODBUS_MAX_READ_FILE_REQUEST_LENGTH ||
+        (byte_count % 7) != 0 || offset + 2 + byte_count > req_length) {
+        return response_exception(ctx,
+                                  sft,
+                                  MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE,
+                                  rsp,
+                                  TRUE,
+                                  "Illegal byte count %d in read_file_record\n",
+                                  byte_count);
+    }
+
+    /* Validate all sub-requests before touching the storage */
+    for (i = 0; i < nb_records; i++) {
+        const uint8_t *sub = req + offset + 2 + 7 * i;
+        int file_number = (sub[1] << 8) + sub[2];
+        int record_number = (sub[3] << 8) + sub[4];
+        int record_length = (sub[5] << 8) + sub[6];
+
+        rsp_pdu_length += 2 + 2 * record_length;
+        if (sub[0] != MODBUS_FILE_REFERENCE_TYPE || record_length < 1 ||
+            rsp_pdu_length > MODBUS_MAX_PDU_LENGTH) {
+            return response_exception(
+                ctx,
+                sft,
+                MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE,
+                rsp,
+                TRUE,
+                "Illegal sub-request %d (type %d, length %d) in read_file_record\n",
+                i,
+                sub[0],
+                record_length);
+        }
+        if (file_number == 0 ||
+            record_number + record_length - 1 > MODBUS_MAX_FILE_RECORD_NUMBER) {
+            return response_exception(
+                ctx,
+                sft,
+                MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS,
+                rsp,
+                FALSE,
+                "Illegal file %d record 0x%0X in read_file_record\n",
+                file_number,
+                record_number);
+        }
+    }
+
+    rsp_length = ctx->backend->build_response_basis(sft, rsp);
+    /* Skip response data length for now */
+    byte_count_pos = rsp_length++;
+
+    for (i = 0; i < nb_records; i++) {
+        const uint8_t *sub = req + offset + 2 + 7 * i;
+        uint16_t record_length = (sub[5] << 8) + sub[6];
+        uint16_t values[MODBUS_MAX_PDU_LENGTH / 2];
+        int rc;
+        int j;
+
+        rc = storage->read(storage->user_data,
+                           (sub[1] << 8) + sub[2],
+                           (sub[3] << 8) + sub[4],
+                           record_length,
+                           values);
+        if (rc != 0) {
+            return response_exception(ctx,
+                                      sft,
+                                      file_storage_exception(rc),
+                                      rsp,
+                                      FALSE,
+                                      "File storage error %d in read_file_record\n",
+                                      rc);
+        }
+
+        rsp[rsp_length++] = 1 + 2 * record_length;
+        rsp[rsp_length++] = MODBUS_FILE_REFERENCE_TYPE;
+        for (j = 0; j < record_length; j++) {
+            rsp[rsp_length++] = values[j] >> 8;
+            rsp[rsp_length++] = values[j] & 0xFF;
+        }
+    }
+    rsp[byte_count_pos] = rsp_length - byte_count_pos - 1;
+
+    return rsp_length;
+}
+#endif
+
+#if MODBUS_CONFIG_FC_WRITE_FILE_RECORD
+/* Build the response to a write file record request */
+static int response_write_file_record(
+    modbus_t *ctx, sft_t *sft, const uint8_t *req, int req_length, uint8_t *rsp)
+{
+    const int offset = ctx->backend->header_length;
+    const modbus_file_storage_t *storage = ctx->file_storage;
+    int byte_count = req[offset + 1];
+    int end = offset + 2 + byte_count;
+    int pos;
+
+    if (storage == NULL || storage->write == NULL) {
+        return response_exception(ctx,
+                                  sft,
+                                  MODBUS_EXCEPTION_ILLEGAL_FUNCTION,
+                                  rsp,
+                                  TRUE,
+                                  "No file storage for write_file_record\n");
+    }
+
+    if (byte_count < 9 || byte_count > MODBUS_MAX_WRITE_FILE_REQUEST_LENGTH ||
+        end > req_length) {
+        return response_exception(ctx,
+                                  sft,
+                                  MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE,
+                                  rsp,
+                                  TRUE,
+                                  "Illegal byte count %d in write_file_record\n",
+                                  byte_count);
+    }
+
+    /* Validate all sub-requests before touching the storage */
+    for (pos = offset + 2; pos < end;) {
+        const uint8_t *sub = req + pos;
+        int file_number;
+        int record_number;
+        int record_length;
+
+        if (pos + 7 > end) {
+            record_length = 0;
+        } else {
+            record_length = (sub[5] << 8) + sub[6];
+        }
+        if (record_length < 1 || sub[0] != MODBUS_FILE_REFERENCE_TYPE ||
+            pos + 7 + 2 * record_length > end) {
+            return response_exception(
+                ctx,
+                sft,
+                MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE,
+                rsp,
+                TRUE,
+                "Illegal sub-request at byte %d in write_file_record\n",
+                pos - offset);
+        }
+
+        file_number = (sub[1] << 8) + sub[2];
+        record_number = (sub[3] << 8) + sub[4];
+        if (file_number == 0 ||
+            record_number + record_length - 1 > MODBUS_MAX_FILE_RECORD_NUMBER) {
+            return response_exception(
+                ctx,
+                sft,
+                MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS,
+                rsp,
+                FALSE,
+                "Illegal file %d record 0x%0X in write_file_record\n",
+                file_number,
+                record_number);
+        }
+        pos += 7 + 2 * record_length;
+    }
+
+    for (pos = offset + 2; pos < end;) {
+        const uint8_t *sub = req + pos;
+        uint16_t record_length = (sub[5] << 8) + sub[6];
+        uint16_t values[MODBUS_MAX_PDU_LENGTH / 2];
+        int rc;
+        int j;
+
+        for (j = 0; j < record_length; j++) {
+            values[j] = (sub[7 + 2 * j] << 8) + sub[8 + 2 * j];
+        }
+
+        rc = storage->write(storage->user_data,
+                            (sub[1] << 8) + sub[2],
+                            (sub[3] << 8) + sub[4],
+                            record_length,
+                            values);
+        if (rc != 0) {
+            return response_exception(ctx,
+                                      sft,
+                                      file_storage_exception(rc),
+                                      rsp,
+                                      FALSE,
+                                      "File storage error %d in write_file_record\n",
+                                      rc);
+        }
+        pos += 7 + 2 * record_length;
+    }
+
+    /* The response is an echo of the request */
+    memcpy(rsp, req, req_length);
+
+    return req_length;
+}
+#endif
+
+/* Send a response to the received request.
+   Analyses the request and constructs a response.
+
+   If an error occurs, this function construct the response
+   accordingly.
+*/
+int modbus_reply(modbus_t *ctx,
+                 const uint8_t *req,
+                 int req_length,
+                 modbus_mapping_t *mb_mapping)
+{
+    unsigned int offset;
+    int slave;
+    int function;
+    uint16_t address;
+    uint8_t rsp[MAX_MESSAGE_LENGTH];
+    int rsp_length = 0;
+    sft_t sft;
+#ifndef PICO_W
+    int mapping_write;
+    uint32_t seq = 0;
+#endif
+#if MODBUS_CONFIG_FC_DIAGNOSTICS
+    int listen_only;
+#endif
+
     if (ctx == NULL) {
         errno = EINVAL;
         return -1;
@@ -844,22 +1670,50 @@ int modbus_reply(modbus_t *ctx,
     address = (req[offset + 1] << 8) + req[offset + 2];
 
     sft.slave = slave;
-    sft.function = function;
     sft.t_id = ctx->backend->prepare_response_tid(req, &req_length);
 
+#if MODBUS_CONFIG_FC_DIAGNOSTICS
+    /* Only a restart of the communications leaves the listen only mode */
+    diag_lock(ctx);
+    listen_only = ctx->diag->listen_only &&
+                  !(function == MODBUS_FC_DIAGNOSTICS &&
+                    address == MODBUS_DIAG_RESTART_COMMUNICATIONS);
+    if (listen_only)
+        ctx->diag->counters.server_no_responses++;
+    diag_unlock(ctx);
+    if (listen_only)
+        return 0;
+#endif
+
 #ifdef PICO_W
     ctx->backend->mapping_lock(ctx);
+#else
+    /* Only the read functions run without excluding the others */
+    mapping_write = function != MODBUS_FC_READ_COILS &&
+                    function != MODBUS_FC_READ_DISCRETE_INPUTS &&
+                    function != MODBUS_FC_READ_HOLDING_REGISTERS &&
+                    function != MODBUS_FC_READ_INPUT_REGISTERS;
+retry:
+    if (ctx->backend->mapping_begin != NULL)
+        seq = ctx->backend->mapping_begin(ctx, mapping_write);
 #endif
+    /* Set again for a read run again, an exception changes it */
+    sft.function = function;
 
     /* Data are flushed on illegal number of values errors. */
     switch (function) {
+#if MODBUS_CONFIG_FC_READ_COILS || MODBUS_CONFIG_FC_READ_DISCRETE_INPUTS
+#if MODBUS_CONFIG_FC_READ_COILS
     case MODBUS_FC_READ_COILS:
-    case MODBUS_FC_READ_DISCRETE_INPUTS: {
+#endif
+#if MODBUS_CONFIG_FC_READ_DISCRETE_INPUTS
+    case MODBUS_FC_READ_DISCRETE_INPUTS:
+#endif
+    {
         unsigned int is_input = (function == MODBUS_FC_READ_DISCRETE_INPUTS);
         int start_bits = is_input ? mb_mapping->start_input_bits : mb_mapping->start_bits;
         int nb_bits = is_input ? mb_mapping->nb_input_bits : mb_mapping->nb_bits;
         uint8_t *tab_bits = is_input ? mb_mapping->tab_input_bits : mb_mapping->tab_bits;
-        const char *const name = is_input ? "read_input_bits" : "read_bits";
         int nb = (req[offset + 3] << 8) + req[offset + 4];
         /* The mapping can be shifted to reduce memory consumption and it
            doesn't always start at address zero. */
@@ -873,7 +1727,7 @@ int modbus_reply(modbus_t *ctx,
                                             TRUE,
                                             "Illegal nb of values %d in %s (max %d)\n",
                                             nb,
-                                            name,
+                                            is_input ? "read_input_bits" : "read_bits",
                                             MODBUS_MAX_READ_BITS);
         } else if (mapping_address < 0 || (mapping_address + nb) > nb_bits) {
             rsp_length = response_exception(ctx,
@@ -883,7 +1737,7 @@ int modbus_reply(modbus_t *ctx,
                                             FALSE,
                                             "Illegal data address 0x%0X in %s\n",
                                             mapping_address < 0 ? address : address + nb,
-                                            name);
+                                            is_input ? "read_input_bits" : "read_bits");
         } else {
             rsp_length = ctx->backend->build_response_basis(&sft, rsp);
             rsp[rsp_length++] = (nb / 8) + ((nb % 8) ? 1 : 0);
@@ -891,8 +1745,15 @@ int modbus_reply(modbus_t *ctx,
                 response_io_status(tab_bits, mapping_address, nb, rsp, rsp_length);
         }
     } break;
+#endif
+#if MODBUS_CONFIG_FC_READ_HOLDING_REGISTERS || MODBUS_CONFIG_FC_READ_INPUT_REGISTERS
+#if MODBUS_CONFIG_FC_READ_HOLDING_REGISTERS
     case MODBUS_FC_READ_HOLDING_REGISTERS:
-    case MODBUS_FC_READ_INPUT_REGISTERS: {
+#endif
+#if MODBUS_CONFIG_FC_READ_INPUT_REGISTERS
+    case MODBUS_FC_READ_INPUT_REGISTERS:
+#endif
+    {
         unsigned int is_input = (function == MODBUS_FC_READ_INPUT_REGISTERS);
         int start_registers =
             is_input ? mb_mapping->start_input_registers : mb_mapping->start_registers;
@@ -900,7 +1761,6 @@ int modbus_reply(modbus_t *ctx,
             is_input ? mb_mapping->nb_input_registers : mb_mapping->nb_registers;
         uint16_t *tab_registers =
             is_input ? mb_mapping->tab_input_registers : mb_mapping->tab_registers;
-        const char *const name = is_input ? "read_input_registers" : "read_registers";
         int nb = (req[offset + 3] << 8) + req[offset + 4];
         /* The mapping can be shifted to reduce memory consumption and it
            doesn't always start at address zero. */
@@ -914,7 +1774,8 @@ int modbus_reply(modbus_t *ctx,
                                             TRUE,
                                             "Illegal nb of values %d in %s (max %d)\n",
                                             nb,
-                                            name,
+                                            is_input ? "read_input_registers"
+                                                     : "read_registers",
                                             MODBUS_MAX_READ_REGISTERS);
         } else if (mapping_address < 0 || (mapping_address + nb) > nb_registers) {
             rsp_length = response_exception(ctx,
@@ -924,7 +1785,8 @@ int modbus_reply(modbus_t *ctx,
                                             FALSE,
                                             "Illegal data address 0x%0X in %s\n",
                                             mapping_address < 0 ? address : address + nb,
-                                            name);
+                                            is_input ? "read_input_registers"
+                                                     : "read_registers");
         } else {
             int i;
 
@@ -936,6 +1798,8 @@ int modbus_reply(modbus_t *ctx,
             }
         }
     } break;
+#endif
+#if MODBUS_CONFIG_FC_WRITE_SINGLE_COIL
     case MODBUS_FC_WRITE_SINGLE_COIL: {
         int mapping_address = address - mb_mapping->start_bits;
 
@@ -967,6 +1831,8 @@ int modbus_reply(modbus_t *ctx,
             }
         }
     } break;
+#endif
+#if MODBUS_CONFIG_FC_WRITE_SINGLE_REGISTER
     case MODBUS_FC_WRITE_SINGLE_REGISTER: {
         int mapping_address = address - mb_mapping->start_registers;
 
@@ -987,6 +1853,8 @@ int modbus_reply(modbus_t *ctx,
             rsp_length = req_length;
         }
     } break;
+#endif
+#if MODBUS_CONFIG_FC_WRITE_MULTIPLE_COILS
     case MODBUS_FC_WRITE_MULTIPLE_COILS: {
         int nb = (req[offset + 3] << 8) + req[offset + 4];
         int nb_bits = req[offset + 5];
@@ -1024,6 +1892,8 @@ int modbus_reply(modbus_t *ctx,
             rsp_length += 4;
         }
     } break;
+#endif
+#if MODBUS_CONFIG_FC_WRITE_MULTIPLE_REGISTERS
     case MODBUS_FC_WRITE_MULTIPLE_REGISTERS: {
         int nb = (req[offset + 3] << 8) + req[offset + 4];
         int nb_bytes = req[offset + 5];
@@ -1063,6 +1933,8 @@ int modbus_reply(modbus_t *ctx,
             rsp_length += 4;
         }
     } break;
+#endif
+#if MODBUS_CONFIG_FC_REPORT_SLAVE_ID
     case MODBUS_FC_REPORT_SLAVE_ID: {
         int str_len;
         int byte_count_pos;
@@ -1079,16 +1951,21 @@ int modbus_reply(modbus_t *ctx,
         rsp_length += str_len;
         rsp[byte_count_pos] = rsp_length - byte_count_pos - 1;
     } break;
+#endif
     case MODBUS_FC_READ_EXCEPTION_STATUS:
 #ifdef PICO_W
         ctx->backend->mapping_unlock(ctx);
+#else
+        if (ctx->backend->mapping_end != NULL)
+            ctx->backend->mapping_end(ctx, mapping_write, seq);
 #endif
-        if (ctx->debug) {
+        if (_MODBUS_ERROR(ctx)) {
             fprintf(stderr, "FIXME Not implemented\n");
         }
         errno = ENOPROTOOPT;
         return -1;
         break;
+#if MODBUS_CONFIG_FC_MASK_WRITE_REGISTER
     case MODBUS_FC_MASK_WRITE_REGISTER: {
         int mapping_address = address - mb_mapping->start_registers;
 
@@ -1112,6 +1989,8 @@ int modbus_reply(modbus_t *ctx,
             rsp_length = req_length;
         }
     } break;
+#endif
+#if MODBUS_CONFIG_FC_WRITE_AND_READ_REGISTERS
     case MODBUS_FC_WRITE_AND_READ_REGISTERS: {
         int nb = (req[offset + 3] << 8) + req[offset + 4];
         uint16_t address_write = (req[offset + 5] << 8) + req[offset + 6];
@@ -1168,6 +2047,44 @@ int modbus_reply(modbus_t *ctx,
             }
         }
     } break;
+#endif
+
+#if MODBUS_CONFIG_FC_READ_FILE_RECORD
+    case MODBUS_FC_READ_FILE_RECORD:
+        rsp_length = response_read_file_record(ctx, &sft, req, req_length, rsp);
+        break;
+#endif
+#if MODBUS_CONFIG_FC_WRITE_FILE_RECORD
+    case MODBUS_FC_WRITE_FILE_RECORD:
+        rsp_length = response_write_file_record(ctx, &sft, req, req_length, rsp);
+        break;
+#endif
+#if MODBUS_CONFIG_FC_DIAGNOSTICS
+    case MODBUS_FC_DIAGNOSTICS:
+        diag_lock(ctx);
+        rsp_length = response_diagnostics(ctx, &sft, req, rsp);
+        diag_unlock(ctx);
+        break;
+#endif
+#if MODBUS_CONFIG_FC_GET_COMM_EVENT_COUNTER
+    case MODBUS_FC_GET_COMM_EVENT_COUNTER:
+        rsp_length = ctx->backend->build_response_basis(&sft, rsp);
+        /* Not busy */
+        rsp[rsp_length++] = 0;
+        rsp[rsp_length++] = 0;
+        diag_lock(ctx);
+        rsp[rsp_length++] = ctx->diag->counters.comm_events >> 8;
+        rsp[rsp_length++] = ctx->diag->counters.comm_events & 0xFF;
+        diag_unlock(ctx);
+        break;
+#endif
+#if MODBUS_CONFIG_FC_GET_COMM_EVENT_LOG
+    case MODBUS_FC_GET_COMM_EVENT_LOG:
+        diag_lock(ctx);
+        rsp_length = response_comm_event_log(ctx, &sft, rsp);
+        diag_unlock(ctx);
+        break;
+#endif
 
     default:
         rsp_length = response_exception(ctx,
@@ -1181,6 +2098,10 @@ int modbus_reply(modbus_t *ctx,
     }
 #ifdef PICO_W
     ctx->backend->mapping_unlock(ctx);
+#else
+    if (ctx->backend->mapping_end != NULL &&
+        ctx->backend->mapping_end(ctx, mapping_write, seq))
+        goto retry;
 #endif
 
     /* Suppress any responses in RTU when the request was a broadcast, excepted when quirk
@@ -1188,9 +2109,23 @@ int modbus_reply(modbus_t *ctx,
     if (ctx->backend->backend_type == _MODBUS_BACKEND_TYPE_RTU &&
         slave == MODBUS_BROADCAST_ADDRESS &&
         !(ctx->quirks & MODBUS_QUIRK_REPLY_TO_BROADCAST)) {
+#if _MODBUS_DIAG
+        diag_lock(ctx);
+        ctx->diag->counters.server_no_responses++;
+        diag_unlock(ctx);
+#endif
+        return 0;
+    }
+#if MODBUS_CONFIG_FC_DIAGNOSTICS
+    if (rsp_length == 0) {
+        /* Entered or left the listen only mode */
+        diag_lock(ctx);
+        ctx->diag->counters.server_no_responses++;
+        diag_unlock(ctx);
         return 0;
     }
-    return send_msg(ctx, rsp, rsp_length);
+#endif
+    return send_reply(ctx, rsp, rsp_length);
 }
 
 int modbus_reply_exception(modbus_t *ctx, const uint8_t *req, unsigned int exception_code)
@@ -1220,13 +2155,43 @@ int modbus_reply_exception(modbus_t *ctx, const uint8_t *req, unsigned int excep
     /* Positive exception code */
     if (exception_code < MODBUS_EXCEPTION_MAX) {
         rsp[rsp_length++] = exception_code;
-        return send_msg(ctx, rsp, rsp_length);
+        return send_reply(ctx, rsp, rsp_length);
     } else {
         errno = EINVAL;
         return -1;
     }
 }
 
+/* Unpacks the nb bits of the byte_count bytes at offset of the response */
+static void
+decode_io_status(const uint8_t *rsp, int offset, int byte_count, int nb, uint8_t *dest)
+{
+    int temp, bit;
+    int pos = 0;
+    int i;
+
+    for (i = offset; i < offset + byte_count; i++) {
+        /* Shift reg hi_byte to temp */
+        temp = rsp[i];
+
+        for (bit = 0x01; (bit & 0xff) && (pos < nb);) {
+            dest[pos++] = (temp & bit) ? TRUE : FALSE;
+            bit = bit << 1;
+        }
+    }
+}
+
+/* Unpacks the nb registers at offset of the response */
+static void decode_registers(const uint8_t *rsp, int offset, int nb, uint16_t *dest)
+{
+    int i;
+
+    for (i = 0; i < nb; i++) {
+        /* shift reg hi_byte to temp OR with lo_byte */
+        dest[i] = (rsp[offset + (i << 1)] << 8) | rsp[offset + 1 + (i << 1)];
+    }
+}
+
 /* Reads IO status */
 static int read_io_status(modbus_t *ctx, int function, int addr, int nb, uint8_t *dest)
 {
@@ -1240,11 +2205,6 @@ static int read_io_status(modbus_t *ctx, int function, int addr, int nb, uint8_t
 
     rc = send_msg(ctx, req, req_length);
     if (rc > 0) {
-        int temp, bit;
-        int pos = 0;
-        unsigned int offset;
-        unsigned int offset_end;
-
         rc = _modbus_receive_msg(ctx, rsp, MSG_CONFIRMATION);
         if (rc == -1)
             return -1;
@@ -1253,17 +2213,7 @@ static int read_io_status(modbus_t *ctx, int function, int addr, int nb, uint8_t
         if (rc == -1)
             return -1;
 
-        offset = ctx->backend->header_length + 2;
-        offset_end = offset + rc;
-        for (unsigned int i = offset; i < offset_end; i++) {
-            /* Shift reg hi_byte to temp */
-            temp = rsp[i];
-
-            for (bit = 0x01; (bit & 0xff) && (pos < nb);) {
-                dest[pos++] = (temp & bit) ? TRUE : FALSE;
-                bit = bit << 1;
-            }
-        }
+        decode_io_status(rsp, ctx->backend->header_length + 2, rc, nb, dest);
     }
 
     return rc;
@@ -1281,7 +2231,7 @@ int modbus_read_bits(modbus_t *ctx, int addr, int nb, uint8_t *dest)
     }
 
     if (nb > MODBUS_MAX_READ_BITS) {
-        if (ctx->debug) {
+        if (_MODBUS_ERROR(ctx)) {
             fprintf(stderr,
                     "ERROR Too many bits requested (%d > %d)\n",
                     nb,
@@ -1310,7 +2260,7 @@ int modbus_read_input_bits(modbus_t *ctx, int addr, int nb, uint8_t *dest)
     }
 
     if (nb > MODBUS_MAX_READ_BITS) {
-        if (ctx->debug) {
+        if (_MODBUS_ERROR(ctx)) {
             fprintf(stderr,
                     "ERROR Too many discrete inputs requested (%d > %d)\n",
                     nb,
@@ -1328,16 +2278,16 @@ int modbus_read_input_bits(modbus_t *ctx, int addr, int nb, uint8_t *dest)
         return nb;
 }
 
-/* Reads the data from a remote device and put that data into an array */
-static int read_registers(modbus_t *ctx, int function, int addr, int nb, uint16_t *dest)
+/* Sends a read request and receives the validated response into rsp. Returns
+   the number of registers read. */
+static int read_registers_rsp(modbus_t *ctx, int function, int addr, int nb, uint8_t *rsp)
 {
     int rc;
     int req_length;
     uint8_t req[_MIN_REQ_LENGTH];
-    uint8_t rsp[MAX_MESSAGE_LENGTH];
 
     if (nb > MODBUS_MAX_READ_REGISTERS) {
-        if (ctx->debug) {
+        if (_MODBUS_ERROR(ctx)) {
             fprintf(stderr,
                     "ERROR Too many registers requested (%d > %d)\n",
                     nb,
@@ -1351,28 +2301,65 @@ static int read_registers(modbus_t *ctx, int function, int addr, int nb, uint16_
 
     rc = send_msg(ctx, req, req_length);
     if (rc > 0) {
-        unsigned int offset;
-        int i;
-
         rc = _modbus_receive_msg(ctx, rsp, MSG_CONFIRMATION);
         if (rc == -1)
             return -1;
 
         rc = check_confirmation(ctx, req, rsp, rc);
-        if (rc == -1)
-            return -1;
+    }
 
-        offset = ctx->backend->header_length;
+    return rc;
+}
 
-        for (i = 0; i < rc; i++) {
-            /* shift reg hi_byte to temp OR with lo_byte */
-            dest[i] = (rsp[offset + 2 + (i << 1)] << 8) | rsp[offset + 3 + (i << 1)];
-        }
+/* Reads the data from a remote device and put that data into an array */
+static int read_registers(modbus_t *ctx, int function, int addr, int nb, uint16_t *dest)
+{
+    int rc;
+    uint8_t rsp[MAX_MESSAGE_LENGTH];
+
+    rc = read_registers_rsp(ctx, function, addr, nb, rsp);
+    if (rc > 0) {
+        decode_registers(rsp, ctx->backend->header_length + 2, rc, dest);
+    }
+
+    return rc;
+}
+
+/* Reads the registers into the response buffer of the caller (at least
+   MODBUS_MAX_ADU_LENGTH bytes) and points the view to their values, nothing
+   is copied or converted. */
+static int read_registers_view(
+    modbus_t *ctx, int function, int addr, int nb, uint8_t *rsp, modbus_view_t *view)
+{
+    int rc;
+
+    if (ctx == NULL || rsp == NULL || view == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    rc = read_registers_rsp(ctx, function, addr, nb, rsp);
+    if (rc > 0) {
+        view->data = rsp + ctx->backend->header_length + 2;
+        view->nb = rc;
     }
 
     return rc;
 }
 
+int modbus_read_registers_view(
+    modbus_t *ctx, int addr, int nb, uint8_t *rsp, modbus_view_t *view)
+{
+    return read_registers_view(
+        ctx, MODBUS_FC_READ_HOLDING_REGISTERS, addr, nb, rsp, view);
+}
+
+int modbus_read_input_registers_view(
+    modbus_t *ctx, int addr, int nb, uint8_t *rsp, modbus_view_t *view)
+{
+    return read_registers_view(ctx, MODBUS_FC_READ_INPUT_REGISTERS, addr, nb, rsp, view);
+}
+
 /* Reads the holding registers of remote device and put the data into an
    array */
 int modbus_read_registers(modbus_t *ctx, int addr, int nb, uint16_t *dest)
@@ -1385,7 +2372,7 @@ int modbus_read_registers(modbus_t *ctx, int addr, int nb, uint16_t *dest)
     }
 
     if (nb > MODBUS_MAX_READ_REGISTERS) {
-        if (ctx->debug) {
+        if (_MODBUS_ERROR(ctx)) {
             fprintf(stderr,
                     "ERROR Too many registers requested (%d > %d)\n",
                     nb,
@@ -1410,10 +2397,12 @@ int modbus_read_input_registers(modbus_t *ctx, int addr, int nb, uint16_t *dest)
     }
 
     if (nb > MODBUS_MAX_READ_REGISTERS) {
-        fprintf(stderr,
-                "ERROR Too many input registers requested (%d > %d)\n",
-                nb,
-                MODBUS_MAX_READ_REGISTERS);
+        if (_MODBUS_ERROR(ctx)) {
+            fprintf(stderr,
+                    "ERROR Too many input registers requested (%d > %d)\n",
+                    nb,
+                    MODBUS_MAX_READ_REGISTERS);
+        }
         errno = EMBMDATA;
         return -1;
     }
@@ -1492,7 +2481,7 @@ int modbus_write_bits(modbus_t *ctx, int addr, int nb, const uint8_t *src)
     }
 
     if (nb > MODBUS_MAX_WRITE_BITS) {
-        if (ctx->debug) {
+        if (_MODBUS_ERROR(ctx)) {
             fprintf(stderr,
                     "ERROR Writing too many bits (%d > %d)\n",
                     nb,
@@ -1553,7 +2542,7 @@ int modbus_write_registers(modbus_t *ctx, int addr, int nb, const uint16_t *src)
     }
 
     if (nb > MODBUS_MAX_WRITE_REGISTERS) {
-        if (ctx->debug) {
+        if (_MODBUS_ERROR(ctx)) {
             fprintf(stderr,
                     "ERROR Trying to write to too many registers (%d > %d)\n",
                     nb,
@@ -1649,7 +2638,7 @@ int modbus_write_and_read_registers(modbus_t *ctx,
     }
 
     if (write_nb > MODBUS_MAX_WR_WRITE_REGISTERS) {
-        if (ctx->debug) {
+        if (_MODBUS_ERROR(ctx)) {
             fprintf(stderr,
                     "ERROR Too many registers to write (%d > %d)\n",
                     write_nb,
@@ -1660,7 +2649,7 @@ int modbus_write_and_read_registers(modbus_t *ctx,
     }
 
     if (read_nb > MODBUS_MAX_WR_READ_REGISTERS) {
-        if (ctx->debug) {
+        if (_MODBUS_ERROR(ctx)) {
             fprintf(stderr,
                     "ERROR Too many registers requested (%d > %d)\n",
                     read_nb,
@@ -1752,58 +2741,576 @@ int modbus_report_slave_id(modbus_t *ctx, int max_dest, uint8_t *dest)
     return rc;
 }
 
-void _modbus_init_common(modbus_t *ctx)
+/* Sends a diagnostics request (MODBUS_DIAG_*), the data of the response is
+   stored in dest if not NULL. MODBUS_DIAG_FORCE_LISTEN_ONLY has no response,
+   0 is returned once it's sent. */
+int modbus_diagnostics(modbus_t *ctx, int sub_function, uint16_t data, uint16_t *dest)
 {
-    /* Slave and socket are initialized to -1 */
-    ctx->slave = -1;
-    ctx->s = -1;
+    int rc;
+    int req_length;
+    uint8_t req[_MIN_REQ_LENGTH];
 
-    ctx->debug = FALSE;
-    ctx->error_recovery = MODBUS_ERROR_RECOVERY_NONE;
-    ctx->quirks = MODBUS_QUIRK_NONE;
+    if (ctx == NULL || sub_function < 0 || sub_function > 0xFFFF) {
+        errno = EINVAL;
+        return -1;
+    }
 
-    ctx->response_timeout.tv_sec = 0;
-    ctx->response_timeout.tv_usec = _RESPONSE_TIMEOUT;
+    req_length = ctx->backend->build_request_basis(
+        ctx, MODBUS_FC_DIAGNOSTICS, sub_function, data, req);
 
-    ctx->byte_timeout.tv_sec = 0;
-    ctx->byte_timeout.tv_usec = _BYTE_TIMEOUT;
+    rc = send_msg(ctx, req, req_length);
+    if (rc > 0) {
+        uint8_t rsp[MAX_MESSAGE_LENGTH];
+        const int offset = ctx->backend->header_length;
 
-    ctx->indication_timeout.tv_sec = 0;
-    ctx->indication_timeout.tv_usec = 0;
-}
+        if (sub_function == MODBUS_DIAG_FORCE_LISTEN_ONLY)
+            return 0;
 
-/* Define the slave number */
-int modbus_set_slave(modbus_t *ctx, int slave)
-{
-    if (ctx == NULL) {
-        errno = EINVAL;
-        return -1;
-    }
+        rc = _modbus_receive_msg(ctx, rsp, MSG_CONFIRMATION);
+        if (rc == -1)
+            return -1;
 
-    return ctx->backend->set_slave(ctx, slave);
-}
+        rc = check_confirmation(ctx, req, rsp, rc);
+        if (rc == -1)
+            return -1;
 
-int modbus_get_slave(modbus_t *ctx)
-{
-    if (ctx == NULL) {
-        errno = EINVAL;
-        return -1;
+        if (dest != NULL)
+            *dest = (rsp[offset + 3] << 8) | rsp[offset + 4];
     }
 
-    return ctx->slave;
+    return rc;
 }
 
-int modbus_set_error_recovery(modbus_t *ctx, modbus_error_recovery_mode error_recovery)
+/* Reads the status (0xFFFF when busy) and the event counter of the server */
+int modbus_get_comm_event_counter(modbus_t *ctx, uint16_t *status, uint16_t *event_count)
 {
-    if (ctx == NULL) {
+    int rc;
+    int req_length;
+    uint8_t req[_MIN_REQ_LENGTH];
+
+    if (ctx == NULL || status == NULL || event_count == NULL) {
         errno = EINVAL;
         return -1;
     }
 
-    /* The type of modbus_error_recovery_mode is unsigned enum */
-    ctx->error_recovery = (uint8_t) error_recovery;
-    return 0;
-}
+    req_length = ctx->backend->build_request_basis(
+        ctx, MODBUS_FC_GET_COMM_EVENT_COUNTER, 0, 0, req);
+
+    /* HACKISH, addr and count are not used */
+    req_length -= 4;
+
+    rc = send_msg(ctx, req, req_length);
+    if (rc > 0) {
+        uint8_t rsp[MAX_MESSAGE_LENGTH];
+        const int offset = ctx->backend->header_length;
+
+        rc = _modbus_receive_msg(ctx, rsp, MSG_CONFIRMATION);
+        if (rc == -1)
+            return -1;
+
+        rc = check_confirmation(ctx, req, rsp, rc);
+        if (rc == -1)
+            return -1;
+
+        *status = (rsp[offset + 1] << 8) | rsp[offset + 2];
+        *event_count = (rsp[offset + 3] << 8) | rsp[offset + 4];
+    }
+
+    return rc;
+}
+
+/* Reads the event log of the server. Returns the number of events. */
+int modbus_get_comm_event_log(modbus_t *ctx, modbus_comm_event_log_t *dest)
+{
+    int rc;
+    int req_length;
+    uint8_t req[_MIN_REQ_LENGTH];
+
+    if (ctx == NULL || dest == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    req_length =
+        ctx->backend->build_request_basis(ctx, MODBUS_FC_GET_COMM_EVENT_LOG, 0, 0, req);
+
+    /* HACKISH, addr and count are not used */
+    req_length -= 4;
+
+    rc = send_msg(ctx, req, req_length);
+    if (rc > 0) {
+        uint8_t rsp[MAX_MESSAGE_LENGTH];
+        const int offset = ctx->backend->header_length;
+
+        rc = _modbus_receive_msg(ctx, rsp, MSG_CONFIRMATION);
+        if (rc == -1)
+            return -1;
+
+        rc = check_confirmation(ctx, req, rsp, rc);
+        if (rc == -1)
+            return -1;
+
+        /* Byte count, status, event count, message count and the events */
+        dest->status = (rsp[offset + 2] << 8) | rsp[offset + 3];
+        dest->event_count = (rsp[offset + 4] << 8) | rsp[offset + 5];
+        dest->message_count = (rsp[offset + 6] << 8) | rsp[offset + 7];
+        dest->nb_events = rc - 6;
+        memcpy(dest->events, rsp + offset + 8, dest->nb_events);
+        rc = dest->nb_events;
+    }
+
+    return rc;
+}
+
+/* Reads records from one or more files of a remote device. Each sub-request
+   of records is filled with record_length registers. Returns the total number
+   of registers read. */
+int modbus_read_file_records(modbus_t *ctx, modbus_file_record_t *records, int nb_records)
+{
+    int rc;
+    int req_length;
+    int rsp_pdu_length;
+    int byte_count;
+    int i;
+    uint8_t req[MAX_MESSAGE_LENGTH];
+    uint8_t rsp[MAX_MESSAGE_LENGTH];
+
+    if (ctx == NULL || records == NULL || nb_records < 1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    byte_count = 7 * nb_records;
+    /* Function code + response data length */
+    rsp_pdu_length = 2;
+    for (i = 0; i < nb_records; i++) {
+        /* The last record of the sub-request too */
+        if (records[i].file_number == 0 || records[i].record_length < 1 ||
+            records[i].record_number + records[i].record_length - 1 >
+                MODBUS_MAX_FILE_RECORD_NUMBER ||
+            records[i].data == NULL) {
+            errno = EINVAL;
+            return -1;
+        }
+        rsp_pdu_length += 2 + 2 * records[i].record_length;
+    }
+
+    if (byte_count > MODBUS_MAX_READ_FILE_REQUEST_LENGTH ||
+        rsp_pdu_length > MODBUS_MAX_PDU_LENGTH) {
+        if (_MODBUS_ERROR(ctx)) {
+            fprintf(stderr,
+                    "ERROR Too many file records requested (%d > %d bytes)\n",
+                    rsp_pdu_length,
+                    MODBUS_MAX_PDU_LENGTH);
+        }
+        errno = EMBMDATA;
+        return -1;
+    }
+
+    req_length =
+        ctx->backend->build_request_basis(ctx, MODBUS_FC_READ_FILE_RECORD, 0, 0, req);
+
+    /* HACKISH, addr and count are replaced by the sub-requests */
+    req_length -= 4;
+    req[req_length++] = byte_count;
+    for (i = 0; i < nb_records; i++) {
+        req[req_length++] = MODBUS_FILE_REFERENCE_TYPE;
+        req[req_length++] = records[i].file_number >> 8;
+        req[req_length++] = records[i].file_number & 0x00FF;
+        req[req_length++] = records[i].record_number >> 8;
+        req[req_length++] = records[i].record_number & 0x00FF;
+        req[req_length++] = records[i].record_length >> 8;
+        req[req_length++] = records[i].record_length & 0x00FF;
+    }
+
+    rc = send_msg(ctx, req, req_length);
+    if (rc > 0) {
+        int rsp_length;
+        int pos;
+        int nb = 0;
+
+        rsp_length = _modbus_receive_msg(ctx, rsp, MSG_CONFIRMATION);
+        if (rsp_length == -1)
+            return -1;
+
+        rc = check_confirmation(ctx, req, rsp, rsp_length);
+        if (rc == -1)
+            return -1;
+
+        /* The sub-responses must fit in the response data length */
+        pos = ctx->backend->header_length + 2;
+        rsp_length = pos + rsp[pos - 1];
+        for (i = 0; i < nb_records; i++) {
+            int j;
+
+            /* File response length and reference type */
+            if (pos + 2 + 2 * records[i].record_length > rsp_length ||
+                rsp[pos] != 1 + 2 * records[i].record_length ||
+                rsp[pos + 1] != MODBUS_FILE_REFERENCE_TYPE) {
+                if (_MODBUS_ERROR(ctx)) {
+                    fprintf(stderr,
+                            "Received sub-response %d not corresponding to the "
+                            "request\n",
+                            i);
+                }
+                errno = EMBBADDATA;
+                return -1;
+            }
+            pos += 2;
+
+            for (j = 0; j < records[i].record_length; j++) {
+                records[i].data[j] = (rsp[pos] << 8) | rsp[pos + 1];
+                pos += 2;
+            }
+            nb += records[i].record_length;
+        }
+        rc = nb;
+    }
+
+    return rc;
+}
+
+/* Reads nb registers of a file of a remote device, starting at record
+   record_number */
+int modbus_read_file_record(
+    modbus_t *ctx, int file_number, int record_number, int nb, uint16_t *dest)
+{
+    modbus_file_record_t record;
+
+    if (file_number < 1 || file_number > 0xFFFF || record_number < 0 ||
+        record_number > MODBUS_MAX_FILE_RECORD_NUMBER || nb < 1 || nb > 0xFFFF) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    record.file_number = file_number;
+    record.record_number = record_number;
+    record.record_length = nb;
+    record.data = dest;
+
+    return modbus_read_file_records(ctx, &record, 1);
+}
+
+/* Writes records to one or more files of a remote device. Returns the total
+   number of registers written. */
+int modbus_write_file_records(modbus_t *ctx,
+                              const modbus_file_record_t *records,
+                              int nb_records)
+{
+    int rc;
+    int req_length;
+    int byte_count;
+    int i;
+    uint8_t req[MAX_MESSAGE_LENGTH];
+    uint8_t rsp[MAX_MESSAGE_LENGTH];
+
+    if (ctx == NULL || records == NULL || nb_records < 1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    byte_count = 0;
+    for (i = 0; i < nb_records; i++) {
+        /* The last record of the sub-request too */
+        if (records[i].file_number == 0 || records[i].record_length < 1 ||
+            records[i].record_number + records[i].record_length - 1 >
+                MODBUS_MAX_FILE_RECORD_NUMBER ||
+            records[i].data == NULL) {
+            errno = EINVAL;
+            return -1;
+        }
+        byte_count += 7 + 2 * records[i].record_length;
+    }
+
+    if (byte_count > MODBUS_MAX_WRITE_FILE_REQUEST_LENGTH) {
+        if (_MODBUS_ERROR(ctx)) {
+            fprintf(stderr,
+                    "ERROR Too many file records to write (%d > %d bytes)\n",
+                    byte_count,
+                    MODBUS_MAX_WRITE_FILE_REQUEST_LENGTH);
+        }
+        errno = EMBMDATA;
+        return -1;
+    }
+
+    req_length =
+        ctx->backend->build_request_basis(ctx, MODBUS_FC_WRITE_FILE_RECORD, 0, 0, req);
+
+    /* HACKISH, addr and count are replaced by the sub-requests */
+    req_length -= 4;
+    req[req_length++] = byte_count;
+    for (i = 0; i < nb_records; i++) {
+        int j;
+
+        req[req_length++] = MODBUS_FILE_REFERENCE_TYPE;
+        req[req_length++] = records[i].file_number >> 8;
+        req[req_length++] = records[i].file_number & 0x00FF;
+        req[req_length++] = records[i].record_number >> 8;
+        req[req_length++] = records[i].record_number & 0x00FF;
+        req[req_length++] = records[i].record_length >> 8;
+        req[req_length++] = records[i].record_length & 0x00FF;
+        for (j = 0; j < records[i].record_length; j++) {
+            req[req_length++] = records[i].data[j] >> 8;
+            req[req_length++] = records[i].data[j] & 0x00FF;
+        }
+    }
+
+    rc = send_msg(ctx, req, req_length);
+    if (rc > 0) {
+        rc = _modbus_receive_msg(ctx, rsp, MSG_CONFIRMATION);
+        if (rc == -1)
+            return -1;
+
+        rc = check_confirmation(ctx, req, rsp, rc);
+        if (rc == -1)
+            return -1;
+
+        rc = 0;
+        for (i = 0; i < nb_records; i++) {
+            rc += records[i].record_length;
+        }
+    }
+
+    return rc;
+}
+
+/* Writes nb registers to a file of a remote device, starting at record
+   record_number */
+int modbus_write_file_record(
+    modbus_t *ctx, int file_number, int record_number, int nb, const uint16_t *src)
+{
+    modbus_file_record_t record;
+
+    if (file_number < 1 || file_number > 0xFFFF || record_number < 0 ||
+        record_number > MODBUS_MAX_FILE_RECORD_NUMBER || nb < 1 || nb > 0xFFFF) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    record.file_number = file_number;
+    record.record_number = record_number;
+    record.record_length = nb;
+    /* The record is only read by modbus_write_file_records() */
+    record.data = (uint16_t *) src;
+
+    return modbus_write_file_records(ctx, &record, 1);
+}
+
+/* A read request serialised once and sent again for each poll */
+struct _modbus_prepared {
+    modbus_t *ctx;
+    int function;
+    int nb;
+    void *dest;
+    int req_length;
+    uint8_t req[_MIN_REQ_LENGTH];
+};
+
+/* Validates and serialises a read request of nb values at addr. Each
+   execution decodes the response into dest (uint8_t for the bits, uint16_t for
+   the registers). The request is bound to the slave set at this time. */
+modbus_prepared_t *
+modbus_prepare_read(modbus_t *ctx, int function, int addr, int nb, void *dest)
+{
+    modbus_prepared_t *prepared;
+    int max_nb;
+
+    if (ctx == NULL || dest == NULL || nb < 1) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    switch (function) {
+    case MODBUS_FC_READ_COILS:
+    case MODBUS_FC_READ_DISCRETE_INPUTS:
+        max_nb = MODBUS_MAX_READ_BITS;
+        break;
+    case MODBUS_FC_READ_HOLDING_REGISTERS:
+    case MODBUS_FC_READ_INPUT_REGISTERS:
+        max_nb = MODBUS_MAX_READ_REGISTERS;
+        break;
+    default:
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (nb > max_nb) {
+        if (_MODBUS_ERROR(ctx)) {
+            fprintf(stderr, "ERROR Too many values requested (%d > %d)\n", nb, max_nb);
+        }
+        errno = EMBMDATA;
+        return NULL;
+    }
+
+    prepared = (modbus_prepared_t *) malloc(sizeof(modbus_prepared_t));
+    if (prepared == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    prepared->ctx = ctx;
+    prepared->function = function;
+    prepared->nb = nb;
+    prepared->dest = dest;
+    prepared->req_length =
+        ctx->backend->build_request_basis(ctx, function, addr, nb, prepared->req);
+    prepared->req_length =
+        ctx->backend->send_msg_pre(prepared->req, prepared->req_length);
+
+    return prepared;
+}
+
+/* Gives the prepared request with a new transaction ID, returns its length */
+int _modbus_prepared_next(modbus_prepared_t *prepared, const uint8_t **req)
+{
+    modbus_t *ctx = prepared->ctx;
+
+    if (ctx->backend->next_tid != NULL) {
+        int t_id = ctx->backend->next_tid(ctx);
+
+        prepared->req[0] = t_id >> 8;
+        prepared->req[1] = t_id & 0x00ff;
+    }
+    *req = prepared->req;
+
+    return prepared->req_length;
+}
+
+/* Sends the prepared request, only the transaction ID is updated */
+int modbus_prepared_send(modbus_prepared_t *prepared)
+{
+    const uint8_t *req;
+    int req_length;
+
+    if (prepared == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    req_length = _modbus_prepared_next(prepared, &req);
+
+    return send_msg_ready(prepared->ctx, prepared->req, req_length);
+}
+
+/* Checks the response to the last request of _modbus_prepared_next() and
+   decodes it into the destination. Returns the number of values read. */
+int _modbus_prepared_decode(modbus_prepared_t *prepared, uint8_t *rsp, int rsp_length)
+{
+    modbus_t *ctx = prepared->ctx;
+    int rc;
+
+    rc = check_confirmation(ctx, prepared->req, rsp, rsp_length);
+    if (rc == -1)
+        return -1;
+
+    if (prepared->function == MODBUS_FC_READ_COILS ||
+        prepared->function == MODBUS_FC_READ_DISCRETE_INPUTS) {
+        decode_io_status(
+            rsp, ctx->backend->header_length + 2, rc, prepared->nb, prepared->dest);
+    } else {
+        decode_registers(rsp, ctx->backend->header_length + 2, rc, prepared->dest);
+    }
+
+    return prepared->nb;
+}
+
+/* Receives the response to the prepared request and decodes it into the
+   destination. Returns the number of values read. */
+int modbus_prepared_receive(modbus_prepared_t *prepared)
+{
+    modbus_t *ctx;
+    uint8_t rsp[MAX_MESSAGE_LENGTH];
+    int rc;
+
+    if (prepared == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ctx = prepared->ctx;
+    rc = _modbus_receive_msg(ctx, rsp, MSG_CONFIRMATION);
+    if (rc == -1)
+        return -1;
+
+    return _modbus_prepared_decode(prepared, rsp, rc);
+}
+
+int modbus_prepared_execute(modbus_prepared_t *prepared)
+{
+    int rc;
+
+    rc = modbus_prepared_send(prepared);
+    if (rc <= 0)
+        return rc;
+
+    return modbus_prepared_receive(prepared);
+}
+
+void modbus_prepared_free(modbus_prepared_t *prepared)
+{
+    free(prepared);
+}
+
+void _modbus_init_common(modbus_t *ctx)
+{
+    /* Slave and socket are initialized to -1 */
+    ctx->slave = -1;
+    ctx->s = -1;
+
+    ctx->debug = FALSE;
+    ctx->error_recovery = MODBUS_ERROR_RECOVERY_NONE;
+    ctx->quirks = MODBUS_QUIRK_NONE;
+
+    ctx->response_timeout.tv_sec = 0;
+    ctx->response_timeout.tv_usec = _RESPONSE_TIMEOUT;
+
+    ctx->byte_timeout.tv_sec = 0;
+    ctx->byte_timeout.tv_usec = _BYTE_TIMEOUT;
+
+    ctx->indication_timeout.tv_sec = 0;
+    ctx->indication_timeout.tv_usec = 0;
+
+    ctx->file_storage = NULL;
+    ctx->trace = NULL;
+    ctx->stats = NULL;
+    ctx->read_ahead = NULL;
+    ctx->cork = NULL;
+    memset(&ctx->diag_data, 0, sizeof(ctx->diag_data));
+    ctx->diag = &ctx->diag_data;
+}
+
+/* Define the slave number */
+int modbus_set_slave(modbus_t *ctx, int slave)
+{
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return ctx->backend->set_slave(ctx, slave);
+}
+
+int modbus_get_slave(modbus_t *ctx)
+{
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return ctx->slave;
+}
+
+int modbus_set_error_recovery(modbus_t *ctx, modbus_error_recovery_mode error_recovery)
+{
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* The type of modbus_error_recovery_mode is unsigned enum */
+    ctx->error_recovery = (uint8_t) error_recovery;
+    return 0;
+}
 
 // FIXME Doesn't work under Windows RTU
 int modbus_set_socket(modbus_t *ctx, int s)
@@ -1939,14 +3446,270 @@ int modbus_disable_quirks(modbus_t *ctx, unsigned int quirks_mask)
     return 0;
 }
 
+/* Enables the read-ahead of the TCP and RTU backends: a read takes all the
+   bytes available, up to 1 KiB, and the next steps of the message and the next
+   messages are served from memory. Not for a context switched between
+   sockets, the bytes read ahead on a socket are dropped when another one is
+   read. A caller waiting for the socket itself must check
+   modbus_get_read_ahead_length() first. */
+int modbus_set_read_ahead(modbus_t *ctx, int enable)
+{
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+#ifdef PICO_W
+    if (enable) {
+        errno = ENOTSUP;
+        return -1;
+    }
+#endif
+
+    if (enable && ctx->read_ahead == NULL) {
+        ctx->read_ahead = (modbus_read_ahead_t *) malloc(sizeof(modbus_read_ahead_t));
+        if (ctx->read_ahead == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        ctx->read_ahead->s = -1;
+        ctx->read_ahead->offset = 0;
+        ctx->read_ahead->length = 0;
+    } else if (!enable) {
+        free(ctx->read_ahead);
+        ctx->read_ahead = NULL;
+    }
+
+    return 0;
+}
+
+/* Returns the number of bytes read ahead on the socket of the context */
+int modbus_get_read_ahead_length(modbus_t *ctx)
+{
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (ctx->read_ahead == NULL || ctx->read_ahead->s != ctx->s)
+        return 0;
+
+    return ctx->read_ahead->length;
+}
+
+/* Recv of a backend with the read-ahead enabled, read_fn is its raw read */
+ssize_t _modbus_read_ahead(modbus_t *ctx,
+                           uint8_t *dest,
+                           int length,
+                           ssize_t (*read_fn)(modbus_t *ctx, uint8_t *buf, int size))
+{
+    modbus_read_ahead_t *read_ahead = ctx->read_ahead;
+
+    if (modbus_get_read_ahead_length(ctx) == 0) {
+        ssize_t rc = read_fn(ctx, read_ahead->buf, _MODBUS_READ_AHEAD_SIZE);
+
+        if (rc <= 0)
+            return rc;
+        read_ahead->s = ctx->s;
+        read_ahead->offset = 0;
+        read_ahead->length = rc;
+    }
+
+    if (length > read_ahead->length)
+        length = read_ahead->length;
+    memcpy(dest, read_ahead->buf + read_ahead->offset, length);
+    read_ahead->offset += length;
+    read_ahead->length -= length;
+
+    return length;
+}
+
+/* Drops the bytes read ahead, on a flush or a close. Returns their number. */
+int _modbus_read_ahead_drop(modbus_t *ctx)
+{
+    int length = modbus_get_read_ahead_length(ctx);
+
+    if (ctx->read_ahead != NULL)
+        ctx->read_ahead->length = 0;
+
+    return length;
+}
+
+/* Holds the messages sent, e.g. the responses of the requests read ahead,
+   until modbus_uncork() writes them all at once: one system call and, with
+   TCP_NODELAY, as few segments as possible instead of one per message. The
+   buffer holds 4 KiB, it's written when full or when the context is switched
+   to another socket. TCP only: a RTU frame is delimited by the silence after
+   it. */
+int modbus_cork(modbus_t *ctx)
+{
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (ctx->backend->backend_type != _MODBUS_BACKEND_TYPE_TCP) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    if (ctx->cork == NULL) {
+        ctx->cork = (modbus_cork_t *) malloc(sizeof(modbus_cork_t));
+        if (ctx->cork == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        ctx->cork->length = 0;
+    }
+    ctx->cork->corked = TRUE;
+
+    return 0;
+}
+
+/* Writes the messages held since modbus_cork(). Returns -1 if the write
+   failed, these messages are lost. */
+int modbus_uncork(modbus_t *ctx)
+{
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (ctx->cork == NULL || !ctx->cork->corked)
+        return 0;
+
+    ctx->cork->corked = FALSE;
+    if (ctx->cork->length == 0)
+        return 0;
+
+    return flush_cork(ctx);
+}
+
+/* Define the storage used by modbus_reply() to serve the file record function
+   codes. The storage must remain valid while it is set, NULL disables the
+   function codes. */
+int modbus_set_file_storage(modbus_t *ctx, const modbus_file_storage_t *storage)
+{
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ctx->file_storage = storage;
+    return 0;
+}
+
+/* Copies the counters reported by the diagnostics function codes of the
+   server. They are written by the thread using the context without lock, or
+   by the workers of a server (see modbus-server.c) which don't wait for this
+   copy. */
+int modbus_get_diag_counters(modbus_t *ctx, modbus_diag_counters_t *dest)
+{
+    if (ctx == NULL || dest == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+#if _MODBUS_DIAG
+    diag_lock(ctx);
+    *dest = ctx->diag->counters;
+    diag_unlock(ctx);
+    return 0;
+#else
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
+/* Records the messages of the context in trace, NULL to stop. The ring is
+   written by the thread using the context, see modbus-trace.c to read it. */
+int modbus_set_trace(modbus_t *ctx, modbus_trace_t *trace)
+{
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+#if MODBUS_CONFIG_TRACE
+    ctx->trace = trace;
+    return 0;
+#else
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
+/* Writes a record in the ring (the oldest one is overwritten when full). Only
+   one thread may write to a given ring. */
+void modbus_trace_add(modbus_trace_t *trace,
+                      int event,
+                      int connection,
+                      int t_id,
+                      int slave,
+                      int function,
+                      int length,
+                      int result)
+{
+    modbus_trace_record_t *record;
+    uint32_t head;
+
+    if (trace == NULL)
+        return;
+
+    head = trace->head;
+    record = &trace->records[head & trace->mask];
+    record->time = (uint32_t) _modbus_time_us();
+    record->result = result;
+    record->t_id = t_id;
+    record->length = length;
+    record->event = event;
+    record->function = function;
+    record->slave = slave;
+    record->connection = connection;
+
+    _MODBUS_FENCE_RELEASE();
+    trace->head = head + 1;
+}
+
+/* Records the statistics of the context in stats, NULL to stop. They are
+   written by the thread using the context, see modbus-stats.c to read them. */
+int modbus_set_stats(modbus_t *ctx, modbus_stats_t *stats)
+{
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+#if MODBUS_CONFIG_STATS
+    if (stats != NULL && ctx->s != -1)
+        stats->connected = TRUE;
+    ctx->stats = stats;
+    return 0;
+#else
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
 int modbus_connect(modbus_t *ctx)
 {
+    int rc;
+
     if (ctx == NULL) {
         errno = EINVAL;
         return -1;
     }
 
-    return ctx->backend->connect(ctx);
+    rc = ctx->backend->connect(ctx);
+#if MODBUS_CONFIG_STATS
+    if (rc != -1 && ctx->stats != NULL) {
+        if (ctx->stats->connected)
+            ctx->stats->counters.reconnects++;
+        ctx->stats->connected = TRUE;
+    }
+#endif
+
+    return rc;
 }
 
 void modbus_close(modbus_t *ctx)
@@ -1955,6 +3718,10 @@ void modbus_close(modbus_t *ctx)
         return;
 
     ctx->backend->close(ctx);
+    _modbus_read_ahead_drop(ctx);
+    /* Not for the next connection */
+    if (ctx->cork != NULL)
+        ctx->cork->length = 0;
 }
 
 void modbus_free(modbus_t *ctx)
@@ -1962,6 +3729,8 @@ void modbus_free(modbus_t *ctx)
     if (ctx == NULL)
         return;
 
+    free(ctx->read_ahead);
+    free(ctx->cork);
     ctx->backend->free(ctx);
 }
 
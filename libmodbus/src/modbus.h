@@ -78,14 +78,53 @@ MODBUS_BEGIN_DECLS
 #define MODBUS_FC_WRITE_SINGLE_COIL        0x05
 #define MODBUS_FC_WRITE_SINGLE_REGISTER    0x06
 #define MODBUS_FC_READ_EXCEPTION_STATUS    0x07
+#define MODBUS_FC_DIAGNOSTICS              0x08
+#define MODBUS_FC_GET_COMM_EVENT_COUNTER   0x0B
+#define MODBUS_FC_GET_COMM_EVENT_LOG       0x0C
 #define MODBUS_FC_WRITE_MULTIPLE_COILS     0x0F
 #define MODBUS_FC_WRITE_MULTIPLE_REGISTERS 0x10
 #define MODBUS_FC_REPORT_SLAVE_ID          0x11
+#define MODBUS_FC_READ_FILE_RECORD         0x14
+#define MODBUS_FC_WRITE_FILE_RECORD        0x15
 #define MODBUS_FC_MASK_WRITE_REGISTER      0x16
 #define MODBUS_FC_WRITE_AND_READ_REGISTERS 0x17
 
 #define MODBUS_BROADCAST_ADDRESS 0
 
+/* Sub-functions of MODBUS_FC_DIAGNOSTICS
+ * (Modbus_Application_Protocol_V1_1b.pdf chapter 6 section 8 page 21) */
+#define MODBUS_DIAG_RETURN_QUERY_DATA          0x00
+#define MODBUS_DIAG_RESTART_COMMUNICATIONS     0x01
+#define MODBUS_DIAG_RETURN_DIAGNOSTIC_REGISTER 0x02
+#define MODBUS_DIAG_FORCE_LISTEN_ONLY          0x04
+#define MODBUS_DIAG_CLEAR_COUNTERS             0x0A
+#define MODBUS_DIAG_BUS_MESSAGE_COUNT          0x0B
+#define MODBUS_DIAG_BUS_COMM_ERROR_COUNT       0x0C
+#define MODBUS_DIAG_BUS_EXCEPTION_COUNT        0x0D
+#define MODBUS_DIAG_SERVER_MESSAGE_COUNT       0x0E
+#define MODBUS_DIAG_SERVER_NO_RESPONSE_COUNT   0x0F
+#define MODBUS_DIAG_SERVER_NAK_COUNT           0x10
+#define MODBUS_DIAG_SERVER_BUSY_COUNT          0x11
+#define MODBUS_DIAG_BUS_OVERRUN_COUNT          0x12
+#define MODBUS_DIAG_CLEAR_OVERRUN              0x14
+
+/* Events of MODBUS_FC_GET_COMM_EVENT_LOG (chapter 6 section 10 page 26), the
+ * receive and send events are or'ed with their flags */
+#define MODBUS_EVENT_COMM_RESTART        0x00
+#define MODBUS_EVENT_LISTEN_ONLY         0x04
+#define MODBUS_EVENT_SEND                0x40
+#define MODBUS_EVENT_SEND_READ_EXCEPTION 0x01
+#define MODBUS_EVENT_SEND_ABORT          0x02
+#define MODBUS_EVENT_SEND_BUSY           0x04
+#define MODBUS_EVENT_SEND_NAK            0x08
+#define MODBUS_EVENT_SEND_LISTEN_ONLY    0x20
+#define MODBUS_EVENT_RECEIVE             0x80
+#define MODBUS_EVENT_RECEIVE_COMM_ERROR  0x02
+#define MODBUS_EVENT_RECEIVE_OVERRUN     0x10
+#define MODBUS_EVENT_RECEIVE_LISTEN_ONLY 0x20
+#define MODBUS_EVENT_RECEIVE_BROADCAST   0x40
+#define MODBUS_MAX_COMM_EVENTS           64
+
 /* Modbus_Application_Protocol_V1_1b.pdf (chapter 6 section 1 page 12)
  * Quantity of Coils to read (2 bytes): 1 to 2000 (0x7D0)
  * (chapter 6 section 11 page 29)
@@ -106,6 +145,19 @@ MODBUS_BEGIN_DECLS
 #define MODBUS_MAX_WR_WRITE_REGISTERS 121
 #define MODBUS_MAX_WR_READ_REGISTERS  125
 
+/* Modbus_Application_Protocol_V1_1b.pdf (chapter 6 section 14 page 32)
+ * Reference type of a file sub-request (1 byte): 6
+ * File number (2 bytes): 1 to 0xFFFF
+ * Record number (2 bytes): 0 to 9999 (0x270F)
+ * Byte count of a read request (1 byte): 0x07 to 0xF5
+ * (chapter 6 section 15 page 34)
+ * Byte count of a write request (1 byte): 0x09 to 0xFB
+ */
+#define MODBUS_FILE_REFERENCE_TYPE           6
+#define MODBUS_MAX_FILE_RECORD_NUMBER        0x270F
+#define MODBUS_MAX_READ_FILE_REQUEST_LENGTH  0xF5
+#define MODBUS_MAX_WRITE_FILE_REQUEST_LENGTH 0xFB
+
 /* The size of the MODBUS PDU is limited by the size constraint inherited from
  * the first MODBUS implementation on Serial Line network (max. RS485 ADU = 256
  * bytes). Therefore, MODBUS PDU for serial line communication = 256 - Server
@@ -166,6 +218,24 @@ extern const unsigned int libmodbus_version_minor;
 extern const unsigned int libmodbus_version_micro;
 
 typedef struct _modbus modbus_t;
+typedef struct _modbus_prepared modbus_prepared_t;
+
+/* Values of a validated response, in the buffer given to the read function.
+ * The view is valid as long as this buffer is not reused. */
+typedef struct _modbus_view {
+    /* Big endian registers as received */
+    const uint8_t *data;
+    int nb;
+} modbus_view_t;
+
+/* Byte order of the 32 and 64 bit values in the registers. For 64 bit values
+ * the same order applies to the 8 bytes (e.g. CDAB is GHEFCDAB). */
+typedef enum {
+    MODBUS_ORDER_ABCD = 0, /* Big endian */
+    MODBUS_ORDER_DCBA,     /* Little endian */
+    MODBUS_ORDER_BADC,     /* Bytes swapped in each register */
+    MODBUS_ORDER_CDAB      /* Registers swapped */
+} modbus_order_t;
 
 typedef struct _modbus_mapping_t {
     int nb_bits;
@@ -182,6 +252,58 @@ typedef struct _modbus_mapping_t {
     uint16_t *tab_registers;
 } modbus_mapping_t;
 
+/* One sub-request of a read/write file record request. record_length is the
+ * number of registers, data points to record_length registers. */
+typedef struct _modbus_file_record {
+    uint16_t file_number;
+    uint16_t record_number;
+    uint16_t record_length;
+    uint16_t *data;
+} modbus_file_record_t;
+
+/* Storage behind the file record function codes of modbus_reply(). The
+ * callbacks return 0 on success or a MODBUS_EXCEPTION_* code which is sent
+ * back to the client. */
+typedef struct _modbus_file_storage {
+    int (*read)(void *user_data,
+                uint16_t file_number,
+                uint16_t record_number,
+                uint16_t record_length,
+                uint16_t *dest);
+    int (*write)(void *user_data,
+                 uint16_t file_number,
+                 uint16_t record_number,
+                 uint16_t record_length,
+                 const uint16_t *src);
+    void *user_data;
+} modbus_file_storage_t;
+
+/* Counters of a server, reported by MODBUS_FC_DIAGNOSTICS */
+typedef struct _modbus_diag_counters {
+    uint16_t bus_messages;
+    /* CRC errors */
+    uint16_t bus_comm_errors;
+    uint16_t bus_exceptions;
+    /* Messages addressed to the server or broadcast */
+    uint16_t server_messages;
+    uint16_t server_no_responses;
+    uint16_t server_naks;
+    uint16_t server_busy;
+    /* Messages longer than an ADU */
+    uint16_t bus_overruns;
+    /* Requests completed without exception (MODBUS_FC_GET_COMM_EVENT_COUNTER) */
+    uint16_t comm_events;
+} modbus_diag_counters_t;
+
+/* Response of MODBUS_FC_GET_COMM_EVENT_LOG, the most recent event first */
+typedef struct _modbus_comm_event_log {
+    uint16_t status;
+    uint16_t event_count;
+    uint16_t message_count;
+    int nb_events;
+    uint8_t events[MODBUS_MAX_COMM_EVENTS];
+} modbus_comm_event_log_t;
+
 typedef enum {
     MODBUS_ERROR_RECOVERY_NONE = 0,
     MODBUS_ERROR_RECOVERY_LINK = (1 << 1),
@@ -233,6 +355,10 @@ MODBUS_API int modbus_read_input_bits(modbus_t *ctx, int addr, int nb, uint8_t *
 MODBUS_API int modbus_read_registers(modbus_t *ctx, int addr, int nb, uint16_t *dest);
 MODBUS_API int
 modbus_read_input_registers(modbus_t *ctx, int addr, int nb, uint16_t *dest);
+MODBUS_API int modbus_read_registers_view(
+    modbus_t *ctx, int addr, int nb, uint8_t *rsp, modbus_view_t *view);
+MODBUS_API int modbus_read_input_registers_view(
+    modbus_t *ctx, int addr, int nb, uint8_t *rsp, modbus_view_t *view);
 MODBUS_API int modbus_write_bit(modbus_t *ctx, int coil_addr, int status);
 MODBUS_API int modbus_write_register(modbus_t *ctx, int reg_addr, const uint16_t value);
 MODBUS_API int modbus_write_bits(modbus_t *ctx, int addr, int nb, const uint8_t *data);
@@ -248,6 +374,27 @@ MODBUS_API int modbus_write_and_read_registers(modbus_t *ctx,
                                                int read_nb,
                                                uint16_t *dest);
 MODBUS_API int modbus_report_slave_id(modbus_t *ctx, int max_dest, uint8_t *dest);
+MODBUS_API int
+modbus_diagnostics(modbus_t *ctx, int sub_function, uint16_t data, uint16_t *dest);
+MODBUS_API int
+modbus_get_comm_event_counter(modbus_t *ctx, uint16_t *status, uint16_t *event_count);
+MODBUS_API int modbus_get_comm_event_log(modbus_t *ctx, modbus_comm_event_log_t *dest);
+MODBUS_API int modbus_read_file_record(
+    modbus_t *ctx, int file_number, int record_number, int nb, uint16_t *dest);
+MODBUS_API int modbus_write_file_record(
+    modbus_t *ctx, int file_number, int record_number, int nb, const uint16_t *src);
+MODBUS_API int
+modbus_read_file_records(modbus_t *ctx, modbus_file_record_t *records, int nb_records);
+MODBUS_API int modbus_write_file_records(modbus_t *ctx,
+                                         const modbus_file_record_t *records,
+                                         int nb_records);
+
+MODBUS_API modbus_prepared_t *
+modbus_prepare_read(modbus_t *ctx, int function, int addr, int nb, void *dest);
+MODBUS_API int modbus_prepared_send(modbus_prepared_t *prepared);
+MODBUS_API int modbus_prepared_receive(modbus_prepared_t *prepared);
+MODBUS_API int modbus_prepared_execute(modbus_prepared_t *prepared);
+MODBUS_API void modbus_prepared_free(modbus_prepared_t *prepared);
 
 MODBUS_API modbus_mapping_t *
 modbus_mapping_new_start_address(unsigned int start_bits,
@@ -278,8 +425,15 @@ MODBUS_API int modbus_reply(modbus_t *ctx,
                             modbus_mapping_t *mb_mapping);
 MODBUS_API int
 modbus_reply_exception(modbus_t *ctx, const uint8_t *req, unsigned int exception_code);
+MODBUS_API int modbus_set_file_storage(modbus_t *ctx,
+                                       const modbus_file_storage_t *storage);
+MODBUS_API int modbus_get_diag_counters(modbus_t *ctx, modbus_diag_counters_t *dest);
 MODBUS_API int modbus_enable_quirks(modbus_t *ctx, unsigned int quirks_mask);
 MODBUS_API int modbus_disable_quirks(modbus_t *ctx, unsigned int quirks_mask);
+MODBUS_API int modbus_set_read_ahead(modbus_t *ctx, int enable);
+MODBUS_API int modbus_get_read_ahead_length(modbus_t *ctx);
+MODBUS_API int modbus_cork(modbus_t *ctx);
+MODBUS_API int modbus_uncork(modbus_t *ctx);
 
 /**
  * UTILS FUNCTIONS
@@ -332,13 +486,59 @@ MODBUS_API void modbus_set_float_dcba(float f, uint16_t *dest);
 MODBUS_API void modbus_set_float_badc(float f, uint16_t *dest);
 MODBUS_API void modbus_set_float_cdab(float f, uint16_t *dest);
 
+MODBUS_API int
+modbus_view_get_uint16(const modbus_view_t *view, int index, int nb, uint16_t *dest);
+MODBUS_API int modbus_view_get_uint32(
+    const modbus_view_t *view, int index, int nb, modbus_order_t order, uint32_t *dest);
+MODBUS_API int modbus_view_get_int32(
+    const modbus_view_t *view, int index, int nb, modbus_order_t order, int32_t *dest);
+MODBUS_API int modbus_view_get_int64(
+    const modbus_view_t *view, int index, int nb, modbus_order_t order, int64_t *dest);
+MODBUS_API int modbus_view_get_float(
+    const modbus_view_t *view, int index, int nb, modbus_order_t order, float *dest);
+MODBUS_API int modbus_view_get_double(
+    const modbus_view_t *view, int index, int nb, modbus_order_t order, double *dest);
+
+MODBUS_API int
+modbus_get_floats(const uint16_t *src, int nb, modbus_order_t order, float *dest);
+MODBUS_API int
+modbus_set_floats(const float *src, int nb, modbus_order_t order, uint16_t *dest);
+MODBUS_API int
+modbus_get_doubles(const uint16_t *src, int nb, modbus_order_t order, double *dest);
+MODBUS_API int
+modbus_set_doubles(const double *src, int nb, modbus_order_t order, uint16_t *dest);
+MODBUS_API int
+modbus_get_int32s(const uint16_t *src, int nb, modbus_order_t order, int32_t *dest);
+MODBUS_API int
+modbus_set_int32s(const int32_t *src, int nb, modbus_order_t order, uint16_t *dest);
+MODBUS_API int
+modbus_get_uint32s(const uint16_t *src, int nb, modbus_order_t order, uint32_t *dest);
+MODBUS_API int
+modbus_set_uint32s(const uint32_t *src, int nb, modbus_order_t order, uint16_t *dest);
+MODBUS_API int
+modbus_get_int64s(const uint16_t *src, int nb, modbus_order_t order, int64_t *dest);
+MODBUS_API int
+modbus_set_int64s(const int64_t *src, int nb, modbus_order_t order, uint16_t *dest);
+MODBUS_API int
+modbus_get_uint64s(const uint16_t *src, int nb, modbus_order_t order, uint64_t *dest);
+MODBUS_API int
+modbus_set_uint64s(const uint64_t *src, int nb, modbus_order_t order, uint16_t *dest);
+
 #ifndef PICO_W
 #include "modbus-rtu.h"
 #include "modbus-tcp.h"
+#include "modbus-bus.h"
+#include "modbus-server.h"
+#include "modbus-poller.h"
+#include "modbus-pool.h"
 #else
 #include <errno.h>
 #include "modbus-pico-tcp.h"
 #endif
+#include "modbus-scan.h"
+#include "modbus-sched.h"
+#include "modbus-trace.h"
+#include "modbus-stats.h"
 
 MODBUS_END_DECLS
 
@@ -6,7 +6,8 @@
  * This file has been adapted from the libmodbus-file "bandwidth-client.c"
  * to test a modbus server running on a RP2040.
  *
- * Use tests/pico-bandwidth-server as the server to test this client.
+ * Use bandwidth-server-one or tests/pico-bandwidth-server as the server to
+ * test this client. See bench.h for the measures.
  *
  * The original copyright notice is below.
  */
@@ -18,106 +19,202 @@
 
 #include <stdio.h>
 #ifndef _MSC_VER
-#include <sys/time.h>
 #include <unistd.h>
 #endif
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
-#include <time.h>
 
 #include <modbus.h>
 
-#define G_MSEC_PER_SEC 1000
-
-static uint32_t gettime_ms(void)
-{
-    struct timeval tv;
-#if !defined(_MSC_VER)
-    gettimeofday(&tv, NULL);
-    return (uint32_t) tv.tv_sec * 1000 + tv.tv_usec / 1000;
-#else
-    return GetTickCount();
-#endif
-}
+#include "bench.h"
 
 enum {
     TCP,
     RTU
 };
 
-/* Tests based on PI-MBUS-300 documentation */
+enum {
+    FORMAT_TEXT,
+    FORMAT_JSON,
+    FORMAT_CSV
+};
+
+static void usage(const char *name)
+{
+    printf("Usage:\n  %s [tcp IP|rtu] [options]\n", name);
+    printf("  -m mix       request mix, e.g. rr=70,wr=30 of rb, rr, wb, wr and wrr\n");
+    printf("               (default: rb, rr and wrr one after the other)\n");
+    printf("  -s points    values per request (default: the maximum)\n");
+    printf("  -n requests  requests measured (default: 10000, rtu 100)\n");
+    printf("  -w requests  requests of warm-up (default: 100, rtu 10)\n");
+    printf("  -d depth     requests in flight, tcp only (default: 1)\n");
+    printf("  -r rate      open loop at rate requests/s (default: closed loop)\n");
+    printf("  -f format    text, json or csv (default: text)\n");
+    printf("  -o file      appends the json or csv line of each run to file\n");
+    printf("  -l label     label of the runs (default: the backend)\n");
+    printf("  -p port      port of the server, tcp only (default: 1502)\n");
+    printf("  -t ms        response timeout (default: 500, 1000 for the Pico-W)\n");
+    printf("  -e           reconnects when the connection is lost\n");
+    printf("  -a           reads the responses ahead (modbus_set_read_ahead)\n");
+    printf("  -T           records the messages in a trace ring (modbus_set_trace)\n");
+    printf("  Eg. %s tcp 10.0.0.1 -m rr=90,wr=10 -s 10 -r 500 -f json -o run.json\n", name);
+    printf("  Through impair-proxy: %s tcp 127.0.0.1 -p 1503 -e -t 300\n", name);
+}
+
+static int run(modbus_t *ctx, bench_config_t *config, int format, FILE *output)
+{
+    static int csv_header_done = 0;
+    bench_result_t result;
+
+    if (bench_measure(ctx, config, &result) == -1) {
+        fprintf(stderr, "%s\n", modbus_strerror(errno));
+        bench_free_result(&result);
+        return -1;
+    }
+
+    if (output != stdout || format == FORMAT_TEXT)
+        bench_print_text(stdout, config, &result);
+
+    if (format == FORMAT_JSON) {
+        bench_print_json(output, config, &result);
+    } else if (format == FORMAT_CSV) {
+        /* The header heads the output once, not a file appended to */
+        if (!csv_header_done) {
+            fseek(output, 0, SEEK_END);
+            if (output == stdout || ftell(output) <= 0)
+                fputs(BENCH_CSV_HEADER, output);
+            csv_header_done = 1;
+        }
+        bench_print_csv(output, config, &result);
+    }
+    fflush(output);
+
+    bench_free_result(&result);
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
-    uint8_t *tab_bit;
-    uint16_t *tab_reg;
+    static const char *default_mixes[] = { "rb", "rr", "wrr" };
+    bench_config_t config;
     modbus_t *ctx;
+    FILE *output = stdout;
+    const char *mix = NULL;
+    const char *filename = NULL;
+    const char *label = NULL;
+    char default_label[64];
+    int format = FORMAT_TEXT;
+    int use_backend = TCP;
+    char *ip_or_device = "127.0.0.1";
+    int port = 1502;
+    int timeout_ms = 0;
+    int read_ahead = 0;
+    modbus_trace_t *trace = NULL;
+    int nb_requests = 0;
+    int warmup = -1;
+    int rc = 0;
+    int opt;
     int i;
-    int nb_points;
-    double elapsed;
-    uint32_t start;
-    uint32_t end;
-    uint32_t bytes;
-#ifndef PICO_W_TESTS
-    uint32_t rate;
-#else
-    float rate;
-#endif
-    int rc;
-    int n_loop;
-    int use_backend;
-#ifdef PICO_W_TESTS
-    char *ip_or_device;
-#endif
 
-    if (argc > 1) {
-        if (strcmp(argv[1], "tcp") == 0) {
-            use_backend = TCP;
-#ifndef PICO_W_TESTS
-            n_loop = 100000;
-#else
-            if (argc > 2) {
-                ip_or_device = argv[2];
+    bench_init_config(&config);
+
+    while ((opt = getopt(argc, argv, "m:s:n:w:d:r:f:o:l:p:t:eaTh")) != -1) {
+        switch (opt) {
+        case 'm':
+            mix = optarg;
+            if (bench_parse_mix(&config, mix) == -1) {
+                fprintf(stderr, "Invalid mix: %s\n", mix);
+                exit(1);
+            }
+            break;
+        case 's':
+            config.nb_points = atoi(optarg);
+            break;
+        case 'n':
+            nb_requests = atoi(optarg);
+            break;
+        case 'w':
+            warmup = atoi(optarg);
+            break;
+        case 'd':
+            config.depth = atoi(optarg);
+            if (config.depth < 1 || config.depth > BENCH_MAX_DEPTH) {
+                fprintf(stderr, "The depth is 1 to %d\n", BENCH_MAX_DEPTH);
+                exit(1);
+            }
+            break;
+        case 'r':
+            config.rate = atoi(optarg);
+            break;
+        case 'f':
+            if (strcmp(optarg, "json") == 0) {
+                format = FORMAT_JSON;
+            } else if (strcmp(optarg, "csv") == 0) {
+                format = FORMAT_CSV;
+            } else if (strcmp(optarg, "text") == 0) {
+                format = FORMAT_TEXT;
             } else {
-                ip_or_device = "127.0.0.1";
+                usage(argv[0]);
+                exit(1);
             }
-            n_loop = 10;
-#endif
-        } else if (strcmp(argv[1], "rtu") == 0) {
+            break;
+        case 'o':
+            filename = optarg;
+            break;
+        case 'l':
+            label = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 't':
+            timeout_ms = atoi(optarg);
+            break;
+        case 'e':
+            config.recover = 1;
+            break;
+        case 'a':
+            read_ahead = 1;
+            break;
+        case 'T':
+            trace = modbus_trace_new(1024);
+            break;
+        default:
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+
+    if (optind < argc) {
+        if (strcmp(argv[optind], "tcp") == 0) {
+            use_backend = TCP;
+            if (optind + 1 < argc)
+                ip_or_device = argv[optind + 1];
+        } else if (strcmp(argv[optind], "rtu") == 0) {
             use_backend = RTU;
-            n_loop = 100;
         } else {
-#ifndef PICO_W_TESTS
-            printf("Usage:\n  %s [tcp|rtu] - Modbus client to measure data bandwidth\n\n",
-                   argv[0]);
-#else
-            printf("Usage:\n  %s [tcp IP|rtu]\n", argv[0]);
-            printf("  Eg. %s tcp 10.0.0.1\n", argv[0]);
-            printf("  or %s rtu\n", argv[0]);
-#endif
+            usage(argv[0]);
             exit(1);
         }
-    } else {
-        /* By default */
-        use_backend = TCP;
-#ifndef PICO_W_TESTS
-        n_loop = 100000;
-#else
-        ip_or_device = "127.0.0.1";
-        n_loop = 10;
-#endif
     }
 
     if (use_backend == TCP) {
-#ifndef PICO_W_TESTS
-        ctx = modbus_new_tcp("127.0.0.1", 1502);
-#else
-        ctx = modbus_new_tcp(ip_or_device, 1502);
-#endif
+        ctx = modbus_new_tcp(ip_or_device, port);
+        config.nb_requests = nb_requests > 0 ? nb_requests : 10000;
+        config.warmup = warmup >= 0 ? warmup : 100;
+        snprintf(default_label, sizeof(default_label), "tcp %s", ip_or_device);
     } else {
         ctx = modbus_new_rtu("/dev/ttyUSB1", 115200, 'N', 8, 1);
         modbus_set_slave(ctx, 1);
+        config.slave = 1;
+        /* No transaction ID to match the responses of a serial line */
+        config.depth = 1;
+        config.nb_requests = nb_requests > 0 ? nb_requests : 100;
+        config.warmup = warmup >= 0 ? warmup : 10;
+        snprintf(default_label, sizeof(default_label), "rtu");
     }
+    config.label = label != NULL ? label : default_label;
 
     if (modbus_connect(ctx) == -1) {
         fprintf(stderr, "Connection failed: %s\n", modbus_strerror(errno));
@@ -128,195 +225,43 @@ int main(int argc, char *argv[])
 #ifdef PICO_W_TESTS
     modbus_set_response_timeout(ctx, 1, 0);
 #endif
-
-    /* Allocate and initialize the memory to store the status */
-    tab_bit = (uint8_t *) malloc(MODBUS_MAX_READ_BITS * sizeof(uint8_t));
-    memset(tab_bit, 0, MODBUS_MAX_READ_BITS * sizeof(uint8_t));
-
-    /* Allocate and initialize the memory to store the registers */
-    tab_reg = (uint16_t *) malloc(MODBUS_MAX_READ_REGISTERS * sizeof(uint16_t));
-    memset(tab_reg, 0, MODBUS_MAX_READ_REGISTERS * sizeof(uint16_t));
-
-    printf("READ BITS\n\n");
-
-    nb_points = MODBUS_MAX_READ_BITS;
-    start = gettime_ms();
-    for (i = 0; i < n_loop; i++) {
-        rc = modbus_read_bits(ctx, 0, nb_points, tab_bit);
-        if (rc == -1) {
-            fprintf(stderr, "%s\n", modbus_strerror(errno));
-            return -1;
-        }
+    if (timeout_ms > 0)
+        modbus_set_response_timeout(ctx, timeout_ms / 1000, (timeout_ms % 1000) * 1000);
+    if (config.recover)
+        modbus_set_error_recovery(ctx, MODBUS_ERROR_RECOVERY_LINK);
+    if (read_ahead)
+        modbus_set_read_ahead(ctx, TRUE);
+    if (trace != NULL) {
+        printf("Trace: %.1f ns per record\n", bench_trace_cost());
+        modbus_set_trace(ctx, trace);
     }
-    end = gettime_ms();
-    elapsed = end - start;
 
-    rate = (n_loop * nb_points) * G_MSEC_PER_SEC / (end - start);
-    printf("Transfer rate in points/seconds:\n");
-#ifndef PICO_W_TESTS
-    printf("* %d KiB/s\n", rate);
-#else
-    printf("* %.0f p/s\n", rate);
-#endif
-    printf("\n");
-
-    bytes = n_loop * (nb_points / 8) + ((nb_points % 8) ? 1 : 0);
-#ifndef PICO_W_TESTS
-    rate = bytes / 1024 * G_MSEC_PER_SEC / (end - start);
-#else
-    rate = (float)bytes / 1024 * G_MSEC_PER_SEC / (end - start);
-#endif
-    printf("Values:\n");
-    printf("* %d x %d values\n", n_loop, nb_points);
-    printf("* %.3f ms for %d bytes\n", elapsed, bytes);
-
-#ifndef PICO_W_TESTS
-    printf("* %d KiB/s\n", rate);
-#else
-    printf("* %.2f KiB/s\n", rate);
-#endif
-    printf("\n");
-
-    /* TCP: Query and response header and values */
-    bytes = 12 + 9 + (nb_points / 8) + ((nb_points % 8) ? 1 : 0);
-    printf("Values and TCP Modbus overhead:\n");
-    printf("* %d x %d bytes\n", n_loop, bytes);
-    bytes = n_loop * bytes;
-#ifndef PICO_W_TESTS
-    rate = bytes / 1024 * G_MSEC_PER_SEC / (end - start);
-#else
-    rate = (float)bytes / 1024 * G_MSEC_PER_SEC / (end - start);
-#endif
-    printf("* %.3f ms for %d bytes\n", elapsed, bytes);
-#ifndef PICO_W_TESTS
-    printf("* %d KiB/s\n", rate);
-#else
-    printf("* %.2f KiB/s\n", rate);
-#endif
-    printf("\n\n");
-
-    printf("READ REGISTERS\n\n");
-
-    nb_points = MODBUS_MAX_READ_REGISTERS;
-    start = gettime_ms();
-    for (i = 0; i < n_loop; i++) {
-        rc = modbus_read_registers(ctx, 0, nb_points, tab_reg);
-        if (rc == -1) {
-            fprintf(stderr, "%s\n", modbus_strerror(errno));
+    if (filename != NULL && format != FORMAT_TEXT) {
+        output = fopen(filename, "a");
+        if (output == NULL) {
+            fprintf(stderr, "Unable to open %s: %s\n", filename, strerror(errno));
+            modbus_close(ctx);
+            modbus_free(ctx);
             return -1;
         }
     }
-    end = gettime_ms();
-    elapsed = end - start;
-
-    rate = (n_loop * nb_points) * G_MSEC_PER_SEC / (end - start);
-    printf("Transfer rate in points/seconds:\n");
-#ifndef PICO_W_TESTS
-    printf("* %d KiB/s\n", rate);
-#else
-    printf("* %.0f p/s\n", rate);
-#endif
-    printf("\n");
 
-    bytes = n_loop * nb_points * sizeof(uint16_t);
-#ifndef PICO_W_TESTS
-    rate = bytes / 1024 * G_MSEC_PER_SEC / (end - start);
-#else
-    rate = (float)bytes / 1024 * G_MSEC_PER_SEC / (end - start);
-#endif
-    printf("Values:\n");
-    printf("* %d x %d values\n", n_loop, nb_points);
-    printf("* %.3f ms for %d bytes\n", elapsed, bytes);
-#ifndef PICO_W_TESTS
-    printf("* %d KiB/s\n", rate);
-#else
-    printf("* %.2f KiB/s\n", rate);
-#endif
-    printf("\n");
-
-    /* TCP:Query and response header and values */
-    bytes = 12 + 9 + (nb_points * sizeof(uint16_t));
-    printf("Values and TCP Modbus overhead:\n");
-    printf("* %d x %d bytes\n", n_loop, bytes);
-    bytes = n_loop * bytes;
-#ifndef PICO_W_TESTS
-    rate = bytes / 1024 * G_MSEC_PER_SEC / (end - start);
-#else
-    rate = (float)bytes / 1024 * G_MSEC_PER_SEC / (end - start);
-#endif
-    printf("* %.3f ms for %d bytes\n", elapsed, bytes);
-#ifndef PICO_W_TESTS
-    printf("* %d KiB/s\n", rate);
-#else
-    printf("* %.2f KiB/s\n", rate);
-#endif
-    printf("\n\n");
-
-    printf("WRITE AND READ REGISTERS\n\n");
-
-    nb_points = MODBUS_MAX_WR_WRITE_REGISTERS;
-    start = gettime_ms();
-    for (i = 0; i < n_loop; i++) {
-        rc = modbus_write_and_read_registers(
-            ctx, 0, nb_points, tab_reg, 0, nb_points, tab_reg);
-        if (rc == -1) {
-            fprintf(stderr, "%s\n", modbus_strerror(errno));
-            return -1;
+    if (mix != NULL) {
+        rc = run(ctx, &config, format, output);
+    } else {
+        for (i = 0; i < 3 && rc == 0; i++) {
+            bench_parse_mix(&config, default_mixes[i]);
+            rc = run(ctx, &config, format, output);
         }
     }
-    end = gettime_ms();
-    elapsed = end - start;
 
-    rate = (n_loop * nb_points) * G_MSEC_PER_SEC / (end - start);
-    printf("Transfer rate in points/seconds:\n");
-#ifndef PICO_W_TESTS
-    printf("* %d KiB/s\n", rate);
-#else
-    printf("* %.0f p/s\n", rate);
-#endif
-    printf("\n");
-
-    bytes = n_loop * nb_points * sizeof(uint16_t);
-#ifndef PICO_W_TESTS
-    rate = bytes / 1024 * G_MSEC_PER_SEC / (end - start);
-#else
-    rate = (float)bytes / 1024 * G_MSEC_PER_SEC / (end - start);
-#endif
-    printf("Values:\n");
-    printf("* %d x %d values\n", n_loop, nb_points);
-    printf("* %.3f ms for %d bytes\n", elapsed, bytes);
-#ifndef PICO_W_TESTS
-    printf("* %d KiB/s\n", rate);
-#else
-    printf("* %.2f KiB/s\n", rate);
-#endif
-    printf("\n");
-
-    /* TCP:Query and response header and values */
-    bytes = 12 + 9 + (nb_points * sizeof(uint16_t));
-    printf("Values and TCP Modbus overhead:\n");
-    printf("* %d x %d bytes\n", n_loop, bytes);
-    bytes = n_loop * bytes;
-#ifndef PICO_W_TESTS
-    rate = bytes / 1024 * G_MSEC_PER_SEC / (end - start);
-#else
-    rate = (float)bytes / 1024 * G_MSEC_PER_SEC / (end - start);
-#endif
-    printf("* %.3f ms for %d bytes\n", elapsed, bytes);
-#ifndef PICO_W_TESTS
-    printf("* %d KiB/s\n", rate);
-#else
-    printf("* %.2f KiB/s\n", rate);
-#endif
-    printf("\n");
-
-    /* Free the memory */
-    free(tab_bit);
-    free(tab_reg);
+    if (output != stdout)
+        fclose(output);
 
     /* Close the connection */
     modbus_close(ctx);
     modbus_free(ctx);
+    modbus_trace_free(trace);
 
-    return 0;
+    return rc;
 }
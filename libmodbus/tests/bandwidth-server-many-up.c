@@ -5,6 +5,12 @@
  *
  * This file has been adapted from the libmodbus-file "bandwidth-server-many-up.c"
  *
+ * Serves the connections with the epoll engine of libmodbus (modbus_server_run)
+ * where it's available, or with the select() loop of the original file when
+ * run as "bandwidth-server-many-up select". "bandwidth-server-many-up workers 4"
+ * runs 4 threads sharing the port and the mapping. A last argument "uring"
+ * switches the engine to io_uring, e.g. "bandwidth-server-many-up workers 4 uring".
+ *
  * The original copyright notice is below.
  */
 /*
@@ -31,15 +37,30 @@
 #include <sys/socket.h>
 #endif
 
+#ifndef PICO_W_TESTS
 #define NB_CONNECTION 5
+#else
+/* Backlog of the connections opened at once by load-client */
+#define NB_CONNECTION 128
+#endif
+
+/* Connections served at once by the epoll engine */
+#define MAX_CONNECTIONS 4096
 
 static modbus_t *ctx = NULL;
 static modbus_mapping_t *mb_mapping;
+static modbus_server_t *server = NULL;
 
 static int server_socket = -1;
 
 static void close_sigint(int dummy)
 {
+    if (server != NULL) {
+        /* modbus_server_run() returns */
+        modbus_server_stop(server);
+        return;
+    }
+
     if (server_socket != -1) {
         close(server_socket);
     }
@@ -49,7 +70,7 @@ static void close_sigint(int dummy)
     exit(dummy);
 }
 
-int main(void)
+int main(int argc, char *argv[])
 {
     uint8_t query[MODBUS_TCP_MAX_ADU_LENGTH];
     int master_socket;
@@ -58,14 +79,15 @@ int main(void)
     fd_set rdset;
     /* Maximum file descriptor number */
     int fdmax;
+    int nb_workers = 0;
+    int uring = argc > 1 && strcmp(argv[argc - 1], "uring") == 0;
 
-#ifdef PICO_W_TESTS
-    printf("\nNot implemented for PICO-W!\n");
-    printf("Use \"bandwidth-server-one\" instead.\n\n");
-    exit(1);
-#endif
-
+#ifndef PICO_W_TESTS
     ctx = modbus_new_tcp("127.0.0.1", 1502);
+#else
+    // this directs modbus_tcp_listen() to listen on INADDR_ANY
+    ctx = modbus_new_tcp("0.0.0.0", 1502);
+#endif
 
     mb_mapping =
         modbus_mapping_new(MODBUS_MAX_READ_BITS, 0, MODBUS_MAX_READ_REGISTERS, 0);
@@ -75,14 +97,42 @@ int main(void)
         return -1;
     }
 
-    server_socket = modbus_tcp_listen(ctx, NB_CONNECTION);
-    if (server_socket == -1) {
-        fprintf(stderr, "Unable to listen TCP connection\n");
-        modbus_free(ctx);
-        return -1;
+    signal(SIGINT, close_sigint);
+
+    if (argc > 1 && strcmp(argv[1], "workers") == 0) {
+        nb_workers = argc > 2 ? atoi(argv[2]) : 4;
+        /* Each worker listens on its own socket */
+        server = modbus_server_new_workers(ctx, mb_mapping, nb_workers, MAX_CONNECTIONS);
+        if (server == NULL) {
+            fprintf(stderr, "Unable to start the workers: %s\n", modbus_strerror(errno));
+            close_sigint(1);
+        }
+    } else {
+        server_socket = modbus_tcp_listen(ctx, NB_CONNECTION);
+        if (server_socket == -1) {
+            fprintf(stderr, "Unable to listen TCP connection\n");
+            modbus_free(ctx);
+            return -1;
+        }
     }
 
-    signal(SIGINT, close_sigint);
+    if (argc < 2 || strcmp(argv[1], "select") != 0) {
+        if (server == NULL)
+            server = modbus_server_new(ctx, server_socket, mb_mapping, MAX_CONNECTIONS);
+        if (server != NULL) {
+            if (uring && modbus_server_set_engine(server, MODBUS_SERVER_ENGINE_IO_URING) == -1)
+                fprintf(stderr, "io_uring not available (%s), epoll is used\n",
+                        modbus_strerror(errno));
+            rc = modbus_server_run(server);
+            if (rc == -1)
+                fprintf(stderr, "Server failure: %s\n", modbus_strerror(errno));
+            printf("%d connections left\n", modbus_server_get_nb_connections(server));
+            modbus_server_free(server);
+            server = NULL;
+            close_sigint(rc == -1);
+        }
+        /* Not available, falls back to select() */
+    }
 
     /* Clear the reference set of socket */
     FD_ZERO(&refset);
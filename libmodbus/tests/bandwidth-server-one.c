@@ -8,6 +8,9 @@
  *
  * Use tests/pico-bandwidth-client as the client to query this server.
  *
+ * "bandwidth-server-one tcp batch" reads the requests ahead and sends the
+ * responses of the requests read at once together (modbus_cork()).
+ *
  * The original copyright notice is below.
  */
 /*
@@ -42,6 +45,7 @@ int main(int argc, char *argv[])
     modbus_mapping_t *mb_mapping = NULL;
     int rc;
     int use_backend;
+    int batch = argc > 2 && strcmp(argv[2], "batch") == 0;
 
     /* TCP */
     if (argc > 1) {
@@ -50,7 +54,7 @@ int main(int argc, char *argv[])
         } else if (strcmp(argv[1], "rtu") == 0) {
             use_backend = RTU;
         } else {
-            printf("Usage:\n  %s [tcp|rtu] - Modbus client to measure data bandwidth\n\n",
+            printf("Usage:\n  %s [tcp|rtu] [batch] - Modbus server to measure data bandwidth\n\n",
                    argv[0]);
             exit(1);
         }
@@ -84,13 +88,22 @@ int main(int argc, char *argv[])
         return -1;
     }
 
+    if (batch)
+        modbus_set_read_ahead(ctx, TRUE);
+
     for (;;) {
         uint8_t query[MODBUS_TCP_MAX_ADU_LENGTH];
 
-        rc = modbus_receive(ctx, query);
-        if (rc > 0) {
-            modbus_reply(ctx, query, rc, mb_mapping);
-        } else if (rc == -1) {
+        if (batch)
+            modbus_cork(ctx);
+        do {
+            rc = modbus_receive(ctx, query);
+            if (rc > 0)
+                modbus_reply(ctx, query, rc, mb_mapping);
+        } while (rc != -1 && modbus_get_read_ahead_length(ctx) > 0);
+        if (batch && modbus_uncork(ctx) == -1)
+            rc = -1;
+        if (rc == -1) {
             /* Connection closed by the client or error */
             break;
         }
@@ -0,0 +1,78 @@
+#!/usr/bin/env python3
+#
+# Copyright © Gerhard Schiller 2024, <gerhard.schiller@pm.me>
+#
+# SPDX-License-Identifier: BSD-3-Clause
+#
+# Compares the runs of bandwidth-client (or of the Pico-W bandwidth client,
+# the JSON lines of its output) with the ones of a baseline:
+#
+#   $ ./bench-compare.py baseline.json run.json [threshold %]
+#
+# The runs are matched on their label, mix, points, depth and rate. Exits with
+# 1 if the throughput or a latency percentile is worse than the baseline by
+# more than the threshold (10 % by default).
+
+import csv
+import json
+import sys
+
+KEY = ("label", "mix", "points", "depth", "rate")
+
+# Metric, True if higher is better
+METRICS = (
+    ("req_per_s", True),
+    ("kib_per_s", True),
+    ("p50_us", False),
+    ("p90_us", False),
+    ("p99_us", False),
+    ("p999_us", False),
+)
+
+
+def load(filename):
+    with open(filename, newline="") as f:
+        text = f.read()
+
+    if text.lstrip().startswith("{"):
+        runs = [json.loads(line) for line in text.splitlines() if line.startswith("{")]
+    else:
+        runs = list(csv.DictReader(text.splitlines()))
+
+    return {tuple(str(run[k]) for k in KEY): run for run in runs}
+
+
+def main():
+    if len(sys.argv) < 3:
+        print("Usage: %s baseline run [threshold %%]" % sys.argv[0])
+        return 2
+
+    baseline = load(sys.argv[1])
+    current = load(sys.argv[2])
+    threshold = float(sys.argv[3]) if len(sys.argv) > 3 else 10.0
+    regressions = 0
+
+    for key, run in current.items():
+        base = baseline.get(key)
+        print("%s mix %s, %s points, depth %s, rate %s" % key)
+        if base is None:
+            print("  not in the baseline\n")
+            continue
+
+        for metric, higher_is_better in METRICS:
+            old = float(base[metric])
+            new = float(run[metric])
+            delta = (new - old) * 100.0 / old if old else 0.0
+            worse = -delta if higher_is_better else delta
+            flag = ""
+            if worse > threshold:
+                flag = "  REGRESSION"
+                regressions += 1
+            print("  %-10s %12.1f %12.1f %+8.1f %%%s" % (metric, old, new, delta, flag))
+        print()
+
+    return 1 if regressions else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,509 @@
+/*
+ * Copyright © Gerhard Schiller 2024, <gerhard.schiller@pm.me>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef PICO_W
+#include "pico/stdlib.h"
+#else
+#include <sys/select.h>
+#include <time.h>
+#endif
+
+#include "bench.h"
+
+typedef struct {
+    const char *name;
+    int function;
+    int max_nb;
+} bench_op_t;
+
+static const bench_op_t bench_ops[BENCH_NB_OPS] = {
+    { "rb", MODBUS_FC_READ_COILS, MODBUS_MAX_READ_BITS },
+    { "rr", MODBUS_FC_READ_HOLDING_REGISTERS, MODBUS_MAX_READ_REGISTERS },
+    { "wb", MODBUS_FC_WRITE_MULTIPLE_COILS, MODBUS_MAX_WRITE_BITS },
+    { "wr", MODBUS_FC_WRITE_MULTIPLE_REGISTERS, MODBUS_MAX_WRITE_REGISTERS },
+    { "wrr", MODBUS_FC_WRITE_AND_READ_REGISTERS, MODBUS_MAX_WR_WRITE_REGISTERS },
+};
+
+uint64_t bench_time_us(void)
+{
+#ifdef PICO_W
+    return time_us_64();
+#else
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+#endif
+}
+
+void bench_sleep_until(uint64_t t)
+{
+    uint64_t now = bench_time_us();
+
+    if (t <= now)
+        return;
+#ifdef PICO_W
+    sleep_us(t - now);
+#else
+    {
+        struct timespec request;
+
+        request.tv_sec = (t - now) / 1000000;
+        request.tv_nsec = (long) ((t - now) % 1000000) * 1000;
+        nanosleep(&request, NULL);
+    }
+#endif
+}
+
+/* Parses a mix like "rr=70,wr=30", an operation without weight counts 1 */
+int bench_parse_mix(bench_config_t *config, const char *mix)
+{
+    char buf[sizeof(config->mix)];
+    char *token;
+    int total = 0;
+    int i;
+
+    if (strlen(mix) >= sizeof(buf)) {
+        errno = EINVAL;
+        return -1;
+    }
+    strcpy(buf, mix);
+    memset(config->weights, 0, sizeof(config->weights));
+
+    for (token = strtok(buf, ","); token != NULL; token = strtok(NULL, ",")) {
+        char *weight = strchr(token, '=');
+
+        if (weight != NULL)
+            *weight++ = '\0';
+
+        for (i = 0; i < BENCH_NB_OPS; i++) {
+            if (strcmp(token, bench_ops[i].name) == 0)
+                break;
+        }
+        if (i == BENCH_NB_OPS || (weight != NULL && atoi(weight) <= 0)) {
+            errno = EINVAL;
+            return -1;
+        }
+        config->weights[i] += weight != NULL ? atoi(weight) : 1;
+        total += config->weights[i];
+    }
+
+    if (total == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    strcpy(config->mix, mix);
+
+    return 0;
+}
+
+void bench_init_config(bench_config_t *config)
+{
+    memset(config, 0, sizeof(bench_config_t));
+    config->label = "";
+    bench_parse_mix(config, "rr");
+    config->depth = 1;
+    config->warmup = 100;
+    config->nb_requests = 1000;
+    config->slave = MODBUS_TCP_SLAVE;
+}
+
+/* Weighted choice of the next operation, reproducible from run to run */
+int bench_pick_op(const bench_config_t *config, uint32_t *seed)
+{
+    int total = 0;
+    int pick;
+    int i;
+
+    for (i = 0; i < BENCH_NB_OPS; i++) {
+        total += config->weights[i];
+    }
+
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    pick = *seed % total;
+
+    for (i = 0; i < BENCH_NB_OPS - 1; i++) {
+        if (pick < config->weights[i])
+            break;
+        pick -= config->weights[i];
+    }
+
+    return i;
+}
+
+static int bench_nb_points(const bench_config_t *config, int op)
+{
+    if (config->nb_points <= 0 || config->nb_points > bench_ops[op].max_nb)
+        return bench_ops[op].max_nb;
+
+    return config->nb_points;
+}
+
+/* Builds the raw request (slave, function and data) of op at address 0, the
+   values written are zeros */
+static int bench_build_request(const bench_config_t *config, int op, uint8_t *req)
+{
+    int nb = bench_nb_points(config, op);
+    int nb_bytes;
+    int length = 0;
+
+    req[length++] = config->slave;
+    req[length++] = bench_ops[op].function;
+    req[length++] = 0;
+    req[length++] = 0;
+    req[length++] = nb >> 8;
+    req[length++] = nb & 0xFF;
+
+    switch (op) {
+    case BENCH_WRITE_BITS:
+        nb_bytes = (nb + 7) / 8;
+        req[length++] = nb_bytes;
+        memset(req + length, 0, nb_bytes);
+        length += nb_bytes;
+        break;
+    case BENCH_WRITE_REGISTERS:
+        nb_bytes = nb * 2;
+        req[length++] = nb_bytes;
+        memset(req + length, 0, nb_bytes);
+        length += nb_bytes;
+        break;
+    case BENCH_WRITE_AND_READ_REGISTERS:
+        /* The same number of registers read */
+        req[length++] = 0;
+        req[length++] = 0;
+        req[length++] = nb >> 8;
+        req[length++] = nb & 0xFF;
+        nb_bytes = nb * 2;
+        req[length++] = nb_bytes;
+        memset(req + length, 0, nb_bytes);
+        length += nb_bytes;
+        break;
+    default:
+        break;
+    }
+
+    return length;
+}
+
+/* Runs nb requests of the mix, the result is only filled when not NULL.
+   Returns 0, or -1 when the connection is lost. */
+static int
+bench_run(modbus_t *ctx, const bench_config_t *config, int nb, bench_result_t *result)
+{
+    uint8_t req[MODBUS_MAX_PDU_LENGTH + 1];
+    uint8_t rsp[MODBUS_MAX_ADU_LENGTH];
+    /* Due time and operation of the requests in flight, in order */
+    uint64_t t_due[BENCH_MAX_DEPTH];
+    int ops[BENCH_MAX_DEPTH];
+    int depth = config->depth < 1                 ? 1
+                : config->depth > BENCH_MAX_DEPTH ? BENCH_MAX_DEPTH
+                                                  : config->depth;
+    int header_length = modbus_get_header_length(ctx);
+    uint32_t seed = 0x2545F491;
+    uint64_t t_start;
+    int nb_sent = 0;
+    int nb_done = 0;
+    int head = 0;
+    int in_flight = 0;
+    int rc;
+
+    t_start = bench_time_us();
+    while (nb_done < nb) {
+        uint64_t now = bench_time_us();
+        uint64_t t_next = config->rate > 0
+                              ? t_start + (uint64_t) nb_sent * 1000000 / config->rate
+                              : now;
+        int op;
+        int slot;
+
+        if (nb_sent < nb && in_flight < depth && t_next <= now) {
+            op = bench_pick_op(config, &seed);
+            rc = modbus_send_raw_request(ctx, req, bench_build_request(config, op, req));
+            if (rc == -1)
+                return -1;
+
+            slot = (head + in_flight) % BENCH_MAX_DEPTH;
+            t_due[slot] = t_next;
+            ops[slot] = op;
+            in_flight++;
+            nb_sent++;
+            if (result != NULL)
+                result->nb_bytes += rc;
+            continue;
+        }
+
+        if (in_flight == 0) {
+            /* Open loop, nothing to wait for until the next request */
+            bench_sleep_until(t_next);
+            continue;
+        }
+
+#ifndef PICO_W
+        if (nb_sent < nb && in_flight < depth) {
+            /* Sends the next request on time if no response comes before, the
+               receive reports a lost connection */
+            struct timeval tv;
+            fd_set rset;
+            int s = modbus_get_socket(ctx);
+
+            /* The responses read ahead are not on the socket anymore */
+            if (s >= 0 && modbus_get_read_ahead_length(ctx) == 0) {
+                FD_ZERO(&rset);
+                FD_SET(s, &rset);
+                tv.tv_sec = (t_next - now) / 1000000;
+                tv.tv_usec = (t_next - now) % 1000000;
+                if (select(s + 1, &rset, NULL, NULL, &tv) == 0)
+                    continue;
+            }
+        }
+#endif
+
+        rc = modbus_receive_confirmation(ctx, rsp);
+        now = bench_time_us();
+        if (rc == -1) {
+            int lost_link = errno == ECONNRESET || errno == ECONNREFUSED ||
+                            errno == EBADF || errno == EPIPE;
+
+            if (errno != ETIMEDOUT && !(config->recover && lost_link))
+                return -1;
+            /* The requests in flight are lost */
+            if (!lost_link)
+                modbus_flush(ctx);
+            if (result != NULL) {
+                result->nb_errors += in_flight;
+                result->nb_reconnects += lost_link;
+            }
+            nb_done += in_flight;
+            in_flight = 0;
+            continue;
+        }
+
+        op = ops[head];
+        if (result != NULL) {
+            result->nb_bytes += rc;
+            if (rc <= header_length || rsp[header_length] != bench_ops[op].function) {
+                /* Exception */
+                result->nb_errors++;
+            } else {
+                result->latencies[result->nb_latencies++] = (uint32_t) (now - t_due[head]);
+                result->nb_ops[op]++;
+            }
+        }
+        head = (head + 1) % BENCH_MAX_DEPTH;
+        in_flight--;
+        nb_done++;
+    }
+
+    if (result != NULL)
+        result->elapsed_us = bench_time_us() - t_start;
+
+    return 0;
+}
+
+int bench_compare_latencies(const void *a, const void *b)
+{
+    uint32_t la = *(const uint32_t *) a;
+    uint32_t lb = *(const uint32_t *) b;
+
+    return la < lb ? -1 : la > lb;
+}
+
+/* Nearest rank of the sorted latencies, permille is 999 for p99.9 */
+static uint32_t bench_percentile(const bench_result_t *result, int permille)
+{
+    int rank;
+
+    if (result->nb_latencies == 0)
+        return 0;
+
+    rank = (int) (((uint64_t) result->nb_latencies * permille + 999) / 1000);
+    if (rank < 1)
+        rank = 1;
+
+    return result->latencies[rank - 1];
+}
+
+/* Warms up, measures and sorts the latencies. Returns 0 or -1 as bench_run(). */
+int bench_measure(modbus_t *ctx, const bench_config_t *config, bench_result_t *result)
+{
+    memset(result, 0, sizeof(bench_result_t));
+    result->latencies = (uint32_t *) malloc(config->nb_requests * sizeof(uint32_t));
+    if (result->latencies == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if (config->warmup > 0 && bench_run(ctx, config, config->warmup, NULL) == -1)
+        return -1;
+
+    if (bench_run(ctx, config, config->nb_requests, result) == -1)
+        return -1;
+
+    qsort(result->latencies,
+          result->nb_latencies,
+          sizeof(uint32_t),
+          bench_compare_latencies);
+
+    return 0;
+}
+
+static double bench_mean(const bench_result_t *result)
+{
+    uint64_t sum = 0;
+    int i;
+
+    for (i = 0; i < result->nb_latencies; i++) {
+        sum += result->latencies[i];
+    }
+
+    return result->nb_latencies > 0 ? (double) sum / result->nb_latencies : 0;
+}
+
+double bench_throughput(const bench_result_t *result)
+{
+    return result->elapsed_us > 0 ? result->nb_latencies * 1e6 / result->elapsed_us : 0;
+}
+
+static double bench_kib_per_s(const bench_result_t *result)
+{
+    return result->elapsed_us > 0 ? result->nb_bytes / 1024.0 * 1e6 / result->elapsed_us
+                                  : 0;
+}
+
+void bench_print_text(FILE *stream,
+                      const bench_config_t *config,
+                      const bench_result_t *result)
+{
+    char points[16] = "max";
+
+    if (config->nb_points > 0)
+        snprintf(points, sizeof(points), "%d", config->nb_points);
+
+    fprintf(stream,
+            "%s mix %s, %s points, depth %d, %s\n",
+            config->label,
+            config->mix,
+            points,
+            config->depth,
+            config->rate > 0 ? "open loop" : "closed loop");
+    if (config->rate > 0)
+        fprintf(stream, "* rate %d req/s\n", config->rate);
+    fprintf(stream,
+            "* %d requests (%d errors, %d reconnections) in %.3f ms\n",
+            result->nb_latencies,
+            result->nb_errors,
+            result->nb_reconnects,
+            result->elapsed_us / 1000.0);
+    fprintf(stream,
+            "* %.1f req/s, %.2f KiB/s with the Modbus overhead\n",
+            bench_throughput(result),
+            bench_kib_per_s(result));
+    fprintf(stream,
+            "* latency us: min %u mean %.1f p50 %u p90 %u p99 %u p99.9 %u max %u\n\n",
+            result->nb_latencies > 0 ? result->latencies[0] : 0,
+            bench_mean(result),
+            bench_percentile(result, 500),
+            bench_percentile(result, 900),
+            bench_percentile(result, 990),
+            bench_percentile(result, 999),
+            bench_percentile(result, 1000));
+}
+
+/* One object per line, the runs can be appended to a file */
+void bench_print_json(FILE *stream,
+                      const bench_config_t *config,
+                      const bench_result_t *result)
+{
+    fprintf(stream,
+            "{\"label\":\"%s\",\"mix\":\"%s\",\"points\":%d,\"depth\":%d,"
+            "\"rate\":%d,\"warmup\":%d,\"requests\":%d,\"errors\":%d,"
+            "\"reconnects\":%d,\"elapsed_us\":%llu,\"req_per_s\":%.1f,\"kib_per_s\":%.2f,"
+            "\"min_us\":%u,\"mean_us\":%.1f,\"p50_us\":%u,\"p90_us\":%u,"
+            "\"p99_us\":%u,\"p999_us\":%u,\"max_us\":%u}\n",
+            config->label,
+            config->mix,
+            config->nb_points,
+            config->depth,
+            config->rate,
+            config->warmup,
+            result->nb_latencies,
+            result->nb_errors,
+            result->nb_reconnects,
+            (unsigned long long) result->elapsed_us,
+            bench_throughput(result),
+            bench_kib_per_s(result),
+            result->nb_latencies > 0 ? result->latencies[0] : 0,
+            bench_mean(result),
+            bench_percentile(result, 500),
+            bench_percentile(result, 900),
+            bench_percentile(result, 990),
+            bench_percentile(result, 999),
+            bench_percentile(result, 1000));
+}
+
+/* The label and the mix are quoted, the mix holds commas */
+void bench_print_csv(FILE *stream,
+                     const bench_config_t *config,
+                     const bench_result_t *result)
+{
+    fprintf(stream,
+            "\"%s\",\"%s\",%d,%d,%d,%d,%d,%d,%d,%llu,%.1f,%.2f,%u,%.1f,%u,%u,%u,%u,%u\n",
+            config->label,
+            config->mix,
+            config->nb_points,
+            config->depth,
+            config->rate,
+            config->warmup,
+            result->nb_latencies,
+            result->nb_errors,
+            result->nb_reconnects,
+            (unsigned long long) result->elapsed_us,
+            bench_throughput(result),
+            bench_kib_per_s(result),
+            result->nb_latencies > 0 ? result->latencies[0] : 0,
+            bench_mean(result),
+            bench_percentile(result, 500),
+            bench_percentile(result, 900),
+            bench_percentile(result, 990),
+            bench_percentile(result, 999),
+            bench_percentile(result, 1000));
+}
+
+void bench_free_result(bench_result_t *result)
+{
+    free(result->latencies);
+    result->latencies = NULL;
+}
+
+#define BENCH_TRACE_RECORDS 100000
+
+/* Nanoseconds taken to write a record of a trace ring, as done for each
+   message sent and received when a trace is set (modbus_set_trace()). Returns
+   -1 if the ring can't be allocated. */
+double bench_trace_cost(void)
+{
+    modbus_trace_t *trace = modbus_trace_new(256);
+    uint64_t start;
+    uint64_t elapsed;
+    int i;
+
+    if (trace == NULL)
+        return -1;
+
+    start = bench_time_us();
+    for (i = 0; i < BENCH_TRACE_RECORDS; i++) {
+        modbus_trace_add(trace, MODBUS_TRACE_SEND, 3, i, 1, 3, 12, 12);
+    }
+    elapsed = bench_time_us() - start;
+    modbus_trace_free(trace);
+
+    return 1000.0 * elapsed / BENCH_TRACE_RECORDS;
+}
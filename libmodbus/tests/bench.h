@@ -0,0 +1,94 @@
+/*
+ * Copyright © Gerhard Schiller 2024, <gerhard.schiller@pm.me>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Benchmark shared by bandwidth-client (workstation) and
+ * tests/pico-bandwidth-client (Pico-W): a request mix sent in closed loop
+ * (the next request when a response is received) or open loop (at a fixed
+ * rate), with up to depth requests in flight. The latencies are measured in
+ * microseconds, from the time a request was due to its response, so a server
+ * falling behind an open loop rate is not hidden.
+ *
+ * One line of JSON or CSV per run is written, bench-compare.py diffs two such
+ * files.
+ */
+
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <modbus.h>
+
+/* Operations of a request mix, named rb, rr, wb, wr and wrr */
+enum {
+    BENCH_READ_BITS,
+    BENCH_READ_REGISTERS,
+    BENCH_WRITE_BITS,
+    BENCH_WRITE_REGISTERS,
+    BENCH_WRITE_AND_READ_REGISTERS,
+    BENCH_NB_OPS
+};
+
+/* Requests in flight at most */
+#define BENCH_MAX_DEPTH 64
+
+typedef struct {
+    const char *label;
+    /* Weights of the operations, e.g. "rr=70,wr=30" */
+    char mix[64];
+    int weights[BENCH_NB_OPS];
+    /* Values per request, 0 for the maximum of each operation */
+    int nb_points;
+    int depth;
+    /* Requests per second, 0 for a closed loop */
+    int rate;
+    /* Requests sent before the measure */
+    int warmup;
+    int nb_requests;
+    int slave;
+    /* Carries on when the connection is lost, the context reconnects with
+       MODBUS_ERROR_RECOVERY_LINK */
+    int recover;
+} bench_config_t;
+
+typedef struct {
+    /* Latencies of the responses received, in microseconds */
+    uint32_t *latencies;
+    int nb_latencies;
+    int nb_ops[BENCH_NB_OPS];
+    int nb_errors;
+    int nb_reconnects;
+    /* ADU bytes sent and received */
+    uint64_t nb_bytes;
+    uint64_t elapsed_us;
+} bench_result_t;
+
+uint64_t bench_time_us(void);
+void bench_sleep_until(uint64_t t);
+int bench_parse_mix(bench_config_t *config, const char *mix);
+void bench_init_config(bench_config_t *config);
+int bench_pick_op(const bench_config_t *config, uint32_t *seed);
+int bench_compare_latencies(const void *a, const void *b);
+int bench_measure(modbus_t *ctx, const bench_config_t *config, bench_result_t *result);
+double bench_throughput(const bench_result_t *result);
+void bench_print_text(FILE *stream,
+                      const bench_config_t *config,
+                      const bench_result_t *result);
+void bench_print_json(FILE *stream,
+                      const bench_config_t *config,
+                      const bench_result_t *result);
+
+#define BENCH_CSV_HEADER                                                              \
+    "label,mix,points,depth,rate,warmup,requests,errors,reconnects,elapsed_us,req_per_s," \
+    "kib_per_s,min_us,mean_us,p50_us,p90_us,p99_us,p999_us,max_us\n"
+
+void bench_print_csv(FILE *stream,
+                     const bench_config_t *config,
+                     const bench_result_t *result);
+void bench_free_result(bench_result_t *result);
+double bench_trace_cost(void);
+
+#endif /* _BENCH_H_ */
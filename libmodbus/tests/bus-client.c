@@ -0,0 +1,331 @@
+/*
+ * Copyright © Gerhard Schiller 2024, <gerhard.schiller@pm.me>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Scans the slaves of a multi-drop RTU line, a read of registers each, first
+ * in sequence with modbus_set_slave() and the fixed response timeout, then
+ * with the bus scheduler of libmodbus (modbus_bus_new()). Dead slaves (-d)
+ * don't respond. Reports the reads per second, the refresh interval of the
+ * slaves responding and the utilisation of the line.
+ *
+ * Without a device, the line is simulated over a pseudo-terminal pair by a
+ * child process: each slave responds after the characters of the request and
+ * of the response at the baud rate, and its own turnaround.
+ */
+
+#define _XOPEN_SOURCE 600
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <modbus.h>
+
+typedef struct {
+    int nb_reads;
+    int nb_timeouts;
+    int nb_others;
+    uint64_t elapsed_us;
+    uint64_t busy_us;
+    uint64_t wire_us;
+} result_t;
+
+static int nb_slaves = 16;
+static int nb_dead = 2;
+static int baud = 19200;
+static int nb_registers = 10;
+static int seconds = 5;
+static int timeout_ms = 500;
+
+static uint64_t time_us(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/* The dead slaves are spread among the others */
+static int is_dead(int slave)
+{
+    return nb_dead > 0 && (slave - 1) % (nb_slaves / nb_dead) == 0 &&
+           (slave - 1) / (nb_slaves / nb_dead) < nb_dead;
+}
+
+static void usage(const char *name)
+{
+    printf("Usage:\n  %s [rtu DEVICE] [options]\n", name);
+    printf("  -n slaves    slaves on the line, from 1 (default: 16)\n");
+    printf("  -d slaves    dead slaves among them (default: 2)\n");
+    printf("  -b baud      baud rate (default: 19200)\n");
+    printf("  -r registers registers read from each slave (default: 10)\n");
+    printf("  -o ms        response timeout (default: 500)\n");
+    printf("  -t seconds   duration of each run (default: 5)\n");
+    printf("  Eg. %s rtu /dev/ttyUSB0 -n 32 -b 38400\n", name);
+}
+
+/* Slaves of the simulated line: reads of holding registers only */
+static void simulate(int fd, uint32_t char_time)
+{
+    uint8_t buf[MODBUS_RTU_MAX_ADU_LENGTH];
+    uint8_t rsp[MODBUS_RTU_MAX_ADU_LENGTH];
+    int length = 0;
+
+    for (;;) {
+        uint16_t crc;
+        int slave;
+        int nb;
+        int rc;
+        int i;
+
+        rc = read(fd, buf + length, sizeof(buf) - length);
+        if (rc <= 0)
+            _exit(0);
+        length += rc;
+        if (length < 8)
+            continue;
+
+        crc = modbus_rtu_crc16(0xFFFF, buf, 8);
+        slave = buf[0];
+        nb = (buf[4] << 8) | buf[5];
+        length = 0;
+        if (crc != 0 || buf[1] != MODBUS_FC_READ_HOLDING_REGISTERS || slave < 1 ||
+            slave > nb_slaves || is_dead(slave) || nb > MODBUS_MAX_READ_REGISTERS)
+            continue;
+
+        rsp[0] = slave;
+        rsp[1] = MODBUS_FC_READ_HOLDING_REGISTERS;
+        rsp[2] = 2 * nb;
+        for (i = 0; i < nb; i++) {
+            rsp[3 + 2 * i] = slave;
+            rsp[4 + 2 * i] = i;
+        }
+        crc = modbus_rtu_crc16(0xFFFF, rsp, 3 + 2 * nb);
+        rsp[3 + 2 * nb] = crc & 0xFF;
+        rsp[4 + 2 * nb] = crc >> 8;
+
+        /* Request on the line, turnaround of 1 to 4 ms and response on the
+           line */
+        usleep((8 + 5 + 2 * nb) * char_time + 1000 * (1 + slave % 4));
+        if (write(fd, rsp, 5 + 2 * nb) == -1)
+            _exit(1);
+    }
+}
+
+static void read_done(modbus_t *ctx, int rc, void *user_data)
+{
+    result_t *result = user_data;
+
+    if (rc != -1)
+        result->nb_reads++;
+    else if (errno == ETIMEDOUT)
+        result->nb_timeouts++;
+    else
+        result->nb_others++;
+}
+
+static void run_sequence(modbus_t *ctx, result_t *result, uint32_t char_time)
+{
+    uint16_t tab_reg[MODBUS_MAX_READ_REGISTERS];
+    uint64_t start = time_us();
+    uint64_t stop = start + seconds * 1000000ULL;
+
+    modbus_set_response_timeout(ctx, timeout_ms / 1000, (timeout_ms % 1000) * 1000);
+    while (time_us() < stop) {
+        int slave;
+
+        for (slave = 1; slave <= nb_slaves; slave++) {
+            uint64_t t = time_us();
+            int rc;
+
+            modbus_set_slave(ctx, slave);
+            rc = modbus_read_registers(ctx, 0, nb_registers, tab_reg);
+            read_done(ctx, rc, result);
+            result->busy_us += time_us() - t;
+            result->wire_us += (8 + (rc == -1 ? 0 : 5 + 2 * nb_registers)) * char_time;
+        }
+    }
+    result->elapsed_us = time_us() - start;
+}
+
+static void print_result(const char *mode, const result_t *result)
+{
+    double elapsed = result->elapsed_us / 1e6;
+    int nb_alive = nb_slaves - nb_dead;
+
+    printf("%-8s %8d %8d %6d %8.1f %11.1f %7.1f %7.1f\n",
+           mode,
+           result->nb_reads,
+           result->nb_timeouts,
+           result->nb_others,
+           result->nb_reads / elapsed,
+           result->nb_reads > 0 ? 1000.0 * elapsed * nb_alive / result->nb_reads : 0,
+           100.0 * result->busy_us / result->elapsed_us,
+           100.0 * result->wire_us / result->elapsed_us);
+}
+
+static void run_bus(modbus_t *ctx, result_t *result, uint16_t *tab_reg)
+{
+    modbus_bus_t *bus;
+    modbus_bus_stats_t stats;
+    int slave;
+
+    modbus_set_response_timeout(ctx, timeout_ms / 1000, (timeout_ms % 1000) * 1000);
+    bus = modbus_bus_new(ctx);
+    if (bus == NULL) {
+        fprintf(stderr, "Unable to create the bus: %s\n", modbus_strerror(errno));
+        exit(1);
+    }
+
+    /* Each slave read again as soon as possible */
+    for (slave = 1; slave <= nb_slaves; slave++) {
+        if (modbus_bus_add_read(bus,
+                                slave,
+                                MODBUS_FC_READ_HOLDING_REGISTERS,
+                                0,
+                                nb_registers,
+                                tab_reg + (slave - 1) * nb_registers,
+                                0,
+                                read_done,
+                                result) == -1) {
+            fprintf(stderr, "Slave %d: %s\n", slave, modbus_strerror(errno));
+            exit(1);
+        }
+    }
+
+    modbus_bus_run(bus, seconds * 1000000);
+    modbus_bus_get_stats(bus, &stats);
+    result->elapsed_us = stats.elapsed_us;
+    result->busy_us = stats.busy_us;
+    result->wire_us = stats.wire_us;
+    print_result("bus", result);
+
+    printf("         %d quarantined, %.0f ms lost in timeouts\n",
+           stats.nb_quarantined,
+           stats.timeout_us / 1000.0);
+    for (slave = 1; slave <= nb_slaves; slave++) {
+        modbus_bus_slave_stats_t slave_stats;
+
+        modbus_bus_get_slave_stats(bus, slave, &slave_stats);
+        if (slave_stats.quarantined)
+            continue;
+        printf("         slave %3d: turnaround %u us (max %u us), timeout %u us\n",
+               slave,
+               slave_stats.turnaround_avg,
+               slave_stats.turnaround_max,
+               slave_stats.timeout);
+    }
+    modbus_bus_free(bus);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *device = NULL;
+    uint16_t *tab_reg;
+    modbus_t *ctx;
+    result_t result;
+    uint32_t char_time;
+    pid_t pid = -1;
+    int opt;
+
+    if (argc > 2 && strcmp(argv[1], "rtu") == 0) {
+        device = argv[2];
+        argv += 2;
+        argc -= 2;
+    }
+
+    while ((opt = getopt(argc, argv, "n:d:b:r:o:t:h")) != -1) {
+        switch (opt) {
+        case 'n':
+            nb_slaves = atoi(optarg);
+            break;
+        case 'd':
+            nb_dead = atoi(optarg);
+            break;
+        case 'b':
+            baud = atoi(optarg);
+            break;
+        case 'r':
+            nb_registers = atoi(optarg);
+            break;
+        case 'o':
+            timeout_ms = atoi(optarg);
+            break;
+        case 't':
+            seconds = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            exit(opt == 'h' ? 0 : 1);
+        }
+    }
+    if (nb_slaves <= 0 || nb_slaves > 247 || nb_dead < 0 || nb_dead >= nb_slaves ||
+        baud <= 0 || nb_registers <= 0 || nb_registers > MODBUS_MAX_READ_REGISTERS ||
+        timeout_ms <= 0 || seconds <= 0) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    /* Start, 8 data bits, no parity and a stop bit */
+    char_time = 10 * 1000000 / baud;
+
+    if (device == NULL) {
+        int master = posix_openpt(O_RDWR | O_NOCTTY);
+
+        if (master == -1 || grantpt(master) == -1 || unlockpt(master) == -1) {
+            fprintf(stderr, "Unable to open a pseudo-terminal: %s\n", strerror(errno));
+            exit(1);
+        }
+        device = ptsname(master);
+        pid = fork();
+        if (pid == 0)
+            simulate(master, char_time);
+        printf("Simulated line on %s, ", device);
+    }
+
+    ctx = modbus_new_rtu(device, baud, 'N', 8, 1);
+    if (ctx == NULL || modbus_connect(ctx) == -1) {
+        fprintf(stderr, "Unable to open %s: %s\n", device, modbus_strerror(errno));
+        exit(1);
+    }
+    tab_reg = calloc(nb_slaves * nb_registers, sizeof(uint16_t));
+
+    printf("%d slaves (%d dead) at %d bauds, %d registers each\n",
+           nb_slaves,
+           nb_dead,
+           baud,
+           nb_registers);
+    printf("%-8s %8s %8s %6s %8s %11s %7s %7s\n",
+           "mode",
+           "reads",
+           "timeouts",
+           "others",
+           "reads/s",
+           "refresh (ms)",
+           "busy %",
+           "wire %");
+
+    memset(&result, 0, sizeof(result));
+    run_sequence(ctx, &result, char_time);
+    print_result("sequence", &result);
+
+    memset(&result, 0, sizeof(result));
+    run_bus(ctx, &result, tab_reg);
+
+    modbus_close(ctx);
+    modbus_free(ctx);
+    free(tab_reg);
+    if (pid > 0) {
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+    }
+
+    return 0;
+}
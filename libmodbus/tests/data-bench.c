@@ -0,0 +1,130 @@
+/*
+ * Copyright © Gerhard Schiller 2024, <gerhard.schiller@pm.me>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Compares the bulk conversions of modbus-data.c (modbus_get_floats...) with
+ * a loop over the single value functions and macros. No server is needed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <modbus.h>
+
+/* A device with a few hundred 32 bit values */
+#define NB_VALUES 500
+#define NB_LOOPS  20000
+
+typedef float (*get_float_fn)(const uint16_t *src);
+
+static uint16_t tab_registers[4 * NB_VALUES];
+static float tab_float[NB_VALUES];
+static int32_t tab_int32[NB_VALUES];
+static int64_t tab_int64[NB_VALUES];
+
+/* Keeps the results alive */
+static volatile uint32_t sink;
+
+static double gettime_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void print_result(const char *name, double single, double bulk)
+{
+    printf("%-28s %8.2f %8.2f %7.1fx\n",
+           name,
+           single / ((double) NB_LOOPS * NB_VALUES),
+           bulk / ((double) NB_LOOPS * NB_VALUES),
+           single / bulk);
+}
+
+static void bench_float(const char *name, get_float_fn get_float, modbus_order_t order)
+{
+    double start;
+    double single;
+    double bulk;
+    int loop;
+    int i;
+
+    start = gettime_ns();
+    for (loop = 0; loop < NB_LOOPS; loop++) {
+        for (i = 0; i < NB_VALUES; i++) {
+            tab_float[i] = get_float(tab_registers + 2 * i);
+        }
+        sink += (uint32_t) tab_float[loop % NB_VALUES];
+    }
+    single = gettime_ns() - start;
+
+    start = gettime_ns();
+    for (loop = 0; loop < NB_LOOPS; loop++) {
+        modbus_get_floats(tab_registers, NB_VALUES, order, tab_float);
+        sink += (uint32_t) tab_float[loop % NB_VALUES];
+    }
+    bulk = gettime_ns() - start;
+
+    print_result(name, single, bulk);
+}
+
+int main(void)
+{
+    double start;
+    double single;
+    double bulk;
+    int loop;
+    int i;
+
+    for (i = 0; i < 4 * NB_VALUES; i++) {
+        tab_registers[i] = (uint16_t) rand();
+    }
+
+    printf("%d values, ns per value\n\n", NB_VALUES);
+    printf("%-28s %8s %8s %8s\n", "conversion", "single", "bulk", "speedup");
+
+    bench_float("float ABCD", modbus_get_float_abcd, MODBUS_ORDER_ABCD);
+    bench_float("float DCBA", modbus_get_float_dcba, MODBUS_ORDER_DCBA);
+    bench_float("float BADC", modbus_get_float_badc, MODBUS_ORDER_BADC);
+    bench_float("float CDAB", modbus_get_float_cdab, MODBUS_ORDER_CDAB);
+
+    start = gettime_ns();
+    for (loop = 0; loop < NB_LOOPS; loop++) {
+        for (i = 0; i < NB_VALUES; i++) {
+            tab_int32[i] = MODBUS_GET_INT32_FROM_INT16(tab_registers, 2 * i);
+        }
+        sink += tab_int32[loop % NB_VALUES];
+    }
+    single = gettime_ns() - start;
+
+    start = gettime_ns();
+    for (loop = 0; loop < NB_LOOPS; loop++) {
+        modbus_get_int32s(tab_registers, NB_VALUES, MODBUS_ORDER_ABCD, tab_int32);
+        sink += tab_int32[loop % NB_VALUES];
+    }
+    bulk = gettime_ns() - start;
+    print_result("int32 ABCD (macro)", single, bulk);
+
+    start = gettime_ns();
+    for (loop = 0; loop < NB_LOOPS; loop++) {
+        for (i = 0; i < NB_VALUES; i++) {
+            tab_int64[i] = MODBUS_GET_INT64_FROM_INT16(tab_registers, 4 * i);
+        }
+        sink += (uint32_t) tab_int64[loop % NB_VALUES];
+    }
+    single = gettime_ns() - start;
+
+    start = gettime_ns();
+    for (loop = 0; loop < NB_LOOPS; loop++) {
+        modbus_get_int64s(tab_registers, NB_VALUES, MODBUS_ORDER_ABCD, tab_int64);
+        sink += (uint32_t) tab_int64[loop % NB_VALUES];
+    }
+    bulk = gettime_ns() - start;
+    print_result("int64 ABCD (macro)", single, bulk);
+
+    return 0;
+}
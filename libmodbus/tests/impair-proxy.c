@@ -0,0 +1,580 @@
+/*
+ * Copyright © Gerhard Schiller 2024, <gerhard.schiller@pm.me>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * TCP proxy impairing the link between a client and a server as a lossy WiFi
+ * does: delay and jitter, a bandwidth cap, packet losses and connection
+ * resets. The clients connect to the proxy instead of the server:
+ *
+ *   $ ./bandwidth-server-many-up &
+ *   $ ./impair-proxy -d 5 -j 3 -L 1 -x 0.1 &
+ *   $ ./bandwidth-client tcp 127.0.0.1 -p 1503 -e
+ *
+ * TCP does not lose data, the segment of a lost packet comes once the sender
+ * retransmits it. So a loss delays the data by a retransmission timeout,
+ * doubled on each loss of the same data, and the data behind it waits too.
+ * The order of the stream is kept whatever the jitter.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Enough for load-client with all its connections */
+#define MAX_SESSIONS 256
+/* Read at once, a segment of an ethernet link */
+#define CHUNK_SIZE 1460
+/* Data queued in a direction before the proxy stops reading its source */
+#define MAX_QUEUED 65536
+
+typedef struct chunk {
+    struct chunk *next;
+    uint64_t t_due;
+    int length;
+    int offset;
+    uint8_t data[CHUNK_SIZE];
+} chunk_t;
+
+/* A direction of a session, from the source to the sink */
+typedef struct {
+    int source;
+    int sink;
+    chunk_t *head;
+    chunk_t *tail;
+    int queued;
+    int eof;
+    int shut;
+    /* The time the link is free again and the last chunk is delivered */
+    uint64_t t_link;
+    uint64_t t_last;
+} direction_t;
+
+typedef struct {
+    int used;
+    int id;
+    uint64_t t_reset;
+    direction_t up;
+    direction_t down;
+} session_t;
+
+typedef struct {
+    uint64_t delay_us;
+    uint64_t jitter_us;
+    uint64_t rate;
+    double loss;
+    uint64_t rto_us;
+    double reset;
+    uint64_t lifetime_us;
+} impairment_t;
+
+typedef struct {
+    int nb_sessions;
+    uint64_t nb_bytes_up;
+    uint64_t nb_bytes_down;
+    uint64_t nb_chunks;
+    uint64_t nb_losses;
+    int nb_resets;
+} stats_t;
+
+static impairment_t impairment = { 0, 0, 0, 0.0, 200000, 0.0, 0 };
+static session_t sessions[MAX_SESSIONS];
+static stats_t stats;
+static uint32_t seed = 0x2545F491;
+static int verbose = 0;
+static volatile sig_atomic_t done = 0;
+
+static void usage(const char *name)
+{
+    printf("Usage:\n  %s [options]\n", name);
+    printf("  -l port       port of the proxy (default: 1503)\n");
+    printf("  -t host:port  server (default: 127.0.0.1:1502)\n");
+    printf("  -d ms         delay each way (default: 0)\n");
+    printf("  -j ms         jitter, the delay varies of +/- ms (default: 0)\n");
+    printf("  -b kbit/s     bandwidth each way (default: no cap)\n");
+    printf("  -L percent    packets lost, delivered after a retransmission\n");
+    printf("  -R ms         retransmission timeout of a loss (default: 200)\n");
+    printf("  -x percent    packets resetting the connection\n");
+    printf("  -k ms         resets each connection after ms\n");
+    printf("  -s seed       seed of the random impairments\n");
+    printf("  -v            prints the sessions opened and closed\n");
+    printf("  Eg. %s -d 5 -j 3 -b 1000 -L 1 -x 0.1\n", name);
+}
+
+static uint64_t time_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Uniform in [0, 1[, xorshift32 */
+static double random_unit(void)
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return (seed >> 8) / 16777216.0;
+}
+
+static void on_signal(int sig)
+{
+    (void) sig;
+    done = 1;
+}
+
+static void set_nonblocking(int s)
+{
+    int one = 1;
+
+    fcntl(s, F_SETFL, fcntl(s, F_GETFL, 0) | O_NONBLOCK);
+    /* The proxy decides when the data leaves */
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+static int connect_server(const char *host, const char *port)
+{
+    struct addrinfo hints;
+    struct addrinfo *ai;
+    int s;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &ai) != 0) {
+        errno = EHOSTUNREACH;
+        return -1;
+    }
+
+    s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (s != -1 && connect(s, ai->ai_addr, ai->ai_addrlen) == -1) {
+        close(s);
+        s = -1;
+    }
+    freeaddrinfo(ai);
+
+    return s;
+}
+
+static void free_chunks(direction_t *dir)
+{
+    chunk_t *chunk;
+
+    while (dir->head != NULL) {
+        chunk = dir->head;
+        dir->head = chunk->next;
+        free(chunk);
+    }
+    dir->tail = NULL;
+    dir->queued = 0;
+}
+
+/* Closes the session, with a RST on both sides if reset */
+static void close_session(session_t *session, int reset)
+{
+    struct linger linger = { 1, 0 };
+
+    if (reset) {
+        setsockopt(session->up.source, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+        setsockopt(session->up.sink, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+        stats.nb_resets++;
+    }
+    close(session->up.source);
+    close(session->up.sink);
+    free_chunks(&session->up);
+    free_chunks(&session->down);
+    session->used = 0;
+
+    if (verbose)
+        printf("session %d %s\n", session->id, reset ? "reset" : "closed");
+}
+
+static void open_session(int listener, const char *host, const char *port)
+{
+    session_t *session = NULL;
+    uint64_t now = time_us();
+    int client;
+    int server;
+    int i;
+
+    client = accept(listener, NULL, NULL);
+    if (client == -1)
+        return;
+
+    for (i = 0; i < MAX_SESSIONS; i++) {
+        if (!sessions[i].used) {
+            session = &sessions[i];
+            break;
+        }
+    }
+
+    server = session != NULL ? connect_server(host, port) : -1;
+    if (server == -1) {
+        fprintf(stderr, "Unable to open a session: %s\n",
+                session != NULL ? strerror(errno) : "too many sessions");
+        close(client);
+        return;
+    }
+    set_nonblocking(client);
+    set_nonblocking(server);
+
+    memset(session, 0, sizeof(session_t));
+    session->used = 1;
+    session->id = ++stats.nb_sessions;
+    session->t_reset = impairment.lifetime_us > 0 ? now + impairment.lifetime_us : 0;
+    session->up.source = client;
+    session->up.sink = server;
+    session->up.t_link = now;
+    session->up.t_last = now;
+    session->down.source = server;
+    session->down.sink = client;
+    session->down.t_link = now;
+    session->down.t_last = now;
+
+    if (verbose)
+        printf("session %d opened\n", session->id);
+}
+
+/* Queues the chunk read with its time of delivery, returns 1 if it resets the
+   connection */
+static int impair(direction_t *dir, chunk_t *chunk, uint64_t now)
+{
+    uint64_t t_due;
+    uint64_t rto;
+
+    if (impairment.reset > 0 && random_unit() * 100 < impairment.reset) {
+        free(chunk);
+        return 1;
+    }
+
+    /* Serialization at the rate of the link */
+    if (dir->t_link < now)
+        dir->t_link = now;
+    if (impairment.rate > 0)
+        dir->t_link += chunk->length * 1000000ULL / impairment.rate;
+    t_due = dir->t_link + impairment.delay_us;
+
+    if (impairment.jitter_us > 0) {
+        int64_t jitter = (int64_t) ((random_unit() * 2 - 1) * impairment.jitter_us);
+        t_due = jitter < 0 && (uint64_t) -jitter > t_due - now ? now : t_due + jitter;
+    }
+
+    /* Retransmitted after a timeout doubled on each loss */
+    for (rto = impairment.rto_us; impairment.loss > 0 && random_unit() * 100 < impairment.loss;
+         rto *= 2) {
+        t_due += rto;
+        stats.nb_losses++;
+    }
+
+    /* In order, whatever the jitter */
+    if (t_due < dir->t_last)
+        t_due = dir->t_last;
+    dir->t_last = t_due;
+
+    chunk->t_due = t_due;
+    chunk->next = NULL;
+    if (dir->tail != NULL)
+        dir->tail->next = chunk;
+    else
+        dir->head = chunk;
+    dir->tail = chunk;
+    dir->queued += chunk->length;
+    stats.nb_chunks++;
+
+    return 0;
+}
+
+/* Returns -1 if the connection is lost, 1 if it is reset and 0 otherwise */
+static int receive(direction_t *dir, uint64_t now, uint64_t *nb_bytes)
+{
+    chunk_t *chunk;
+    ssize_t rc;
+
+    chunk = malloc(sizeof(chunk_t));
+    if (chunk == NULL)
+        return 0;
+
+    rc = recv(dir->source, chunk->data, CHUNK_SIZE, 0);
+    if (rc <= 0) {
+        free(chunk);
+        if (rc == 0) {
+            dir->eof = 1;
+            return 0;
+        }
+        return errno == EAGAIN || errno == EINTR ? 0 : -1;
+    }
+    chunk->length = rc;
+    chunk->offset = 0;
+    *nb_bytes += rc;
+
+    return impair(dir, chunk, now);
+}
+
+/* Delivers the chunks due, returns -1 if the connection is lost */
+static int deliver(direction_t *dir, uint64_t now)
+{
+    chunk_t *chunk;
+    ssize_t rc;
+
+    while (dir->head != NULL && dir->head->t_due <= now) {
+        chunk = dir->head;
+        rc = send(dir->sink, chunk->data + chunk->offset, chunk->length - chunk->offset,
+                  MSG_NOSIGNAL);
+        if (rc == -1)
+            return errno == EAGAIN || errno == EINTR ? 0 : -1;
+
+        chunk->offset += rc;
+        if (chunk->offset < chunk->length)
+            return 0;
+
+        dir->head = chunk->next;
+        if (dir->head == NULL)
+            dir->tail = NULL;
+        dir->queued -= chunk->length;
+        free(chunk);
+    }
+
+    if (dir->eof && dir->head == NULL && !dir->shut) {
+        shutdown(dir->sink, SHUT_WR);
+        dir->shut = 1;
+    }
+
+    return 0;
+}
+
+static void add_fd(struct pollfd *fds, int *nfds, int fd, short events)
+{
+    /* Ignored, a socket at the end of its stream keeps signaling it */
+    fds[*nfds].fd = events != 0 ? fd : -1;
+    fds[*nfds].events = events;
+    fds[*nfds].revents = 0;
+    (*nfds)++;
+}
+
+/* Events awaited on the source of dir, the sink of the other direction */
+static short events_of(const direction_t *dir, const direction_t *other, uint64_t now)
+{
+    short events = 0;
+
+    if (!dir->eof && dir->queued < MAX_QUEUED)
+        events |= POLLIN;
+    if (other->head != NULL && other->head->t_due <= now)
+        events |= POLLOUT;
+
+    return events;
+}
+
+static void print_stats(void)
+{
+    printf("\n%d sessions, %d reset\n", stats.nb_sessions, stats.nb_resets);
+    printf("%llu bytes up, %llu bytes down in %llu packets, %llu lost\n",
+           (unsigned long long) stats.nb_bytes_up,
+           (unsigned long long) stats.nb_bytes_down,
+           (unsigned long long) stats.nb_chunks,
+           (unsigned long long) stats.nb_losses);
+}
+
+int main(int argc, char *argv[])
+{
+    static struct pollfd fds[1 + 2 * MAX_SESSIONS];
+    static int index[MAX_SESSIONS];
+    struct sockaddr_in addr;
+    char host[256] = "127.0.0.1";
+    char *port = "1502";
+    char *colon;
+    int listen_port = 1503;
+    int listener;
+    int one = 1;
+    int opt;
+    int i;
+
+    while ((opt = getopt(argc, argv, "l:t:d:j:b:L:R:x:k:s:vh")) != -1) {
+        switch (opt) {
+        case 'l':
+            listen_port = atoi(optarg);
+            break;
+        case 't':
+            colon = strrchr(optarg, ':');
+            if (colon != NULL) {
+                snprintf(host, sizeof(host), "%.*s", (int) (colon - optarg), optarg);
+                port = colon + 1;
+            } else {
+                snprintf(host, sizeof(host), "%s", optarg);
+            }
+            break;
+        case 'd':
+            impairment.delay_us = (uint64_t) (atof(optarg) * 1000);
+            break;
+        case 'j':
+            impairment.jitter_us = (uint64_t) (atof(optarg) * 1000);
+            break;
+        case 'b':
+            impairment.rate = (uint64_t) (atof(optarg) * 1000 / 8);
+            break;
+        case 'L':
+            impairment.loss = atof(optarg);
+            break;
+        case 'R':
+            impairment.rto_us = (uint64_t) (atof(optarg) * 1000);
+            break;
+        case 'x':
+            impairment.reset = atof(optarg);
+            break;
+        case 'k':
+            impairment.lifetime_us = (uint64_t) (atof(optarg) * 1000);
+            break;
+        case 's':
+            seed = (uint32_t) strtoul(optarg, NULL, 0);
+            if (seed == 0)
+                seed = 1;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+
+    /* Up to 100 % but a loss of every packet never delivers */
+    if (impairment.loss >= 100 || impairment.rto_us == 0) {
+        fprintf(stderr, "The loss is below 100 %% and the timeout above 0\n");
+        exit(1);
+    }
+
+    listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (listener == -1) {
+        perror("socket");
+        exit(1);
+    }
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(listen_port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(listener, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+        listen(listener, MAX_SESSIONS) == -1) {
+        perror("bind");
+        close(listener);
+        exit(1);
+    }
+
+    for (i = 0; i < MAX_SESSIONS; i++)
+        index[i] = -1;
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    printf("Proxy of port %d to %s:%s, delay %.1f +/- %.1f ms, ",
+           listen_port,
+           host,
+           port,
+           impairment.delay_us / 1000.0,
+           impairment.jitter_us / 1000.0);
+    if (impairment.rate > 0)
+        printf("%llu kbit/s, ", (unsigned long long) impairment.rate * 8 / 1000);
+    printf("%.2f %% lost, %.2f %% reset\n", impairment.loss, impairment.reset);
+    fflush(stdout);
+
+    while (!done) {
+        uint64_t now = time_us();
+        uint64_t t_next = UINT64_MAX;
+        int timeout;
+        int nfds = 0;
+
+        add_fd(fds, &nfds, listener, POLLIN);
+        for (i = 0; i < MAX_SESSIONS; i++) {
+            session_t *session = &sessions[i];
+
+            if (!session->used)
+                continue;
+
+            if (session->t_reset != 0 && session->t_reset <= now) {
+                close_session(session, 1);
+                continue;
+            }
+            if (session->up.shut && session->down.shut) {
+                close_session(session, 0);
+                continue;
+            }
+
+            index[i] = nfds;
+            add_fd(fds, &nfds, session->up.source, events_of(&session->up, &session->down, now));
+            add_fd(fds, &nfds, session->down.source, events_of(&session->down, &session->up, now));
+
+            if (session->up.head != NULL && session->up.head->t_due < t_next)
+                t_next = session->up.head->t_due;
+            if (session->down.head != NULL && session->down.head->t_due < t_next)
+                t_next = session->down.head->t_due;
+            if (session->t_reset != 0 && session->t_reset < t_next)
+                t_next = session->t_reset;
+        }
+
+        /* In ms rounded up, the chunks are never delivered early */
+        if (t_next == UINT64_MAX)
+            timeout = -1;
+        else if (t_next <= now)
+            timeout = 0;
+        else
+            timeout = (int) ((t_next - now + 999) / 1000);
+
+        if (poll(fds, nfds, timeout) == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+        now = time_us();
+
+        if (fds[0].revents & POLLIN)
+            open_session(listener, host, port);
+
+        for (i = 0; i < MAX_SESSIONS; i++) {
+            session_t *session = &sessions[i];
+            short client_events;
+            short server_events;
+            int rc = 0;
+
+            /* The sessions opened by this loop are not polled yet */
+            if (!session->used || index[i] < 0)
+                continue;
+            client_events = fds[index[i]].revents;
+            server_events = fds[index[i] + 1].revents;
+            index[i] = -1;
+
+            if (!session->up.eof && client_events & (POLLIN | POLLHUP | POLLERR))
+                rc = receive(&session->up, now, &stats.nb_bytes_up);
+            if (rc == 0 && !session->down.eof && server_events & (POLLIN | POLLHUP | POLLERR))
+                rc = receive(&session->down, now, &stats.nb_bytes_down);
+            if (rc == 0)
+                rc = deliver(&session->up, now);
+            if (rc == 0)
+                rc = deliver(&session->down, now);
+
+            if (rc != 0)
+                close_session(session, 1);
+        }
+    }
+
+    for (i = 0; i < MAX_SESSIONS; i++) {
+        if (sessions[i].used)
+            close_session(&sessions[i], 0);
+    }
+    close(listener);
+    print_stats();
+
+    return 0;
+}
@@ -0,0 +1,512 @@
+/*
+ * Copyright © Gerhard Schiller 2024, <gerhard.schiller@pm.me>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Concurrent load: opens N connections, one thread each, driving a request mix
+ * at a rate per connection for a number of seconds. Each connection owns a
+ * slice of the bits and of the registers, writes random values and checks
+ * that the values read back are the ones it wrote, as random-test-client
+ * does. With -c 1:64 the run is repeated with 1, 2, 4... 64 connections to
+ * find the point where the server falls over.
+ *
+ * Use bandwidth-server-many-up (or tests/pico-bandwidth-server) as the server.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <modbus.h>
+
+#include "bench.h"
+
+/* The mapping of bandwidth-server-many-up is shared by the connections */
+#define MAX_CONNECTIONS MODBUS_MAX_READ_REGISTERS
+
+enum {
+    FORMAT_TEXT,
+    FORMAT_JSON,
+    FORMAT_CSV
+};
+
+typedef struct {
+    int id;
+    modbus_t *ctx;
+    const bench_config_t *config;
+    uint64_t t_start;
+    uint64_t t_end;
+    uint32_t seed;
+    /* Slice of the connection and the values last written to it */
+    int addr_bits;
+    int nb_bits;
+    int addr_registers;
+    int nb_registers;
+    uint8_t tab_bits[MODBUS_MAX_READ_BITS];
+    uint16_t tab_registers[MODBUS_MAX_READ_REGISTERS];
+    /* The latencies of the connection, grown as needed */
+    bench_result_t result;
+    int capacity;
+    int nb_mismatches;
+} connection_t;
+
+static const char *ip = "127.0.0.1";
+static int port = 1502;
+static int verbose = 0;
+
+static void usage(const char *name)
+{
+    printf("Usage:\n  %s [tcp IP] [options]\n", name);
+    printf("  -c n[:max]   connections, doubled up to max (default: 4)\n");
+    printf("  -t seconds   duration of a run (default: 5)\n");
+    printf("  -r rate      requests/s of each connection (default: closed loop)\n");
+    printf("  -m mix       request mix, e.g. rr=70,wr=30 of rb, rr, wb, wr and wrr\n");
+    printf("               (default: rr=40,wr=20,rb=20,wb=10,wrr=10)\n");
+    printf("  -s points    values per request (default: the slice of a connection)\n");
+    printf("  -p port      port of the server (default: 1502)\n");
+    printf("  -f format    text, json or csv (default: text)\n");
+    printf("  -o file      appends the json or csv line of each run to file\n");
+    printf("  -v           prints the result of each connection\n");
+    printf("  Eg. %s tcp 10.0.0.100 -c 1:32 -r 50 -t 10 -f json -o load.json\n", name);
+}
+
+static uint32_t next_random(uint32_t *seed)
+{
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    return *seed;
+}
+
+static int add_latency(connection_t *conn, uint32_t latency)
+{
+    bench_result_t *result = &conn->result;
+
+    if (result->nb_latencies == conn->capacity) {
+        int capacity = conn->capacity > 0 ? conn->capacity * 2 : 4096;
+        uint32_t *latencies = realloc(result->latencies, capacity * sizeof(uint32_t));
+
+        if (latencies == NULL)
+            return -1;
+        result->latencies = latencies;
+        conn->capacity = capacity;
+    }
+    result->latencies[result->nb_latencies++] = latency;
+
+    return 0;
+}
+
+static void mismatch(connection_t *conn, const char *op, int index, int expected, int read)
+{
+    if (conn->nb_mismatches++ < 3) {
+        fprintf(stderr,
+                "Connection %d: %s value %d read 0x%X instead of 0x%X\n",
+                conn->id,
+                op,
+                index,
+                read,
+                expected);
+    }
+}
+
+/* Bytes of the request and of the response on TCP */
+static int adu_bytes(int op, int nb)
+{
+    switch (op) {
+    case BENCH_READ_BITS:
+        return 12 + 9 + (nb + 7) / 8;
+    case BENCH_READ_REGISTERS:
+        return 12 + 9 + nb * 2;
+    case BENCH_WRITE_BITS:
+        return 13 + (nb + 7) / 8 + 12;
+    case BENCH_WRITE_REGISTERS:
+        return 13 + nb * 2 + 12;
+    default:
+        return 17 + nb * 2 + 9 + nb * 2;
+    }
+}
+
+/* Runs one request of op on the slice, checks the values read. Returns 0 or
+   -1 on a Modbus error. */
+static int do_request(connection_t *conn, int op)
+{
+    uint8_t tab_bits[MODBUS_MAX_READ_BITS] = { 0 };
+    uint16_t tab_registers[MODBUS_MAX_READ_REGISTERS] = { 0 };
+    uint16_t tab_rp_registers[MODBUS_MAX_READ_REGISTERS];
+    int nb = conn->config->nb_points;
+    int rc;
+    int i;
+
+    if (op == BENCH_READ_BITS || op == BENCH_WRITE_BITS) {
+        if (nb <= 0 || nb > conn->nb_bits)
+            nb = conn->nb_bits;
+    } else {
+        if (nb <= 0 || nb > conn->nb_registers)
+            nb = conn->nb_registers;
+        if (op == BENCH_WRITE_AND_READ_REGISTERS && nb > MODBUS_MAX_WR_WRITE_REGISTERS)
+            nb = MODBUS_MAX_WR_WRITE_REGISTERS;
+    }
+
+    switch (op) {
+    case BENCH_READ_BITS:
+        rc = modbus_read_bits(conn->ctx, conn->addr_bits, nb, tab_bits);
+        for (i = 0; rc == nb && i < nb; i++) {
+            if (tab_bits[i] != conn->tab_bits[i])
+                mismatch(conn, "bit", i, conn->tab_bits[i], tab_bits[i]);
+        }
+        break;
+    case BENCH_READ_REGISTERS:
+        rc = modbus_read_registers(conn->ctx, conn->addr_registers, nb, tab_registers);
+        for (i = 0; rc == nb && i < nb; i++) {
+            if (tab_registers[i] != conn->tab_registers[i])
+                mismatch(conn, "register", i, conn->tab_registers[i], tab_registers[i]);
+        }
+        break;
+    case BENCH_WRITE_BITS:
+        for (i = 0; i < nb; i++) {
+            tab_bits[i] = next_random(&conn->seed) & 1;
+        }
+        rc = modbus_write_bits(conn->ctx, conn->addr_bits, nb, tab_bits);
+        if (rc == nb)
+            memcpy(conn->tab_bits, tab_bits, nb);
+        break;
+    case BENCH_WRITE_REGISTERS:
+        for (i = 0; i < nb; i++) {
+            tab_registers[i] = next_random(&conn->seed) & 0xFFFF;
+        }
+        rc = modbus_write_registers(conn->ctx, conn->addr_registers, nb, tab_registers);
+        if (rc == nb)
+            memcpy(conn->tab_registers, tab_registers, nb * sizeof(uint16_t));
+        break;
+    default:
+        for (i = 0; i < nb; i++) {
+            tab_registers[i] = next_random(&conn->seed) & 0xFFFF;
+        }
+        rc = modbus_write_and_read_registers(conn->ctx,
+                                             conn->addr_registers,
+                                             nb,
+                                             tab_registers,
+                                             conn->addr_registers,
+                                             nb,
+                                             tab_rp_registers);
+        for (i = 0; rc == nb && i < nb; i++) {
+            if (tab_rp_registers[i] != tab_registers[i])
+                mismatch(conn, "written and read register", i, tab_registers[i],
+                         tab_rp_registers[i]);
+        }
+        if (rc == nb)
+            memcpy(conn->tab_registers, tab_registers, nb * sizeof(uint16_t));
+        break;
+    }
+
+    if (rc == -1)
+        return -1;
+
+    conn->result.nb_bytes += adu_bytes(op, nb);
+    return 0;
+}
+
+static void *connection_main(void *arg)
+{
+    connection_t *conn = arg;
+    const bench_config_t *config = conn->config;
+    bench_result_t *result = &conn->result;
+    int nb_sent = 0;
+
+    bench_sleep_until(conn->t_start);
+
+    while (bench_time_us() < conn->t_end) {
+        uint64_t t_due = config->rate > 0
+                             ? conn->t_start + (uint64_t) nb_sent * 1000000 / config->rate
+                             : bench_time_us();
+        int op = bench_pick_op(config, &conn->seed);
+
+        if (t_due >= conn->t_end)
+            break;
+        bench_sleep_until(t_due);
+
+        nb_sent++;
+        if (do_request(conn, op) == -1) {
+            result->nb_errors++;
+            if (errno == ETIMEDOUT || errno == EBADF || errno == ECONNRESET ||
+                errno == EPIPE) {
+                /* Drops what's left of the response, or connects again */
+                if (modbus_flush(conn->ctx) == -1) {
+                    modbus_close(conn->ctx);
+                    modbus_connect(conn->ctx);
+                }
+            }
+            continue;
+        }
+
+        if (add_latency(conn, (uint32_t) (bench_time_us() - t_due)) == -1)
+            break;
+        result->nb_ops[op]++;
+    }
+
+    result->elapsed_us = bench_time_us() - conn->t_start;
+    qsort(result->latencies, result->nb_latencies, sizeof(uint32_t), bench_compare_latencies);
+
+    return NULL;
+}
+
+/* Connects and initialises the slice of each connection, runs them and
+   prints the results. Returns 0 or -1 when a connection fails. */
+static int run(const bench_config_t *config, int nb_connections, int seconds, int format, FILE *output)
+{
+    static int csv_header_done = 0;
+    connection_t *conns;
+    pthread_t *threads;
+    bench_result_t total;
+    bench_config_t total_config = *config;
+    char label[64];
+    uint64_t t_start;
+    int nb_mismatches = 0;
+    int nb_connected = 0;
+    int rc = 0;
+    int i;
+    int j;
+
+    conns = calloc(nb_connections, sizeof(connection_t));
+    threads = calloc(nb_connections, sizeof(pthread_t));
+    if (conns == NULL || threads == NULL) {
+        free(conns);
+        free(threads);
+        return -1;
+    }
+
+    for (i = 0; i < nb_connections; i++) {
+        connection_t *conn = &conns[i];
+
+        conn->id = i;
+        conn->config = config;
+        conn->seed = 0x9E3779B9 * (i + 1);
+        /* Written at once by the initialisation */
+        conn->nb_bits = MODBUS_MAX_READ_BITS / nb_connections;
+        if (conn->nb_bits > MODBUS_MAX_WRITE_BITS)
+            conn->nb_bits = MODBUS_MAX_WRITE_BITS;
+        conn->addr_bits = i * conn->nb_bits;
+        conn->nb_registers = MODBUS_MAX_READ_REGISTERS / nb_connections;
+        if (conn->nb_registers > MODBUS_MAX_WRITE_REGISTERS)
+            conn->nb_registers = MODBUS_MAX_WRITE_REGISTERS;
+        conn->addr_registers = i * conn->nb_registers;
+
+        conn->ctx = modbus_new_tcp(ip, port);
+        if (conn->ctx == NULL || modbus_connect(conn->ctx) == -1) {
+            fprintf(stderr, "Connection %d failed: %s\n", i, modbus_strerror(errno));
+            rc = -1;
+            break;
+        }
+        nb_connected++;
+
+        /* The values of the slice are known from now on */
+        if (modbus_write_bits(conn->ctx, conn->addr_bits, conn->nb_bits, conn->tab_bits) == -1 ||
+            modbus_write_registers(
+                conn->ctx, conn->addr_registers, conn->nb_registers, conn->tab_registers) == -1) {
+            fprintf(stderr, "Connection %d: %s\n", i, modbus_strerror(errno));
+            rc = -1;
+            break;
+        }
+    }
+
+    if (rc == 0) {
+        int nb_threads;
+
+        t_start = bench_time_us() + 10000;
+        for (nb_threads = 0; nb_threads < nb_connections; nb_threads++) {
+            conns[nb_threads].t_start = t_start;
+            conns[nb_threads].t_end = t_start + (uint64_t) seconds * 1000000;
+            rc = pthread_create(&threads[nb_threads], NULL, connection_main, &conns[nb_threads]);
+            if (rc != 0) {
+                fprintf(stderr, "Thread %d failed: %s\n", nb_threads, strerror(rc));
+                rc = -1;
+                break;
+            }
+        }
+        /* Only the threads created */
+        for (i = 0; i < nb_threads; i++) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+
+    /* Aggregate of the connections */
+    memset(&total, 0, sizeof(total));
+    for (i = 0; i < nb_connections; i++) {
+        total.nb_latencies += conns[i].result.nb_latencies;
+    }
+    total.latencies = malloc((total.nb_latencies + 1) * sizeof(uint32_t));
+    total.nb_latencies = 0;
+
+    for (i = 0; rc == 0 && i < nb_connections; i++) {
+        connection_t *conn = &conns[i];
+
+        if (verbose) {
+            snprintf(label, sizeof(label), "connection %d", i);
+            total_config.label = label;
+            bench_print_text(stdout, &total_config, &conn->result);
+        }
+        if (conn->nb_mismatches > 0)
+            printf("connection %d: %d values mismatched\n", i, conn->nb_mismatches);
+
+        if (total.latencies != NULL) {
+            memcpy(total.latencies + total.nb_latencies,
+                   conn->result.latencies,
+                   conn->result.nb_latencies * sizeof(uint32_t));
+            total.nb_latencies += conn->result.nb_latencies;
+        }
+        total.nb_errors += conn->result.nb_errors;
+        total.nb_bytes += conn->result.nb_bytes;
+        if (conn->result.elapsed_us > total.elapsed_us)
+            total.elapsed_us = conn->result.elapsed_us;
+        for (j = 0; j < BENCH_NB_OPS; j++) {
+            total.nb_ops[j] += conn->result.nb_ops[j];
+        }
+        nb_mismatches += conn->nb_mismatches;
+    }
+
+    if (rc == 0 && total.latencies != NULL) {
+        qsort(total.latencies, total.nb_latencies, sizeof(uint32_t), bench_compare_latencies);
+        snprintf(label, sizeof(label), "%s x%d", config->label, nb_connections);
+        total_config.label = label;
+
+        bench_print_text(stdout, &total_config, &total);
+        printf("* per connection %.1f req/s, %d values mismatched\n\n",
+               bench_throughput(&total) / nb_connections,
+               nb_mismatches);
+
+        if (format == FORMAT_JSON) {
+            bench_print_json(output, &total_config, &total);
+        } else if (format == FORMAT_CSV) {
+            if (!csv_header_done) {
+                fseek(output, 0, SEEK_END);
+                if (output == stdout || ftell(output) <= 0)
+                    fputs(BENCH_CSV_HEADER, output);
+                csv_header_done = 1;
+            }
+            bench_print_csv(output, &total_config, &total);
+        }
+        fflush(output);
+    }
+
+    free(total.latencies);
+    for (i = 0; i < nb_connections; i++) {
+        if (i < nb_connected)
+            modbus_close(conns[i].ctx);
+        modbus_free(conns[i].ctx);
+        bench_free_result(&conns[i].result);
+    }
+    free(conns);
+    free(threads);
+
+    return rc;
+}
+
+int main(int argc, char *argv[])
+{
+    bench_config_t config;
+    FILE *output = stdout;
+    const char *filename = NULL;
+    char label[64];
+    int format = FORMAT_TEXT;
+    int nb_connections = 4;
+    int max_connections = 0;
+    int seconds = 5;
+    int rc = 0;
+    int opt;
+    int n;
+
+    bench_init_config(&config);
+    bench_parse_mix(&config, "rr=40,wr=20,rb=20,wb=10,wrr=10");
+    config.warmup = 0;
+
+    while ((opt = getopt(argc, argv, "c:t:r:m:s:p:f:o:vh")) != -1) {
+        switch (opt) {
+        case 'c':
+            if (sscanf(optarg, "%d:%d", &nb_connections, &max_connections) < 1)
+                nb_connections = 0;
+            break;
+        case 't':
+            seconds = atoi(optarg);
+            break;
+        case 'r':
+            config.rate = atoi(optarg);
+            break;
+        case 'm':
+            if (bench_parse_mix(&config, optarg) == -1) {
+                fprintf(stderr, "Invalid mix: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 's':
+            config.nb_points = atoi(optarg);
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'f':
+            if (strcmp(optarg, "json") == 0) {
+                format = FORMAT_JSON;
+            } else if (strcmp(optarg, "csv") == 0) {
+                format = FORMAT_CSV;
+            } else if (strcmp(optarg, "text") == 0) {
+                format = FORMAT_TEXT;
+            } else {
+                usage(argv[0]);
+                exit(1);
+            }
+            break;
+        case 'o':
+            filename = optarg;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+
+    if (optind < argc) {
+        if (strcmp(argv[optind], "tcp") != 0) {
+            usage(argv[0]);
+            exit(1);
+        }
+        if (optind + 1 < argc)
+            ip = argv[optind + 1];
+    }
+
+    if (max_connections < nb_connections)
+        max_connections = nb_connections;
+    if (nb_connections < 1 || max_connections > MAX_CONNECTIONS || seconds < 1) {
+        fprintf(stderr, "1 to %d connections of 1 second at least\n", MAX_CONNECTIONS);
+        exit(1);
+    }
+
+    snprintf(label, sizeof(label), "load tcp %s", ip);
+    config.label = label;
+
+    if (filename != NULL && format != FORMAT_TEXT) {
+        output = fopen(filename, "a");
+        if (output == NULL) {
+            fprintf(stderr, "Unable to open %s: %s\n", filename, strerror(errno));
+            return -1;
+        }
+    }
+
+    n = nb_connections;
+    for (;;) {
+        rc = run(&config, n, seconds, format, output);
+        if (rc == -1 || n == max_connections)
+            break;
+        n = n * 2 < max_connections ? n * 2 : max_connections;
+    }
+
+    if (output != stdout)
+        fclose(output);
+
+    return rc;
+}
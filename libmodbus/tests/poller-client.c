@@ -0,0 +1,234 @@
+/*
+ * Copyright © Gerhard Schiller 2024, <gerhard.schiller@pm.me>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Polls a fleet of devices from one thread with the poller of libmodbus: one
+ * connection per device, a read of 10 registers each at a rate per device.
+ * Devices down (-d) are pointed at a closed port, they must not delay the
+ * others. Reports the reads completed, the errors, the largest interval
+ * between two reads of a device and the CPU used by the thread.
+ *
+ * Use bandwidth-server-many-up (or a fleet of tests/pico-bandwidth-server) as
+ * the server.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <modbus.h>
+
+#define NB_REGISTERS 10
+
+typedef struct {
+    uint16_t tab_reg[NB_REGISTERS];
+    uint64_t last;
+    uint32_t interval_max;
+    int down;
+} device_t;
+
+static int nb_reads = 0;
+static int nb_timeouts = 0;
+static int nb_refused = 0;
+static int nb_others = 0;
+
+static uint64_t time_us(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void usage(const char *name)
+{
+    printf("Usage:\n  %s [tcp IP] [options]\n", name);
+    printf("  -n devices   devices polled (default: 1000)\n");
+    printf("  -d devices   devices down among them (default: 0)\n");
+    printf("  -r rate      reads/s of each device (default: 1)\n");
+    printf("  -t seconds   duration of the run (default: 10)\n");
+    printf("  -p port      port of the server (default: 1502)\n");
+    printf("  -u           io_uring instead of epoll\n");
+    printf("  Eg. %s tcp 127.0.0.1 -n 1000 -d 50 -t 30\n", name);
+}
+
+static void read_done(modbus_t *ctx, int rc, void *user_data)
+{
+    device_t *device = user_data;
+    uint64_t now;
+
+    if (rc == -1) {
+        if (errno == ETIMEDOUT)
+            nb_timeouts++;
+        else if (errno == ECONNREFUSED)
+            nb_refused++;
+        else
+            nb_others++;
+        return;
+    }
+
+    now = time_us();
+    if (device->last != 0 && now - device->last > device->interval_max)
+        device->interval_max = now - device->last;
+    device->last = now;
+    nb_reads++;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *ip = "127.0.0.1";
+    modbus_poller_t *poller;
+    modbus_t **ctxs;
+    device_t *devices;
+    struct rusage usage_start;
+    struct rusage usage_end;
+    uint64_t start;
+    uint64_t elapsed;
+    uint64_t cpu;
+    uint32_t interval_max = 0;
+    int nb_devices = 1000;
+    int nb_down = 0;
+    int rate = 1;
+    int seconds = 10;
+    int port = 1502;
+    int use_uring = 0;
+    int opt;
+    int i;
+
+    if (argc > 1 && strcmp(argv[1], "tcp") == 0) {
+        argv++;
+        argc--;
+        if (argc > 1 && argv[1][0] != '-') {
+            ip = argv[1];
+            argv++;
+            argc--;
+        }
+    }
+
+    while ((opt = getopt(argc, argv, "n:d:r:t:p:uh")) != -1) {
+        switch (opt) {
+        case 'n':
+            nb_devices = atoi(optarg);
+            break;
+        case 'd':
+            nb_down = atoi(optarg);
+            break;
+        case 'r':
+            rate = atoi(optarg);
+            break;
+        case 't':
+            seconds = atoi(optarg);
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'u':
+            use_uring = 1;
+            break;
+        default:
+            usage(argv[0]);
+            exit(opt == 'h' ? 0 : 1);
+        }
+    }
+    if (nb_devices <= 0 || nb_down < 0 || nb_down > nb_devices || rate <= 0 ||
+        seconds <= 0) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    poller = modbus_poller_new();
+    if (poller == NULL) {
+        fprintf(stderr, "Unable to create the poller: %s\n", modbus_strerror(errno));
+        return -1;
+    }
+    if (use_uring &&
+        modbus_poller_set_engine(poller, MODBUS_POLLER_ENGINE_IO_URING) == -1) {
+        fprintf(stderr, "io_uring not available: %s\n", modbus_strerror(errno));
+        return -1;
+    }
+
+    ctxs = calloc(nb_devices, sizeof(modbus_t *));
+    devices = calloc(nb_devices, sizeof(device_t));
+    if (ctxs == NULL || devices == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+
+    /* The devices down are spread among the others */
+    for (i = 0; i < nb_devices; i++) {
+        int device;
+
+        devices[i].down = nb_down > 0 && i % (nb_devices / nb_down) == 0 &&
+                          i / (nb_devices / nb_down) < nb_down;
+        ctxs[i] = modbus_new_tcp(ip, devices[i].down ? 1 : port);
+        if (ctxs[i] == NULL) {
+            fprintf(stderr, "Unable to allocate libmodbus context\n");
+            return -1;
+        }
+        modbus_set_response_timeout(ctxs[i], 0, 500000);
+
+        device = modbus_poller_add_device(poller, ctxs[i]);
+        if (device == -1 ||
+            modbus_poller_add_read(poller,
+                                   device,
+                                   MODBUS_FC_READ_HOLDING_REGISTERS,
+                                   0,
+                                   NB_REGISTERS,
+                                   devices[i].tab_reg,
+                                   1000000 / rate,
+                                   read_done,
+                                   &devices[i]) == -1) {
+            fprintf(stderr, "Device %d: %s\n", i, modbus_strerror(errno));
+            return -1;
+        }
+    }
+
+    printf("Polling %d devices (%d down) at %d Hz for %d s with %s...\n",
+           nb_devices,
+           nb_down,
+           rate,
+           seconds,
+           use_uring ? "io_uring" : "epoll");
+    getrusage(RUSAGE_SELF, &usage_start);
+    start = time_us();
+    modbus_poller_run(poller, seconds * 1000000);
+    elapsed = time_us() - start;
+    getrusage(RUSAGE_SELF, &usage_end);
+
+    cpu = (usage_end.ru_utime.tv_sec - usage_start.ru_utime.tv_sec +
+           usage_end.ru_stime.tv_sec - usage_start.ru_stime.tv_sec) *
+              1000000ULL +
+          usage_end.ru_utime.tv_usec - usage_start.ru_utime.tv_usec +
+          usage_end.ru_stime.tv_usec - usage_start.ru_stime.tv_usec;
+    for (i = 0; i < nb_devices; i++) {
+        if (devices[i].interval_max > interval_max)
+            interval_max = devices[i].interval_max;
+    }
+
+    printf("Connected:    %d\n", modbus_poller_get_nb_connected(poller));
+    printf("Reads:        %d (%.0f/s, %d expected)\n",
+           nb_reads,
+           nb_reads * 1000000.0 / elapsed,
+           (nb_devices - nb_down) * rate * seconds);
+    printf("Errors:       %d timeouts, %d refused, %d others\n",
+           nb_timeouts,
+           nb_refused,
+           nb_others);
+    printf("Interval max: %u us\n", interval_max);
+    printf("CPU:          %.1f %%\n", cpu * 100.0 / elapsed);
+
+    modbus_poller_free(poller);
+    for (i = 0; i < nb_devices; i++) {
+        modbus_close(ctxs[i]);
+        modbus_free(ctxs[i]);
+    }
+    free(ctxs);
+    free(devices);
+
+    return 0;
+}
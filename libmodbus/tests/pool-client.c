@@ -0,0 +1,271 @@
+/*
+ * Copyright © Gerhard Schiller 2024, <gerhard.schiller@pm.me>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Compares the latency of short queries connecting for each one, as the
+ * tools calling modbus_new_tcp()/modbus_connect() per query do, with queries
+ * taking a connection from the pool of libmodbus (modbus_pool_get()). Several
+ * threads share the pool with a limit per endpoint, the Pico accepts a
+ * single client.
+ *
+ * Use bandwidth-server-many-up (or tests/pico-bandwidth-server) as the server.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <modbus.h>
+
+enum {
+    MODE_CONNECT,
+    MODE_POOL
+};
+
+typedef struct {
+    /* Latencies of the queries done, in microseconds */
+    uint32_t *latencies;
+    int nb_latencies;
+    int nb_errors;
+    uint64_t elapsed_us;
+} result_t;
+
+typedef struct {
+    int mode;
+    int nb_queries;
+    modbus_pool_t *pool;
+    result_t result;
+} worker_t;
+
+static const char *ip = "127.0.0.1";
+static int port = 1502;
+
+static uint64_t time_us(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static int compare_latencies(const void *a, const void *b)
+{
+    uint32_t la = *(const uint32_t *) a;
+    uint32_t lb = *(const uint32_t *) b;
+
+    return la < lb ? -1 : la > lb;
+}
+
+/* Nearest rank of the sorted latencies, permille is 990 for p99 */
+static uint32_t percentile(const result_t *result, int permille)
+{
+    int rank;
+
+    if (result->nb_latencies == 0)
+        return 0;
+
+    rank = (int) (((uint64_t) result->nb_latencies * permille + 999) / 1000);
+    if (rank < 1)
+        rank = 1;
+
+    return result->latencies[rank - 1];
+}
+
+static double mean(const result_t *result)
+{
+    uint64_t sum = 0;
+    int i;
+
+    for (i = 0; i < result->nb_latencies; i++) {
+        sum += result->latencies[i];
+    }
+
+    return result->nb_latencies > 0 ? (double) sum / result->nb_latencies : 0;
+}
+
+static void usage(const char *name)
+{
+    printf("Usage:\n  %s [tcp IP] [options]\n", name);
+    printf("  -n queries   queries of each thread (default: 1000)\n");
+    printf("  -j threads   threads querying the endpoint (default: 1)\n");
+    printf("  -l limit     connections of the pool to the endpoint (default: 1)\n");
+    printf("  -p port      port of the server (default: 1502)\n");
+    printf("  Eg. %s tcp 10.0.0.100 -n 200 -j 4\n", name);
+}
+
+/* One read of 10 registers, with its own connection or one of the pool */
+static int query(worker_t *worker)
+{
+    uint16_t tab_reg[10];
+    modbus_t *ctx;
+    int rc;
+
+    if (worker->mode == MODE_CONNECT) {
+        ctx = modbus_new_tcp(ip, port);
+        if (ctx == NULL)
+            return -1;
+        if (modbus_connect(ctx) == -1) {
+            modbus_free(ctx);
+            return -1;
+        }
+        rc = modbus_read_registers(ctx, 0, 10, tab_reg);
+        modbus_close(ctx);
+        modbus_free(ctx);
+        return rc;
+    }
+
+    ctx = modbus_pool_get(worker->pool, ip, port, 5000000);
+    if (ctx == NULL)
+        return -1;
+    rc = modbus_read_registers(ctx, 0, 10, tab_reg);
+    modbus_pool_put(worker->pool, ctx, rc == -1 ? errno : 0);
+
+    return rc;
+}
+
+static void *worker_main(void *arg)
+{
+    worker_t *worker = arg;
+    result_t *result = &worker->result;
+    uint64_t start = time_us();
+    int i;
+
+    for (i = 0; i < worker->nb_queries; i++) {
+        uint64_t t = time_us();
+
+        if (query(worker) == -1) {
+            result->nb_errors++;
+            continue;
+        }
+        result->latencies[result->nb_latencies++] = time_us() - t;
+    }
+    result->elapsed_us = time_us() - start;
+
+    return NULL;
+}
+
+static void run(int mode, int nb_threads, int nb_queries, int limit)
+{
+    worker_t *workers = calloc(nb_threads, sizeof(worker_t));
+    pthread_t *threads = calloc(nb_threads, sizeof(pthread_t));
+    modbus_pool_t *pool = NULL;
+    modbus_pool_stats_t stats;
+    result_t total;
+    int i;
+
+    if (mode == MODE_POOL) {
+        pool = modbus_pool_new(limit, 10000000);
+        if (pool == NULL) {
+            fprintf(stderr, "Unable to create the pool: %s\n", modbus_strerror(errno));
+            exit(1);
+        }
+    }
+
+    memset(&total, 0, sizeof(total));
+    total.latencies = malloc(nb_threads * nb_queries * sizeof(uint32_t));
+    for (i = 0; i < nb_threads; i++) {
+        workers[i].mode = mode;
+        workers[i].nb_queries = nb_queries;
+        workers[i].pool = pool;
+        workers[i].result.latencies = malloc(nb_queries * sizeof(uint32_t));
+        pthread_create(&threads[i], NULL, worker_main, &workers[i]);
+    }
+    for (i = 0; i < nb_threads; i++) {
+        result_t *result = &workers[i].result;
+
+        pthread_join(threads[i], NULL);
+        memcpy(total.latencies + total.nb_latencies,
+               result->latencies,
+               result->nb_latencies * sizeof(uint32_t));
+        total.nb_latencies += result->nb_latencies;
+        total.nb_errors += result->nb_errors;
+        if (result->elapsed_us > total.elapsed_us)
+            total.elapsed_us = result->elapsed_us;
+        free(result->latencies);
+    }
+    qsort(total.latencies, total.nb_latencies, sizeof(uint32_t), compare_latencies);
+
+    printf("%-8s %8d %6d %10.0f %9.1f %9u %9u\n",
+           mode == MODE_POOL ? "pool" : "connect",
+           total.nb_latencies,
+           total.nb_errors,
+           total.elapsed_us > 0 ? total.nb_latencies * 1e6 / total.elapsed_us : 0,
+           mean(&total),
+           percentile(&total, 500),
+           percentile(&total, 990));
+
+    if (pool != NULL) {
+        modbus_pool_get_stats(pool, ip, port, &stats);
+        printf("         %u checkouts, %u reuses, %u connects, %u waits, %u dead\n",
+               stats.checkouts,
+               stats.reuses,
+               stats.connects,
+               stats.waits,
+               stats.dead);
+        modbus_pool_free(pool);
+    }
+
+    free(total.latencies);
+    free(workers);
+    free(threads);
+}
+
+int main(int argc, char *argv[])
+{
+    int nb_queries = 1000;
+    int nb_threads = 1;
+    int limit = 1;
+    int opt;
+
+    if (argc > 1 && strcmp(argv[1], "tcp") == 0) {
+        argv++;
+        argc--;
+        if (argc > 1 && argv[1][0] != '-') {
+            ip = argv[1];
+            argv++;
+            argc--;
+        }
+    }
+
+    while ((opt = getopt(argc, argv, "n:j:l:p:h")) != -1) {
+        switch (opt) {
+        case 'n':
+            nb_queries = atoi(optarg);
+            break;
+        case 'j':
+            nb_threads = atoi(optarg);
+            break;
+        case 'l':
+            limit = atoi(optarg);
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            exit(opt == 'h' ? 0 : 1);
+        }
+    }
+    if (nb_queries <= 0 || nb_threads <= 0 || limit <= 0) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    printf("%-8s %8s %6s %10s %9s %9s %9s\n",
+           "mode",
+           "queries",
+           "errors",
+           "queries/s",
+           "mean (us)",
+           "p50 (us)",
+           "p99 (us)");
+    run(MODE_CONNECT, nb_threads, nb_queries, limit);
+    run(MODE_POOL, nb_threads, nb_queries, limit);
+
+    return 0;
+}
@@ -0,0 +1,186 @@
+/*
+ * Copyright © Gerhard Schiller 2024, <gerhard.schiller@pm.me>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Tests the receive of the RTU backend over a pseudo-terminal pair: the
+ * context opens the slave side as its serial port, the test writes the bytes
+ * of the messages on the master side, whole, in chunks or byte by byte, and
+ * with garbage. No serial line is needed.
+ */
+
+#define _XOPEN_SOURCE 600
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <modbus.h>
+
+#define SERVER_ID 17
+
+#define ASSERT_TRUE(_cond, _format, __args...)                                          \
+    {                                                                                    \
+        if (_cond) {                                                                     \
+            printf("OK\n");                                                              \
+        } else {                                                                         \
+            printf("FAILED " _format "\n", ##__args);                                    \
+            goto close;                                                                  \
+        }                                                                                \
+    };
+
+static uint64_t time_us(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/* Appends the CRC to the length bytes of msg, returns the length of the message */
+static int add_crc(uint8_t *msg, int length)
+{
+    uint16_t crc = modbus_rtu_crc16(0xFFFF, msg, length);
+
+    msg[length] = crc & 0xFF;
+    msg[length + 1] = crc >> 8;
+    return length + 2;
+}
+
+/* Writes the message in chunks of chunk bytes, delay_us apart, from a child
+   process started after delay_us */
+static pid_t write_later(int fd, const uint8_t *msg, int length, int chunk, int delay_us)
+{
+    pid_t pid = fork();
+    int i;
+
+    if (pid != 0)
+        return pid;
+
+    for (i = 0; i < length; i += chunk) {
+        usleep(delay_us);
+        if (write(fd, msg + i, length - i < chunk ? length - i : chunk) == -1)
+            _exit(1);
+    }
+    _exit(0);
+}
+
+int main(void)
+{
+    uint8_t read_req[] = {SERVER_ID, 0x03, 0x00, 0x10, 0x00, 0x02, 0, 0};
+    uint8_t write_req[] = {SERVER_ID, 0x10, 0x00, 0x10, 0x00, 0x02, 0x04,
+                           0x12,      0x34, 0x56, 0x78, 0,    0};
+    /* Function code unknown to the library, with 4 bytes of data */
+    uint8_t custom_req[] = {SERVER_ID, 0x42, 0x01, 0x02, 0x03, 0x04, 0, 0};
+    /* Byte count beyond the largest message, followed by garbage */
+    uint8_t bad_req[] = {SERVER_ID, 0x10, 0x00, 0x10, 0x00, 0x7D, 0xFA,
+                         0xAA,      0x55, 0xAA, 0x55, 0xAA, 0x55, 0xAA};
+    uint8_t read_rsp[] = {SERVER_ID, 0x03, 0x04, 0xBE, 0xEF, 0xCA, 0xFE, 0, 0};
+    uint8_t both[sizeof(read_req) + sizeof(write_req)];
+    uint8_t msg[MODBUS_RTU_MAX_ADU_LENGTH];
+    uint16_t tab_reg[2];
+    modbus_t *ctx = NULL;
+    uint64_t start;
+    uint32_t elapsed;
+    pid_t pid;
+    int master;
+    int success = 0;
+    int rc;
+
+    add_crc(read_req, sizeof(read_req) - 2);
+    add_crc(write_req, sizeof(write_req) - 2);
+    add_crc(custom_req, sizeof(custom_req) - 2);
+    add_crc(read_rsp, sizeof(read_rsp) - 2);
+    memcpy(both, read_req, sizeof(read_req));
+    memcpy(both + sizeof(read_req), write_req, sizeof(write_req));
+
+    master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master == -1 || grantpt(master) == -1 || unlockpt(master) == -1) {
+        fprintf(stderr, "Unable to open a pseudo-terminal: %s\n", strerror(errno));
+        return 77;
+    }
+
+    ctx = modbus_new_rtu(ptsname(master), 115200, 'N', 8, 1);
+    if (ctx == NULL || modbus_connect(ctx) == -1) {
+        fprintf(stderr,
+                "Unable to open %s: %s\n",
+                ptsname(master),
+                modbus_strerror(errno));
+        return -1;
+    }
+    modbus_set_slave(ctx, SERVER_ID);
+    modbus_set_response_timeout(ctx, 1, 0);
+    modbus_set_byte_timeout(ctx, 0, 500000);
+    /* Scheduling latency between the writes of the test */
+    modbus_rtu_set_silent_interval(ctx, 20000);
+
+    printf("** RTU RECEIVE OVER %s **\n", ptsname(master));
+
+    printf("1/8 Request written whole: ");
+    rc = write(master, read_req, sizeof(read_req));
+    rc = modbus_receive(ctx, msg);
+    ASSERT_TRUE(rc == sizeof(read_req) && memcmp(msg, read_req, rc) == 0, "rc %d", rc);
+
+    printf("2/8 Request written byte by byte: ");
+    pid = write_later(master, write_req, sizeof(write_req), 1, 1000);
+    rc = modbus_receive(ctx, msg);
+    waitpid(pid, NULL, 0);
+    ASSERT_TRUE(rc == sizeof(write_req) && memcmp(msg, write_req, rc) == 0, "rc %d", rc);
+
+    printf("3/8 Two requests written at once, first: ");
+    rc = write(master, both, sizeof(both));
+    rc = modbus_receive(ctx, msg);
+    ASSERT_TRUE(rc == sizeof(read_req) && memcmp(msg, read_req, rc) == 0, "rc %d", rc);
+
+    printf("4/8 Two requests written at once, second: ");
+    rc = modbus_receive(ctx, msg);
+    ASSERT_TRUE(rc == sizeof(write_req) && memcmp(msg, write_req, rc) == 0, "rc %d", rc);
+
+    printf("5/8 Unknown function code ended by the silent interval: ");
+    pid = write_later(master, custom_req, sizeof(custom_req), 3, 1000);
+    rc = modbus_receive(ctx, msg);
+    waitpid(pid, NULL, 0);
+    ASSERT_TRUE(rc == sizeof(custom_req) && memcmp(msg, custom_req, rc) == 0,
+                "rc %d",
+                rc);
+
+    printf("6/8 Invalid byte count dropped before the byte timeout: ");
+    rc = write(master, bad_req, sizeof(bad_req));
+    start = time_us();
+    rc = modbus_receive(ctx, msg);
+    elapsed = time_us() - start;
+    ASSERT_TRUE(rc == -1 && errno == EMBBADDATA && elapsed < 250000,
+                "rc %d (%s) in %u us",
+                rc,
+                modbus_strerror(errno),
+                elapsed);
+
+    printf("7/8 Next request received after the garbage: ");
+    rc = write(master, read_req, sizeof(read_req));
+    rc = modbus_receive(ctx, msg);
+    ASSERT_TRUE(rc == sizeof(read_req) && memcmp(msg, read_req, rc) == 0, "rc %d", rc);
+
+    printf("8/8 Response written in chunks: ");
+    pid = write_later(master, read_rsp, sizeof(read_rsp), 4, 2000);
+    rc = modbus_read_registers(ctx, 0x10, 2, tab_reg);
+    waitpid(pid, NULL, 0);
+    ASSERT_TRUE(rc == 2 && tab_reg[0] == 0xBEEF && tab_reg[1] == 0xCAFE,
+                "rc %d (%s)",
+                rc,
+                modbus_strerror(errno));
+
+    printf("\nALL TESTS PASS WITH SUCCESS.\n");
+    success = 1;
+
+close:
+    modbus_close(ctx);
+    modbus_free(ctx);
+    close(master);
+
+    return success ? 0 : -1;
+}
@@ -0,0 +1,134 @@
+/*
+ * Copyright © Gerhard Schiller 2024, <gerhard.schiller@pm.me>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Runs cyclic poll jobs with the scheduler of libmodbus and reports their
+ * jitter, overruns and missed deadlines.
+ *
+ * Use bandwidth-server-one (or tests/pico-bandwidth-server) as the server.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <modbus.h>
+
+enum {
+    TCP,
+    RTU
+};
+
+typedef struct {
+    const char *name;
+    int nb;
+    uint8_t tab_bit[MODBUS_MAX_READ_BITS];
+    uint16_t tab_reg[MODBUS_MAX_READ_REGISTERS];
+} poll_t;
+
+static int poll_registers(modbus_t *ctx, void *user_data)
+{
+    poll_t *poll = user_data;
+
+    return modbus_read_registers(ctx, 0, poll->nb, poll->tab_reg);
+}
+
+static int poll_bits(modbus_t *ctx, void *user_data)
+{
+    poll_t *poll = user_data;
+
+    return modbus_read_bits(ctx, 0, poll->nb, poll->tab_bit);
+}
+
+int main(int argc, char *argv[])
+{
+    modbus_t *ctx;
+    modbus_sched_t *sched;
+    modbus_sched_stats_t stats;
+    poll_t polls[3] = { { "fast 1 reg / 2 ms", 1 },
+                        { "bulk 125 regs / 20 ms", MODBUS_MAX_READ_REGISTERS },
+                        { "bits 2000 / 50 ms", MODBUS_MAX_READ_BITS } };
+    int use_backend;
+    char *ip_or_device = "127.0.0.1";
+    int seconds = 5;
+    int rc;
+    int i;
+
+    if (argc > 1) {
+        if (strcmp(argv[1], "tcp") == 0) {
+            use_backend = TCP;
+            if (argc > 2) {
+                ip_or_device = argv[2];
+            }
+        } else if (strcmp(argv[1], "rtu") == 0) {
+            use_backend = RTU;
+        } else {
+            printf("Usage:\n  %s [tcp IP|rtu] [seconds]\n", argv[0]);
+            printf("  Eg. %s tcp 10.0.0.1 10\n", argv[0]);
+            exit(1);
+        }
+        if (argc > 3) {
+            seconds = atoi(argv[3]);
+        }
+    } else {
+        /* By default */
+        use_backend = TCP;
+    }
+
+    if (use_backend == TCP) {
+        ctx = modbus_new_tcp(ip_or_device, 1502);
+    } else {
+        ctx = modbus_new_rtu("/dev/ttyUSB1", 115200, 'N', 8, 1);
+        modbus_set_slave(ctx, 1);
+    }
+    if (ctx == NULL) {
+        fprintf(stderr, "Unable to allocate libmodbus context\n");
+        return -1;
+    }
+    if (modbus_connect(ctx) == -1) {
+        fprintf(stderr, "Connection failed: %s\n", modbus_strerror(errno));
+        modbus_free(ctx);
+        return -1;
+    }
+
+    sched = modbus_sched_new();
+    /* The fast loop has the shortest deadline, it's never queued behind more
+       than one bulk read */
+    modbus_sched_add(sched, ctx, 2000, 0, 2, poll_registers, &polls[0]);
+    modbus_sched_add(sched, ctx, 20000, 0, 1, poll_registers, &polls[1]);
+    modbus_sched_add(sched, ctx, 50000, 0, 0, poll_bits, &polls[2]);
+
+    printf("Running the jobs for %d s...\n", seconds);
+    rc = modbus_sched_run(sched, seconds * 1000000);
+    printf("%d runs\n\n", rc);
+
+    printf("%-24s %8s %6s %9s %8s %12s %8s\n",
+           "job",
+           "runs",
+           "errors",
+           "overruns",
+           "missed",
+           "jitter (us)",
+           "max (us)");
+    for (i = 0; i < 3; i++) {
+        modbus_sched_get_stats(sched, i, &stats);
+        printf("%-24s %8u %6u %9u %8u %4u/%3u/%4u %8u\n",
+               polls[i].name,
+               stats.runs,
+               stats.errors,
+               stats.overruns,
+               stats.missed_deadlines,
+               stats.jitter_min,
+               stats.jitter_avg,
+               stats.jitter_max,
+               stats.duration_max);
+    }
+
+    modbus_sched_free(sched);
+    modbus_close(ctx);
+    modbus_free(ctx);
+
+    return 0;
+}
@@ -33,6 +33,9 @@ enum {
     RTU
 };
 
+/* Connections spread over the workers of the server by the kernel */
+#define NB_CONNECTIONS_WORKERS 8
+
 int test_server(modbus_t *ctx, int use_backend);
 int send_crafted_request(modbus_t *ctx,
                          int function,
@@ -44,6 +47,9 @@ int send_crafted_request(modbus_t *ctx,
                          int backend_offset);
 int equal_dword(uint16_t *tab_reg, const uint32_t value);
 int is_memory_equal(const void *s1, const void *s2, size_t size);
+int poll_register(modbus_t *ctx, void *user_data);
+void poller_done(modbus_t *ctx, int rc, void *user_data);
+uint16_t crc16_bitwise(const uint8_t *buffer, int length);
 
 #define BUG_REPORT(_cond, _format, _args...) \
   printf("\nLine %d: assertion error for '%s': " _format "\n", __LINE__, #_cond, ##_args)
@@ -68,6 +74,40 @@ int equal_dword(uint16_t *tab_reg, const uint32_t value)
     return ((tab_reg[0] == (value >> 16)) && (tab_reg[1] == (value & 0xFFFF)));
 }
 
+int poll_register(modbus_t *ctx, void *user_data)
+{
+    return modbus_read_registers(ctx, UT_REGISTERS_ADDRESS, 1, user_data);
+}
+
+/* Reference CRC-16/MODBUS, one bit at a time */
+uint16_t crc16_bitwise(const uint8_t *buffer, int length)
+{
+    uint16_t crc = 0xFFFF;
+    int i;
+
+    while (length--) {
+        crc ^= *buffer++;
+        for (i = 0; i < 8; i++) {
+            crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+        }
+    }
+
+    return crc;
+}
+
+/* Counts the reads and the errors, keeps the last error */
+void poller_done(modbus_t *ctx, int rc, void *user_data)
+{
+    int *counts = user_data;
+
+    if (rc == -1) {
+        counts[1]++;
+        counts[2] = errno;
+    } else {
+        counts[0]++;
+    }
+}
+
 int main(int argc, char *argv[])
 {
     /* Length of report slave ID response slave ID + ON/OFF + 'LMB' + version */
@@ -81,6 +121,74 @@ int main(int argc, char *argv[])
     int nb_points;
     int rc;
     float real;
+    uint16_t tab_rp_file_records[sizeof(UT_FILE_RECORDS_TAB) / sizeof(uint16_t)];
+    modbus_file_record_t file_records[2];
+    modbus_scan_t *scan = NULL;
+    uint16_t tab_scan_registers[8];
+    uint16_t scan_u16;
+    uint32_t scan_u32;
+    int16_t scan_i16;
+    uint8_t scan_bits[8];
+    uint16_t scan_input[2];
+    int scan_tags[2];
+    modbus_sched_t *sched = NULL;
+    modbus_sched_stats_t sched_stats;
+    modbus_poller_t *poller = NULL;
+    modbus_t *ctx_down = NULL;
+    int poller_up[3] = { 0 };
+    int poller_down[3] = { 0 };
+    uint16_t poller_input = 0;
+    uint16_t poller_input_down = 0;
+    modbus_pool_t *pool = NULL;
+    modbus_t *ctx_pool = NULL;
+    modbus_pool_stats_t pool_stats;
+    modbus_bus_t *bus = NULL;
+    modbus_bus_slave_stats_t bus_slave_stats;
+    int bus_counts[3] = { 0 };
+    uint16_t bus_input = 0;
+    uint8_t crc_data[300];
+    uint16_t crc;
+    modbus_prepared_t *prepared = NULL;
+    modbus_prepared_t *prepared_next = NULL;
+    uint8_t rsp_view[MODBUS_MAX_ADU_LENGTH];
+    modbus_view_t view;
+    const uint16_t tab_view[] = {
+        /* UT_REAL in the 4 orders */
+        0x47F1, 0x2000, 0x0020, 0xF147, 0xF147, 0x0020, 0x2000, 0x47F1,
+        /* 0x0102030405060708 in the 4 orders */
+        0x0102, 0x0304, 0x0506, 0x0708, 0x0807, 0x0605, 0x0403, 0x0201,
+        0x0201, 0x0403, 0x0605, 0x0807, 0x0708, 0x0506, 0x0304, 0x0102,
+        /* 1.0 CDAB */
+        0x0000, 0x0000, 0x0000, 0x3FF0};
+    const int nb_view = sizeof(tab_view) / sizeof(uint16_t);
+    uint16_t tab_view_uint16[4];
+    float tab_view_float[4];
+    uint32_t tab_view_uint32[2];
+    int32_t tab_view_int32[1];
+    int64_t tab_view_int64[4];
+    double tab_view_double[1];
+    uint16_t tab_bulk_registers[4 * 13];
+    uint16_t tab_bulk_set[4 * 13];
+    uint8_t tab_bulk_wire[8 * 13];
+    float tab_bulk_float[13];
+    int64_t tab_bulk_int64[13];
+    int64_t tab_bulk_view[13];
+    int order;
+    modbus_trace_t *trace = NULL;
+    modbus_trace_record_t trace_records[16];
+    uint32_t trace_seq;
+    uint16_t tab_trace_registers[MODBUS_TRACE_RECORD_REGISTERS];
+    modbus_stats_t *stats = NULL;
+    modbus_stats_counters_t stats_counters;
+    uint32_t stats_histogram[MODBUS_STATS_NB_BUCKETS];
+    uint32_t stats_nb;
+    uint16_t tab_stats_registers[MODBUS_STATS_REGISTERS];
+    uint16_t diag_value;
+    uint16_t diag_status;
+    modbus_comm_event_log_t event_log;
+    modbus_t *ctx_workers[NB_CONNECTIONS_WORKERS] = { NULL };
+    int has_workers;
+    int nb_answered;
     uint32_t old_response_to_sec;
     uint32_t old_response_to_usec;
     uint32_t new_response_to_sec;
@@ -101,8 +209,9 @@ int main(int argc, char *argv[])
             use_backend = RTU;
         } else {
             printf("Modbus client for unit testing\n");
-            printf("Usage:\n  %s [tcp|tcppi|rtu]\n", argv[0]);
-            printf("Eg. tcp 127.0.0.1 or rtu /dev/ttyUSB1\n\n");
+            printf("Usage:\n  %s [tcp|tcppi|rtu] [<ip or device>] [<server engine>]\n",
+                   argv[0]);
+            printf("Eg. tcp 127.0.0.1 or rtu /dev/ttyUSB1 or tcp 127.0.0.1 workers\n\n");
             exit(1);
         }
     } else {
@@ -110,6 +219,10 @@ int main(int argc, char *argv[])
         use_backend = TCP;
     }
 
+    /* The engine of unit-test-server, with several workers */
+    has_workers =
+        argc > 3 && (strcmp(argv[3], "workers") == 0 || strcmp(argv[3], "fallback") == 0);
+
     if (argc > 2) {
         ip_or_device = argv[2];
     } else {
@@ -334,6 +447,804 @@ int main(int argc, char *argv[])
     ASSERT_TRUE(
         tab_rp_registers[0] == 0x17, "FAILED (%0X != %0X)\n", tab_rp_registers[0], 0x17);
 
+    /** FILE RECORDS **/
+    printf("\nTEST FILE RECORDS:\n");
+    nb_points = sizeof(UT_FILE_RECORDS_TAB) / sizeof(uint16_t);
+    rc = modbus_write_file_record(
+        ctx, UT_FILE_NUMBER, UT_FILE_RECORD_NUMBER, nb_points, UT_FILE_RECORDS_TAB);
+    printf("1/5 modbus_write_file_record: ");
+    ASSERT_TRUE(rc == nb_points, "FAILED (nb points %d)\n", rc);
+
+    rc = modbus_read_file_record(
+        ctx, UT_FILE_NUMBER, UT_FILE_RECORD_NUMBER, nb_points, tab_rp_file_records);
+    printf("2/5 modbus_read_file_record: ");
+    ASSERT_TRUE(rc == nb_points, "FAILED (nb points %d)\n", rc);
+    for (i = 0; i < nb_points; i++) {
+        ASSERT_TRUE(tab_rp_file_records[i] == UT_FILE_RECORDS_TAB[i],
+                    "FAILED (%0X != %0X)\n",
+                    tab_rp_file_records[i],
+                    UT_FILE_RECORDS_TAB[i]);
+    }
+
+    /* Two sub-requests in one request, the second half is read first */
+    file_records[0].file_number = UT_FILE_NUMBER;
+    file_records[0].record_number = UT_FILE_RECORD_NUMBER + 2;
+    file_records[0].record_length = 2;
+    file_records[0].data = tab_rp_file_records;
+    file_records[1].file_number = UT_FILE_NUMBER;
+    file_records[1].record_number = UT_FILE_RECORD_NUMBER;
+    file_records[1].record_length = 2;
+    file_records[1].data = tab_rp_file_records + 2;
+    rc = modbus_read_file_records(ctx, file_records, 2);
+    printf("3/5 modbus_read_file_records: ");
+    ASSERT_TRUE(rc == nb_points, "FAILED (nb points %d)\n", rc);
+    for (i = 0; i < nb_points; i++) {
+        ASSERT_TRUE(tab_rp_file_records[i] == UT_FILE_RECORDS_TAB[(i + 2) % nb_points],
+                    "FAILED (%0X != %0X)\n",
+                    tab_rp_file_records[i],
+                    UT_FILE_RECORDS_TAB[(i + 2) % nb_points]);
+    }
+
+    /* Write the halves back swapped */
+    file_records[0].record_number = UT_FILE_RECORD_NUMBER;
+    file_records[1].record_number = UT_FILE_RECORD_NUMBER + 2;
+    rc = modbus_write_file_records(ctx, file_records, 2);
+    printf("4/5 modbus_write_file_records: ");
+    ASSERT_TRUE(rc == nb_points, "FAILED (nb points %d)\n", rc);
+    rc = modbus_read_file_record(
+        ctx, UT_FILE_NUMBER, UT_FILE_RECORD_NUMBER, nb_points, tab_rp_file_records);
+    ASSERT_TRUE(rc == nb_points, "FAILED (nb points %d)\n", rc);
+    for (i = 0; i < nb_points; i++) {
+        ASSERT_TRUE(tab_rp_file_records[i] == UT_FILE_RECORDS_TAB[(i + 2) % nb_points],
+                    "FAILED (%0X != %0X)\n",
+                    tab_rp_file_records[i],
+                    UT_FILE_RECORDS_TAB[(i + 2) % nb_points]);
+    }
+
+    /* The last record past the end of the file, refused before sending */
+    rc = modbus_read_file_record(
+        ctx, UT_FILE_NUMBER, MODBUS_MAX_FILE_RECORD_NUMBER, 2, tab_rp_file_records);
+    printf("5/5 records past the end of the file: ");
+    ASSERT_TRUE(rc == -1 && errno == EINVAL, "FAILED (%d)\n", rc);
+    rc = modbus_write_file_record(
+        ctx, UT_FILE_NUMBER, MODBUS_MAX_FILE_RECORD_NUMBER, 2, tab_rp_file_records);
+    ASSERT_TRUE(rc == -1 && errno == EINVAL, "FAILED (%d)\n", rc);
+
+    /** VIEW **/
+    printf("\nTEST RESPONSE VIEW:\n");
+    modbus_write_registers(ctx, UT_REGISTERS_ADDRESS, nb_view, tab_view);
+    rc = modbus_read_registers_view(ctx, UT_REGISTERS_ADDRESS, nb_view, rsp_view, &view);
+    printf("1/6 modbus_read_registers_view: ");
+    ASSERT_TRUE(rc == nb_view && view.nb == nb_view, "FAILED (nb points %d)\n", rc);
+
+    modbus_view_get_uint16(&view, 0, 4, tab_view_uint16);
+    printf("2/6 modbus_view_get_uint16: ");
+    ASSERT_TRUE(is_memory_equal(tab_view_uint16, tab_view, 4 * sizeof(uint16_t)),
+                "FAILED\n");
+
+    for (i = MODBUS_ORDER_ABCD; i <= MODBUS_ORDER_CDAB; i++) {
+        modbus_view_get_float(&view, 2 * i, 1, i, &tab_view_float[i]);
+        modbus_view_get_int64(&view, 8 + 4 * i, 1, i, &tab_view_int64[i]);
+    }
+    printf("3/6 modbus_view_get_float: ");
+    ASSERT_TRUE(tab_view_float[0] == UT_REAL && tab_view_float[1] == UT_REAL &&
+                    tab_view_float[2] == UT_REAL && tab_view_float[3] == UT_REAL,
+                "FAILED (%f %f %f %f)\n",
+                tab_view_float[0],
+                tab_view_float[1],
+                tab_view_float[2],
+                tab_view_float[3]);
+    printf("4/6 modbus_view_get_int64: ");
+    ASSERT_TRUE(tab_view_int64[0] == 0x0102030405060708 &&
+                    tab_view_int64[1] == 0x0102030405060708 &&
+                    tab_view_int64[2] == 0x0102030405060708 &&
+                    tab_view_int64[3] == 0x0102030405060708,
+                "FAILED\n");
+
+    /* Bulk decode of consecutive values and integer types */
+    rc = modbus_view_get_uint32(&view, 8, 2, MODBUS_ORDER_ABCD, tab_view_uint32);
+    modbus_view_get_int32(&view, 2, 1, MODBUS_ORDER_DCBA, tab_view_int32);
+    modbus_view_get_double(&view, 24, 1, MODBUS_ORDER_CDAB, tab_view_double);
+    printf("5/6 modbus_view_get_uint32/int32/double: ");
+    ASSERT_TRUE(rc == 2 && tab_view_uint32[0] == 0x01020304 &&
+                    tab_view_uint32[1] == 0x05060708 &&
+                    tab_view_int32[0] == 0x47F12000 && tab_view_double[0] == 1.0,
+                "FAILED\n");
+
+    rc = modbus_view_get_double(&view, 25, 1, MODBUS_ORDER_ABCD, tab_view_double);
+    printf("6/6 modbus_view_get_double out of the view: ");
+    ASSERT_TRUE(rc == -1 && errno == EINVAL, "FAILED (%d)\n", rc);
+
+    /** TRACE **/
+    printf("\nTEST TRACE:\n");
+    trace = modbus_trace_new(16);
+    modbus_set_trace(ctx, trace);
+    rc = modbus_read_registers(ctx, UT_REGISTERS_ADDRESS, UT_REGISTERS_NB, tab_rp_registers);
+    modbus_set_trace(ctx, NULL);
+    trace_seq = 0;
+    rc = modbus_trace_read(trace, &trace_seq, trace_records, 16);
+    printf("1/4 modbus_trace_read: ");
+    ASSERT_TRUE(rc == 2 && trace_seq == 2 && trace_records[0].event == MODBUS_TRACE_SEND &&
+                    trace_records[1].event == MODBUS_TRACE_RECEIVE &&
+                    trace_records[0].function == MODBUS_FC_READ_HOLDING_REGISTERS &&
+                    trace_records[1].function == MODBUS_FC_READ_HOLDING_REGISTERS &&
+                    trace_records[0].t_id == trace_records[1].t_id &&
+                    trace_records[0].result == trace_records[0].length &&
+                    trace_records[1].result == trace_records[1].length &&
+                    trace_records[1].length > trace_records[0].length &&
+                    (uint32_t) (trace_records[1].time - trace_records[0].time) < 1000000,
+                "FAILED (%d records)\n",
+                rc);
+
+    /* 40 records in a ring of 16, the 15 last ones are readable */
+    modbus_set_trace(ctx, trace);
+    for (i = 0; i < 20; i++) {
+        modbus_read_registers(ctx, UT_REGISTERS_ADDRESS, 1, tab_rp_registers);
+    }
+    modbus_set_trace(ctx, NULL);
+    rc = modbus_trace_read(trace, &trace_seq, trace_records, 16);
+    printf("2/4 modbus_trace_read after overflow: ");
+    ASSERT_TRUE(rc == 15 && trace_seq == 42 &&
+                    trace_records[0].event == MODBUS_TRACE_RECEIVE &&
+                    trace_records[14].event == MODBUS_TRACE_RECEIVE,
+                "FAILED (%d records, seq %u)\n",
+                rc,
+                trace_seq);
+
+    rc = modbus_trace_to_registers(trace_records, 1, tab_trace_registers);
+    printf("3/4 modbus_trace_to_registers: ");
+    ASSERT_TRUE(rc == MODBUS_TRACE_RECORD_REGISTERS &&
+                    tab_trace_registers[5] == trace_records[0].length &&
+                    tab_trace_registers[6] ==
+                        ((MODBUS_TRACE_RECEIVE << 8) | MODBUS_FC_READ_HOLDING_REGISTERS),
+                "FAILED\n");
+    modbus_trace_free(trace);
+    trace = NULL;
+
+    printf("4/4 modbus_trace_new too small: ");
+    ASSERT_TRUE(modbus_trace_new(1) == NULL && errno == EINVAL, "FAILED\n");
+
+    /** STATS **/
+    printf("\nTEST STATS:\n");
+    stats = modbus_stats_new();
+    modbus_set_stats(ctx, stats);
+    modbus_read_registers(ctx, UT_REGISTERS_ADDRESS, UT_REGISTERS_NB, tab_rp_registers);
+    modbus_read_registers(ctx, UT_REGISTERS_ADDRESS, 1, tab_rp_registers);
+    modbus_read_registers(
+        ctx, UT_REGISTERS_ADDRESS + UT_REGISTERS_NB_MAX, 1, tab_rp_registers);
+    modbus_flush(ctx);
+    modbus_set_stats(ctx, NULL);
+    modbus_stats_get_counters(stats, &stats_counters);
+    printf("1/5 modbus_stats_get_counters: ");
+    ASSERT_TRUE(stats_counters.requests == 3 && stats_counters.exceptions == 1 &&
+                    stats_counters.timeouts == 0 && stats_counters.flushes == 1 &&
+                    stats_counters.reconnects == 0,
+                "FAILED (%u requests, %u exceptions)\n",
+                stats_counters.requests,
+                stats_counters.exceptions);
+
+    rc = modbus_stats_get_histogram(
+        stats, MODBUS_STATS_TOTAL, MODBUS_FC_READ_HOLDING_REGISTERS, stats_histogram);
+    for (i = 0, stats_nb = 0; i < MODBUS_STATS_NB_BUCKETS; i++) {
+        stats_nb += stats_histogram[i];
+    }
+    printf("2/5 modbus_stats_get_histogram of FC03: ");
+    ASSERT_TRUE(rc == 0 && stats_nb == 3, "FAILED (%u latencies)\n", stats_nb);
+
+    rc = modbus_stats_get_histogram(
+        stats, MODBUS_STATS_RECEIVE, MODBUS_FC_READ_COILS, stats_histogram);
+    printf("3/5 modbus_stats_get_histogram of a stage per FC: ");
+    ASSERT_TRUE(rc == -1 && errno == EINVAL, "FAILED (%d)\n", rc);
+
+    memset(stats_histogram, 0, sizeof(stats_histogram));
+    stats_histogram[3] = 90;
+    stats_histogram[10] = 10;
+    printf("4/5 modbus_stats_percentile: ");
+    ASSERT_TRUE(modbus_stats_percentile(stats_histogram, 500) == 7 &&
+                    modbus_stats_percentile(stats_histogram, 990) == 1023,
+                "FAILED\n");
+
+    rc = modbus_stats_to_registers(stats, tab_stats_registers);
+    printf("5/5 modbus_stats_to_registers: ");
+    ASSERT_TRUE(rc == MODBUS_STATS_REGISTERS && tab_stats_registers[0] == 0 &&
+                    tab_stats_registers[1] == 3 && tab_stats_registers[3] == 1,
+                "FAILED\n");
+    /* The buckets of the TOTAL histogram, on 32 bits */
+    for (i = 0, stats_nb = 0; i < MODBUS_STATS_NB_BUCKETS; i++) {
+        stats_nb += ((uint32_t) tab_stats_registers[10 + 2 * i] << 16) |
+                    tab_stats_registers[11 + 2 * i];
+    }
+    ASSERT_TRUE(stats_nb == 3, "FAILED (%u latencies)\n", stats_nb);
+    modbus_stats_free(stats);
+    stats = NULL;
+
+    /** DIAGNOSTICS **/
+    printf("\nTEST DIAGNOSTICS:\n");
+    rc = modbus_diagnostics(ctx, MODBUS_DIAG_RETURN_QUERY_DATA, 0xA537, &diag_value);
+    printf("1/8 modbus_diagnostics return query data: ");
+    ASSERT_TRUE(rc == 1 && diag_value == 0xA537, "FAILED (%d)\n", rc);
+
+    modbus_diagnostics(ctx, MODBUS_DIAG_CLEAR_COUNTERS, 0, NULL);
+    modbus_read_registers(ctx, UT_REGISTERS_ADDRESS, 1, tab_rp_registers);
+    /* Busy exception of the server */
+    modbus_read_registers(ctx, UT_REGISTERS_ADDRESS_SPECIAL, 1, tab_rp_registers);
+    rc = modbus_diagnostics(ctx, MODBUS_DIAG_SERVER_MESSAGE_COUNT, 0, &diag_value);
+    printf("2/8 modbus_diagnostics server message count: ");
+    ASSERT_TRUE(rc == 1 && diag_value == 3, "FAILED (%d messages)\n", diag_value);
+
+    rc = modbus_diagnostics(ctx, MODBUS_DIAG_SERVER_BUSY_COUNT, 0, &diag_value);
+    printf("3/8 modbus_diagnostics server busy count: ");
+    ASSERT_TRUE(rc == 1 && diag_value == 1, "FAILED (%d busy)\n", diag_value);
+
+    /* Clear, read and the two diagnostics, not the exception */
+    rc = modbus_get_comm_event_counter(ctx, &diag_status, &diag_value);
+    printf("4/8 modbus_get_comm_event_counter: ");
+    ASSERT_TRUE(rc == 1 && diag_status == 0 && diag_value == 4,
+                "FAILED (%d events)\n",
+                diag_value);
+
+    rc = modbus_get_comm_event_log(ctx, &event_log);
+    printf("5/8 modbus_get_comm_event_log: ");
+    ASSERT_TRUE(rc >= 3 && rc == event_log.nb_events && event_log.event_count == 4 &&
+                    event_log.message_count == 6 &&
+                    event_log.events[0] == MODBUS_EVENT_RECEIVE &&
+                    event_log.events[1] == MODBUS_EVENT_SEND &&
+                    event_log.events[2] == MODBUS_EVENT_RECEIVE,
+                "FAILED (%d events)\n",
+                rc);
+
+    rc = modbus_diagnostics(ctx, 0x03, 0, NULL);
+    printf("6/8 modbus_diagnostics unknown sub-function: ");
+    ASSERT_TRUE(rc == -1 && errno == EMBXILFUN, "FAILED (%d)\n", rc);
+
+    modbus_get_response_timeout(ctx, &old_response_to_sec, &old_response_to_usec);
+    modbus_set_response_timeout(ctx, 0, 200000);
+    rc = modbus_diagnostics(ctx, MODBUS_DIAG_FORCE_LISTEN_ONLY, 0, NULL);
+    if (rc == 0)
+        rc = modbus_read_registers(ctx, UT_REGISTERS_ADDRESS, 1, tab_rp_registers);
+    printf("7/8 no response in listen only mode: ");
+    ASSERT_TRUE(rc == -1 && errno == ETIMEDOUT, "FAILED (%d)\n", rc);
+
+    /* Not answered either, the server was listening only */
+    modbus_diagnostics(ctx, MODBUS_DIAG_RESTART_COMMUNICATIONS, 0, NULL);
+    modbus_set_response_timeout(ctx, old_response_to_sec, old_response_to_usec);
+    rc = modbus_diagnostics(ctx, MODBUS_DIAG_RETURN_QUERY_DATA, 0x1234, &diag_value);
+    printf("8/8 modbus_diagnostics restart communications: ");
+    ASSERT_TRUE(rc == 1 && diag_value == 0x1234, "FAILED (%d)\n", rc);
+
+    if (has_workers) {
+        printf("\nTEST DIAGNOSTICS OF THE WORKERS:\n");
+        for (i = 0; i < NB_CONNECTIONS_WORKERS; i++) {
+            ctx_workers[i] = modbus_new_tcp(ip_or_device, 1502);
+            if (ctx_workers[i] == NULL || modbus_connect(ctx_workers[i]) == -1)
+                break;
+            modbus_set_response_timeout(ctx_workers[i], 0, 200000);
+        }
+        printf("1/3 connections to the workers: ");
+        ASSERT_TRUE(i == NB_CONNECTIONS_WORKERS, "FAILED (%d)\n", i);
+
+        /* Forced on the worker of ctx, the others are silent too. Without
+           response, the mode is set once a read of ctx is left unanswered. */
+        modbus_set_response_timeout(ctx, 0, 200000);
+        modbus_diagnostics(ctx, MODBUS_DIAG_FORCE_LISTEN_ONLY, 0, NULL);
+        modbus_read_registers(ctx, UT_REGISTERS_ADDRESS, 1, tab_rp_registers);
+        nb_answered = 0;
+        for (i = 0; i < NB_CONNECTIONS_WORKERS; i++) {
+            rc = modbus_read_registers(
+                ctx_workers[i], UT_REGISTERS_ADDRESS, 1, tab_rp_registers);
+            if (rc != -1)
+                nb_answered++;
+        }
+        printf("2/3 listen only mode on all the workers: ");
+        ASSERT_TRUE(nb_answered == 0, "FAILED (%d answered)\n", nb_answered);
+
+        /* Restarted once the query of ctx is answered */
+        modbus_diagnostics(ctx, MODBUS_DIAG_RESTART_COMMUNICATIONS, 0, NULL);
+        modbus_set_response_timeout(ctx, old_response_to_sec, old_response_to_usec);
+        modbus_diagnostics(ctx, MODBUS_DIAG_RETURN_QUERY_DATA, 0x1234, &diag_value);
+        for (i = 0; i < NB_CONNECTIONS_WORKERS; i++) {
+            rc = modbus_read_registers(
+                ctx_workers[i], UT_REGISTERS_ADDRESS, 1, tab_rp_registers);
+            if (rc != -1)
+                nb_answered++;
+        }
+        printf("3/3 restarted on all the workers: ");
+        ASSERT_TRUE(nb_answered == NB_CONNECTIONS_WORKERS,
+                    "FAILED (%d answered)\n",
+                    nb_answered);
+        for (i = 0; i < NB_CONNECTIONS_WORKERS; i++) {
+            modbus_close(ctx_workers[i]);
+            modbus_free(ctx_workers[i]);
+            ctx_workers[i] = NULL;
+        }
+    }
+
+    /** PREPARED REQUESTS **/
+    printf("\nTEST PREPARED REQUESTS:\n");
+    modbus_write_registers(ctx, UT_REGISTERS_ADDRESS, UT_REGISTERS_NB, UT_REGISTERS_TAB);
+    prepared = modbus_prepare_read(ctx,
+                                   MODBUS_FC_READ_HOLDING_REGISTERS,
+                                   UT_REGISTERS_ADDRESS,
+                                   UT_REGISTERS_NB,
+                                   tab_rp_registers);
+    printf("1/4 modbus_prepare_read: ");
+    ASSERT_TRUE(prepared != NULL, "FAILED (%s)\n", modbus_strerror(errno));
+
+    /* The same request is executed twice, with a new TID each time */
+    for (i = 0; i < 2; i++) {
+        memset(tab_rp_registers, 0, UT_REGISTERS_NB * sizeof(uint16_t));
+        rc = modbus_prepared_execute(prepared);
+        printf("%d/4 modbus_prepared_execute: ", i + 2);
+        ASSERT_TRUE(rc == UT_REGISTERS_NB &&
+                        is_memory_equal(tab_rp_registers,
+                                        UT_REGISTERS_TAB,
+                                        UT_REGISTERS_NB * sizeof(uint16_t)),
+                    "FAILED (nb points %d)\n",
+                    rc);
+    }
+    modbus_prepared_free(prepared);
+
+    prepared = modbus_prepare_read(ctx,
+                                   MODBUS_FC_READ_DISCRETE_INPUTS,
+                                   UT_INPUT_BITS_ADDRESS,
+                                   UT_INPUT_BITS_NB,
+                                   tab_rp_bits);
+    rc = modbus_prepared_send(prepared);
+    if (rc > 0) {
+        rc = modbus_prepared_receive(prepared);
+    }
+    for (i = 0; rc == UT_INPUT_BITS_NB && i < UT_INPUT_BITS_NB; i++) {
+        value = modbus_get_byte_from_bits(tab_rp_bits, i, 1);
+        if (value != ((UT_INPUT_BITS_TAB[i / 8] >> (i % 8)) & 1))
+            break;
+    }
+    printf("4/4 modbus_prepared_send/receive: ");
+    ASSERT_TRUE(rc == UT_INPUT_BITS_NB && i == UT_INPUT_BITS_NB,
+                "FAILED (nb points %d, bit %d)\n",
+                rc,
+                i);
+    modbus_prepared_free(prepared);
+    prepared = NULL;
+
+    /** READ-AHEAD **/
+    printf("\nTEST READ-AHEAD:\n");
+    rc = modbus_set_read_ahead(ctx, TRUE);
+    printf("1/3 modbus_set_read_ahead: ");
+    ASSERT_TRUE(rc == 0, "FAILED (%s)\n", modbus_strerror(errno));
+
+    /* Two requests in flight, the second response comes with the first one */
+    prepared = modbus_prepare_read(ctx,
+                                   MODBUS_FC_READ_HOLDING_REGISTERS,
+                                   UT_REGISTERS_ADDRESS,
+                                   UT_REGISTERS_NB,
+                                   tab_rp_registers);
+    prepared_next = modbus_prepare_read(ctx,
+                                        MODBUS_FC_READ_DISCRETE_INPUTS,
+                                        UT_INPUT_BITS_ADDRESS,
+                                        UT_INPUT_BITS_NB,
+                                        tab_rp_bits);
+    rc = modbus_prepared_send(prepared);
+    if (rc > 0)
+        rc = modbus_prepared_send(prepared_next);
+    usleep(100000);
+    if (rc > 0)
+        rc = modbus_prepared_receive(prepared);
+    printf("2/3 modbus_prepared_receive with the next response read ahead: ");
+    ASSERT_TRUE(rc == UT_REGISTERS_NB &&
+                    (use_backend == RTU || modbus_get_read_ahead_length(ctx) > 0),
+                "FAILED (nb points %d, %d bytes ahead)\n",
+                rc,
+                modbus_get_read_ahead_length(ctx));
+
+    rc = modbus_prepared_receive(prepared_next);
+    printf("3/3 modbus_prepared_receive from the read-ahead: ");
+    ASSERT_TRUE(rc == UT_INPUT_BITS_NB && modbus_get_read_ahead_length(ctx) == 0,
+                "FAILED (nb points %d, %d bytes ahead)\n",
+                rc,
+                modbus_get_read_ahead_length(ctx));
+    modbus_prepared_free(prepared);
+    prepared = NULL;
+    modbus_prepared_free(prepared_next);
+    prepared_next = NULL;
+
+    /** CORK **/
+    printf("\nTEST CORK:\n");
+    if (use_backend == RTU) {
+        rc = modbus_cork(ctx);
+        printf("1/1 modbus_cork not supported by RTU: ");
+        ASSERT_TRUE(rc == -1 && errno == ENOTSUP, "FAILED (%d)\n", rc);
+    } else {
+        prepared = modbus_prepare_read(ctx,
+                                       MODBUS_FC_READ_HOLDING_REGISTERS,
+                                       UT_REGISTERS_ADDRESS,
+                                       UT_REGISTERS_NB,
+                                       tab_rp_registers);
+        prepared_next = modbus_prepare_read(ctx,
+                                            MODBUS_FC_READ_DISCRETE_INPUTS,
+                                            UT_INPUT_BITS_ADDRESS,
+                                            UT_INPUT_BITS_NB,
+                                            tab_rp_bits);
+        /* Both requests are written by modbus_uncork() */
+        rc = modbus_cork(ctx);
+        if (rc == 0)
+            rc = modbus_prepared_send(prepared);
+        if (rc > 0)
+            rc = modbus_prepared_send(prepared_next);
+        if (rc > 0)
+            rc = modbus_uncork(ctx);
+        printf("1/3 modbus_cork/uncork: ");
+        ASSERT_TRUE(rc == 0, "FAILED (%s)\n", modbus_strerror(errno));
+
+        rc = modbus_prepared_receive(prepared);
+        printf("2/3 modbus_prepared_receive of the first request: ");
+        ASSERT_TRUE(rc == UT_REGISTERS_NB, "FAILED (nb points %d)\n", rc);
+        rc = modbus_prepared_receive(prepared_next);
+        printf("3/3 modbus_prepared_receive of the second request: ");
+        ASSERT_TRUE(rc == UT_INPUT_BITS_NB, "FAILED (nb points %d)\n", rc);
+        modbus_prepared_free(prepared);
+        prepared = NULL;
+        modbus_prepared_free(prepared_next);
+        prepared_next = NULL;
+    }
+
+    /** SCAN LIST **/
+    printf("\nTEST SCAN LIST:\n");
+    tab_scan_registers[0] = 0x1234;
+    tab_scan_registers[1] = 0x0001;
+    tab_scan_registers[2] = 0x0002;
+    tab_scan_registers[3] = 0xFFFE;
+    tab_scan_registers[4] = 0;
+    tab_scan_registers[5] = 0;
+    tab_scan_registers[6] = UT_IREAL_ABCD_GET[0];
+    tab_scan_registers[7] = UT_IREAL_ABCD_GET[1];
+    modbus_write_registers(ctx, UT_REGISTERS_ADDRESS, 8, tab_scan_registers);
+
+    /* A hole of 2 registers before the float */
+    scan = modbus_scan_new(2);
+    modbus_scan_add(scan,
+                    MODBUS_TABLE_HOLDING_REGISTERS,
+                    UT_REGISTERS_ADDRESS,
+                    1,
+                    MODBUS_SCAN_UINT16,
+                    &scan_u16);
+    modbus_scan_add(scan,
+                    MODBUS_TABLE_HOLDING_REGISTERS,
+                    UT_REGISTERS_ADDRESS + 6,
+                    1,
+                    MODBUS_SCAN_FLOAT,
+                    &real);
+    modbus_scan_add(scan,
+                    MODBUS_TABLE_HOLDING_REGISTERS,
+                    UT_REGISTERS_ADDRESS + 1,
+                    1,
+                    MODBUS_SCAN_UINT32,
+                    &scan_u32);
+    modbus_scan_add(scan,
+                    MODBUS_TABLE_HOLDING_REGISTERS,
+                    UT_REGISTERS_ADDRESS + 3,
+                    1,
+                    MODBUS_SCAN_INT16,
+                    &scan_i16);
+    modbus_scan_add(
+        scan, MODBUS_TABLE_COILS, UT_BITS_ADDRESS, 8, MODBUS_SCAN_BIT, scan_bits);
+    modbus_scan_add(scan,
+                    MODBUS_TABLE_INPUT_REGISTERS,
+                    UT_INPUT_REGISTERS_ADDRESS,
+                    UT_INPUT_REGISTERS_NB,
+                    MODBUS_SCAN_UINT16,
+                    scan_input);
+    printf("1/5 modbus_scan_get_nb_requests: ");
+    rc = modbus_scan_get_nb_requests(scan);
+    ASSERT_TRUE(rc == 3, "FAILED (%d requests)\n", rc);
+
+    printf("2/5 modbus_scan_run: ");
+    rc = modbus_scan_run(scan, ctx);
+    ASSERT_TRUE(rc == 3, "FAILED (%d)\n", rc);
+    ASSERT_TRUE(scan_u16 == 0x1234, "FAILED (%0X != %0X)\n", scan_u16, 0x1234);
+    ASSERT_TRUE(scan_u32 == 0x00010002, "FAILED (%0X != %0X)\n", scan_u32, 0x00010002);
+    ASSERT_TRUE(scan_i16 == -2, "FAILED (%d != %d)\n", scan_i16, -2);
+    ASSERT_TRUE(real == UT_REAL, "FAILED (%f != %f)\n", real, UT_REAL);
+    ASSERT_TRUE(scan_input[0] == UT_INPUT_REGISTERS_TAB[0],
+                "FAILED (%0X != %0X)\n",
+                scan_input[0],
+                UT_INPUT_REGISTERS_TAB[0]);
+    rc = modbus_read_bits(ctx, UT_BITS_ADDRESS, 8, tab_rp_bits);
+    ASSERT_TRUE(rc == 8 && is_memory_equal(scan_bits, tab_rp_bits, 8), "FAILED\n");
+
+    /* The requests are prepared again for the new slave, the TCP server
+       responds to any unit ID */
+    if (use_backend != RTU) {
+        old_slave = modbus_get_slave(ctx);
+        modbus_set_slave(ctx, INVALID_SERVER_ID);
+        trace = modbus_trace_new(16);
+        modbus_set_trace(ctx, trace);
+        rc = modbus_scan_run(scan, ctx);
+        modbus_set_trace(ctx, NULL);
+        modbus_set_slave(ctx, old_slave);
+        trace_seq = 0;
+        modbus_trace_read(trace, &trace_seq, trace_records, 16);
+        modbus_trace_free(trace);
+        trace = NULL;
+        printf("2-B/5 modbus_scan_run after modbus_set_slave: ");
+        ASSERT_TRUE(rc == 3 && trace_records[0].event == MODBUS_TRACE_SEND &&
+                        trace_records[0].slave == INVALID_SERVER_ID,
+                    "FAILED (%d, slave %d)\n",
+                    rc,
+                    trace_records[0].slave);
+    }
+    modbus_scan_free(scan);
+
+    /* Without gap fill, the float needs its own request */
+    scan = modbus_scan_new(0);
+    modbus_scan_add(scan,
+                    MODBUS_TABLE_HOLDING_REGISTERS,
+                    UT_REGISTERS_ADDRESS,
+                    1,
+                    MODBUS_SCAN_UINT16,
+                    &scan_u16);
+    modbus_scan_add(scan,
+                    MODBUS_TABLE_HOLDING_REGISTERS,
+                    UT_REGISTERS_ADDRESS + 6,
+                    1,
+                    MODBUS_SCAN_FLOAT,
+                    &real);
+    printf("3/5 modbus_scan_get_nb_requests (no gap): ");
+    rc = modbus_scan_get_nb_requests(scan);
+    ASSERT_TRUE(rc == 2, "FAILED (%d requests)\n", rc);
+    modbus_scan_free(scan);
+
+    /* An exception only fails the tags of its request */
+    scan = modbus_scan_new(0);
+    scan_tags[0] = modbus_scan_add(scan,
+                                   MODBUS_TABLE_HOLDING_REGISTERS,
+                                   UT_REGISTERS_ADDRESS + UT_REGISTERS_NB_MAX,
+                                   1,
+                                   MODBUS_SCAN_UINT16,
+                                   &scan_u16);
+    scan_tags[1] = modbus_scan_add(scan,
+                                   MODBUS_TABLE_INPUT_REGISTERS,
+                                   UT_INPUT_REGISTERS_ADDRESS,
+                                   UT_INPUT_REGISTERS_NB,
+                                   MODBUS_SCAN_UINT16,
+                                   scan_input);
+    printf("4/5 modbus_scan_run (illegal address): ");
+    rc = modbus_scan_run(scan, ctx);
+    ASSERT_TRUE(rc == -1 && errno == EMBXILADD, "");
+    ASSERT_TRUE(modbus_scan_get_status(scan, scan_tags[0]) == EMBXILADD, "");
+    ASSERT_TRUE(modbus_scan_get_status(scan, scan_tags[1]) == 0, "");
+    modbus_scan_free(scan);
+
+    scan = modbus_scan_new(0);
+    printf("5/5 modbus_scan_run (no tag): ");
+    rc = modbus_scan_run(scan, ctx);
+    ASSERT_TRUE(rc == 0 && modbus_scan_get_nb_requests(scan) == 0, "FAILED (%d)\n", rc);
+    modbus_scan_free(scan);
+    scan = NULL;
+
+    /** SCHEDULER **/
+    printf("\nTEST SCHEDULER:\n");
+    sched = modbus_sched_new();
+    modbus_sched_add(sched, ctx, 5000, 0, 1, poll_register, &tab_rp_registers[0]);
+    modbus_sched_add(sched, ctx, 20000, 0, 0, poll_register, &tab_rp_registers[1]);
+    rc = modbus_sched_run(sched, 200000);
+    printf("1/2 modbus_sched_run: ");
+    ASSERT_TRUE(rc > 0, "FAILED (%d runs)\n", rc);
+
+    /* 40 and 10 releases, be tolerant with a loaded host */
+    printf("2/2 modbus_sched_get_stats: ");
+    modbus_sched_get_stats(sched, 0, &sched_stats);
+    ASSERT_TRUE(sched_stats.runs >= 20 && sched_stats.errors == 0,
+                "FAILED (%u runs, %u errors)\n",
+                sched_stats.runs,
+                sched_stats.errors);
+    ASSERT_TRUE(sched_stats.jitter_min <= sched_stats.jitter_avg &&
+                    sched_stats.jitter_avg <= sched_stats.jitter_max,
+                "FAILED (jitter %u/%u/%u)\n",
+                sched_stats.jitter_min,
+                sched_stats.jitter_avg,
+                sched_stats.jitter_max);
+    modbus_sched_get_stats(sched, 1, &sched_stats);
+    ASSERT_TRUE(sched_stats.runs >= 5 && sched_stats.errors == 0,
+                "FAILED (%u runs, %u errors)\n",
+                sched_stats.runs,
+                sched_stats.errors);
+    ASSERT_TRUE(tab_rp_registers[0] == tab_rp_registers[1],
+                "FAILED (%0X != %0X)\n",
+                tab_rp_registers[0],
+                tab_rp_registers[1]);
+    modbus_sched_free(sched);
+    sched = NULL;
+
+    /** POLLER **/
+    for (i = 0; use_backend != RTU && i < 2; i++) {
+        printf("\nTEST POLLER (%s):\n", i == 0 ? "epoll" : "io_uring");
+        poller = modbus_poller_new();
+        if (i == 1 &&
+            modbus_poller_set_engine(poller, MODBUS_POLLER_ENGINE_IO_URING) == -1) {
+            printf("io_uring not available (%s)\n", modbus_strerror(errno));
+            modbus_poller_free(poller);
+            poller = NULL;
+            break;
+        }
+        memset(poller_up, 0, sizeof(poller_up));
+        memset(poller_down, 0, sizeof(poller_down));
+        poller_input = 0;
+        /* The connection of the tests and a device down */
+        rc = modbus_poller_add_device(poller, ctx);
+        modbus_poller_add_read(poller,
+                               rc,
+                               MODBUS_FC_READ_INPUT_REGISTERS,
+                               UT_INPUT_REGISTERS_ADDRESS,
+                               UT_INPUT_REGISTERS_NB,
+                               &poller_input,
+                               10000,
+                               poller_done,
+                               poller_up);
+        ctx_down = modbus_new_tcp("127.0.0.1", 1);
+        rc = modbus_poller_add_device(poller, ctx_down);
+        modbus_poller_add_read(poller,
+                               rc,
+                               MODBUS_FC_READ_INPUT_REGISTERS,
+                               UT_INPUT_REGISTERS_ADDRESS,
+                               UT_INPUT_REGISTERS_NB,
+                               &poller_input_down,
+                               10000,
+                               poller_done,
+                               poller_down);
+        rc = modbus_poller_run(poller, 100000);
+        printf("1/3 modbus_poller_run: ");
+        ASSERT_TRUE(rc > 0, "FAILED (%d reads)\n", rc);
+
+        /* 10 releases each, be tolerant with a loaded host */
+        printf("2/3 device up: ");
+        ASSERT_TRUE(poller_up[0] >= 5 && poller_up[1] == 0 &&
+                        poller_input == UT_INPUT_REGISTERS_TAB[0],
+                    "FAILED (%d reads, %d errors, 0x%X)\n",
+                    poller_up[0],
+                    poller_up[1],
+                    poller_input);
+
+        printf("3/3 device down: ");
+        ASSERT_TRUE(poller_down[0] == 0 && poller_down[1] >= 5 &&
+                        poller_down[2] == ECONNREFUSED,
+                    "FAILED (%d reads, %d errors, %s)\n",
+                    poller_down[0],
+                    poller_down[1],
+                    modbus_strerror(poller_down[2]));
+        modbus_poller_free(poller);
+        poller = NULL;
+        modbus_free(ctx_down);
+        ctx_down = NULL;
+
+        /* A response may be left in flight */
+        usleep(50000);
+        modbus_flush(ctx);
+    }
+
+    /** POOL **/
+    if (use_backend == TCP) {
+        printf("\nTEST POOL:\n");
+        pool = modbus_pool_new(1, 0);
+        /* The server only accepts the connection of the tests, the
+           connection of the pool waits in its backlog */
+        ctx_pool = modbus_pool_get(pool, ip_or_device, 1502, 0);
+        printf("1/5 modbus_pool_get: ");
+        ASSERT_TRUE(ctx_pool != NULL, "FAILED (%s)\n", modbus_strerror(errno));
+
+        printf("2/5 limit of the endpoint: ");
+        ASSERT_TRUE(modbus_pool_get(pool, ip_or_device, 1502, 10000) == NULL &&
+                        errno == EBUSY,
+                    "");
+
+        printf("3/5 reuse: ");
+        modbus_pool_put(pool, ctx_pool, 0);
+        ctx_pool = modbus_pool_get(pool, ip_or_device, 1502, 0);
+        modbus_pool_get_stats(pool, ip_or_device, 1502, &pool_stats);
+        ASSERT_TRUE(ctx_pool != NULL && pool_stats.connects == 1 &&
+                        pool_stats.reuses == 1 && pool_stats.waits == 1,
+                    "FAILED (%u connects, %u reuses, %u waits)\n",
+                    pool_stats.connects,
+                    pool_stats.reuses,
+                    pool_stats.waits);
+
+        printf("4/5 closed on a link error: ");
+        modbus_pool_put(pool, ctx_pool, ETIMEDOUT);
+        ctx_pool = NULL;
+        modbus_pool_get_stats(pool, ip_or_device, 1502, &pool_stats);
+        ASSERT_TRUE(pool_stats.nb_idle == 0 && pool_stats.nb_in_use == 0, "");
+
+        printf("5/5 endpoint down: ");
+        ASSERT_TRUE(modbus_pool_get(pool, "127.0.0.1", 1, 0) == NULL &&
+                        errno == ECONNREFUSED,
+                    "");
+        /* Before any wait */
+        ASSERT_TRUE(modbus_pool_get(pool, "127.0.0.1", 1, 1000000) == NULL &&
+                        errno == ECONNREFUSED,
+                    "");
+        modbus_pool_get_stats(pool, "127.0.0.1", 1, &pool_stats);
+        ASSERT_TRUE(pool_stats.connects == 1 && pool_stats.fast_failures == 1 &&
+                        pool_stats.waits == 0,
+                    "FAILED (%u connects, %u fast failures, %u waits)\n",
+                    pool_stats.connects,
+                    pool_stats.fast_failures,
+                    pool_stats.waits);
+        modbus_pool_free(pool);
+        pool = NULL;
+    }
+
+    /** BUS **/
+    printf("\nTEST BUS:\n");
+    bus = modbus_bus_new(ctx);
+    if (use_backend != RTU) {
+        printf("1/1 modbus_bus_new on RTU only: ");
+        ASSERT_TRUE(bus == NULL && errno == EINVAL, "");
+    } else {
+        rc = modbus_bus_add_read(bus,
+                                 SERVER_ID,
+                                 MODBUS_FC_READ_INPUT_REGISTERS,
+                                 UT_INPUT_REGISTERS_ADDRESS,
+                                 UT_INPUT_REGISTERS_NB,
+                                 &bus_input,
+                                 10000,
+                                 poller_done,
+                                 bus_counts);
+        if (rc != -1)
+            rc = modbus_bus_run(bus, 200000);
+        printf("1/3 modbus_bus_run: ");
+        ASSERT_TRUE(rc > 0, "FAILED (%d reads)\n", rc);
+
+        /* 20 releases, be tolerant with a loaded host */
+        printf("2/3 slave read: ");
+        ASSERT_TRUE(bus_counts[0] >= 5 && bus_counts[1] == 0 &&
+                        bus_input == UT_INPUT_REGISTERS_TAB[0],
+                    "FAILED (%d reads, %d errors, 0x%X)\n",
+                    bus_counts[0],
+                    bus_counts[1],
+                    bus_input);
+
+        /* The response timeout of the context is restored */
+        printf("3/3 response timeout learned: ");
+        modbus_bus_get_slave_stats(bus, SERVER_ID, &bus_slave_stats);
+        modbus_bus_free(bus);
+        bus = NULL;
+        modbus_get_response_timeout(ctx, &old_response_to_sec, &old_response_to_usec);
+        ASSERT_TRUE(bus_slave_stats.timeout > 0 &&
+                        bus_slave_stats.timeout <
+                            old_response_to_sec * 1000000 + old_response_to_usec,
+                    "FAILED (%u us)\n",
+                    bus_slave_stats.timeout);
+    }
+
+    /** CRC16 **/
+    printf("\nTEST CRC16:\n");
+    printf("1/3 modbus_rtu_crc16 check value: ");
+    crc = modbus_rtu_crc16(0xFFFF, (const uint8_t *) "123456789", 9);
+    ASSERT_TRUE(crc == 0x4B37, "FAILED (0x%04X != 0x4B37)\n", crc);
+
+    printf("2/3 modbus_rtu_crc16 of 0 to 300 bytes: ");
+    for (i = 0; i < (int) sizeof(crc_data); i++) {
+        crc_data[i] = (i * 167 + 13) ^ (i >> 3);
+    }
+    for (i = 0; i <= (int) sizeof(crc_data); i++) {
+        crc = modbus_rtu_crc16(0xFFFF, crc_data, i);
+        if (crc != crc16_bitwise(crc_data, i))
+            break;
+    }
+    ASSERT_TRUE(i > (int) sizeof(crc_data), "FAILED (length %d)\n", i);
+
+    printf("3/3 modbus_rtu_crc16 updated byte by byte: ");
+    crc = 0xFFFF;
+    for (i = 0; i < MODBUS_RTU_MAX_ADU_LENGTH - 2; i++) {
+        crc = modbus_rtu_crc16(crc, crc_data + i, 1);
+    }
+    ASSERT_TRUE(crc == crc16_bitwise(crc_data, i), "");
+    /* Followed by its CRC, low order byte first */
+    crc_data[i] = crc & 0xFF;
+    crc_data[i + 1] = crc >> 8;
+    crc = modbus_rtu_crc16(0xFFFF, crc_data, 100);
+    crc = modbus_rtu_crc16(crc, crc_data + 100, MODBUS_RTU_MAX_ADU_LENGTH - 100);
+    ASSERT_TRUE(crc == 0, "FAILED (0x%04X)\n", crc);
+
     printf("\nTEST FLOATS\n");
     /** FLOAT **/
     printf("1/4 Set/get float ABCD: ");
@@ -364,6 +1275,74 @@ int main(int argc, char *argv[])
     real = modbus_get_float_cdab(UT_IREAL_CDAB_GET);
     ASSERT_TRUE(real == UT_REAL, "FAILED (%f != %f)\n", real, UT_REAL);
 
+    /** BULK CONVERSIONS **/
+    /* 13 values to use both the vector and the scalar code */
+    printf("\nTEST BULK CONVERSIONS\n");
+    for (i = 0; i < 4 * 13; i++) {
+        tab_bulk_registers[i] = (uint16_t) (0x4711 * (i + 1));
+        tab_bulk_wire[2 * i] = tab_bulk_registers[i] >> 8;
+        tab_bulk_wire[2 * i + 1] = tab_bulk_registers[i] & 0xFF;
+    }
+    view.data = tab_bulk_wire;
+    view.nb = 4 * 13;
+
+    printf("1/4 modbus_get_floats vs modbus_get_float_*: ");
+    for (order = MODBUS_ORDER_ABCD, rc = 0; order <= MODBUS_ORDER_CDAB && rc == 0;
+         order++) {
+        modbus_get_floats(tab_bulk_registers, 13, order, tab_bulk_float);
+        for (i = 0; i < 13; i++) {
+            const uint16_t *src = tab_bulk_registers + 2 * i;
+
+            real = order == MODBUS_ORDER_ABCD   ? modbus_get_float_abcd(src)
+                   : order == MODBUS_ORDER_DCBA ? modbus_get_float_dcba(src)
+                   : order == MODBUS_ORDER_BADC ? modbus_get_float_badc(src)
+                                                : modbus_get_float_cdab(src);
+            if (memcmp(&real, &tab_bulk_float[i], sizeof(float)) != 0) {
+                rc = -1;
+                break;
+            }
+        }
+    }
+    ASSERT_TRUE(rc == 0, "FAILED (order %d, value %d)\n", order - 1, i);
+
+    printf("2/4 modbus_get_int64s/uint32s vs modbus_view_get_*: ");
+    for (order = MODBUS_ORDER_ABCD, rc = 0; order <= MODBUS_ORDER_CDAB && rc == 0;
+         order++) {
+        modbus_get_int64s(tab_bulk_registers, 13, order, tab_bulk_int64);
+        modbus_view_get_int64(&view, 0, 13, order, tab_bulk_view);
+        if (memcmp(tab_bulk_int64, tab_bulk_view, 13 * sizeof(int64_t)) != 0)
+            rc = -1;
+        modbus_get_uint32s(tab_bulk_registers, 26, order, (uint32_t *) tab_bulk_int64);
+        modbus_view_get_uint32(&view, 0, 26, order, (uint32_t *) tab_bulk_view);
+        if (memcmp(tab_bulk_int64, tab_bulk_view, 13 * sizeof(int64_t)) != 0)
+            rc = -1;
+    }
+    ASSERT_TRUE(rc == 0, "FAILED (order %d)\n", order - 1);
+
+    printf("3/4 modbus_set_doubles/int32s round trip: ");
+    for (order = MODBUS_ORDER_ABCD, rc = 0; order <= MODBUS_ORDER_CDAB && rc == 0;
+         order++) {
+        modbus_get_doubles(tab_bulk_registers, 13, order, (double *) tab_bulk_int64);
+        modbus_set_doubles((double *) tab_bulk_int64, 13, order, tab_bulk_set);
+        if (memcmp(tab_bulk_set, tab_bulk_registers, sizeof(tab_bulk_set)) != 0)
+            rc = -1;
+        modbus_get_int32s(tab_bulk_registers, 26, order, (int32_t *) tab_bulk_int64);
+        modbus_set_int32s((int32_t *) tab_bulk_int64, 26, order, tab_bulk_set);
+        if (memcmp(tab_bulk_set, tab_bulk_registers, sizeof(tab_bulk_set)) != 0)
+            rc = -1;
+    }
+    ASSERT_TRUE(rc == 0, "FAILED (order %d)\n", order - 1);
+
+    printf("4/4 modbus_get_uint64s in place: ");
+    memcpy(tab_bulk_set, tab_bulk_registers, sizeof(tab_bulk_set));
+    modbus_get_uint64s(tab_bulk_set, 13, MODBUS_ORDER_BADC, (uint64_t *) tab_bulk_set);
+    modbus_get_uint64s(
+        tab_bulk_registers, 13, MODBUS_ORDER_BADC, (uint64_t *) tab_bulk_int64);
+    rc = modbus_get_uint64s(tab_bulk_registers, 13, 4, (uint64_t *) tab_bulk_int64);
+    ASSERT_TRUE(memcmp(tab_bulk_set, tab_bulk_int64, sizeof(tab_bulk_set)) == 0 &&
+                    rc == -1 && errno == EINVAL,
+                "FAILED\n");
+
     printf("\nAt this point, error messages doesn't mean the test has failed\n");
 
     /** ILLEGAL DATA ADDRESS **/
@@ -467,6 +1446,15 @@ int main(int argc, char *argv[])
     printf("* modbus_write_and_read_registers (max): ");
     ASSERT_TRUE(rc == -1 && errno == EMBXILADD, "");
 
+    rc = modbus_read_file_record(ctx, UT_FILE_NUMBER + 1, 0, 1, tab_rp_file_records);
+    printf("* modbus_read_file_record (file): ");
+    ASSERT_TRUE(rc == -1 && errno == EMBXILADD, "");
+
+    rc = modbus_write_file_record(
+        ctx, UT_FILE_NUMBER, UT_FILE_RECORDS_NB - 1, 2, UT_FILE_RECORDS_TAB);
+    printf("* modbus_write_file_record (max): ");
+    ASSERT_TRUE(rc == -1 && errno == EMBXILADD, "");
+
     /** TOO MANY DATA **/
     printf("\nTEST TOO MANY DATA ERROR:\n");
 
@@ -498,6 +1486,24 @@ int main(int argc, char *argv[])
     printf("* modbus_write_registers: ");
     ASSERT_TRUE(rc == -1 && errno == EMBMDATA, "");
 
+    prepared = modbus_prepare_read(ctx,
+                                   MODBUS_FC_READ_HOLDING_REGISTERS,
+                                   UT_REGISTERS_ADDRESS,
+                                   MODBUS_MAX_READ_REGISTERS + 1,
+                                   tab_rp_registers);
+    printf("* modbus_prepare_read: ");
+    ASSERT_TRUE(prepared == NULL && errno == EMBMDATA, "");
+
+    rc = modbus_read_file_record(
+        ctx, UT_FILE_NUMBER, 0, MODBUS_MAX_READ_REGISTERS, tab_rp_registers);
+    printf("* modbus_read_file_record: ");
+    ASSERT_TRUE(rc == -1 && errno == EMBMDATA, "");
+
+    rc = modbus_write_file_record(
+        ctx, UT_FILE_NUMBER, 0, MODBUS_MAX_WRITE_REGISTERS, tab_rp_registers);
+    printf("* modbus_write_file_record: ");
+    ASSERT_TRUE(rc == -1 && errno == EMBMDATA, "");
+
     /** SLAVE ADDRESS **/
     old_slave = modbus_get_slave(ctx);
 
@@ -762,8 +1768,24 @@ int main(int argc, char *argv[])
 
 close:
     /* Free the memory */
+    for (i = 0; i < NB_CONNECTIONS_WORKERS; i++) {
+        modbus_close(ctx_workers[i]);
+        modbus_free(ctx_workers[i]);
+    }
     free(tab_rp_bits);
     free(tab_rp_registers);
+    modbus_scan_free(scan);
+    modbus_trace_free(trace);
+    modbus_stats_free(stats);
+    modbus_prepared_free(prepared);
+    modbus_prepared_free(prepared_next);
+    modbus_sched_free(sched);
+    modbus_poller_free(poller);
+    modbus_free(ctx_down);
+    modbus_close(ctx_pool);
+    modbus_free(ctx_pool);
+    modbus_pool_free(pool);
+    modbus_bus_free(bus);
 
     /* Close the connection */
     modbus_close(ctx);
@@ -27,6 +27,7 @@
 #ifdef _WIN32
 # include <winsock2.h>
 #else
+# include <sys/resource.h>
 # include <sys/socket.h>
 #endif
 
@@ -44,17 +45,216 @@ enum {
     RTU
 };
 
+/* Connections served by the engines, a few clients open more than one. Each
+   worker takes its share, the kernel may give all the connections of the
+   client to one of them. */
+#define MAX_CONNECTIONS 64
+
+static int use_backend;
+static modbus_mapping_t *mb_mapping;
+
+/* RAM file served by the file record function codes */
+static int file_read(void *user_data,
+                     uint16_t file_number,
+                     uint16_t record_number,
+                     uint16_t record_length,
+                     uint16_t *dest)
+{
+    const uint16_t *file_records = user_data;
+
+    if (file_number != UT_FILE_NUMBER ||
+        record_number + record_length > UT_FILE_RECORDS_NB) {
+        return MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+    }
+    memcpy(dest, file_records + record_number, record_length * sizeof(uint16_t));
+
+    return 0;
+}
+
+static int file_write(void *user_data,
+                      uint16_t file_number,
+                      uint16_t record_number,
+                      uint16_t record_length,
+                      const uint16_t *src)
+{
+    uint16_t *file_records = user_data;
+
+    if (file_number != UT_FILE_NUMBER ||
+        record_number + record_length > UT_FILE_RECORDS_NB) {
+        return MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+    }
+    memcpy(file_records + record_number, src, record_length * sizeof(uint16_t));
+
+    return 0;
+}
+
+/* Replies to the query of length bytes, with the special behaviors tested by
+   the client. Returns -1 to quit. */
+static int serve(modbus_t *ctx, uint8_t *query, int length)
+{
+    int header_length = modbus_get_header_length(ctx);
+    int rc;
+    int i;
+
+    /* Special server behavior to test client */
+    if (query[header_length] == 0x03) {
+        /* Read holding registers */
+
+        if (MODBUS_GET_INT16_FROM_INT8(query, header_length + 3) ==
+            UT_REGISTERS_NB_SPECIAL) {
+            printf("Set an incorrect number of values\n");
+            MODBUS_SET_INT16_TO_INT8(
+                query, header_length + 3, UT_REGISTERS_NB_SPECIAL - 1);
+        } else if (MODBUS_GET_INT16_FROM_INT8(query, header_length + 1) ==
+                   UT_REGISTERS_ADDRESS_SPECIAL) {
+            printf("Reply to this special register address by an exception\n");
+            modbus_reply_exception(ctx, query, MODBUS_EXCEPTION_SLAVE_OR_SERVER_BUSY);
+            return 0;
+        } else if (MODBUS_GET_INT16_FROM_INT8(query, header_length + 1) ==
+                   UT_REGISTERS_ADDRESS_INVALID_TID_OR_SLAVE) {
+            const int RAW_REQ_LENGTH = 5;
+            uint8_t raw_req[] = {(use_backend == RTU) ? INVALID_SERVER_ID : 0xFF,
+                                 0x03,
+                                 0x02,
+                                 0x00,
+                                 0x00};
+
+            printf("Reply with an invalid TID or slave\n");
+            modbus_send_raw_request(ctx, raw_req, RAW_REQ_LENGTH * sizeof(uint8_t));
+            return 0;
+        } else if (MODBUS_GET_INT16_FROM_INT8(query, header_length + 1) ==
+                   UT_REGISTERS_ADDRESS_SLEEP_500_MS) {
+            printf("Sleep 0.5 s before replying\n");
+            usleep(500000);
+        } else if (MODBUS_GET_INT16_FROM_INT8(query, header_length + 1) ==
+                   UT_REGISTERS_ADDRESS_BYTE_SLEEP_5_MS) {
+            /* Test low level only available in TCP mode */
+            /* Catch the reply and send reply byte a byte */
+            uint8_t req[] = "\x00\x1C\x00\x00\x00\x05\xFF\x03\x02\x00\x00";
+            int req_length = 11;
+            int w_s = modbus_get_socket(ctx);
+            if (w_s == -1) {
+                fprintf(stderr, "Unable to get a valid socket in special test\n");
+                return 0;
+            }
+
+            /* Copy TID */
+            req[1] = query[1];
+            for (i = 0; i < req_length; i++) {
+                printf("(%.2X)", req[i]);
+                usleep(5000);
+                rc = send(w_s, (const char *) (req + i), 1, MSG_NOSIGNAL);
+                if (rc == -1) {
+                    break;
+                }
+            }
+            return 0;
+        }
+    }
+
+    return modbus_reply(ctx, query, length, mb_mapping);
+}
+
+/* Request callback of the engines, the query is modified by the special
+   behaviors */
+static int
+serve_request(modbus_t *ctx, const uint8_t *req, int req_length, void *user_data)
+{
+    uint8_t query[MODBUS_TCP_MAX_ADU_LENGTH];
+
+    memcpy(query, req, req_length);
+    return serve(ctx, query, req_length) == -1 ? -1 : 0;
+}
+
+/* Sets the io_uring engine up with room for the rings of all the workers
+   but the last one */
+static int set_uring_short_of_files(modbus_server_t *server, int nb_workers)
+{
+#ifndef _WIN32
+    struct rlimit limit;
+    struct rlimit low;
+    int fd = dup(0);
+    int rc;
+
+    close(fd);
+    getrlimit(RLIMIT_NOFILE, &limit);
+    low = limit;
+    low.rlim_cur = fd + nb_workers - 1;
+    setrlimit(RLIMIT_NOFILE, &low);
+    rc = modbus_server_set_engine(server, MODBUS_SERVER_ENGINE_IO_URING);
+    setrlimit(RLIMIT_NOFILE, &limit);
+
+    return rc;
+#else
+    return modbus_server_set_engine(server, MODBUS_SERVER_ENGINE_IO_URING);
+#endif
+}
+
+/* Serves the clients with the engine of libmodbus: "epoll", "uring", "workers"
+   (2 threads) or "fallback", 4 threads left on epoll by an io_uring which
+   can't be set up for the last one. Returns the exit code. */
+static int run_engine(modbus_t *ctx, const char *engine)
+{
+    modbus_server_t *server;
+    int nb_workers = 1;
+    int rc;
+
+    if (use_backend == RTU) {
+        fprintf(stderr, "The engines serve TCP only\n");
+        return -1;
+    }
+
+    if (strcmp(engine, "workers") == 0) {
+        nb_workers = 2;
+    } else if (strcmp(engine, "fallback") == 0) {
+        nb_workers = 4;
+    }
+
+    if (nb_workers == 1) {
+        int s = use_backend == TCP ? modbus_tcp_listen(ctx, MAX_CONNECTIONS)
+                                   : modbus_tcp_pi_listen(ctx, MAX_CONNECTIONS);
+
+        server = modbus_server_new(ctx, s, mb_mapping, MAX_CONNECTIONS);
+    } else {
+        server = modbus_server_new_workers(ctx, mb_mapping, nb_workers, MAX_CONNECTIONS);
+    }
+    if (server == NULL) {
+        fprintf(stderr, "Unable to create the server: %s\n", modbus_strerror(errno));
+        return -1;
+    }
+    modbus_server_set_request_callback(server, serve_request, NULL);
+
+    if (strcmp(engine, "fallback") == 0) {
+        if (set_uring_short_of_files(server, nb_workers) != -1) {
+            fprintf(stderr, "io_uring set up for all the workers\n");
+            modbus_server_free(server);
+            return -1;
+        }
+        printf("io_uring failed for the last worker (%s), epoll is used\n",
+               modbus_strerror(errno));
+    } else if (strcmp(engine, "uring") == 0 &&
+               modbus_server_set_engine(server, MODBUS_SERVER_ENGINE_IO_URING) == -1) {
+        printf("io_uring not available (%s), epoll is used\n", modbus_strerror(errno));
+    }
+
+    rc = modbus_server_run(server);
+    printf("Quit the engine: %s\n", modbus_strerror(errno));
+    modbus_server_free(server);
+
+    return rc == -1 ? -1 : 0;
+}
+
 int main(int argc, char *argv[])
 {
     int s = -1;
     modbus_t *ctx;
-    modbus_mapping_t *mb_mapping;
+    modbus_file_storage_t file_storage;
+    uint16_t *file_records;
     int rc;
     int i;
-    int use_backend;
     uint8_t *query;
-    int header_length;
     char *ip_or_device;
+    const char *engine = NULL;
 
     if (argc > 1) {
         if (strcmp(argv[1], "tcp") == 0) {
@@ -65,8 +265,10 @@ int main(int argc, char *argv[])
             use_backend = RTU;
         } else {
             printf("Modbus server for unit testing.\n");
-            printf("Usage:\n  %s [tcp|tcppi|rtu] [<ip or device>]\n", argv[0]);
-            printf("Eg. tcp 127.0.0.1 or rtu /dev/ttyUSB0\n\n");
+            printf("Usage:\n  %s [tcp|tcppi|rtu] [<ip or device>] "
+                   "[epoll|uring|workers|fallback]\n",
+                   argv[0]);
+            printf("Eg. tcp 127.0.0.1 or rtu /dev/ttyUSB0 or tcp 127.0.0.1 epoll\n\n");
             return -1;
         }
     } else {
@@ -109,8 +311,6 @@ int main(int argc, char *argv[])
         query = malloc(MODBUS_RTU_MAX_ADU_LENGTH);
     }
 
-    header_length = modbus_get_header_length(ctx);
-
     modbus_set_debug(ctx, FALSE);
 
     mb_mapping = modbus_mapping_new_start_address(UT_BITS_ADDRESS,
@@ -139,7 +339,25 @@ int main(int argc, char *argv[])
         mb_mapping->tab_input_registers[i] = UT_INPUT_REGISTERS_TAB[i];
     }
 
-    if (use_backend == TCP) {
+    /* Serve the file records from RAM */
+    file_records = calloc(UT_FILE_RECORDS_NB, sizeof(uint16_t));
+    file_storage.read = file_read;
+    file_storage.write = file_write;
+    file_storage.user_data = file_records;
+    modbus_set_file_storage(ctx, &file_storage);
+
+    if (argc > 3) {
+        engine = argv[3];
+    }
+
+    if (engine != NULL) {
+        rc = run_engine(ctx, engine);
+        modbus_mapping_free(mb_mapping);
+        free(file_records);
+        free(query);
+        modbus_free(ctx);
+        return rc;
+    } else if (use_backend == TCP) {
         s = modbus_tcp_listen(ctx, 1);
         modbus_tcp_accept(ctx, &s);
     } else if (use_backend == TCP_PI) {
@@ -167,64 +385,7 @@ int main(int argc, char *argv[])
             break;
         }
 
-        /* Special server behavior to test client */
-        if (query[header_length] == 0x03) {
-            /* Read holding registers */
-
-            if (MODBUS_GET_INT16_FROM_INT8(query, header_length + 3) ==
-                UT_REGISTERS_NB_SPECIAL) {
-                printf("Set an incorrect number of values\n");
-                MODBUS_SET_INT16_TO_INT8(
-                    query, header_length + 3, UT_REGISTERS_NB_SPECIAL - 1);
-            } else if (MODBUS_GET_INT16_FROM_INT8(query, header_length + 1) ==
-                       UT_REGISTERS_ADDRESS_SPECIAL) {
-                printf("Reply to this special register address by an exception\n");
-                modbus_reply_exception(ctx, query, MODBUS_EXCEPTION_SLAVE_OR_SERVER_BUSY);
-                continue;
-            } else if (MODBUS_GET_INT16_FROM_INT8(query, header_length + 1) ==
-                       UT_REGISTERS_ADDRESS_INVALID_TID_OR_SLAVE) {
-                const int RAW_REQ_LENGTH = 5;
-                uint8_t raw_req[] = {(use_backend == RTU) ? INVALID_SERVER_ID : 0xFF,
-                                     0x03,
-                                     0x02,
-                                     0x00,
-                                     0x00};
-
-                printf("Reply with an invalid TID or slave\n");
-                modbus_send_raw_request(ctx, raw_req, RAW_REQ_LENGTH * sizeof(uint8_t));
-                continue;
-            } else if (MODBUS_GET_INT16_FROM_INT8(query, header_length + 1) ==
-                       UT_REGISTERS_ADDRESS_SLEEP_500_MS) {
-                printf("Sleep 0.5 s before replying\n");
-                usleep(500000);
-            } else if (MODBUS_GET_INT16_FROM_INT8(query, header_length + 1) ==
-                       UT_REGISTERS_ADDRESS_BYTE_SLEEP_5_MS) {
-                /* Test low level only available in TCP mode */
-                /* Catch the reply and send reply byte a byte */
-                uint8_t req[] = "\x00\x1C\x00\x00\x00\x05\xFF\x03\x02\x00\x00";
-                int req_length = 11;
-                int w_s = modbus_get_socket(ctx);
-                if (w_s == -1) {
-                    fprintf(stderr, "Unable to get a valid socket in special test\n");
-                    continue;
-                }
-
-                /* Copy TID */
-                req[1] = query[1];
-                for (i = 0; i < req_length; i++) {
-                    printf("(%.2X)", req[i]);
-                    usleep(5000);
-                    rc = send(w_s, (const char *) (req + i), 1, MSG_NOSIGNAL);
-                    if (rc == -1) {
-                        break;
-                    }
-                }
-                continue;
-            }
-        }
-
-        rc = modbus_reply(ctx, query, rc, mb_mapping);
-        if (rc == -1) {
+        if (serve(ctx, query, rc) == -1) {
             break;
         }
     }
@@ -237,6 +398,7 @@ int main(int argc, char *argv[])
         }
     }
     modbus_mapping_free(mb_mapping);
+    free(file_records);
     free(query);
     /* For RTU */
     modbus_close(ctx);
@@ -5,15 +5,21 @@ server_log=unit-test-server.log
 
 rm -f $client_log $server_log
 
-echo "Starting server"
-./unit-test-server > $server_log 2>&1 &
+# The loop of the server first, then the engines of libmodbus
+for engine in "" epoll workers uring fallback; do
+    echo "Starting server $engine"
+    ./unit-test-server tcp 127.0.0.1 $engine >> $server_log 2>&1 &
 
-sleep 1
+    sleep 1
 
-echo "Starting client"
-./unit-test-client > $client_log 2>&1
-rc=$?
-
-killall unit-test-server
-exit $rc
+    echo "Starting client"
+    ./unit-test-client tcp 127.0.0.1 $engine >> $client_log 2>&1
+    rc=$?
 
+    killall unit-test-server
+    wait
+    if [ $rc -ne 0 ]; then
+        exit $rc
+    fi
+done
+exit 0
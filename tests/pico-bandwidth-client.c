@@ -8,6 +8,11 @@
  *
  * Use libmodbus/tests/bandwidth-server-one as the server to test this client.
  *
+ * The runs are the ones of libmodbus/tests/bandwidth-client (see bench.h),
+ * configured below. Each one prints a summary and a JSON line, collect them
+ * from the serial output with "grep '^{'" to compare them with
+ * libmodbus/tests/bench-compare.py.
+ *
  * The original copyright notice is below.
  */
 /*
@@ -19,41 +24,38 @@
 #include "pico/stdlib.h"
 #include "pico/cyw43_arch.h"
 
-// #include "lwip/pbuf.h"
-// #include "lwip/tcp.h"
-//
 #include "wifi.h"
 #include <modbus.h>
 
-#define G_MSEC_PER_SEC 1000
+#include "bench.h"
 
-static uint32_t gettime_ms(void)
-{
-    struct timeval tv;
-#if !defined(_MSC_VER)
-    gettimeofday(&tv, NULL);
-    return (uint32_t) tv.tv_sec * 1000 + tv.tv_usec / 1000;
-#else
-    return GetTickCount();
-#endif
-}
+#define NB_REQUESTS 1000
+#define NB_WARMUP   50
+
+typedef struct {
+    const char *mix;
+    int nb_points;
+    int depth;
+    int rate;
+} run_t;
+
+/* The three tests of bandwidth-client, then a mix of small requests in open
+   loop */
+static const run_t runs[] = {
+    { "rb", 0, 1, 0 },
+    { "rr", 0, 1, 0 },
+    { "wrr", 0, 1, 0 },
+    { "rr=90,wr=10", 10, 1, 100 },
+};
 
 /* Tests based on PI-MBUS-300 documentation */
 void main(void)
 {
-    uint8_t *tab_bit;
-    uint16_t *tab_reg;
+    bench_config_t config;
+    bench_result_t result;
     modbus_t *ctx;
-    int i;
-    int nb_points;
-    double elapsed;
-    uint32_t start;
-    uint32_t end;
-    uint32_t bytes;
-    float rate;
-    int rc;
-    int n_loop = 10;
     int nb_loop;
+    int i;
 
     stdio_init_all();
 
@@ -76,15 +78,16 @@ void main(void)
     printf("IP Address: %s\n",
            ip4addr_ntoa(netif_ip4_addr(netif_list)));
 
+    /* Cost of the trace hooks on the RP2040 */
+    printf("Trace: %.1f ns per record\n\n", bench_trace_cost());
+
     ctx = modbus_new_tcp(SERVER_IP, 1502);
     modbus_set_debug(ctx, FALSE);
-    /* Allocate and initialize the memory to store the status */
-    tab_bit = (uint8_t *) malloc(MODBUS_MAX_READ_BITS * sizeof(uint8_t));
-    memset(tab_bit, 0, MODBUS_MAX_READ_BITS * sizeof(uint8_t));
 
-    /* Allocate and initialize the memory to store the registers */
-    tab_reg = (uint16_t *) malloc(MODBUS_MAX_READ_REGISTERS * sizeof(uint16_t));
-    memset(tab_reg, 0, MODBUS_MAX_READ_REGISTERS * sizeof(uint16_t));
+    bench_init_config(&config);
+    config.label = "pico";
+    config.nb_requests = NB_REQUESTS;
+    config.warmup = NB_WARMUP;
 
     nb_loop = 0;
     while (true) {
@@ -95,128 +98,28 @@ void main(void)
             continue;
         }
 
-        printf("Loop %d\n", nb_loop++);
-        printf("READ BITS\n\n");
+        printf("Loop %d\n\n", nb_loop++);
 
-        nb_points = MODBUS_MAX_READ_BITS;
-        start = gettime_ms();
-        for (i = 0; i < n_loop; i++) {
-            rc = modbus_read_bits(ctx, 0, nb_points, tab_bit);
-            if (rc == -1) {
-                fprintf(stderr, "%s\n", modbus_strerror(errno));
-                break;
-            }
-        }
-        end = gettime_ms();
-        elapsed = end - start;
-
-        rate = (n_loop * nb_points) * G_MSEC_PER_SEC / (end - start);
-        printf("Transfer rate in points/seconds:\n");
-        printf("* %.0f p/s\n", rate);
-        printf("\n");
-
-        bytes = n_loop * (nb_points / 8) + ((nb_points % 8) ? 1 : 0);
-        rate = (float)bytes / 1024 * G_MSEC_PER_SEC / (end - start);
-        printf("Values:\n");
-        printf("* %d x %d values\n", n_loop, nb_points);
-        printf("* %.3f ms for %d bytes\n", elapsed, bytes);
-
-        printf("* %.2f KiB/s\n", rate);
-        printf("\n");
-
-        /* TCP: Query and response header and values */
-        bytes = 12 + 9 + (nb_points / 8) + ((nb_points % 8) ? 1 : 0);
-        printf("Values and TCP Modbus overhead:\n");
-        printf("* %d x %d bytes\n", n_loop, bytes);
-        bytes = n_loop * bytes;
-        rate = (float)bytes / 1024 * G_MSEC_PER_SEC / (end - start);
-        printf("* %.3f ms for %d bytes\n", elapsed, bytes);
-        printf("* %.2f KiB/s\n", rate);
-        printf("\n\n");
-
-        printf("READ REGISTERS\n\n");
-
-        nb_points = MODBUS_MAX_READ_REGISTERS;
-        start = gettime_ms();
-        for (i = 0; i < n_loop; i++) {
-            rc = modbus_read_registers(ctx, 0, nb_points, tab_reg);
-            if (rc == -1) {
-                fprintf(stderr, "%s\n", modbus_strerror(errno));
-                break;
-            }
-        }
-        end = gettime_ms();
-        elapsed = end - start;
-
-        rate = (n_loop * nb_points) * G_MSEC_PER_SEC / (end - start);
-        printf("Transfer rate in points/seconds:\n");
-        printf("* %.0f p/s\n", rate);
-        printf("\n");
-
-        bytes = n_loop * nb_points * sizeof(uint16_t);
-        rate = (float)bytes / 1024 * G_MSEC_PER_SEC / (end - start);
-        printf("Values:\n");
-        printf("* %d x %d values\n", n_loop, nb_points);
-        printf("* %.3f ms for %d bytes\n", elapsed, bytes);
-        printf("* %.2f KiB/s\n", rate);
-        printf("\n");
-
-        /* TCP:Query and response header and values */
-        bytes = 12 + 9 + (nb_points * sizeof(uint16_t));
-        printf("Values and TCP Modbus overhead:\n");
-        printf("* %d x %d bytes\n", n_loop, bytes);
-        bytes = n_loop * bytes;
-        rate = (float)bytes / 1024 * G_MSEC_PER_SEC / (end - start);
-        printf("* %.3f ms for %d bytes\n", elapsed, bytes);
-        printf("* %.2f KiB/s\n", rate);
-        printf("\n\n");
-
-        printf("WRITE AND READ REGISTERS\n\n");
-
-        nb_points = MODBUS_MAX_WR_WRITE_REGISTERS;
-        start = gettime_ms();
-        for (i = 0; i < n_loop; i++) {
-            rc = modbus_write_and_read_registers(
-                ctx, 0, nb_points, tab_reg, 0, nb_points, tab_reg);
-            if (rc == -1) {
+        for (i = 0; i < (int) (sizeof(runs) / sizeof(runs[0])); i++) {
+            bench_parse_mix(&config, runs[i].mix);
+            config.nb_points = runs[i].nb_points;
+            config.depth = runs[i].depth;
+            config.rate = runs[i].rate;
+
+            if (bench_measure(ctx, &config, &result) == -1) {
                 fprintf(stderr, "%s\n", modbus_strerror(errno));
+                bench_free_result(&result);
                 break;
             }
+            bench_print_text(stdout, &config, &result);
+            bench_print_json(stdout, &config, &result);
+            bench_free_result(&result);
         }
-        end = gettime_ms();
-        elapsed = end - start;
-
-        rate = (n_loop * nb_points) * G_MSEC_PER_SEC / (end - start);
-        printf("Transfer rate in points/seconds:\n");
-        printf("* %.0f p/s\n", rate);
-        printf("\n");
-
-        bytes = n_loop * nb_points * sizeof(uint16_t);
-        rate = (float)bytes / 1024 * G_MSEC_PER_SEC / (end - start);
-        printf("Values:\n");
-        printf("* %d x %d values\n", n_loop, nb_points);
-        printf("* %.3f ms for %d bytes\n", elapsed, bytes);
-        printf("* %.2f KiB/s\n", rate);
-        printf("\n");
-
-        /* TCP:Query and response header and values */
-        bytes = 12 + 9 + (nb_points * sizeof(uint16_t));
-        printf("Values and TCP Modbus overhead:\n");
-        printf("* %d x %d bytes\n", n_loop, bytes);
-        bytes = n_loop * bytes;
-        rate = (float)bytes / 1024 * G_MSEC_PER_SEC / (end - start);
-        printf("* %.3f ms for %d bytes\n", elapsed, bytes);
-        printf("* %.2f KiB/s\n", rate);
-        printf("\n");
     } // End of "while (true)"
 
     // NOT REACHED (just to show what to do if your client quits...
     printf("Quit the loop\n");
 
-    /* Free the memory */
-    free(tab_bit);
-    free(tab_reg);
-
     /* Close the connection */
     modbus_close(ctx);
     modbus_free(ctx);
@@ -76,6 +76,8 @@ void main(void)
     int nb_points;
     int rc;
     float real;
+    uint16_t tab_rp_file_records[sizeof(UT_FILE_RECORDS_TAB) / sizeof(uint16_t)];
+    modbus_file_record_t file_records[2];
     uint32_t old_response_to_sec;
     uint32_t old_response_to_usec;
     uint32_t new_response_to_sec;
@@ -304,6 +306,60 @@ void main(void)
         ASSERT_TRUE(
             tab_rp_registers[0] == 0x17, "FAILED (%0X != %0X)\n", tab_rp_registers[0], 0x17);
 
+        /** FILE RECORDS **/
+        printf("\nTEST FILE RECORDS:\n");
+        nb_points = sizeof(UT_FILE_RECORDS_TAB) / sizeof(uint16_t);
+        rc = modbus_write_file_record(
+            ctx, UT_FILE_NUMBER, UT_FILE_RECORD_NUMBER, nb_points, UT_FILE_RECORDS_TAB);
+        printf("1/4 modbus_write_file_record: ");
+        ASSERT_TRUE(rc == nb_points, "FAILED (nb points %d)\n", rc);
+
+        rc = modbus_read_file_record(
+            ctx, UT_FILE_NUMBER, UT_FILE_RECORD_NUMBER, nb_points, tab_rp_file_records);
+        printf("2/4 modbus_read_file_record: ");
+        ASSERT_TRUE(rc == nb_points, "FAILED (nb points %d)\n", rc);
+        for (i = 0; i < nb_points; i++) {
+            ASSERT_TRUE(tab_rp_file_records[i] == UT_FILE_RECORDS_TAB[i],
+                        "FAILED (%0X != %0X)\n",
+                        tab_rp_file_records[i],
+                        UT_FILE_RECORDS_TAB[i]);
+        }
+
+        /* Two sub-requests in one request, the second half is read first */
+        file_records[0].file_number = UT_FILE_NUMBER;
+        file_records[0].record_number = UT_FILE_RECORD_NUMBER + 2;
+        file_records[0].record_length = 2;
+        file_records[0].data = tab_rp_file_records;
+        file_records[1].file_number = UT_FILE_NUMBER;
+        file_records[1].record_number = UT_FILE_RECORD_NUMBER;
+        file_records[1].record_length = 2;
+        file_records[1].data = tab_rp_file_records + 2;
+        rc = modbus_read_file_records(ctx, file_records, 2);
+        printf("3/4 modbus_read_file_records: ");
+        ASSERT_TRUE(rc == nb_points, "FAILED (nb points %d)\n", rc);
+        for (i = 0; i < nb_points; i++) {
+            ASSERT_TRUE(tab_rp_file_records[i] == UT_FILE_RECORDS_TAB[(i + 2) % nb_points],
+                        "FAILED (%0X != %0X)\n",
+                        tab_rp_file_records[i],
+                        UT_FILE_RECORDS_TAB[(i + 2) % nb_points]);
+        }
+
+        /* Write the halves back swapped */
+        file_records[0].record_number = UT_FILE_RECORD_NUMBER;
+        file_records[1].record_number = UT_FILE_RECORD_NUMBER + 2;
+        rc = modbus_write_file_records(ctx, file_records, 2);
+        printf("4/4 modbus_write_file_records: ");
+        ASSERT_TRUE(rc == nb_points, "FAILED (nb points %d)\n", rc);
+        rc = modbus_read_file_record(
+            ctx, UT_FILE_NUMBER, UT_FILE_RECORD_NUMBER, nb_points, tab_rp_file_records);
+        ASSERT_TRUE(rc == nb_points, "FAILED (nb points %d)\n", rc);
+        for (i = 0; i < nb_points; i++) {
+            ASSERT_TRUE(tab_rp_file_records[i] == UT_FILE_RECORDS_TAB[(i + 2) % nb_points],
+                        "FAILED (%0X != %0X)\n",
+                        tab_rp_file_records[i],
+                        UT_FILE_RECORDS_TAB[(i + 2) % nb_points]);
+        }
+
         printf("\nTEST FLOATS\n");
         /** FLOAT **/
         printf("1/4 Set/get float ABCD: ");
@@ -437,6 +493,15 @@ void main(void)
         printf("* modbus_write_and_read_registers (max): ");
         ASSERT_TRUE(rc == -1 && errno == EMBXILADD, "");
 
+        rc = modbus_read_file_record(ctx, UT_FILE_NUMBER + 1, 0, 1, tab_rp_file_records);
+        printf("* modbus_read_file_record (file): ");
+        ASSERT_TRUE(rc == -1 && errno == EMBXILADD, "");
+
+        rc = modbus_write_file_record(
+            ctx, UT_FILE_NUMBER, UT_FILE_RECORDS_NB - 1, 2, UT_FILE_RECORDS_TAB);
+        printf("* modbus_write_file_record (max): ");
+        ASSERT_TRUE(rc == -1 && errno == EMBXILADD, "");
+
         /** TOO MANY DATA **/
         printf("\nTEST TOO MANY DATA ERROR:\n");
 
@@ -468,6 +533,16 @@ void main(void)
         printf("* modbus_write_registers: ");
         ASSERT_TRUE(rc == -1 && errno == EMBMDATA, "");
 
+        rc = modbus_read_file_record(
+            ctx, UT_FILE_NUMBER, 0, MODBUS_MAX_READ_REGISTERS, tab_rp_registers);
+        printf("* modbus_read_file_record: ");
+        ASSERT_TRUE(rc == -1 && errno == EMBMDATA, "");
+
+        rc = modbus_write_file_record(
+            ctx, UT_FILE_NUMBER, 0, MODBUS_MAX_WRITE_REGISTERS, tab_rp_registers);
+        printf("* modbus_write_file_record: ");
+        ASSERT_TRUE(rc == -1 && errno == EMBMDATA, "");
+
         /** SLAVE ADDRESS **/
         old_slave = modbus_get_slave(ctx);
 
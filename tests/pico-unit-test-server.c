@@ -27,11 +27,48 @@
 #include "modbus.h"
 #include "unit-test.h"
 
+/* RAM file served by the file record function codes */
+static int file_read(void *user_data,
+                     uint16_t file_number,
+                     uint16_t record_number,
+                     uint16_t record_length,
+                     uint16_t *dest)
+{
+    const uint16_t *file_records = user_data;
+
+    if (file_number != UT_FILE_NUMBER ||
+        record_number + record_length > UT_FILE_RECORDS_NB) {
+        return MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+    }
+    memcpy(dest, file_records + record_number, record_length * sizeof(uint16_t));
+
+    return 0;
+}
+
+static int file_write(void *user_data,
+                      uint16_t file_number,
+                      uint16_t record_number,
+                      uint16_t record_length,
+                      const uint16_t *src)
+{
+    uint16_t *file_records = user_data;
+
+    if (file_number != UT_FILE_NUMBER ||
+        record_number + record_length > UT_FILE_RECORDS_NB) {
+        return MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+    }
+    memcpy(file_records + record_number, src, record_length * sizeof(uint16_t));
+
+    return 0;
+}
+
 void runMbServer(void)
 {
     int s = -1;
     modbus_t *ctx;
     modbus_mapping_t *mb_mapping;
+    modbus_file_storage_t file_storage;
+    uint16_t *file_records;
     int rc;
     int i;
     int use_backend;
@@ -77,6 +114,13 @@ void runMbServer(void)
         mb_mapping->tab_input_registers[i] = UT_INPUT_REGISTERS_TAB[i];
     }
 
+    /* Serve the file records from RAM */
+    file_records = calloc(UT_FILE_RECORDS_NB, sizeof(uint16_t));
+    file_storage.read = file_read;
+    file_storage.write = file_write;
+    file_storage.user_data = file_records;
+    modbus_set_file_storage(ctx, &file_storage);
+
     rc = modbus_tcp_listen(ctx, 2);
     if(rc == -1){
         fprintf(stderr, "Listen failed: %s\n", modbus_strerror(errno));
@@ -137,6 +181,7 @@ void runMbServer(void)
     // NOT REACHED (just to show what to do if your server quits...
     printf("Quit the loop: %s\n", modbus_strerror(errno));
     modbus_mapping_free(mb_mapping);
+    free(file_records);
     free(query);
 }
 
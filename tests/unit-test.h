@@ -59,6 +59,12 @@ const uint16_t UT_INPUT_REGISTERS_ADDRESS = 0x108;
 const uint16_t UT_INPUT_REGISTERS_NB = 0x1;
 const uint16_t UT_INPUT_REGISTERS_TAB[] = { 0x000A };
 
+/* RAM file served by the file storage of the server (read/write file record) */
+const uint16_t UT_FILE_NUMBER = 4;
+const uint16_t UT_FILE_RECORDS_NB = 0x40;
+const uint16_t UT_FILE_RECORD_NUMBER = 0x10;
+const uint16_t UT_FILE_RECORDS_TAB[] = { 0x0D0E, 0x0A0D, 0xBEEF, 0xCAFE };
+
 /*
  * This float value is 0x47F12000 (in big-endian format).
  * In Little-endian(intel) format, it will be stored in memory as follows: